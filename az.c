@@ -1,374 +1,8045 @@
 /*
- * AZ Editor v1.1 - A minimal terminal text editor for Windows
+ * AZ Editor v1.1 - A minimal terminal text editor for Windows and POSIX terminals
  * Features: Dark theme, directory sidebar, mouse support, intuitive motions
  * Compile: gcc az.c -o az.exe -O2
+ *          gcc az.c -o az -O2 -pthread   (Linux, macOS)
+ *          gcc az.c -o az-bench -O2 -pthread -DAZ_COUNT_ALLOCS   (replay bench with heap counts)
  */
 
 #define _CRT_SECURE_NO_WARNINGS
+#ifdef _WIN32
 #include <windows.h>
+#include <direct.h>
+#define PATH_SEP '\\'
+#else
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <termios.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <dirent.h>
+#include <strings.h>
+#define _strdup strdup
+#define _strnicmp strncasecmp
+#define _getcwd getcwd
+#define PATH_SEP '/'
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
-#include <direct.h>
+#include <limits.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define AZ_VERSION "1.1"
 #define TAB_SIZE 4
-#define MAX_LINES 50000
-#define MAX_LINE_LEN 4096
 #define SIDEBAR_WIDTH 30
 #define STATUS_HEIGHT 2
-#define MAX_DIR_ENTRIES 1000
-#define MAX_UNDO 100
+#define UNDO_MAX_BYTES (16 * 1024 * 1024)
+#define SWAP_DELAY 200          /* ms between journal writes */
+#define SWAP_TICK 10            /* ms the journal writer sleeps between checks for a stop */
+#define AUTOSAVE_DELAY 5000     /* ms between background saves while there are unsaved changes */
+#define BUFFER_BUDGET 512       /* MB of heap the open buffers may hold before inactive ones give some back */
+#define PIECE_LINES 64
+#define ARENA_SLAB (256 * 1024)
+#define ARENA_MIN 32            /* Smallest line block, header included */
+#define ARENA_CLASSES 8         /* Block sizes 32 bytes to 4 KB, doubling */
+#define INDEX_CHUNK (8 * 1024 * 1024)
+#define INDEX_MAX_THREADS 16
+#define SAVE_IOV 512
+#define SAVE_BUFFER (1024 * 1024)
+#define SEARCH_BMH_MIN 16
+#define SEARCH_SLICE 262144
+#define REGEX_MAX_STATES 20000
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_DFA_STATES 1024
+#define GREP_MAX_THREADS 16
+#define GREP_BINARY_PROBE 8192
+#define GREP_TEXT_MAX 256
+#define GREP_MAX_HITS 100000
+#define GREP_IDLE_YIELDS 64   /* Yields an idle grep worker makes before sleeping between looks at the queue */
+#define FIND_MAX_HITS 500
+#define FUZZY_SEP 1   /* Word starts after it */
+#define FUZZY_LOWER 2
+#define FUZZY_UPPER 3   /* Word starts at it after a lower case letter */
+#define FUZZY_WORDS 4   /* Paths below 64 * FUZZY_WORDS bytes are scored from bitmasks */
+#define FUZZY_MAX_THREADS 16
+#define FUZZY_PART_MIN 32768   /* Fewer candidates than this per thread are ranked on one */
+#define FIND_REFRESH_MS 60000
+#define SYN_WORD_SLOTS 256
+#define HL_MARK_STEP 4096       /* Bytes of a long line lexed between two saved lexer states */
+#define HL_MARK_LINES 32        /* Long lines whose saved states are kept */
+#define HL_TOKEN_MAX 4096       /* Bytes read past where lexing part of a line stops; a longer token is cut there */
+#define WRAP_BLOCK 128          /* Lines per block of the wrap index; one of twice that is split */
+#define REGISTERS 27   /* The unnamed register and a to z */
+#define REGISTER_APPEND 64   /* Or'ed into a register index by A to Z: add to the register instead of replacing it */
+#define INPUT_BATCH 4096   /* Events handled per frame at most */
 
-/* Editor modes */
-typedef enum {
-    MODE_NORMAL,
-    MODE_INSERT,
-    MODE_COMMAND,
-    MODE_SEARCH,
-    MODE_SIDEBAR
-} EditorMode;
+/*
+ * Heap accounting
+ *
+ * Built with -DAZ_COUNT_ALLOCS, the editor's own malloc, calloc, realloc,
+ * strdup and free calls are counted for the --replay report. Allocations
+ * made inside the C library (stdio, directory reads) are not seen.
+ */
+long long alloc_calls, alloc_bytes, free_calls;
 
-/* Directory entry for sidebar */
-typedef struct {
-    char name[260];
-    int is_dir;
-} DirEntry;
+#ifdef AZ_COUNT_ALLOCS
+void *alloc_malloc(size_t n) {
+    __atomic_add_fetch(&alloc_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_bytes, (long long)n, __ATOMIC_RELAXED);
+    return malloc(n);
+}
+
+void *alloc_calloc(size_t count, size_t n) {
+    __atomic_add_fetch(&alloc_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_bytes, (long long)(count * n), __ATOMIC_RELAXED);
+    return calloc(count, n);
+}
+
+void *alloc_realloc(void *p, size_t n) {
+    __atomic_add_fetch(&alloc_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_bytes, (long long)n, __ATOMIC_RELAXED);
+    return realloc(p, n);
+}
+
+char *alloc_strdup(const char *s) {
+    size_t n = strlen(s) + 1;
+    char *copy = alloc_malloc(n);
+    if (copy) memcpy(copy, s, n);
+    return copy;
+}
+
+void alloc_free(void *p) {
+    if (p) __atomic_add_fetch(&free_calls, 1, __ATOMIC_RELAXED);
+    free(p);
+}
+
+#define malloc alloc_malloc
+#define calloc alloc_calloc
+#define realloc alloc_realloc
+#define free alloc_free
+#undef _strdup
+#define _strdup alloc_strdup
+#endif
+
+/*
+ * Threads
+ *
+ * Just enough of a portable thread API for background workers. Shared
+ * counters use the GCC/Clang __atomic builtins on both platforms.
+ */
+#ifdef _WIN32
+typedef HANDLE Thread;
 
-/* Undo state */
 typedef struct {
-    char **lines;
-    int num_lines;
-    int cx, cy;
-} UndoState;
+    void *(*fn)(void *);
+    void *arg;
+} ThreadStart;
 
-/* Selection */
+DWORD WINAPI thread_trampoline(LPVOID param) {
+    ThreadStart start = *(ThreadStart *)param;
+    free(param);
+    start.fn(start.arg);
+    return 0;
+}
+#else
+typedef pthread_t Thread;
+#endif
+
+int thread_start(Thread *t, void *(*fn)(void *), void *arg) {
+#ifdef _WIN32
+    ThreadStart *start = malloc(sizeof(ThreadStart));
+    start->fn = fn;
+    start->arg = arg;
+    *t = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+    if (!*t) free(start);
+    return *t != NULL;
+#else
+    return pthread_create(t, NULL, fn, arg) == 0;
+#endif
+}
+
+void thread_join(Thread t) {
+#ifdef _WIN32
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+#else
+    pthread_join(t, NULL);
+#endif
+}
+
+/* Let another thread run while waiting for work */
+void thread_yield(void) {
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+void thread_sleep(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+#endif
+}
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+#else
+typedef pthread_mutex_t Mutex;
+#endif
+
+void mutex_init(Mutex *m) {
+#ifdef _WIN32
+    InitializeCriticalSection(m);
+#else
+    pthread_mutex_init(m, NULL);
+#endif
+}
+
+void mutex_lock(Mutex *m) {
+#ifdef _WIN32
+    EnterCriticalSection(m);
+#else
+    pthread_mutex_lock(m);
+#endif
+}
+
+void mutex_unlock(Mutex *m) {
+#ifdef _WIN32
+    LeaveCriticalSection(m);
+#else
+    pthread_mutex_unlock(m);
+#endif
+}
+
+void mutex_free(Mutex *m) {
+#ifdef _WIN32
+    DeleteCriticalSection(m);
+#else
+    pthread_mutex_destroy(m);
+#endif
+}
+
+int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+/*
+ * File mapping
+ *
+ * Files are opened read-only and mapped into memory. The mapping is cut into
+ * INDEX_CHUNK sized chunks whose line starts are found with a vectorized
+ * newline scan. The first chunk is indexed before filemap_open returns so the
+ * first screen can be drawn at once; a small thread pool indexes the rest,
+ * and finished chunks are handed to the rope in file order by rope_poll.
+ */
 typedef struct {
-    int active;
-    int start_x, start_y;
-    int end_x, end_y;
-} Selection;
+    size_t *starts;             /* [0] is the line carried in from earlier chunks */
+    int count;
+    int cap;
+    int crlf;                   /* Newlines preceded by '\r' */
+    int ready;
+} IndexChunk;
 
-/* Editor state */
 typedef struct {
-    char **lines;
-    int num_lines;
-    int cx, cy;
-    int row_offset;
-    int col_offset;
-    int screen_rows;
-    int screen_cols;
-    char filename[512];
-    int modified;
-    EditorMode mode;
-    EditorMode prev_mode;
-    char status_msg[256];
-    char command_buf[256];
-    int command_len;
-    char search_buf[256];
-    int search_len;
+    const char *data;
+    size_t size;
+    size_t chunk_size;
+    IndexChunk *chunks;
+    int num_chunks;
+    int published;              /* Chunks already appended to the rope */
+    int next_chunk;             /* Next chunk for a worker to claim */
+    int cancel;
+    Thread workers[INDEX_MAX_THREADS];
+    int num_workers;
+    long long newlines;
+    long long crlf_newlines;
+    int refs;                   /* The rope, its mapped pieces and any registers */
+    int heap;                   /* data is a malloc'd copy, not a mapping */
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} FileMap;
+
+void index_grow(IndexChunk *c, int need) {
+    if (c->count + need <= c->cap) return;
+    c->cap = c->cap * 2 > c->count + need ? c->cap * 2 : c->count + need;
+    c->starts = realloc(c->starts, sizeof(size_t) * c->cap);
+}
+
+/* Record the line start after each set bit of a newline mask */
+void index_emit(IndexChunk *c, const char *data, size_t base, unsigned long long mask) {
+    index_grow(c, 64);
+    while (mask) {
+        size_t nl = base + __builtin_ctzll(mask);
+        c->starts[c->count++] = nl + 1;
+        if (nl > 0 && data[nl - 1] == '\r') c->crlf++;
+        mask &= mask - 1;
+    }
+}
+
+void index_scan_scalar(IndexChunk *c, const char *data, size_t begin, size_t end) {
+    const char *p = data + begin, *stop = data + end, *nl;
+    while ((nl = memchr(p, '\n', stop - p)) != NULL) {
+        index_emit(c, data, nl - data, 1);
+        p = nl + 1;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+void index_scan_sse2(IndexChunk *c, const char *data, size_t begin, size_t end) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = begin;
     
-    int sidebar_visible;
-    DirEntry dir_entries[MAX_DIR_ENTRIES];
-    int num_entries;
-    int sidebar_scroll;
-    int sidebar_cursor;
-    char current_dir[512];
+    for (; i + 64 <= end; i += 64) {
+        const __m128i *p = (const __m128i *)(data + i);
+        unsigned long long mask =
+            (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p), nl)) |
+            (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 1), nl)) << 16 |
+            (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), nl)) << 32 |
+            (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 3), nl)) << 48;
+        if (mask) index_emit(c, data, i, mask);
+    }
+    index_scan_scalar(c, data, i, end);
+}
+
+__attribute__((target("avx2")))
+void index_scan_avx2(IndexChunk *c, const char *data, size_t begin, size_t end) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = begin;
     
-    char *clipboard;
-    Selection sel;
+    for (; i + 64 <= end; i += 64) {
+        const __m256i *p = (const __m256i *)(data + i);
+        unsigned long long mask =
+            (unsigned long long)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(p), nl)) |
+            (unsigned long long)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(p + 1), nl)) << 32;
+        if (mask) index_emit(c, data, i, mask);
+    }
+    index_scan_scalar(c, data, i, end);
+}
+#endif
+
+/* Pick the widest newline scanner the CPU supports */
+void (*index_kernel(void))(IndexChunk *, const char *, size_t, size_t) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return index_scan_avx2;
+    return index_scan_sse2;
+#else
+    return index_scan_scalar;
+#endif
+}
+
+void index_chunk(FileMap *m, int k) {
+    static void (*scan)(IndexChunk *, const char *, size_t, size_t);
+    IndexChunk *c = &m->chunks[k];
+    size_t begin = (size_t)k * m->chunk_size;
+    size_t end = begin + m->chunk_size < m->size ? begin + m->chunk_size : m->size;
     
-    UndoState undo_stack[MAX_UNDO];
-    int undo_count;
-    int undo_pos;
+    if (!__atomic_load_n(&scan, __ATOMIC_RELAXED)) __atomic_store_n(&scan, index_kernel(), __ATOMIC_RELAXED);
+    c->cap = (int)((end - begin) / 40) + 64;
+    c->starts = malloc(sizeof(size_t) * c->cap);
+    c->count = 1;
+    scan(c, m->data, begin, end);
+}
+
+void *index_worker(void *arg) {
+    FileMap *m = arg;
+    int k;
+    while (!__atomic_load_n(&m->cancel, __ATOMIC_RELAXED) &&
+           (k = __atomic_fetch_add(&m->next_chunk, 1, __ATOMIC_RELAXED)) < m->num_chunks) {
+        index_chunk(m, k);
+        __atomic_store_n(&m->chunks[k].ready, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* Index the first chunk now and start workers for the rest */
+void filemap_index(FileMap *m, int threads) {
+    m->num_chunks = (int)((m->size + m->chunk_size - 1) / m->chunk_size);
+    if (m->num_chunks == 0) return;
+    m->chunks = calloc(m->num_chunks, sizeof(IndexChunk));
+    index_chunk(m, 0);
+    m->chunks[0].ready = 1;
+    m->next_chunk = 1;
+    
+    if (threads > m->num_chunks - 1) threads = m->num_chunks - 1;
+    if (threads > INDEX_MAX_THREADS) threads = INDEX_MAX_THREADS;
+    while (m->num_workers < threads && thread_start(&m->workers[m->num_workers], index_worker, m)) {
+        m->num_workers++;
+    }
+    if (m->num_workers == 0) index_worker(m);
+}
+
+/* Wait for every worker; with cancel set, unclaimed chunks are left unindexed */
+void filemap_join(FileMap *m, int cancel) {
+    if (cancel) __atomic_store_n(&m->cancel, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < m->num_workers; i++) thread_join(m->workers[i]);
+    m->num_workers = 0;
+}
+
+int filemap_loading(FileMap *m) {
+    return m && m->published < m->num_chunks;
+}
+
+/* Majority vote of the line endings seen so far */
+int filemap_crlf(FileMap *m) {
+    return m && m->crlf_newlines * 2 > m->newlines;
+}
+
+/* Release the mapping made by filemap_map */
+void filemap_unmap(FileMap *m) {
+    if (m->heap) {
+        free((void *)m->data);
+        return;
+    }
+#ifdef _WIN32
+    if (m->data) UnmapViewOfFile(m->data);
+    if (m->mapping) CloseHandle(m->mapping);
+    if (m->file && m->file != INVALID_HANDLE_VALUE) CloseHandle(m->file);
+#else
+    if (m->data) munmap((void *)m->data, m->size);
+#endif
+}
+
+void filemap_close(FileMap *m) {
+    if (!m) return;
+    filemap_join(m, 1);
+    filemap_unmap(m);
+    for (int i = 0; i < m->num_chunks; i++) free(m->chunks[i].starts);
+    free(m->chunks);
+    free(m);
+}
+
+void filemap_release(FileMap *m) {
+    if (m && --m->refs == 0) filemap_close(m);
+}
+
+/* A map over lines already in memory: data holds count lines, each ending in '\n' */
+FileMap *filemap_memory(char *data, size_t size, size_t *starts, int count) {
+    FileMap *m = calloc(1, sizeof(FileMap));
+    m->data = data;
+    m->size = size;
+    m->heap = 1;
+    m->refs = 1;
+    m->chunks = calloc(1, sizeof(IndexChunk));
+    m->chunks[0].starts = starts;
+    m->chunks[0].count = m->chunks[0].cap = count + 1;
+    m->chunks[0].ready = 1;
+    m->num_chunks = m->published = 1;
+    m->newlines = count;
+    return m;
+}
+
+/* Copy the file's bytes to the heap and close it, so it can be replaced while lines still refer to it */
+void filemap_detach(FileMap *m) {
+    if (m->heap) return;
+    char *copy = malloc(m->size ? m->size : 1);
+    memcpy(copy, m->data, m->size);
+    filemap_unmap(m);
+#ifdef _WIN32
+    m->file = m->mapping = NULL;
+#endif
+    m->data = copy;
+    m->heap = 1;
+}
+
+/* Map a regular file read-only; on failure whatever was opened is left for filemap_unmap */
+int filemap_map(FileMap *m, const char *path) {
+#ifdef _WIN32
+    m->file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                         OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m->file == INVALID_HANDLE_VALUE) return 0;
+    LARGE_INTEGER size;
+    GetFileSizeEx(m->file, &size);
+    m->size = (size_t)size.QuadPart;
+    if (m->size > 0) {
+        m->mapping = CreateFileMapping(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m->mapping) m->data = MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!m->data) return 0;
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+    m->size = st.st_size;
+    if (m->size > 0) {
+        void *data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        madvise(data, m->size, MADV_WILLNEED);
+        m->data = data;
+    }
+    close(fd);
+#endif
+    return 1;
+}
+
+FileMap *filemap_open_chunked(const char *path, size_t chunk_size, int threads) {
+    FileMap *m = calloc(1, sizeof(FileMap));
+    m->chunk_size = chunk_size;
+    m->refs = 1;
+    if (!filemap_map(m, path)) {
+        filemap_close(m);
+        return NULL;
+    }
+    filemap_index(m, threads);
+    return m;
+}
+
+FileMap *filemap_open(const char *path) {
+    return filemap_open_chunked(path, INDEX_CHUNK, cpu_count());
+}
+
+/*
+ * Line arena
+ *
+ * Owned lines are carved out of slabs that belong to their rope. A header in
+ * front of each line keeps its length and capacity, so no row is ever
+ * measured with strlen, and a growing line moves up a size class instead of
+ * being reallocated on every keystroke. Freed blocks go on a free list per
+ * class; lines too long for the largest class get a block of their own, kept
+ * on a list. Closing a document hands back whole slabs, not single lines.
+ * Such a long line is edited as a gap buffer: its spare bytes sit where the
+ * last edit was, so typing in the middle of a line of many megabytes moves
+ * only the bytes between one edit and the next. Whatever reads the whole
+ * line joins it again first; rope_peek reads a few columns without that.
+ */
+typedef struct {
+    int len;                    /* Bytes of text */
+    int cap;                    /* Most bytes the block holds, NUL not counted */
+    int cls;                    /* Size class, or -1 for a block of its own */
+    int gap_at;                 /* Where the spare bytes of a line being edited sit, -1 when they follow the text */
+} LineHead;
+
+typedef struct LargeLine {
+    struct LargeLine *prev, *next;
+    LineHead head;
+} LargeLine;
+
+typedef struct Slab {
+    struct Slab *next;
+    size_t used;
+    char data[];
+} Slab;
+
+typedef struct {
+    Slab *slabs;
+    char *free_list[ARENA_CLASSES];     /* Free blocks, linked through their first bytes */
+    LargeLine *large;
+    int slab_count, large_count;
+    long long lines;                    /* Live lines */
+    long long moves;                    /* Lines moved to a bigger block */
+} Arena;
+
+#define LINE_HEAD(line) ((LineHead *)(line) - 1)
+
+int line_length(const char *line) {
+    return ((const LineHead *)line - 1)->len;
+}
+
+/* Block with room for cap bytes and a NUL */
+char *arena_block(Arena *a, int cap) {
+    int need = cap + 1 + (int)sizeof(LineHead), cls = 0;
+    LineHead *h;
     
-    HANDLE hStdout;
-    HANDLE hStdin;
-    HANDLE hBuffer;
-    DWORD orig_in_mode;
-    DWORD orig_out_mode;
+    if (need > ARENA_MIN << (ARENA_CLASSES - 1)) {
+        LargeLine *b = malloc(sizeof(LargeLine) + cap + 1);
+        b->prev = NULL;
+        b->next = a->large;
+        if (a->large) a->large->prev = b;
+        a->large = b;
+        a->large_count++;
+        b->head.cap = cap;
+        b->head.cls = -1;
+        b->head.gap_at = -1;
+        return (char *)(&b->head + 1);
+    }
+    while (ARENA_MIN << cls < need) cls++;
+    int size = ARENA_MIN << cls;
+    if (a->free_list[cls]) {
+        h = (LineHead *)a->free_list[cls];
+        a->free_list[cls] = *(char **)h;
+    } else {
+        if (!a->slabs || a->slabs->used + size > ARENA_SLAB) {
+            Slab *slab = malloc(sizeof(Slab) + ARENA_SLAB);
+            slab->next = a->slabs;
+            slab->used = 0;
+            a->slabs = slab;
+            a->slab_count++;
+        }
+        h = (LineHead *)(a->slabs->data + a->slabs->used);
+        a->slabs->used += size;
+    }
+    h->cap = size - (int)sizeof(LineHead) - 1;
+    h->cls = cls;
+    h->gap_at = -1;
+    return (char *)(h + 1);
+}
+
+void arena_unblock(Arena *a, char *line) {
+    LineHead *h = LINE_HEAD(line);
+    if (h->cls < 0) {
+        LargeLine *b = (LargeLine *)((char *)h - offsetof(LargeLine, head));
+        if (b->prev) b->prev->next = b->next;
+        else a->large = b->next;
+        if (b->next) b->next->prev = b->prev;
+        a->large_count--;
+        free(b);
+        return;
+    }
+    *(char **)h = a->free_list[h->cls];
+    a->free_list[h->cls] = (char *)h;
+}
+
+/* New line holding len bytes of s, or len unset bytes if s is NULL */
+char *line_new(Arena *a, const char *s, int len) {
+    char *line = arena_block(a, len);
+    if (s) memcpy(line, s, len);
+    line[len] = '\0';
+    LINE_HEAD(line)->len = len;
+    a->lines++;
+    return line;
+}
+
+void line_free(Arena *a, char *line) {
+    arena_unblock(a, line);
+    a->lines--;
+}
+
+/* Move the spare bytes of a line to x, shifting the text between; at the end they leave the text whole */
+void line_gap_move(char *line, int x) {
+    LineHead *h = LINE_HEAD(line);
+    int at = h->gap_at < 0 ? h->len : h->gap_at, gap = h->cap - h->len;
     
-    /* Double buffer */
-    CHAR_INFO *buffer;
-    int buf_size;
+    if (x < at) memmove(line + x + gap, line + x, at - x);
+    else if (x > at) memmove(line + at, line + at + gap, x - at);
+    h->gap_at = x < h->len ? x : -1;
+    if (h->gap_at < 0) line[h->len] = '\0';
+}
+
+/* Make a line one NUL-terminated run of text again */
+char *line_join(char *line) {
+    if (LINE_HEAD(line)->gap_at >= 0) line_gap_move(line, LINE_HEAD(line)->len);
+    return line;
+}
+
+/* Set a line's length, keeping the bytes it already has; growth doubles the capacity, so the line may move */
+char *line_resize(Arena *a, char *line, int len) {
+    LineHead *h = LINE_HEAD(line);
+    line_join(line);
+    if (len > h->cap) {
+        char *bigger = arena_block(a, h->cap * 2 > len ? h->cap * 2 : len);
+        memcpy(bigger, line, h->len);
+        arena_unblock(a, line);
+        a->moves++;
+        line = bigger;
+        h = LINE_HEAD(line);
+    }
+    h->len = len;
+    line[len] = '\0';
+    return line;
+}
+
+/* Insert n bytes at x; a line with a block of its own takes them in its gap, which stays after them */
+char *line_insert(Arena *a, char *line, int x, const char *s, int n) {
+    LineHead *h = LINE_HEAD(line);
+    int len = h->len;
     
-    int dirty;
-} Editor;
+    if (h->cls < 0 && h->cap - len >= n) {
+        line_gap_move(line, x);
+        memcpy(line + x, s, n);
+        h->len += n;
+        h->gap_at = x + n < h->len ? x + n : -1;
+        if (h->gap_at < 0) line[h->len] = '\0';
+        return line;
+    }
+    line = line_resize(a, line, len + n);
+    memmove(line + x + n, line + x, len - x);
+    memcpy(line + x, s, n);
+    return line;
+}
 
-Editor E;
+/* Remove n bytes at x; a line with a block of its own adds them to its gap */
+char *line_erase(Arena *a, char *line, int x, int n) {
+    LineHead *h = LINE_HEAD(line);
+    
+    if (h->cls < 0) {
+        line_gap_move(line, x + n);
+        h->len -= n;
+        h->gap_at = x < h->len ? x : -1;
+        if (h->gap_at < 0) line[h->len] = '\0';
+        return line;
+    }
+    memmove(line + x, line + x + n, h->len - x - n);
+    return line_resize(a, line, h->len - n);
+}
 
-/* Colors - Dark theme */
-#define CLR_DEFAULT     (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE)
-#define CLR_YELLOW      (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_INTENSITY)
-#define CLR_CYAN        (FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY)
-#define CLR_GREEN       (FOREGROUND_GREEN | FOREGROUND_INTENSITY)
-#define CLR_MAGENTA     (FOREGROUND_RED | FOREGROUND_BLUE | FOREGROUND_INTENSITY)
-#define CLR_WHITE       (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY)
-#define CLR_GRAY        (FOREGROUND_INTENSITY)
-#define CLR_RED         (FOREGROUND_RED | FOREGROUND_INTENSITY)
+/* Release every line at once */
+void arena_free(Arena *a) {
+    while (a->slabs) {
+        Slab *next = a->slabs->next;
+        free(a->slabs);
+        a->slabs = next;
+    }
+    while (a->large) {
+        LargeLine *next = a->large->next;
+        free(a->large);
+        a->large = next;
+    }
+    memset(a, 0, sizeof(Arena));
+}
 
-#define BG_BLACK        0
-#define BG_BLUE         (BACKGROUND_BLUE)
-#define BG_CYAN         (BACKGROUND_GREEN | BACKGROUND_BLUE)
-#define BG_GRAY         (BACKGROUND_INTENSITY)
-#define BG_SELECT       (BACKGROUND_BLUE | BACKGROUND_INTENSITY)
+/* Heap bytes the arena holds, free blocks included */
+size_t arena_footprint(Arena *a) {
+    size_t n = (size_t)a->slab_count * (sizeof(Slab) + ARENA_SLAB);
+    for (LargeLine *b = a->large; b; b = b->next) n += sizeof(LargeLine) + b->head.cap + 1;
+    return n;
+}
 
-/* Function prototypes */
-void editor_init(void);
-void editor_free(void);
-void editor_open(const char *filename);
-void editor_save(void);
-void editor_draw(void);
-void editor_process_key(void);
-void editor_set_status(const char *fmt, ...);
-void sidebar_load_dir(const char *path);
-void push_undo(void);
-void pop_undo(void);
+/*
+ * Document storage
+ *
+ * Lines live in a rope: a treap of pieces ordered implicitly by line number.
+ * Every node caches the number of lines in its subtree, so looking up,
+ * inserting or removing a line costs O(log N) instead of shifting one big
+ * pointer array. A piece is either a run of untouched lines in a file
+ * mapping (starts points into its line index) or up to PIECE_LINES owned,
+ * NUL-terminated lines from the rope's arena. Editing a mapped line copies
+ * just that line.
+ * Mapped pieces hold a reference on their map, which need not be the
+ * rope's own: lines put from a register still point into the file they
+ * were yanked from.
+ */
+typedef struct Piece {
+    struct Piece *left, *right;
+    unsigned prio;
+    int total;                  /* Lines in this subtree */
+    int count;                  /* Lines in this piece */
+    const size_t *starts;       /* Mapped run, or NULL for owned rows */
+    FileMap *map;               /* Map of a mapped run */
+    char *rows[];
+} Piece;
 
-/* Buffer drawing functions */
-void buf_clear(void) {
-    for (int i = 0; i < E.buf_size; i++) {
-        E.buffer[i].Char.AsciiChar = ' ';
-        E.buffer[i].Attributes = CLR_DEFAULT | BG_BLACK;
+typedef struct {
+    Piece *root;
+    FileMap *map;
+    Piece *hint;                /* Last piece looked up, for sequential access */
+    int hint_start;
+    Arena arena;                /* Owned lines */
+} Rope;
+
+unsigned rope_rand(void) {
+    static unsigned seed = 2463534242u;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+int piece_total(Piece *t) {
+    return t ? t->total : 0;
+}
+
+void piece_update(Piece *t) {
+    t->total = piece_total(t->left) + t->count + piece_total(t->right);
+}
+
+Piece *piece_new(FileMap *map, const size_t *starts, int count) {
+    Piece *p = calloc(1, sizeof(Piece) + (starts ? 0 : sizeof(char*) * PIECE_LINES));
+    p->prio = rope_rand();
+    p->starts = starts;
+    if (starts) {
+        p->map = map;
+        map->refs++;
+    }
+    p->count = p->total = count;
+    return p;
+}
+
+Piece *piece_merge(Piece *a, Piece *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        a->right = piece_merge(a->right, b);
+        piece_update(a);
+        return a;
+    }
+    b->left = piece_merge(a, b->left);
+    piece_update(b);
+    return b;
+}
+
+/* Split so the left tree holds the first n lines; n must be a piece boundary */
+void piece_split(Piece *t, int n, Piece **l, Piece **r) {
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    int lt = piece_total(t->left);
+    if (n <= lt) {
+        piece_split(t->left, n, l, &t->left);
+        piece_update(t);
+        *r = t;
+    } else {
+        piece_split(t->right, n - lt - t->count, &t->right, r);
+        piece_update(t);
+        *l = t;
+    }
+}
+
+/* Find the piece holding line n, adding delta to every subtree count on the way */
+Piece *piece_walk(Piece *t, int n, int *start, int delta) {
+    int base = 0;
+    *start = 0;
+    while (t) {
+        int lt = piece_total(t->left);
+        t->total += delta;
+        if (n < lt) {
+            t = t->left;
+        } else if (n < lt + t->count) {
+            *start = base + lt;
+            return t;
+        } else {
+            n -= lt + t->count;
+            base += lt + t->count;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+
+/* Free a tree of pieces, returning owned lines to a, or leaving them for the arena to drop if a is NULL */
+void piece_free(Piece *t, Arena *a) {
+    if (!t) return;
+    piece_free(t->left, a);
+    piece_free(t->right, a);
+    if (!t->starts) {
+        if (a) for (int i = 0; i < t->count; i++) line_free(a, t->rows[i]);
+    } else {
+        filemap_release(t->map);
+    }
+    free(t);
+}
+
+/* Join two trees with one owned line between them, reusing a neighbouring text piece */
+Piece *piece_join_line(Piece *left, char *line, Piece *right) {
+    int start;
+    Piece *p;
+    
+    if (left && !(p = piece_walk(left, left->total - 1, &start, 0))->starts && p->count < PIECE_LINES) {
+        piece_walk(left, left->total - 1, &start, 1);
+        p->rows[p->count++] = line;
+    } else if (right && !(p = piece_walk(right, 0, &start, 0))->starts && p->count < PIECE_LINES) {
+        piece_walk(right, 0, &start, 1);
+        memmove(&p->rows[1], &p->rows[0], sizeof(char*) * p->count);
+        p->rows[0] = line;
+        p->count++;
+    } else {
+        p = piece_new(NULL, NULL, 1);
+        p->rows[0] = line;
+        left = piece_merge(left, p);
+    }
+    return piece_merge(left, right);
+}
+
+int rope_count(Rope *r) {
+    return piece_total(r->root);
+}
+
+/* Make line n the first line of a piece by splitting the piece holding it */
+void rope_cut(Rope *r, int n) {
+    int start;
+    if (n <= 0 || n >= rope_count(r)) return;
+    
+    Piece *p = piece_walk(r->root, n, &start, 0);
+    int i = n - start;
+    if (i == 0) return;
+    
+    Piece *q = piece_new(p->map, p->starts ? p->starts + i : NULL, p->count - i);
+    if (!p->starts) memcpy(q->rows, &p->rows[i], sizeof(char*) * q->count);
+    piece_walk(r->root, start, &start, -q->count);
+    p->count = i;
+    
+    Piece *left, *right;
+    piece_split(r->root, n, &left, &right);
+    r->root = piece_merge(piece_merge(left, q), right);
+    r->hint = NULL;
+}
+
+/* Detach line n into its own piece; returns it with the rest of the rope in *left and *right */
+Piece *rope_isolate(Rope *r, int n, Piece **left, Piece **right) {
+    Piece *mid;
+    rope_cut(r, n);
+    rope_cut(r, n + 1);
+    piece_split(r->root, n, left, &mid);
+    piece_split(mid, 1, &mid, right);
+    r->root = r->hint = NULL;
+    return mid;
+}
+
+Piece *rope_find(Rope *r, int n, int *start) {
+    if (r->hint && n >= r->hint_start && n < r->hint_start + r->hint->count) {
+        *start = r->hint_start;
+        return r->hint;
+    }
+    Piece *p = piece_walk(r->root, n, start, 0);
+    r->hint = p;
+    r->hint_start = *start;
+    return p;
+}
+
+/* Line i of piece p; mapped lines come without their line ending */
+const char *piece_line(Piece *p, int i, int *len) {
+    if (!p->starts) {
+        *len = line_length(p->rows[i]);
+        return line_join(p->rows[i]);
     }
+    const char *s = p->map->data + p->starts[i];
+    int l = (int)(p->starts[i + 1] - p->starts[i] - 1);
+    if (l > 0 && s[l - 1] == '\r') l--;
+    *len = l;
+    return s;
+}
+
+/* Read-only view of line n; mapped lines are not NUL-terminated */
+const char *rope_get(Rope *r, int n, int *len) {
+    int start;
+    Piece *p = rope_find(r, n, &start);
+    return piece_line(p, n - start, len);
+}
+
+int rope_len(Rope *r, int n) {
+    int start, len;
+    Piece *p = rope_find(r, n, &start);
+    if (!p->starts) return line_length(p->rows[n - start]);
+    piece_line(p, n - start, &len);
+    return len;
+}
+
+/*
+ * Bytes [from, to) of line n, without joining a line that is being edited:
+ * the result is indexed like rope_get's, but only that range may be read.
+ * A gap inside the range is moved out of it, to whichever end is nearer.
+ */
+const char *rope_peek(Rope *r, int n, int from, int to, int *len) {
+    int start;
+    Piece *p = rope_find(r, n, &start);
+    if (p->starts) return piece_line(p, n - start, len);
+    
+    char *line = p->rows[n - start];
+    LineHead *h = LINE_HEAD(line);
+    *len = h->len;
+    if (to > h->len) to = h->len;
+    if (h->gap_at >= 0 && from < h->gap_at && h->gap_at < to) line_gap_move(line, h->gap_at - from < to - h->gap_at ? from : to);
+    if (h->gap_at >= 0 && from >= h->gap_at) return line + (h->cap - h->len);
+    return line;
+}
+
+/* Owned, NUL-terminated copy of line n */
+char *rope_dup(Rope *r, int n) {
+    int len;
+    const char *s = rope_get(r, n, &len);
+    char *line = malloc(len + 1);
+    memcpy(line, s, len);
+    line[len] = '\0';
+    return line;
+}
+
+/* Writable storage slot of line n, copying a mapped line on first write */
+char **rope_slot(Rope *r, int n) {
+    int start;
+    Piece *p = rope_find(r, n, &start);
+    if (!p->starts) return &p->rows[n - start];
+    
+    int len;
+    const char *s = rope_get(r, n, &len);
+    char *line = line_new(&r->arena, s, len);
+    Piece *left, *right;
+    piece_free(rope_isolate(r, n, &left, &right), &r->arena);
+    r->root = piece_join_line(left, line, right);
+    p = rope_find(r, n, &start);
+    return &p->rows[n - start];
+}
+
+/* Insert a line from the rope's arena before line n (n == count appends); the rope takes ownership */
+void rope_insert_line(Rope *r, int n, char *line) {
+    int start, count = rope_count(r);
+    Piece *p = count ? piece_walk(r->root, n < count ? n : count - 1, &start, 0) : NULL;
+    
+    r->hint = NULL;
+    if (p && !p->starts && p->count == PIECE_LINES) {
+        /* Full: move the upper half into a new piece and retry */
+        rope_cut(r, start + PIECE_LINES / 2);
+        p = piece_walk(r->root, n < count ? n : count - 1, &start, 0);
+    }
+    
+    if (p && !p->starts) {
+        piece_walk(r->root, start, &start, 1);
+        memmove(&p->rows[n - start + 1], &p->rows[n - start], sizeof(char*) * (p->count - (n - start)));
+        p->rows[n - start] = line;
+        p->count++;
+    } else {
+        Piece *left, *right;
+        rope_cut(r, n);
+        piece_split(r->root, n, &left, &right);
+        r->root = piece_join_line(left, line, right);
+    }
+}
+
+/* Insert a copy of len bytes of s as a line before line n */
+void rope_insert(Rope *r, int n, const char *s, int len) {
+    rope_insert_line(r, n, line_new(&r->arena, s, len));
+}
+
+/* Remove line n and free its storage */
+void rope_delete(Rope *r, int n) {
+    int start;
+    Piece *p = piece_walk(r->root, n, &start, 0);
+    
+    r->hint = NULL;
+    if (p->starts || p->count == 1) {
+        Piece *left, *right;
+        piece_free(rope_isolate(r, n, &left, &right), &r->arena);
+        r->root = piece_merge(left, right);
+    } else {
+        piece_walk(r->root, n, &start, -1);
+        line_free(&r->arena, p->rows[n - start]);
+        memmove(&p->rows[n - start], &p->rows[n - start + 1], sizeof(char*) * (p->count - (n - start) - 1));
+        p->count--;
+    }
+}
+
+void rope_free(Rope *r) {
+    piece_free(r->root, NULL);
+    arena_free(&r->arena);
+    if (r->map) {
+        filemap_join(r->map, 1);
+#ifdef _WIN32
+        /* Registers still hold lines: let go of the file so it can be saved over or edited elsewhere */
+        if (r->map->refs > 1) filemap_detach(r->map);
+#endif
+        filemap_release(r->map);
+    }
+    r->root = r->hint = NULL;
+    r->map = NULL;
+}
+
+/* Heap bytes of a piece tree: the nodes, and the lines of runs over copies in memory */
+size_t piece_footprint(Piece *t) {
+    if (!t) return 0;
+    size_t n = sizeof(Piece) + piece_footprint(t->left) + piece_footprint(t->right);
+    if (!t->starts) n += sizeof(char*) * PIECE_LINES;
+    else if (t->map->heap) n += t->starts[t->count] - t->starts[0] + sizeof(size_t) * t->count;
+    return n;
+}
+
+/* Roughly the heap bytes behind a rope; the bytes of a mapped file are not counted, the system can read them back */
+size_t rope_footprint(Rope *r) {
+    size_t n = piece_footprint(r->root) + arena_footprint(&r->arena);
+    if (r->map) {
+        for (int i = 0; i < r->map->num_chunks; i++) n += sizeof(size_t) * r->map->chunks[i].count;
+    }
+    return n;
+}
+
+/* Append chunks whose index is finished, in file order; returns 1 if lines were added */
+int rope_poll(Rope *r) {
+    FileMap *m = r->map;
+    int added = 0;
+    
+    while (filemap_loading(m) && __atomic_load_n(&m->chunks[m->published].ready, __ATOMIC_ACQUIRE)) {
+        IndexChunk *c = &m->chunks[m->published];
+        IndexChunk *prev = m->published ? c - 1 : NULL;
+        
+        /* The last line of the previous chunk runs up to this chunk's first newline */
+        c->starts[0] = prev ? prev->starts[prev->count - 1] : 0;
+        m->newlines += c->count - 1;
+        m->crlf_newlines += c->crlf;
+        
+        /* A final line without a newline ends at EOF */
+        if (++m->published == m->num_chunks && c->starts[c->count - 1] != m->size) {
+            index_grow(c, 1);
+            c->starts[c->count++] = m->size + 1;
+        }
+        if (c->count > 1) {
+            r->root = piece_merge(r->root, piece_new(m, c->starts, c->count - 1));
+            added = 1;
+        }
+    }
+    if (m && !filemap_loading(m) && m->num_workers) filemap_join(m, 0);
+    return added;
+}
+
+/* Block until the whole file is indexed */
+void rope_finish(Rope *r) {
+    if (!filemap_loading(r->map)) return;
+    filemap_join(r->map, 0);
+    rope_poll(r);
+}
+
+/* Replace the contents with the lines of a mapped file; the rope owns the map */
+void rope_load(Rope *r, FileMap *m) {
+    rope_free(r);
+    r->map = m;
+    rope_poll(r);
+}
+
+/* Insert pieces before line n */
+void rope_splice(Rope *r, int n, Piece *pieces) {
+    Piece *left, *right;
+    rope_cut(r, n);
+    piece_split(r->root, n, &left, &right);
+    r->root = piece_merge(piece_merge(left, pieces), right);
+    r->hint = NULL;
+}
+
+/* Remove lines [n, n + count) */
+void rope_delete_range(Rope *r, int n, int count) {
+    Piece *left, *mid, *right;
+    rope_cut(r, n);
+    rope_cut(r, n + count);
+    piece_split(r->root, n, &left, &mid);
+    piece_split(mid, count, &mid, &right);
+    piece_free(mid, &r->arena);
+    r->root = piece_merge(left, right);
+    r->hint = NULL;
+}
+
+/*
+ * Line spans
+ *
+ * A span is an immutable run of whole lines, as held by a register or an
+ * undo step: a list of runs of mapped lines, each holding a reference on
+ * its map. Lines still untouched in a file are taken as one run per piece,
+ * whatever their number; edited lines are packed once into a heap map of
+ * their own. Putting a span back splices in new pieces over the same bytes.
+ */
+typedef struct {
+    FileMap *map;
+    const size_t *starts;
+    int count;
+} SpanRun;
+
+typedef struct {
+    int refs;
+    int lines;
+    long long bytes;            /* As stored, with a line ending for every line */
+    int num_runs;
+    SpanRun *runs;
+} Span;
+
+/* Lines [n, n + count) of a rope */
+Span *span_from_rope(Rope *r, int n, int count) {
+    Span *s = calloc(1, sizeof(Span));
+    int owned = 0, start, cap = 0;
+    
+    s->refs = 1;
+    s->lines = count;
+    for (int i = n; i < n + count; ) {
+        Piece *p = rope_find(r, i, &start);
+        int take = start + p->count < n + count ? start + p->count - i : n + count - i;
+        if (!p->starts) owned += take;
+        i += take;
+    }
+    
+    /* Owned rows go into one packed block; its line index is sized up front so runs can point into it */
+    size_t *pack_starts = owned ? malloc(sizeof(size_t) * (owned + 1)) : NULL;
+    char *pack = NULL;
+    size_t pack_size = 0, pack_cap = 0;
+    int packed = 0, crlf = 0;
+    FileMap *pack_map = NULL;
+    
+    for (int i = n; i < n + count; ) {
+        Piece *p = rope_find(r, i, &start);
+        int off = i - start;
+        int take = start + p->count < n + count ? start + p->count - i : n + count - i;
+        SpanRun *last = s->num_runs ? &s->runs[s->num_runs - 1] : NULL;
+        if (p->starts || !last || last->map) {
+            if (s->num_runs == cap) {
+                cap = cap ? cap * 2 : 8;
+                s->runs = realloc(s->runs, sizeof(SpanRun) * cap);
+            }
+            last = &s->runs[s->num_runs++];
+            last->map = p->starts ? p->map : NULL;
+            last->starts = p->starts ? p->starts + off : pack_starts + packed;
+            last->count = 0;
+        }
+        last->count += take;
+        if (p->starts) {
+            p->map->refs++;
+            s->bytes += p->starts[off + take] - p->starts[off];
+        } else {
+            for (int k = off; k < off + take; k++) {
+                size_t len = line_length(line_join(p->rows[k]));
+                if (pack_size + len + 2 > pack_cap) {
+                    pack_cap = (pack_size + len + 2) * 2;
+                    pack = realloc(pack, pack_cap);
+                }
+                pack_starts[packed++] = pack_size;
+                memcpy(pack + pack_size, p->rows[k], len);
+                pack_size += len;
+                /* A row ending in CR gets a CRLF so reading it back strips only the added one */
+                if (len && p->rows[k][len - 1] == '\r') {
+                    pack[pack_size++] = '\r';
+                    crlf++;
+                }
+                pack[pack_size++] = '\n';
+            }
+        }
+        i += take;
+    }
+    if (owned) {
+        pack_starts[owned] = pack_size;
+        pack_map = filemap_memory(pack, pack_size, pack_starts, owned);
+        pack_map->crlf_newlines = crlf;
+        s->bytes += pack_size;
+        for (int i = 0; i < s->num_runs; i++) {
+            if (s->runs[i].map) continue;
+            s->runs[i].map = pack_map;
+            pack_map->refs++;
+        }
+        filemap_release(pack_map);
+    }
+    return s;
+}
+
+/* A span of a's lines followed by b's, sharing their text */
+Span *span_join(Span *a, Span *b) {
+    Span *s = calloc(1, sizeof(Span));
+    s->refs = 1;
+    s->lines = a->lines + b->lines;
+    s->bytes = a->bytes + b->bytes;
+    s->num_runs = a->num_runs + b->num_runs;
+    s->runs = malloc(sizeof(SpanRun) * (s->num_runs ? s->num_runs : 1));
+    memcpy(s->runs, a->runs, sizeof(SpanRun) * a->num_runs);
+    memcpy(s->runs + a->num_runs, b->runs, sizeof(SpanRun) * b->num_runs);
+    for (int i = 0; i < s->num_runs; i++) s->runs[i].map->refs++;
+    return s;
+}
+
+void span_release(Span *s) {
+    if (!s || --s->refs > 0) return;
+    for (int i = 0; i < s->num_runs; i++) filemap_release(s->runs[i].map);
+    free(s->runs);
+    free(s);
+}
+
+/* Insert a span's lines before line n */
+void rope_insert_span(Rope *r, int n, Span *s) {
+    Piece *pieces = NULL;
+    for (int i = 0; i < s->num_runs; i++) {
+        pieces = piece_merge(pieces, piece_new(s->runs[i].map, s->runs[i].starts, s->runs[i].count));
+    }
+    rope_splice(r, n, pieces);
+}
+
+/* Pack every owned line into one block and let the arena go, keeping untouched lines where they are */
+void rope_compact(Rope *r) {
+    if (!r->arena.lines) return;
+    Span *s = span_from_rope(r, 0, rope_count(r));
+    piece_free(r->root, NULL);
+    arena_free(&r->arena);
+    r->root = r->hint = NULL;
+    rope_insert_span(r, 0, s);
+    span_release(s);
+}
+
+/* A span's lines as text in the packed form: each ends in '\n', and one ending in CR gets an extra CR */
+char *span_text(Span *s, int *len) {
+    size_t size = 0, cap = s->bytes + s->lines + 1;
+    char *out = malloc(cap);
+    
+    for (int i = 0; i < s->num_runs; i++) {
+        SpanRun *run = &s->runs[i];
+        for (int k = 0; k < run->count; k++) {
+            const char *line = run->map->data + run->starts[k];
+            size_t n = run->starts[k + 1] - run->starts[k] - 1;
+            if (n > 0 && line[n - 1] == '\r') n--;
+            if (size + n + 2 > cap) {
+                cap = (size + n + 2) * 2;
+                out = realloc(out, cap);
+            }
+            memcpy(out + size, line, n);
+            size += n;
+            if (n > 0 && line[n - 1] == '\r') out[size++] = '\r';
+            out[size++] = '\n';
+        }
+    }
+    *len = (int)size;
+    return out;
+}
+
+/* Span over a copy of text in the packed form */
+Span *span_from_text(const char *text, int len) {
+    Span *s = calloc(1, sizeof(Span));
+    char *data = malloc(len ? len : 1);
+    int lines = 0, crlf = 0;
+    
+    memcpy(data, text, len);
+    for (const char *p = data; (p = memchr(p, '\n', data + len - p)) != NULL; p++) lines++;
+    size_t *starts = malloc(sizeof(size_t) * (lines + 1));
+    starts[0] = 0;
+    for (int i = 0, k = 1; i < len; i++) {
+        if (data[i] != '\n') continue;
+        if (i > 0 && data[i - 1] == '\r') crlf++;
+        starts[k++] = i + 1;
+    }
+    FileMap *m = filemap_memory(data, len, starts, lines);
+    m->crlf_newlines = crlf;
+    s->refs = 1;
+    s->lines = lines;
+    s->bytes = len;
+    s->num_runs = 1;
+    s->runs = malloc(sizeof(SpanRun));
+    s->runs[0].map = m;
+    s->runs[0].starts = starts;
+    s->runs[0].count = lines;
+    return s;
+}
+
+/*
+ * Saving
+ *
+ * The document is written to a temporary file next to the target, synced
+ * and renamed over it, so a crash leaves either the old or the new file.
+ * Writes are gathered: a run of untouched mapped lines goes out as one span
+ * of the original bytes, and owned lines are batched SAVE_IOV spans per
+ * writev call (copied into a staging buffer for WriteFile on Windows).
+ */
+typedef struct {
+#ifdef _WIN32
+    HANDLE file;
+    char *buf;
+    size_t used;
+#else
+    int fd;
+    struct iovec iov[SAVE_IOV];
+    int n;
+#endif
+    long long bytes;
+    int failed;
+} SaveWriter;
+
+void save_flush(SaveWriter *w) {
+#ifdef _WIN32
+    DWORD written;
+    if (w->used && !w->failed && (!WriteFile(w->file, w->buf, (DWORD)w->used, &written, NULL) || written != w->used)) {
+        w->failed = 1;
+    }
+    w->used = 0;
+#else
+    struct iovec *iov = w->iov;
+    int n = w->n;
+    while (n > 0 && !w->failed) {
+        ssize_t done = writev(w->fd, iov, n);
+        if (done < 0) {
+            w->failed = 1;
+            break;
+        }
+        /* Skip what was written, resuming partway into a span if needed */
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    w->n = 0;
+#endif
+}
+
+void save_put(SaveWriter *w, const char *p, size_t len) {
+    w->bytes += len;
+#ifdef _WIN32
+    if (w->used + len > SAVE_BUFFER) save_flush(w);
+    if (len < SAVE_BUFFER) {
+        memcpy(w->buf + w->used, p, len);
+        w->used += len;
+        return;
+    }
+    /* Large mapped runs skip the staging buffer */
+    while (len > 0 && !w->failed) {
+        DWORD chunk = len > (1u << 30) ? (1u << 30) : (DWORD)len, written;
+        if (!WriteFile(w->file, p, chunk, &written, NULL) || written != chunk) w->failed = 1;
+        p += chunk;
+        len -= chunk;
+    }
+#else
+    if (len == 0) return;
+    if (w->n == SAVE_IOV) save_flush(w);
+    w->iov[w->n].iov_base = (void *)p;
+    w->iov[w->n].iov_len = len;
+    w->n++;
+#endif
+}
+
+/* Queue a subtree in line order */
+void save_piece(SaveWriter *w, Rope *r, Piece *t, const char *eol) {
+    if (!t) return;
+    save_piece(w, r, t->left, eol);
+    if (t->starts && (t->map == r->map || (t->map->crlf_newlines == 0 && eol[0] == '\n'))) {
+        /* Untouched lines keep their original bytes and line endings */
+        size_t end = t->starts[t->count];
+        save_put(w, t->map->data + t->starts[0], (end > t->map->size ? t->map->size : end) - t->starts[0]);
+        if (end > t->map->size) save_put(w, eol, strlen(eol));
+    } else if (t->starts) {
+        /* Lines put from another file with other line endings */
+        for (int i = 0, len; i < t->count; i++) {
+            const char *line = piece_line(t, i, &len);
+            save_put(w, line, len);
+            save_put(w, eol, strlen(eol));
+        }
+    } else {
+        for (int i = 0; i < t->count; i++) {
+            save_put(w, line_join(t->rows[i]), line_length(t->rows[i]));
+            save_put(w, eol, strlen(eol));
+        }
+    }
+    save_piece(w, r, t->right, eol);
+}
+
+/* The temporary file a save of path is written to */
+void save_temp_name(char *tmp, int size, const char *path) {
+#ifdef _WIN32
+    snprintf(tmp, size, "%s.az-save", path);
+#else
+    snprintf(tmp, size, "%s.az-save-%d", path, (int)getpid());
+#endif
+}
+
+/* Write the document to tmp, with the permissions of path, and sync it; returns bytes written or -1 */
+long long rope_write(Rope *r, const char *tmp, const char *path, int crlf) {
+    SaveWriter w = {0};
+    const char *eol = crlf ? "\r\n" : "\n";
+    
+    rope_finish(r);
+#ifdef _WIN32
+    (void)path;
+    w.file = CreateFile(tmp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (w.file == INVALID_HANDLE_VALUE) return -1;
+    w.buf = malloc(SAVE_BUFFER);
+    save_piece(&w, r, r->root, eol);
+    save_flush(&w);
+    free(w.buf);
+    if (!FlushFileBuffers(w.file)) w.failed = 1;
+    CloseHandle(w.file);
+    if (w.failed) {
+        DeleteFile(tmp);
+        return -1;
+    }
+#else
+    struct stat st;
+    int exists = stat(path, &st) == 0;
+    w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (w.fd < 0) return -1;
+    if (exists) fchmod(w.fd, st.st_mode & 07777);
+    save_piece(&w, r, r->root, eol);
+    save_flush(&w);
+    if (fsync(w.fd) != 0) w.failed = 1;
+    if (close(w.fd) != 0) w.failed = 1;
+    if (w.failed) {
+        unlink(tmp);
+        return -1;
+    }
+#endif
+    return w.bytes;
+}
+
+/* Move a written tmp over path; returns 0 on failure. On Windows a rope mapping path moves to the new file */
+int rope_replace(Rope *r, const char *tmp, const char *path) {
+#ifdef _WIN32
+    /* A mapped file cannot be replaced; the new file has the same lines, so map that instead */
+    int mapped = r->map != NULL;
+    if (mapped) rope_free(r);
+    int ok = MoveFileEx(tmp, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    if (mapped) {
+        FileMap *m = filemap_open(ok ? path : tmp);
+        if (m) {
+            rope_load(r, m);
+            rope_finish(r);
+        }
+    }
+    return ok;
+#else
+    (void)r;
+    if (rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 0;
+    }
+    
+    /* Make the rename itself durable */
+    char dir[600];
+    char *slash;
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (slash) {
+        *(slash == dir ? slash + 1 : slash) = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+    int dfd = open(dir, O_RDONLY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    return 1;
+#endif
+}
+
+/* Atomically replace path with the document; returns bytes written or -1 */
+long long rope_save(Rope *r, const char *path, int crlf) {
+    char tmp[600];
+    save_temp_name(tmp, sizeof(tmp), path);
+    long long bytes = rope_write(r, tmp, path, crlf);
+    if (bytes < 0 || !rope_replace(r, tmp, path)) return -1;
+    return bytes;
+}
+
+/*
+ * Search
+ *
+ * A compiled pattern is found with a vectorized filter on its two rarest
+ * bytes (by a rough frequency table for code and logs), verifying only the
+ * candidate positions. Without SSE2 the portable kernel uses memchr on the
+ * rarest byte, or Boyer-Moore-Horspool skips for patterns of SEARCH_BMH_MIN
+ * bytes or more. With icase the pattern is stored lower-cased and letters
+ * are compared with the 0x20 bit forced on. Runs of untouched mapped lines
+ * are searched as one block of file bytes; patterns never contain a
+ * newline, so a match cannot straddle two lines.
+ */
+typedef struct Searcher Searcher;
+
+struct Searcher {
+    char pat[256];
+    int len;
+    int icase;
+    int off1, off2;                 /* Offsets of the two rarest bytes */
+    unsigned char fold1, fold2;     /* 0x20 when that byte is a letter under icase */
+    unsigned char fold_last;
+    int skip[256];
+    const char *(*scan)(Searcher *, const char *, const char *);
+};
+
+/* Higher for bytes that turn up more often in source code and logs */
+int search_rank(unsigned char c) {
+    static const char common[] = "zqjxkvbywgfpmucdlhrsnioate ";
+    const char *hit = c ? strchr(common, c) : NULL;
+    if (hit) return 64 + (int)(hit - common);
+    if (c >= '0' && c <= '9') return 48;
+    if (c >= 'A' && c <= 'Z') return 40;
+    if (c == '\t' || ispunct(c)) return 32;
+    return 0;
+}
+
+int search_verify(Searcher *s, const char *p) {
+    if (!s->icase) return memcmp(p, s->pat, s->len) == 0;
+    for (int i = 0; i < s->len; i++) {
+        if (tolower((unsigned char)p[i]) != (unsigned char)s->pat[i]) return 0;
+    }
+    return 1;
+}
+
+/* Portable kernel: first match starting in [p, last] */
+const char *search_scan_scalar(Searcher *s, const char *p, const char *last) {
+    int m = s->len;
+    
+    if (m >= SEARCH_BMH_MIN) {
+        while (p <= last) {
+            unsigned char c = p[m - 1];
+            if ((c | s->fold_last) == (unsigned char)s->pat[m - 1] && search_verify(s, p)) return p;
+            p += s->skip[c];
+        }
+        return NULL;
+    }
+    for (unsigned char b = s->pat[s->off1]; p <= last; p++) {
+        if (!s->fold1) {
+            p = memchr(p + s->off1, b, last - p + 1);
+            if (!p) return NULL;
+            p -= s->off1;
+        } else if (((unsigned char)p[s->off1] | 0x20) != b) {
+            continue;
+        }
+        if (search_verify(s, p)) return p;
+    }
+    return NULL;
+}
+
+/* A single byte needs no verify step, and the C library's memchr is as fast as it gets */
+const char *search_scan_byte(Searcher *s, const char *p, const char *last) {
+    return memchr(p, s->pat[0], last - p + 1);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+const char *search_scan_sse2(Searcher *s, const char *p, const char *last) {
+    const __m128i b1 = _mm_set1_epi8(s->pat[s->off1]), b2 = _mm_set1_epi8(s->pat[s->off2]);
+    const __m128i f1 = _mm_set1_epi8(s->fold1), f2 = _mm_set1_epi8(s->fold2);
+    
+    for (; p + 15 <= last; p += 16) {
+        __m128i x = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + s->off1)), f1);
+        __m128i y = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + s->off2)), f2);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, b1), _mm_cmpeq_epi8(y, b2)));
+        while (mask) {
+            const char *q = p + __builtin_ctz(mask);
+            if (search_verify(s, q)) return q;
+            mask &= mask - 1;
+        }
+    }
+    for (; p <= last; p++) {
+        if (((unsigned char)p[s->off1] | s->fold1) == (unsigned char)s->pat[s->off1] && search_verify(s, p)) return p;
+    }
+    return NULL;
+}
+
+__attribute__((target("avx2")))
+const char *search_scan_avx2(Searcher *s, const char *p, const char *last) {
+    const __m256i b1 = _mm256_set1_epi8(s->pat[s->off1]), b2 = _mm256_set1_epi8(s->pat[s->off2]);
+    const __m256i f1 = _mm256_set1_epi8(s->fold1), f2 = _mm256_set1_epi8(s->fold2);
+    
+    for (; p + 31 <= last; p += 32) {
+        __m256i x = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + s->off1)), f1);
+        __m256i y = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + s->off2)), f2);
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(x, b1), _mm256_cmpeq_epi8(y, b2)));
+        while (mask) {
+            const char *q = p + __builtin_ctz(mask);
+            if (search_verify(s, q)) return q;
+            mask &= mask - 1;
+        }
+    }
+    return search_scan_sse2(s, p, last);
+}
+#endif
+
+void search_compile(Searcher *s, const char *pat, int len, int icase) {
+    if (len > (int)sizeof(s->pat)) len = sizeof(s->pat);
+    s->len = len;
+    s->icase = icase;
+    for (int i = 0; i < len; i++) {
+        s->pat[i] = icase ? tolower((unsigned char)pat[i]) : pat[i];
+    }
+    
+    s->off1 = s->off2 = 0;
+    for (int i = 1; i < len; i++) {
+        if (search_rank(s->pat[i]) < search_rank(s->pat[s->off1])) s->off1 = i;
+    }
+    for (int i = 0, best = INT_MAX; i < len; i++) {
+        if (i != s->off1 && search_rank(s->pat[i]) < best) {
+            best = search_rank(s->pat[i]);
+            s->off2 = i;
+        }
+    }
+    if (len == 1) s->off2 = s->off1;
+    s->fold1 = (icase && len && isalpha((unsigned char)s->pat[s->off1])) ? 0x20 : 0;
+    s->fold2 = (icase && len && isalpha((unsigned char)s->pat[s->off2])) ? 0x20 : 0;
+    s->fold_last = (icase && len && isalpha((unsigned char)s->pat[len - 1])) ? 0x20 : 0;
+    
+    for (int c = 0; c < 256; c++) s->skip[c] = len;
+    for (int i = 0; i < len - 1; i++) {
+        s->skip[(unsigned char)s->pat[i]] = len - 1 - i;
+        if (icase) s->skip[toupper((unsigned char)s->pat[i])] = len - 1 - i;
+    }
+    
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    s->scan = __builtin_cpu_supports("avx2") ? search_scan_avx2 : search_scan_sse2;
+#else
+    s->scan = search_scan_scalar;
+#endif
+    if (len == 1 && !s->fold1) s->scan = search_scan_byte;
+}
+
+/* First match starting in [p, end - len] */
+const char *search_next(Searcher *s, const char *p, const char *end) {
+    if (s->len == 0 || end - p < s->len) return NULL;
+    return s->scan(s, p, end - s->len);
+}
+
+/* Last match starting in [begin, before) that ends by end */
+const char *search_prev(Searcher *s, const char *begin, const char *before, const char *end) {
+    int m = s->len;
+    if (m == 0 || end - begin < m) return NULL;
+    ptrdiff_t i = before - begin - 1;
+    if (i > end - begin - m) i = end - begin - m;
+    
+#if defined(__x86_64__) || defined(__i386__)
+    const __m128i b1 = _mm_set1_epi8(s->pat[s->off1]), b2 = _mm_set1_epi8(s->pat[s->off2]);
+    const __m128i f1 = _mm_set1_epi8(s->fold1), f2 = _mm_set1_epi8(s->fold2);
+    for (; i >= 15; i -= 16) {
+        const char *base = begin + i - 15;
+        __m128i x = _mm_or_si128(_mm_loadu_si128((const __m128i *)(base + s->off1)), f1);
+        __m128i y = _mm_or_si128(_mm_loadu_si128((const __m128i *)(base + s->off2)), f2);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, b1), _mm_cmpeq_epi8(y, b2)));
+        while (mask) {
+            int bit = 31 - __builtin_clz(mask);
+            if (search_verify(s, base + bit)) return base + bit;
+            mask &= ~(1u << bit);
+        }
+    }
+#endif
+    for (; i >= 0; i--) {
+        if (((unsigned char)begin[i + s->off1] | s->fold1) == (unsigned char)s->pat[s->off1] && search_verify(s, begin + i)) {
+            return begin + i;
+        }
+    }
+    return NULL;
+}
+
+/* Index of the line in starts[lo, hi) that holds byte offset off */
+int search_line_at(const size_t *starts, int lo, int hi, size_t off) {
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (starts[mid] <= off) lo = mid; else hi = mid;
+    }
+    return lo;
+}
+
+/* First match at or after (y, x) in lines [y, end_y) */
+int rope_search(Rope *r, Searcher *s, int y, int x, int end_y, int *my, int *mx) {
+    while (y < end_y) {
+        int start, len;
+        Piece *p = rope_find(r, y, &start);
+        int stop = start + p->count < end_y ? start + p->count : end_y;
+        
+        rope_get(r, y, &len);
+        if (x > len) x = len;
+        if (p->starts) {
+            const char *data = p->map->data;
+            size_t to = p->starts[stop - start] < p->map->size ? p->starts[stop - start] : p->map->size;
+            const char *hit = search_next(s, data + p->starts[y - start] + x, data + to);
+            if (hit) {
+                int i = search_line_at(p->starts, y - start, stop - start, hit - data);
+                *my = start + i;
+                *mx = (int)(hit - data - p->starts[i]);
+                return 1;
+            }
+        } else {
+            for (; y < stop; y++, x = 0) {
+                const char *row = line_join(p->rows[y - start]);
+                const char *hit = search_next(s, row + x, row + line_length(row));
+                if (hit) {
+                    *my = y;
+                    *mx = (int)(hit - row);
+                    return 1;
+                }
+            }
+        }
+        y = stop;
+        x = 0;
+    }
+    return 0;
+}
+
+/* Last match starting before (y, x) in lines [stop_y, y]; x past the end means the whole line */
+int rope_search_back(Rope *r, Searcher *s, int y, int x, int stop_y, int *my, int *mx) {
+    while (y >= stop_y) {
+        int start, len;
+        Piece *p = rope_find(r, y, &start);
+        int first = start > stop_y ? start : stop_y;
+        
+        rope_get(r, y, &len);
+        if (x > len) x = len;
+        if (p->starts) {
+            const char *data = p->map->data;
+            const size_t *st = p->starts;
+            const char *line_end = data + st[y - start] + len;
+            const char *hit = search_prev(s, data + st[first - start], data + st[y - start] + x, line_end);
+            if (hit) {
+                int i = search_line_at(st, first - start, y - start + 1, hit - data);
+                *my = start + i;
+                *mx = (int)(hit - data - st[i]);
+                return 1;
+            }
+        } else {
+            for (; y >= first; y--, x = INT_MAX) {
+                const char *row = line_join(p->rows[y - start]);
+                int row_len = line_length(row);
+                const char *hit = search_prev(s, row, row + (x < row_len ? x : row_len), row + row_len);
+                if (hit) {
+                    *my = y;
+                    *mx = (int)(hit - row);
+                    return 1;
+                }
+            }
+        }
+        y = first - 1;
+        x = INT_MAX;
+    }
+    return 0;
+}
+
+/*
+ * Regular expressions
+ *
+ * Patterns are parsed into a small syntax tree, compiled to a Thompson NFA
+ * and run as a lazily built DFA: a DFA state is a set of NFA states whose
+ * transitions are filled in the first time each byte is seen, so a line is
+ * matched in one pass with no backtracking. When REGEX_DFA_STATES states
+ * have been built the cache is flushed and rebuilt on demand.
+ *
+ * Syntax: literals, ., [classes] with ranges and ^, \d \w \s and their
+ * upper-case complements, ^ and $ at the line ends, |, (groups), * + ? and
+ * {m} {m,} {m,n}. Bounded repetition is expanded into copies, so counts
+ * are capped at REGEX_MAX_REPEAT and the NFA at REGEX_MAX_STATES.
+ */
+enum { RX_SET, RX_CAT, RX_ALT, RX_REPEAT, RX_BOL, RX_EOL, RX_EMPTY, RX_SPLIT, RX_MATCH };
+
+/* Per-line results kept between searches for the same pattern */
+enum { RX_LINE_UNKNOWN, RX_LINE_MISS, RX_LINE_HIT };
+
+typedef struct {
+    int type;
+    int a, b;               /* Children, or the set index for RX_SET */
+    int min, max;           /* RX_REPEAT bounds, max -1 for no limit */
+} RxNode;
+
+typedef struct {
+    int type;               /* RX_SET, RX_SPLIT, RX_BOL, RX_EOL or RX_MATCH */
+    int out, out1;
+    int set;
+} RxState;
+
+typedef struct {
+    int set_at, n;          /* Sorted NFA states in the pool */
+    int accept;             /* A match ends here */
+    int accept_eol;         /* A match ends here if this is the end of the line */
+    int next[256];          /* -1 until the byte is first seen */
+} RxDState;
+
+typedef struct {
+    RxDState *states;
+    int count, cap;
+    int table[REGEX_DFA_STATES * 2];   /* Open-addressed hash of sets to states */
+    int *pool;
+    int pool_len, pool_cap;
+    int start[2];           /* Start state mid-line and at the line start */
+    int scan;               /* Unanchored: the pattern may start at every byte */
+} RxDfa;
+
+typedef struct {
+    RxNode *nodes;
+    int node_count, node_cap;
+    unsigned char (*sets)[32];
+    int set_count, set_cap;
+    int root;
+    RxState *nfa;
+    int nfa_count, nfa_cap;
+    int start;
+    int icase;
+    RxDfa dfa[2];           /* Anchored at a start position, and scanning */
+    Searcher must;          /* Literal every match contains, len 0 if none */
+    int *mark, gen;         /* Closure scratch */
+    int *stack, *list, *list2;
+} Regex;
+
+typedef struct {
+    Regex *re;
+    const char *p, *end;
+    const char *error;
+} RxParser;
+
+int rx_has(const unsigned char *set, unsigned char c) {
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+void rx_add(unsigned char *set, unsigned char c) {
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+int rx_node(Regex *re, int type, int a, int b) {
+    if (re->node_count == re->node_cap) {
+        re->node_cap = re->node_cap ? re->node_cap * 2 : 32;
+        re->nodes = realloc(re->nodes, sizeof(RxNode) * re->node_cap);
+    }
+    RxNode *n = &re->nodes[re->node_count];
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    n->min = n->max = 0;
+    return re->node_count++;
+}
+
+int rx_new_set(Regex *re) {
+    if (re->set_count == re->set_cap) {
+        re->set_cap = re->set_cap ? re->set_cap * 2 : 16;
+        re->sets = realloc(re->sets, 32 * re->set_cap);
+    }
+    memset(re->sets[re->set_count], 0, 32);
+    return re->set_count++;
+}
+
+/* Classes behind \d \w \s and friends; anything else stands for itself */
+void rx_escape(unsigned char *set, int c) {
+    int lower = tolower(c), negate = isupper(c);
+    if (lower != 'd' && lower != 'w' && lower != 's') {
+        rx_add(set, c == 't' ? '\t' : c);
+        return;
+    }
+    unsigned char bits[32] = {0};
+    for (int i = 0; i < 256; i++) {
+        int in = lower == 'd' ? isdigit(i) : lower == 'w' ? (isalnum(i) || i == '_') : (isspace(i) != 0);
+        if (in != negate) rx_add(bits, i);
+    }
+    for (int i = 0; i < 32; i++) set[i] |= bits[i];
+}
+
+void rx_fold(unsigned char *set) {
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (rx_has(set, c) || rx_has(set, toupper(c))) {
+            rx_add(set, c);
+            rx_add(set, toupper(c));
+        }
+    }
+}
+
+/* Body of a [...] class; p is just past the '[' */
+int rx_class(RxParser *ps, unsigned char *set) {
+    int negate = 0, first = 1;
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+    while (ps->p < ps->end && (*ps->p != ']' || first)) {
+        int lo = (unsigned char)*ps->p++, hi;
+        first = 0;
+        if (lo == '\\' && ps->p < ps->end) {
+            lo = (unsigned char)*ps->p++;
+            if (strchr("dDwWsS", lo)) {
+                rx_escape(set, lo);
+                continue;
+            }
+            if (lo == 't') lo = '\t';
+        }
+        hi = lo;
+        if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && ps->p < ps->end) hi = (unsigned char)*ps->p++;
+            if (hi < lo) {
+                ps->error = "bad range";
+                return 0;
+            }
+        }
+        for (int c = lo; c <= hi; c++) rx_add(set, c);
+    }
+    if (ps->p >= ps->end) {
+        ps->error = "missing ]";
+        return 0;
+    }
+    ps->p++;
+    if (ps->re->icase) rx_fold(set);
+    if (negate) {
+        for (int i = 0; i < 32; i++) set[i] = ~set[i];
+    }
+    return 1;
+}
+
+int rx_alt(RxParser *ps);
+
+int rx_atom(RxParser *ps) {
+    Regex *re = ps->re;
+    int c = (unsigned char)*ps->p++;
+    
+    if (c == '(') {
+        int n = rx_alt(ps);
+        if (n < 0) return -1;
+        if (ps->p >= ps->end || *ps->p != ')') {
+            ps->error = "missing )";
+            return -1;
+        }
+        ps->p++;
+        return n;
+    }
+    if (c == '^') return rx_node(re, RX_BOL, 0, 0);
+    if (c == '$') return rx_node(re, RX_EOL, 0, 0);
+    if (c == '*' || c == '+' || c == '?') {
+        ps->error = "nothing to repeat";
+        return -1;
+    }
+    
+    int set = rx_new_set(re);
+    unsigned char *bits = re->sets[set];
+    if (c == '.') {
+        memset(bits, 0xff, 32);
+    } else if (c == '[') {
+        if (!rx_class(ps, bits)) return -1;
+    } else if (c == '\\') {
+        if (ps->p >= ps->end) {
+            ps->error = "trailing \\";
+            return -1;
+        }
+        rx_escape(bits, (unsigned char)*ps->p++);
+        if (re->icase) rx_fold(bits);
+    } else {
+        rx_add(bits, c);
+        if (re->icase) rx_fold(bits);
+    }
+    return rx_node(re, RX_SET, set, 0);
+}
+
+/* Accumulate a repeat count, saturating just past the limit */
+int rx_digit(int n, char c) {
+    n = n * 10 + (c - '0');
+    return n > REGEX_MAX_REPEAT ? REGEX_MAX_REPEAT + 1 : n;
+}
+
+/* {m}, {m,} or {m,n} at p; 0 if p does not start one, so the '{' is a literal */
+int rx_bounds(RxParser *ps, int *min, int *max) {
+    const char *q = ps->p + 1;
+    if (q >= ps->end || !isdigit((unsigned char)*q)) return 0;
+    for (*min = 0; q < ps->end && isdigit((unsigned char)*q); q++) *min = rx_digit(*min, *q);
+    *max = *min;
+    if (q < ps->end && *q == ',') {
+        q++;
+        *max = -1;
+        if (q < ps->end && isdigit((unsigned char)*q)) {
+            for (*max = 0; q < ps->end && isdigit((unsigned char)*q); q++) *max = rx_digit(*max, *q);
+        }
+    }
+    if (q >= ps->end || *q != '}') return 0;
+    ps->p = q;
+    return 1;
+}
+
+int rx_repeat(RxParser *ps) {
+    int n = rx_atom(ps);
+    while (n >= 0 && ps->p < ps->end) {
+        int min, max;
+        if (*ps->p == '*') {
+            min = 0, max = -1;
+        } else if (*ps->p == '+') {
+            min = 1, max = -1;
+        } else if (*ps->p == '?') {
+            min = 0, max = 1;
+        } else if (*ps->p != '{' || !rx_bounds(ps, &min, &max)) {
+            break;
+        }
+        ps->p++;
+        if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT || (max >= 0 && max < min)) {
+            ps->error = "bad repeat count";
+            return -1;
+        }
+        n = rx_node(ps->re, RX_REPEAT, n, 0);
+        ps->re->nodes[n].min = min;
+        ps->re->nodes[n].max = max;
+    }
+    return n;
+}
+
+int rx_cat(RxParser *ps) {
+    int n = -1;
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        int m = rx_repeat(ps);
+        if (m < 0) return -1;
+        n = n < 0 ? m : rx_node(ps->re, RX_CAT, n, m);
+    }
+    return n < 0 ? rx_node(ps->re, RX_EMPTY, 0, 0) : n;
+}
+
+int rx_alt(RxParser *ps) {
+    int n = rx_cat(ps);
+    while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        int m = rx_cat(ps);
+        if (m < 0) return -1;
+        n = rx_node(ps->re, RX_ALT, n, m);
+    }
+    return n;
+}
+
+int rx_state(Regex *re, int type, int out, int out1, int set) {
+    if (re->nfa_count == re->nfa_cap) {
+        re->nfa_cap = re->nfa_cap ? re->nfa_cap * 2 : 64;
+        re->nfa = realloc(re->nfa, sizeof(RxState) * re->nfa_cap);
+    }
+    RxState *s = &re->nfa[re->nfa_count];
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    s->set = set;
+    return re->nfa_count++;
+}
+
+/* NFA states for node n that continue to next; returns the entry state */
+int rx_emit(Regex *re, int n, int next) {
+    RxNode node = re->nodes[n];
+    if (re->nfa_count > REGEX_MAX_STATES) return next;
+    
+    switch (node.type) {
+    case RX_SET:
+        return rx_state(re, RX_SET, next, -1, node.a);
+    case RX_CAT:
+        return rx_emit(re, node.a, rx_emit(re, node.b, next));
+    case RX_ALT: {
+        int a = rx_emit(re, node.a, next);
+        int b = rx_emit(re, node.b, next);
+        return rx_state(re, RX_SPLIT, a, b, 0);
+    }
+    case RX_REPEAT: {
+        int t = next;
+        if (node.max < 0) {
+            t = rx_state(re, RX_SPLIT, -1, next, 0);
+            int body = rx_emit(re, node.a, t);
+            re->nfa[t].out = body;
+        } else {
+            for (int i = node.min; i < node.max; i++) t = rx_state(re, RX_SPLIT, rx_emit(re, node.a, t), next, 0);
+        }
+        for (int i = 0; i < node.min; i++) t = rx_emit(re, node.a, t);
+        return t;
+    }
+    case RX_BOL:
+    case RX_EOL:
+        return rx_state(re, node.type, next, -1, 0);
+    default:
+        return next;
+    }
+}
+
+/* Add s and every state reachable from it without reading a byte */
+void rx_closure(Regex *re, int s, int at_bol, int at_eol, int *list, int *n) {
+    int sp = 0;
+    re->stack[sp++] = s;
+    while (sp > 0) {
+        s = re->stack[--sp];
+        if (re->mark[s] == re->gen) continue;
+        re->mark[s] = re->gen;
+        RxState *st = &re->nfa[s];
+        if (st->type == RX_SPLIT) {
+            re->stack[sp++] = st->out1;
+            re->stack[sp++] = st->out;
+        } else if (st->type == RX_BOL) {
+            if (at_bol) re->stack[sp++] = st->out;
+        } else if (st->type == RX_EOL && at_eol) {
+            re->stack[sp++] = st->out;
+        } else {
+            list[(*n)++] = s;
+        }
+    }
+}
+
+void rx_flush(RxDfa *d) {
+    d->count = 0;
+    d->pool_len = 0;
+    d->start[0] = d->start[1] = -1;
+    memset(d->table, -1, sizeof(d->table));
+}
+
+int rx_cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/* DFA state for a set of NFA states, built if new; -1 when the cache is full */
+int rx_dstate(Regex *re, RxDfa *d, int *list, int n) {
+    unsigned h = 2166136261u;
+    qsort(list, n, sizeof(int), rx_cmp_int);
+    for (int i = 0; i < n; i++) h = (h ^ list[i]) * 16777619u;
+    
+    int slot = h & (REGEX_DFA_STATES * 2 - 1);
+    for (; d->table[slot] >= 0; slot = (slot + 1) & (REGEX_DFA_STATES * 2 - 1)) {
+        RxDState *st = &d->states[d->table[slot]];
+        if (st->n == n && memcmp(d->pool + st->set_at, list, sizeof(int) * n) == 0) return d->table[slot];
+    }
+    if (d->count == REGEX_DFA_STATES) return -1;
+    
+    if (d->count == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->states = realloc(d->states, sizeof(RxDState) * d->cap);
+    }
+    if (d->pool_len + n >= d->pool_cap) {
+        d->pool_cap = (d->pool_len + n) * 2 + 64;
+        d->pool = realloc(d->pool, sizeof(int) * d->pool_cap);
+    }
+    RxDState *st = &d->states[d->count];
+    st->set_at = d->pool_len;
+    st->n = n;
+    memcpy(d->pool + d->pool_len, list, sizeof(int) * n);
+    d->pool_len += n;
+    memset(st->next, -1, sizeof(st->next));
+    
+    /* $ only holds at the end of the line, so that case is worked out up front */
+    int m = 0;
+    re->gen++;
+    for (int i = 0; i < n; i++) {
+        if (re->nfa[list[i]].type == RX_EOL || re->nfa[list[i]].type == RX_MATCH) rx_closure(re, list[i], 0, 1, re->list2, &m);
+    }
+    st->accept = st->accept_eol = 0;
+    for (int i = 0; i < n; i++) st->accept |= re->nfa[list[i]].type == RX_MATCH;
+    for (int i = 0; i < m; i++) st->accept_eol |= re->nfa[re->list2[i]].type == RX_MATCH;
+    
+    d->table[slot] = d->count;
+    return d->count++;
+}
+
+int rx_start(Regex *re, RxDfa *d, int at_bol) {
+    if (d->start[at_bol] < 0) {
+        int n = 0;
+        re->gen++;
+        rx_closure(re, re->start, at_bol, 0, re->list, &n);
+        int id = rx_dstate(re, d, re->list, n);
+        if (id < 0) {
+            rx_flush(d);
+            id = rx_dstate(re, d, re->list, n);
+        }
+        d->start[at_bol] = id;
+    }
+    return d->start[at_bol];
+}
+
+/* Follow byte c out of DFA state id, building the target state if needed */
+int rx_step(Regex *re, RxDfa *d, int id, unsigned char c) {
+    RxDState *st = &d->states[id];
+    int n = 0;
+    
+    re->gen++;
+    for (int i = 0; i < st->n; i++) {
+        RxState *s = &re->nfa[d->pool[st->set_at + i]];
+        if (s->type == RX_SET && rx_has(re->sets[s->set], c)) rx_closure(re, s->out, 0, 0, re->list, &n);
+    }
+    if (d->scan) rx_closure(re, re->start, 0, 0, re->list, &n);
+    
+    int next = rx_dstate(re, d, re->list, n);
+    if (next < 0) {
+        rx_flush(d);
+        return rx_dstate(re, d, re->list, n);
+    }
+    d->states[id].next[c] = next;
+    return next;
+}
+
+/* The byte a set stands for when it is a single literal (either case under icase), else -1 */
+int rx_set_literal(Regex *re, const unsigned char *set) {
+    int found = -1, n = 0;
+    for (int c = 0; c < 256; c++) {
+        if (!rx_has(set, c)) continue;
+        if (++n > 2) return -1;
+        if (found < 0) found = c;
+    }
+    if (n == 1) return found;
+    if (n == 2 && re->icase && isupper(found) && rx_has(set, tolower(found))) return tolower(found);
+    return -1;
+}
+
+/* Longest run of literal bytes in the top-level concatenation of node n */
+void rx_must(Regex *re, int n, char *run, int *len, char *best, int *best_len) {
+    RxNode *node = &re->nodes[n];
+    int c = node->type == RX_SET ? rx_set_literal(re, re->sets[node->a]) : -1;
+    
+    if (node->type == RX_CAT) {
+        rx_must(re, node->a, run, len, best, best_len);
+        rx_must(re, node->b, run, len, best, best_len);
+        return;
+    }
+    if (c >= 0 && *len < (int)sizeof(re->must.pat)) {
+        run[(*len)++] = c;
+        if (*len > *best_len) {
+            memcpy(best, run, *len);
+            *best_len = *len;
+        }
+    } else if (node->type != RX_BOL && node->type != RX_EOL && node->type != RX_EMPTY) {
+        *len = 0;
+    }
+}
+
+void regex_free(Regex *re) {
+    if (!re) return;
+    for (int i = 0; i < 2; i++) {
+        free(re->dfa[i].states);
+        free(re->dfa[i].pool);
+    }
+    free(re->nodes);
+    free(re->sets);
+    free(re->nfa);
+    free(re->mark);
+    free(re->stack);
+    free(re->list);
+    free(re->list2);
+    free(re);
+}
+
+/* Compile pat; NULL with a message in error if it is not a valid pattern */
+Regex *regex_compile(const char *pat, int len, int icase, char *error, int error_size) {
+    Regex *re = calloc(1, sizeof(Regex));
+    RxParser ps = { re, pat, pat + len, NULL };
+    
+    re->icase = icase;
+    re->root = rx_alt(&ps);
+    if (re->root >= 0 && ps.p < ps.end) ps.error = "unmatched )";
+    if (!ps.error) {
+        re->start = rx_emit(re, re->root, rx_state(re, RX_MATCH, -1, -1, 0));
+        if (re->nfa_count > REGEX_MAX_STATES) ps.error = "pattern too large";
+    }
+    if (ps.error) {
+        snprintf(error, error_size, "%s", ps.error);
+        regex_free(re);
+        return NULL;
+    }
+    
+    char run[256], best[256];
+    int run_len = 0, best_len = 0;
+    rx_must(re, re->root, run, &run_len, best, &best_len);
+    search_compile(&re->must, best, best_len, icase);
+    
+    re->mark = calloc(re->nfa_count, sizeof(int));
+    re->stack = malloc(sizeof(int) * (re->nfa_count * 2 + 2));
+    re->list = malloc(sizeof(int) * re->nfa_count);
+    re->list2 = malloc(sizeof(int) * re->nfa_count);
+    for (int i = 0; i < 2; i++) rx_flush(&re->dfa[i]);
+    re->dfa[1].scan = 1;
+    return re;
+}
+
+/* Patterns without metacharacters go to the literal searcher instead */
+int regex_is_literal(const char *pat, int len) {
+    for (int i = 0; i < len; i++) {
+        if (strchr(".[]()*+?{}|^$\\", pat[i])) return 0;
+    }
+    return 1;
+}
+
+/* Quick reject: no match can start at s because its first byte leads nowhere */
+int rx_dead_start(Regex *re, const char *line, int len, int s) {
+    RxDfa *d = &re->dfa[0];
+    int id = rx_start(re, d, s == 0);
+    RxDState *st = &d->states[id];
+    if (s >= len || st->accept) return 0;
+    int next = st->next[(unsigned char)line[s]];
+    return next >= 0 && d->states[next].n == 0;
+}
+
+/* End of the longest match starting at s, or -1 */
+int regex_match_at(Regex *re, const char *line, int len, int s) {
+    RxDfa *d = &re->dfa[0];
+    int st = rx_start(re, d, s == 0), end = -1;
+    
+    for (int i = s; ; i++) {
+        RxDState *ds = &d->states[st];
+        if (ds->n == 0) return end;
+        if (ds->accept) end = i;
+        if (i == len) return ds->accept_eol ? len : end;
+        st = ds->next[(unsigned char)line[i]];
+        if (st < 0) st = rx_step(re, d, ds - d->states, line[i]);
+    }
+}
+
+/* Where the first match starting at or after x ends, or -1 */
+int regex_first_end(Regex *re, const char *line, int len, int x) {
+    RxDfa *d = &re->dfa[1];
+    int st = rx_start(re, d, x == 0);
+    
+    for (int i = x; ; i++) {
+        RxDState *ds = &d->states[st];
+        if (ds->accept) return i;
+        if (i == len) return ds->accept_eol ? len : -1;
+        st = ds->next[(unsigned char)line[i]];
+        if (st < 0) st = rx_step(re, d, ds - d->states, line[i]);
+    }
+}
+
+/* Leftmost-longest match starting at or after x */
+int regex_find(Regex *re, const char *line, int len, int x, int *mlen) {
+    int e = regex_first_end(re, line, len, x);
+    if (e < 0) return -1;
+    
+    /* The match ending at e starts no later than e */
+    for (int s = x; s <= e; s++) {
+        if (rx_dead_start(re, line, len, s)) continue;
+        int end = regex_match_at(re, line, len, s);
+        if (end >= 0) {
+            *mlen = end - s;
+            return s;
+        }
+    }
+    return -1;
+}
+
+/* Longest match with the last start before before */
+int regex_find_last(Regex *re, const char *line, int len, int before, int *mlen) {
+    for (int s = before - 1 < len ? before - 1 : len; s >= 0; s--) {
+        if (rx_dead_start(re, line, len, s)) continue;
+        int end = regex_match_at(re, line, len, s);
+        if (end >= 0) {
+            *mlen = end - s;
+            return s;
+        }
+    }
+    return -1;
+}
+
+/* Whole-line match test, through the per-line cache when there is one */
+int rx_line_hit(Regex *re, unsigned char *cache, int cache_len, int y, const char *line, int len) {
+    if (y < cache_len && cache[y] != RX_LINE_UNKNOWN) return cache[y] == RX_LINE_HIT;
+    int hit = (re->must.len == 0 || search_next(&re->must, line, line + len)) && regex_first_end(re, line, len, 0) >= 0;
+    if (y < cache_len) cache[y] = hit ? RX_LINE_HIT : RX_LINE_MISS;
+    return hit;
+}
+
+/* First match at or after (y, x) in lines [y, end_y); lines the cache marks as misses are skipped */
+int rope_regex_search(Rope *r, Regex *re, unsigned char *cache, int cache_len, int y, int x, int end_y, int *my, int *mx) {
+    while (y < end_y) {
+        int start;
+        Piece *p = rope_find(r, y, &start);
+        int stop = start + p->count < end_y ? start + p->count : end_y;
+        
+        for (; y < stop; y++, x = 0) {
+            int len, mlen;
+            if (y < cache_len && cache[y] == RX_LINE_MISS) continue;
+            const char *line = piece_line(p, y - start, &len);
+            if (x > len || !rx_line_hit(re, cache, cache_len, y, line, len)) continue;
+            int m = regex_find(re, line, len, x, &mlen);
+            if (m >= 0) {
+                *my = y;
+                *mx = m;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Last match starting before (y, x) in lines [stop_y, y]; x past the end means the whole line */
+int rope_regex_search_back(Rope *r, Regex *re, unsigned char *cache, int cache_len, int y, int x, int stop_y, int *my, int *mx) {
+    while (y >= stop_y) {
+        int start;
+        Piece *p = rope_find(r, y, &start);
+        int first = start > stop_y ? start : stop_y;
+        
+        for (; y >= first; y--, x = INT_MAX) {
+            int len, mlen;
+            if (y < cache_len && cache[y] == RX_LINE_MISS) continue;
+            const char *line = piece_line(p, y - start, &len);
+            if (!rx_line_hit(re, cache, cache_len, y, line, len)) continue;
+            int m = regex_find_last(re, line, len, x, &mlen);
+            if (m >= 0) {
+                *my = y;
+                *mx = m;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Monotonic clock for benchmarks */
+double now_ms(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+/*
+ * Project search
+ *
+ * :grep walks a directory tree on a pool of workers. Each worker owns a
+ * deque of paths still to visit: it pushes and pops at the back, so its own
+ * walk stays depth first, and when it runs dry it steals from the front of
+ * another worker's deque, where the oldest and usually largest directories
+ * wait. Files are mapped read-only and scanned in place. A NUL byte among
+ * the first GREP_BINARY_PROBE bytes marks a binary file, which is skipped,
+ * and so are hidden entries and symbolic links. Each file's matching lines
+ * are appended to the shared result list in one go, so the editor can show
+ * them while the walk is still running.
+ */
+typedef struct {
+    int file;               /* Index into Grep.files */
+    int line, col, len;     /* Match position and length */
+    int text_col;           /* Column of the first byte of text */
+    char *text;             /* Part of the line around the match, NUL-terminated */
+} GrepHit;
+
+typedef struct {
+    Mutex lock;
+    char **items;           /* Paths with a leading 'd' or 'f' for directories and files */
+    int head, tail, cap;    /* Live items are [head, tail) */
+} GrepQueue;
+
+typedef struct Grep Grep;
+
+typedef struct {
+    Grep *g;
+    int id;
+    Thread thread;
+    Regex *re;              /* Every worker needs its own, the DFA is built as it runs */
+    GrepHit *hits;          /* Matches in the current file */
+    int count, cap;
+} GrepWorker;
+
+struct Grep {
+    char root[512];
+    char pattern[256];
+    Searcher lit;           /* The pattern itself, or for a regex the literal every match holds */
+    int regex;
+    GrepQueue queues[GREP_MAX_THREADS];
+    GrepWorker workers[GREP_MAX_THREADS];
+    int threads;
+    int running;            /* Workers that have not exited yet */
+    int pending;            /* Paths queued or being visited; the walk is over at 0 */
+    int cancel;
+    int scanned;            /* Files read, for the status line */
+    double started, elapsed;
+    
+    Mutex lock;             /* Guards everything below */
+    char **files;           /* Files with at least one match */
+    int file_count, file_cap;
+    GrepHit *hits;
+    int count, cap;
+};
+
+void grep_push(Grep *g, int id, char kind, const char *path) {
+    GrepQueue *q = &g->queues[id];
+    size_t n = strlen(path);
+    char *item = malloc(n + 2);
+    item[0] = kind;
+    memcpy(item + 1, path, n + 1);
+    __atomic_add_fetch(&g->pending, 1, __ATOMIC_RELAXED);
+    
+    mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        /* Slide the live items down before growing */
+        if (q->head > q->cap / 2) {
+            memmove(q->items, q->items + q->head, sizeof(char *) * (q->tail - q->head));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            q->cap = q->cap ? q->cap * 2 : 64;
+            q->items = realloc(q->items, sizeof(char *) * q->cap);
+        }
+    }
+    q->items[q->tail++] = item;
+    mutex_unlock(&q->lock);
+}
+
+/* Next path for worker id: its own newest, else the oldest of another worker */
+char *grep_take(Grep *g, int id) {
+    char *item = NULL;
+    GrepQueue *q = &g->queues[id];
+    
+    mutex_lock(&q->lock);
+    if (q->tail > q->head) item = q->items[--q->tail];
+    mutex_unlock(&q->lock);
+    
+    for (int i = 1; !item && i < g->threads; i++) {
+        q = &g->queues[(id + i) % g->threads];
+        mutex_lock(&q->lock);
+        if (q->tail > q->head) item = q->items[q->head++];
+        mutex_unlock(&q->lock);
+    }
+    return item;
+}
+
+void grep_list_dir(Grep *g, int id, const char *dir) {
+    char path[1024];
+#ifdef _WIN32
+    char search_path[1024];
+    snprintf(search_path, sizeof(search_path), "%s\\*", dir);
+    
+    WIN32_FIND_DATA ffd;
+    HANDLE hFind = FindFirstFile(search_path, &ffd);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    do {
+        if (ffd.cFileName[0] == '.') continue;
+        if (ffd.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_REPARSE_POINT)) continue;
+        snprintf(path, sizeof(path), "%s\\%s", dir, ffd.cFileName);
+        grep_push(g, id, (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? 'd' : 'f', path);
+    } while (FindNextFile(hFind, &ffd));
+    FindClose(hFind);
+#else
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    
+    while (d && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        int type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(path, &st) != 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+        if (type == DT_DIR || type == DT_REG) grep_push(g, id, type == DT_DIR ? 'd' : 'f', path);
+    }
+    if (d) closedir(d);
+#endif
+}
+
+void grep_add_hit(GrepWorker *w, const char *line, int len, int y, int col, int mlen) {
+    if (w->count == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 16;
+        w->hits = realloc(w->hits, sizeof(GrepHit) * w->cap);
+    }
+    GrepHit *h = &w->hits[w->count++];
+    int from = col > GREP_TEXT_MAX / 4 ? col - GREP_TEXT_MAX / 4 : 0;
+    int n = len - from < GREP_TEXT_MAX ? len - from : GREP_TEXT_MAX;
+    h->line = y;
+    h->col = col;
+    h->len = mlen;
+    h->text_col = from;
+    h->text = malloc(n + 1);
+    memcpy(h->text, line + from, n);
+    h->text[n] = '\0';
+}
+
+/* Hand the current file's matches to the shared list */
+void grep_publish(GrepWorker *w, const char *path) {
+    Grep *g = w->g;
+    if (w->count == 0) return;
+    
+    mutex_lock(&g->lock);
+    if (g->file_count == g->file_cap) {
+        g->file_cap = g->file_cap ? g->file_cap * 2 : 64;
+        g->files = realloc(g->files, sizeof(char *) * g->file_cap);
+    }
+    if (g->count + w->count > g->cap) {
+        while (g->count + w->count > g->cap) g->cap = g->cap ? g->cap * 2 : 256;
+        g->hits = realloc(g->hits, sizeof(GrepHit) * g->cap);
+    }
+    for (int i = 0; i < w->count; i++) w->hits[i].file = g->file_count;
+    g->files[g->file_count++] = _strdup(path);
+    memcpy(g->hits + g->count, w->hits, sizeof(GrepHit) * w->count);
+    g->count += w->count;
+    if (g->count >= GREP_MAX_HITS) __atomic_store_n(&g->cancel, 1, __ATOMIC_RELAXED);
+    mutex_unlock(&g->lock);
+    w->count = 0;
+}
+
+/* First match in a line, or -1 */
+int grep_line_match(GrepWorker *w, const char *line, int len, int *mlen) {
+    if (!w->re) {
+        const char *hit = search_next(&w->g->lit, line, line + len);
+        *mlen = w->g->lit.len;
+        return hit ? (int)(hit - line) : -1;
+    }
+    if (regex_first_end(w->re, line, len, 0) < 0) return -1;
+    return regex_find(w->re, line, len, 0, mlen);
+}
+
+/*
+ * Report the first match on every matching line of a mapped file. With a
+ * literal to look for, the searcher skips straight to candidate lines and
+ * newlines are only counted up to each candidate; otherwise every line is
+ * run through the regex.
+ */
+void grep_scan(GrepWorker *w, const char *data, size_t size) {
+    Grep *g = w->g;
+    const char *p = data, *end = data + size, *counted = data;
+    int y = 0;
+    
+    if (memchr(data, '\0', size < GREP_BINARY_PROBE ? size : GREP_BINARY_PROBE)) return;
+    while (p < end && !__atomic_load_n(&g->cancel, __ATOMIC_RELAXED)) {
+        const char *line = p;
+        if (g->lit.len) {
+            const char *hit = search_next(&g->lit, p, end);
+            if (!hit) break;
+            for (line = hit; line > p && line[-1] != '\n'; line--);
+        }
+        for (const char *nl; (nl = memchr(counted, '\n', line - counted)) != NULL; counted = nl + 1) y++;
+        
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        int len = (int)(eol - line), mlen;
+        if (len > 0 && line[len - 1] == '\r') len--;
+        int col = grep_line_match(w, line, len, &mlen);
+        if (col >= 0) grep_add_hit(w, line, len, y, col, mlen);
+        p = eol + 1;
+    }
+}
+
+void *grep_worker(void *arg) {
+    GrepWorker *w = arg;
+    Grep *g = w->g;
+    int idle = 0;
+    
+    while (!__atomic_load_n(&g->cancel, __ATOMIC_RELAXED)) {
+        char *item = grep_take(g, w->id);
+        if (!item) {
+            if (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) == 0) break;
+            
+            /* Others still hold work that may queue more; back off instead of spinning until it does */
+            if (++idle < GREP_IDLE_YIELDS) thread_yield();
+            else thread_sleep(1);
+            continue;
+        }
+        idle = 0;
+        if (item[0] == 'd') {
+            grep_list_dir(g, w->id, item + 1);
+        } else {
+            FileMap m = {0};
+            if (filemap_map(&m, item + 1)) {
+                grep_scan(w, m.data, m.size);
+                grep_publish(w, item + 1);
+            }
+            filemap_unmap(&m);
+            __atomic_add_fetch(&g->scanned, 1, __ATOMIC_RELAXED);
+        }
+        free(item);
+        __atomic_sub_fetch(&g->pending, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_sub_fetch(&g->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Wait for the workers; with cancel set they stop at the next file */
+void grep_join(Grep *g, int cancel) {
+    if (cancel) __atomic_store_n(&g->cancel, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < g->threads; i++) {
+        if (g->workers[i].thread) thread_join(g->workers[i].thread);
+        g->workers[i].thread = 0;
+    }
+    if (!g->elapsed) g->elapsed = now_ms() - g->started;
+}
+
+void grep_free(Grep *g) {
+    if (!g) return;
+    grep_join(g, 1);
+    for (int i = 0; i < g->threads; i++) {
+        GrepQueue *q = &g->queues[i];
+        while (q->tail > q->head) free(q->items[--q->tail]);
+        free(q->items);
+        mutex_free(&q->lock);
+        regex_free(g->workers[i].re);
+        free(g->workers[i].hits);
+    }
+    for (int i = 0; i < g->count; i++) free(g->hits[i].text);
+    for (int i = 0; i < g->file_count; i++) free(g->files[i]);
+    free(g->hits);
+    free(g->files);
+    mutex_free(&g->lock);
+    free(g);
+}
+
+/* Start searching the tree under root; NULL with a message in error for a bad pattern */
+Grep *grep_start(const char *root, const char *pat, int icase, int regex, int threads, char *error, int error_size) {
+    Grep *g = calloc(1, sizeof(Grep));
+    int len = (int)strlen(pat);
+    
+    snprintf(g->root, sizeof(g->root), "%s", root);
+    snprintf(g->pattern, sizeof(g->pattern), "%s", pat);
+    g->regex = regex && !regex_is_literal(pat, len);
+    g->threads = threads < 1 ? 1 : threads < GREP_MAX_THREADS ? threads : GREP_MAX_THREADS;
+    mutex_init(&g->lock);
+    for (int i = 0; i < g->threads; i++) {
+        mutex_init(&g->queues[i].lock);
+        g->workers[i].g = g;
+        g->workers[i].id = i;
+    }
+    for (int i = 0; g->regex && i < g->threads; i++) {
+        if (!(g->workers[i].re = regex_compile(pat, len, icase, error, error_size))) {
+            grep_free(g);
+            return NULL;
+        }
+    }
+    if (g->regex) {
+        g->lit = g->workers[0].re->must;
+    } else {
+        search_compile(&g->lit, pat, len, icase);
+    }
+    
+    grep_push(g, 0, 'd', root);
+    g->started = now_ms();
+    g->running = g->threads;
+    for (int i = 0; i < g->threads; i++) {
+        if (!thread_start(&g->workers[i].thread, grep_worker, &g->workers[i])) {
+            /* Fewer workers just means less stealing */
+            g->running--;
+            g->workers[i].thread = 0;
+        }
+    }
+    if (g->running == 0) {
+        g->running = 1;
+        grep_worker(&g->workers[0]);
+    }
+    return g;
+}
+
+int grep_running(Grep *g) {
+    return g && __atomic_load_n(&g->running, __ATOMIC_ACQUIRE) > 0;
+}
+
+/*
+ * Directory listing
+ *
+ * The sidebar lists directories on a background thread. Names go into one
+ * growable arena and entries refer to them by offset, so a listing costs
+ * what its names take and has no size limit. The worker reads entries in
+ * batches, sorts each batch and merges it into the sorted list under the
+ * lock; batches grow with the list, so the merges stay linear overall and
+ * the first screen of a huge directory shows up after the first batch.
+ */
+typedef struct {
+    size_t name;            /* Offset into DirList.names */
+    int is_dir;
+} DirEntry;
+
+typedef struct {
+    char path[512];
+    Thread thread;
+    int threaded;           /* The worker runs on thread, not inline */
+    int cancel;
+    int done;               /* The worker has merged its last batch */
+    
+    Mutex lock;             /* Guards everything below */
+    char *names;
+    size_t names_len, names_cap;
+    DirEntry *entries;      /* Sorted: "..", directories, then files */
+    int count;
+    int version;            /* Bumped by every merge */
+} DirList;
+
+/* A batch entry before it is merged; name points into the batch's own arena */
+typedef struct {
+    const char *name;
+    size_t off;
+    int is_dir;
+} DirPending;
+
+/* Case-insensitive, with runs of digits compared by value: file2 before file10 */
+int natural_cmp(const char *a, const char *b) {
+    const char *a0 = a, *b0 = b;
+    while (*a && *b) {
+        if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+            while (*a == '0') a++;
+            while (*b == '0') b++;
+            const char *ea = a, *eb = b;
+            while (isdigit((unsigned char)*ea)) ea++;
+            while (isdigit((unsigned char)*eb)) eb++;
+            if (ea - a != eb - b) return ea - a < eb - b ? -1 : 1;
+            int c = strncmp(a, b, ea - a);
+            if (c) return c;
+            a = ea;
+            b = eb;
+        } else {
+            int c = tolower((unsigned char)*a) - tolower((unsigned char)*b);
+            if (c) return c;
+            a++;
+            b++;
+        }
+    }
+    if (*a || *b) return *a ? 1 : -1;
+    return strcmp(a0, b0);
+}
+
+/* Sidebar order: ".." first, then directories, then files */
+int dir_cmp(const char *a, int a_dir, const char *b, int b_dir) {
+    int a_up = strcmp(a, "..") == 0, b_up = strcmp(b, "..") == 0;
+    if (a_up != b_up) return a_up ? -1 : 1;
+    if (a_dir != b_dir) return a_dir ? -1 : 1;
+    return natural_cmp(a, b);
+}
+
+int dir_pending_cmp(const void *a, const void *b) {
+    const DirPending *x = a, *y = b;
+    return dir_cmp(x->name, x->is_dir, y->name, y->is_dir);
+}
+
+/* Sort a batch and merge it into the shared list */
+void dir_merge(DirList *d, DirPending *batch, int n, const char *names, size_t names_len) {
+    for (int i = 0; i < n; i++) batch[i].name = names + batch[i].off;
+    qsort(batch, n, sizeof(DirPending), dir_pending_cmp);
+    
+    mutex_lock(&d->lock);
+    size_t base = d->names_len;
+    if (base + names_len > d->names_cap) {
+        while (base + names_len > d->names_cap) d->names_cap = d->names_cap ? d->names_cap * 2 : 4096;
+        d->names = realloc(d->names, d->names_cap);
+    }
+    memcpy(d->names + base, names, names_len);
+    d->names_len += names_len;
+    
+    DirEntry *merged = malloc(sizeof(DirEntry) * (d->count + n + 1));
+    int i = 0, j = 0, k = 0;
+    while (i < d->count || j < n) {
+        if (j == n || (i < d->count && dir_cmp(d->names + d->entries[i].name, d->entries[i].is_dir,
+                                               batch[j].name, batch[j].is_dir) <= 0)) {
+            merged[k++] = d->entries[i++];
+        } else {
+            merged[k].name = base + batch[j].off;
+            merged[k++].is_dir = batch[j++].is_dir;
+        }
+    }
+    free(d->entries);
+    d->entries = merged;
+    d->count = k;
+    d->version++;
+    mutex_unlock(&d->lock);
+}
+
+void *dir_worker(void *arg) {
+    DirList *d = arg;
+    DirPending *batch = NULL;
+    char *names = NULL;
+    size_t names_len = 0, names_cap = 0;
+    int n = 0, batch_cap = 0, limit = 256;
+    
+#ifdef _WIN32
+    char search_path[520];
+    snprintf(search_path, sizeof(search_path), "%s\\*", d->path);
+    WIN32_FIND_DATA ffd;
+    HANDLE hFind = FindFirstFile(search_path, &ffd);
+    int more = hFind != INVALID_HANDLE_VALUE;
+#else
+    DIR *dir = opendir(d->path);
+    struct dirent *de = NULL;
+    int more = dir && (de = readdir(dir)) != NULL;
+#endif
+    
+    while (more && !__atomic_load_n(&d->cancel, __ATOMIC_RELAXED)) {
+#ifdef _WIN32
+        const char *name = ffd.cFileName;
+        int is_dir = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+        const char *name = de->d_name;
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) {
+            /* Ask the file system; links count as what they point to */
+            char full[1024];
+            struct stat st;
+            snprintf(full, sizeof(full), "%s/%s", d->path, name);
+            is_dir = stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+#endif
+        if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+            size_t len = strlen(name) + 1;
+            if (names_len + len > names_cap) {
+                names_cap = names_cap * 2 + len + 4096;
+                names = realloc(names, names_cap);
+            }
+            if (n == batch_cap) {
+                batch_cap = batch_cap ? batch_cap * 2 : 256;
+                batch = realloc(batch, sizeof(DirPending) * batch_cap);
+            }
+            memcpy(names + names_len, name, len);
+            batch[n].off = names_len;
+            batch[n++].is_dir = is_dir;
+            names_len += len;
+        }
+        
+#ifdef _WIN32
+        more = FindNextFile(hFind, &ffd);
+#else
+        more = (de = readdir(dir)) != NULL;
+#endif
+        if (n == limit || (!more && n)) {
+            dir_merge(d, batch, n, names, names_len);
+            limit = d->count / 2 > limit ? d->count / 2 : limit;
+            n = 0;
+            names_len = 0;
+        }
+    }
+#ifdef _WIN32
+    if (hFind != INVALID_HANDLE_VALUE) FindClose(hFind);
+#else
+    if (dir) closedir(dir);
+#endif
+    free(batch);
+    free(names);
+    __atomic_store_n(&d->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Start listing path; ".." is there from the start */
+DirList *dir_list_start(const char *path) {
+    DirList *d = calloc(1, sizeof(DirList));
+    DirPending up = { NULL, 0, 1 };
+    snprintf(d->path, sizeof(d->path), "%s", path);
+    mutex_init(&d->lock);
+    dir_merge(d, &up, 1, "..", 3);
+    d->threaded = thread_start(&d->thread, dir_worker, d);
+    if (!d->threaded) dir_worker(d);
+    return d;
+}
+
+int dir_list_loading(DirList *d) {
+    return d && !__atomic_load_n(&d->done, __ATOMIC_ACQUIRE);
+}
+
+void dir_list_free(DirList *d) {
+    if (!d) return;
+    __atomic_store_n(&d->cancel, 1, __ATOMIC_RELAXED);
+    if (d->threaded) thread_join(d->thread);
+    mutex_free(&d->lock);
+    free(d->names);
+    free(d->entries);
+    free(d);
+}
+
+/* Index of entry e in the current list; entries are never removed, only merged in */
+int dir_list_find(DirList *d, DirEntry e) {
+    int lo = 0, hi = d->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        DirEntry *m = &d->entries[mid];
+        if (dir_cmp(d->names + m->name, m->is_dir, d->names + e.name, e.is_dir) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Fuzzy finder
+ *
+ * :find and Ctrl+P rank every file below the sidebar directory against a
+ * query whose characters must appear in order. The paths come from a
+ * PathIndex built on a background thread and cached on disk, so a later
+ * launch starts with the last index while a fresh one is built.
+ *
+ * Each path carries a 64-bit bag of the characters it contains. A query's
+ * bag must be a subset of the path's, a test that runs four paths per
+ * instruction with AVX2 and rejects most of the tree before any path is
+ * read. Survivors are scored: matches count more at the start of a word,
+ * after a camelCase hump, right after the previous match and inside the
+ * file name, and long gaps and long paths count against. Scoring works on
+ * bitmasks of where each query byte occurs, found 32 path bytes per compare,
+ * and large candidate lists are split across threads. Each query prefix
+ * keeps its matches, so a keystroke only rescores the previous survivors.
+ */
+typedef struct {
+    char root[512];
+    char *names;            /* Paths relative to root, NUL-terminated */
+    size_t names_len, names_cap;
+    size_t *offs;
+    unsigned long long *bags;
+    int count, cap;
+} PathIndex;
+
+typedef struct {
+    char root[512];
+    Thread thread;
+    int cancel;
+    int done;
+    int progress;           /* Paths found so far */
+    PathIndex *index;
+} PathBuild;
+
+typedef struct {
+    int path;
+    int score;
+} FindHit;
+
+/* One thread's slice [start, end) of the candidates, with its own top list */
+typedef struct {
+    PathIndex *ix;
+    const int *from;
+    int *out;
+    int start, end, kept;
+    const char *q;
+    int qlen;
+    FindHit *hits;
+    int max, count;
+    Thread thread;
+} FuzzyPart;
+
+unsigned char fuzzy_fold[256];
+unsigned char fuzzy_class[256];   /* FUZZY_SEP, FUZZY_LOWER or FUZZY_UPPER */
+int fuzzy_avx2;
+
+/* Bit of c in a character bag: letters and digits get their own, other bytes share the rest */
+int fuzzy_bit(unsigned char c) {
+    c = fuzzy_fold[c];
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= '0' && c <= '9') return 26 + c - '0';
+    return 36 + c % 28;
+}
+
+unsigned long long fuzzy_bag(const char *s, int len) {
+    unsigned long long bag = 0;
+    for (int i = 0; i < len; i++) bag |= 1ULL << fuzzy_bit(s[i]);
+    return bag;
+}
+
+void path_index_add(PathIndex *ix, const char *path) {
+    size_t len = strlen(path);
+    if (ix->count == ix->cap) {
+        ix->cap = ix->cap ? ix->cap * 2 : 1024;
+        ix->offs = realloc(ix->offs, sizeof(size_t) * ix->cap);
+        ix->bags = realloc(ix->bags, sizeof(unsigned long long) * ix->cap);
+    }
+    /* The vector scorer reads up to 31 bytes past the end of a path */
+    if (ix->names_len + len + 1 + 32 > ix->names_cap) {
+        ix->names_cap = ix->names_cap * 2 + len + 65536;
+        ix->names = realloc(ix->names, ix->names_cap);
+    }
+    memcpy(ix->names + ix->names_len, path, len + 1);
+    ix->offs[ix->count] = ix->names_len;
+    ix->bags[ix->count++] = fuzzy_bag(path, (int)len);
+    ix->names_len += len + 1;
+}
+
+/* Fill the case folding table; before any index is built or loaded */
+void fuzzy_init(void) {
+    for (int c = 0; c < 256; c++) {
+        fuzzy_fold[c] = (unsigned char)tolower(c);
+        fuzzy_class[c] = c && strchr("/\\_-. ", c) ? FUZZY_SEP : islower(c) ? FUZZY_LOWER : isupper(c) ? FUZZY_UPPER : 0;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    fuzzy_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+PathIndex *path_index_new(const char *root) {
+    PathIndex *ix = calloc(1, sizeof(PathIndex));
+    snprintf(ix->root, sizeof(ix->root), "%s", root);
+    return ix;
+}
+
+void path_index_free(PathIndex *ix) {
+    if (!ix) return;
+    free(ix->names);
+    free(ix->offs);
+    free(ix->bags);
+    free(ix);
+}
+
+/* The absolute name of a file, or the name as given if it cannot be resolved */
+void path_absolute(const char *path, char *abs, int abs_size) {
+#ifdef _WIN32
+    if (!_fullpath(abs, path, abs_size)) snprintf(abs, abs_size, "%s", path);
+#else
+    char *real = realpath(path, NULL);
+    snprintf(abs, abs_size, "%s", real ? real : path);
+    free(real);
+#endif
+}
+
+/* A file in the user's cache directory named kind-<hash of key> */
+void cache_file(const char *kind, const char *key, char *out, int size) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (const char *p = key; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+#ifdef _WIN32
+    const char *base = getenv("LOCALAPPDATA");
+    snprintf(out, size, "%s\\az", base ? base : ".");
+    _mkdir(out);
+    snprintf(out + strlen(out), size - strlen(out), "\\%s-%016llx", kind, h);
+#else
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if (xdg && *xdg) snprintf(out, size, "%s", xdg);
+    else snprintf(out, size, "%s/.cache", home ? home : ".");
+    
+    /* The base need not exist yet, nor the directories above it */
+    for (char *q = out + 1; *q; q++) {
+        if (*q != '/') continue;
+        *q = '\0';
+        mkdir(out, 0755);
+        *q = '/';
+    }
+    mkdir(out, 0755);
+    snprintf(out + strlen(out), size - strlen(out), "/az");
+    mkdir(out, 0755);
+    snprintf(out + strlen(out), size - strlen(out), "/%s-%016llx", kind, h);
+#endif
+}
+
+/* Where the index of root is cached */
+void path_index_cache(const char *root, char *out, int size) {
+    cache_file("paths", root, out, size);
+}
+
+/* Cache file: a header line, the root, then one path per line */
+int path_index_save(PathIndex *ix, const char *file) {
+    char tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return 0;
+    fprintf(fp, "AZPATHS1 %d\n%s\n", ix->count, ix->root);
+    for (int i = 0; i < ix->count; i++) {
+        fputs(ix->names + ix->offs[i], fp);
+        fputc('\n', fp);
+    }
+    int ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+    ok = ok && MoveFileEx(tmp, file, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp, file) == 0;
+#endif
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+/* The cached index of root, or NULL if there is none */
+PathIndex *path_index_load(const char *root, const char *file) {
+    FileMap m = {0};
+    PathIndex *ix = NULL;
+    int count;
+    char line[600];
+    
+    fuzzy_init();
+    if (filemap_map(&m, file) && m.size > 0) {
+        const char *p = m.data, *end = m.data + m.size, *nl = memchr(p, '\n', end - p);
+        const char *nl2 = nl ? memchr(nl + 1, '\n', end - nl - 1) : NULL;
+        if (nl2 && nl2 - nl - 1 < (ptrdiff_t)sizeof(line) && sscanf(p, "AZPATHS1 %d", &count) == 1) {
+            memcpy(line, nl + 1, nl2 - nl - 1);
+            line[nl2 - nl - 1] = '\0';
+            if (strcmp(line, root) == 0) ix = path_index_new(root);
+        }
+        for (p = nl2 + 1; ix && p < end; p = nl + 1) {
+            nl = memchr(p, '\n', end - p);
+            if (!nl) break;
+            if (nl - p >= (ptrdiff_t)sizeof(line)) continue;
+            memcpy(line, p, nl - p);
+            line[nl - p] = '\0';
+            path_index_add(ix, line);
+        }
+    }
+    filemap_unmap(&m);
+    return ix;
+}
+
+/* Walk root depth first, skipping hidden entries and symbolic links like :grep does */
+void *path_build_worker(void *arg) {
+    PathBuild *b = arg;
+    PathIndex *ix = path_index_new(b->root);
+    char **stack = malloc(sizeof(char *) * 64), path[1024];
+    int depth = 0, cap = 64;
+    stack[depth++] = _strdup("");
+    
+    while (depth > 0 && !__atomic_load_n(&b->cancel, __ATOMIC_RELAXED)) {
+        char *rel = stack[--depth];
+        char dir[1024];
+        snprintf(dir, sizeof(dir), "%s%s%s", b->root, *rel ? "/" : "", rel);
+#ifdef _WIN32
+        for (char *q = dir; *q; q++) if (*q == '/') *q = '\\';
+        char search_path[1040];
+        snprintf(search_path, sizeof(search_path), "%s\\*", dir);
+        WIN32_FIND_DATA ffd;
+        HANDLE hFind = FindFirstFile(search_path, &ffd);
+        int more = hFind != INVALID_HANDLE_VALUE;
+        while (more) {
+            const char *name = ffd.cFileName;
+            int skip = name[0] == '.' || (ffd.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_REPARSE_POINT));
+            int is_dir = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+        DIR *d = opendir(dir);
+        struct dirent *de;
+        while (d && (de = readdir(d)) != NULL) {
+            const char *name = de->d_name;
+            int type = de->d_type;
+            if (type == DT_UNKNOWN) {
+                /* A path too long to build is skipped, like one that cannot be read */
+                struct stat st;
+                int n = snprintf(path, sizeof(path), "%s/%s", dir, name);
+                type = n >= (int)sizeof(path) || lstat(path, &st) != 0 ? DT_LNK : S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+            }
+            int skip = name[0] == '.' || (type != DT_DIR && type != DT_REG);
+            int is_dir = type == DT_DIR;
+#endif
+            if (!skip) {
+                snprintf(path, sizeof(path), "%s%s%s", rel, *rel ? "/" : "", name);
+                if (is_dir) {
+                    if (depth == cap) stack = realloc(stack, sizeof(char *) * (cap *= 2));
+                    stack[depth++] = _strdup(path);
+                } else {
+                    path_index_add(ix, path);
+                    __atomic_store_n(&b->progress, ix->count, __ATOMIC_RELAXED);
+                }
+            }
+#ifdef _WIN32
+            more = FindNextFile(hFind, &ffd);
+        }
+        if (hFind != INVALID_HANDLE_VALUE) FindClose(hFind);
+#else
+        }
+        if (d) closedir(d);
+#endif
+        free(rel);
+    }
+    while (depth > 0) free(stack[--depth]);
+    free(stack);
+    
+    if (!__atomic_load_n(&b->cancel, __ATOMIC_RELAXED)) {
+        char cache[600];
+        path_index_cache(b->root, cache, sizeof(cache));
+        path_index_save(ix, cache);
+    }
+    b->index = ix;
+    __atomic_store_n(&b->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+PathBuild *path_build_start(const char *root) {
+    PathBuild *b = calloc(1, sizeof(PathBuild));
+    snprintf(b->root, sizeof(b->root), "%s", root);
+    fuzzy_init();
+    if (!thread_start(&b->thread, path_build_worker, b)) {
+        path_build_worker(b);
+        b->thread = 0;
+    }
+    return b;
+}
+
+int path_build_done(PathBuild *b) {
+    return __atomic_load_n(&b->done, __ATOMIC_ACQUIRE);
+}
+
+/* Wait for the builder and take its index; with cancel set the walk stops early */
+PathIndex *path_build_finish(PathBuild *b, int cancel) {
+    if (cancel) __atomic_store_n(&b->cancel, 1, __ATOMIC_RELAXED);
+    if (b->thread) thread_join(b->thread);
+    PathIndex *ix = b->index;
+    free(b);
+    if (cancel) {
+        path_index_free(ix);
+        return NULL;
+    }
+    return ix;
+}
+
+/* Indexes in [from, to) whose bag holds every bit of need */
+int fuzzy_filter_scalar(const unsigned long long *bags, int from, int to, unsigned long long need, int *out) {
+    int kept = 0;
+    for (int i = from; i < to; i++) {
+        out[kept] = i;
+        kept += (bags[i] & need) == need;
+    }
+    return kept;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+int fuzzy_filter_avx2(const unsigned long long *bags, int from, int to, unsigned long long need, int *out) {
+    const __m256i want = _mm256_set1_epi64x((long long)need);
+    int kept = 0, i = from;
+    
+    for (; i + 4 <= to; i += 4) {
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(bags + i)), want);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(b, want)));
+        while (mask) {
+            out[kept++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return kept + fuzzy_filter_scalar(bags, i, to, need, out + kept);
+}
+#endif
+
+/* Pick the widest bag filter the CPU supports */
+int fuzzy_filter(const unsigned long long *bags, int from, int to, unsigned long long need, int *out) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (fuzzy_avx2) return fuzzy_filter_avx2(bags, from, to, need, out);
+#endif
+    return fuzzy_filter_scalar(bags, from, to, need, out);
+}
+
+int fuzzy_boundary(const char *s, int i) {
+    if (i == 0) return 1;
+    int before = fuzzy_class[(unsigned char)s[i - 1]];
+    return before == FUZZY_SEP || (before == FUZZY_LOWER && fuzzy_class[(unsigned char)s[i]] == FUZZY_UPPER);
+}
+
+/* Points for the match at i given the previous one; the same for both scorers */
+int fuzzy_points(const char *s, int i, int prev) {
+    int points = 16;
+    if (fuzzy_boundary(s, i)) points += 10;
+    if (prev >= 0) points += i == prev + 1 ? 12 : -(i - prev - 1 < 8 ? i - prev - 1 : 8);
+    return points;
+}
+
+/* Matches inside the file name beat matches spread over the directories; then shorter paths win */
+int fuzzy_total(int score, int in_name, int len) {
+    return score < 0 ? -1 : (score + (in_name ? 40 : 0)) * 64 - (len < 63 ? len : 63) + 64;
+}
+
+/*
+ * Score of the folded query q as an in-order subsequence of s[from, len),
+ * or -1. The match used is the shortest window that ends where the
+ * earliest match ends; pos gets its offsets when given.
+ */
+int fuzzy_match(const char *s, int from, int len, const char *q, int qlen, int *pos) {
+    int i = from, j = 0, score = 0, prev = -1;
+    
+    for (; i < len && j < qlen; i++) j += fuzzy_fold[(unsigned char)s[i]] == (unsigned char)q[j];
+    if (j < qlen) return -1;
+    for (j = qlen - 1, i--; j >= 0; i--) j -= fuzzy_fold[(unsigned char)s[i]] == (unsigned char)q[j];
+    
+    for (i++, j = 0; j < qlen; i++) {
+        if (fuzzy_fold[(unsigned char)s[i]] != (unsigned char)q[j]) continue;
+        score += fuzzy_points(s, i, prev);
+        if (pos) pos[j] = i;
+        prev = i;
+        j++;
+    }
+    return score;
+}
+
+int fuzzy_path_score_scalar(const char *path, const char *q, int qlen, int *pos) {
+    int len = (int)strlen(path), base = len;
+    while (base > 0 && path[base - 1] != '/') base--;
+    int score = fuzzy_match(path, base, len, q, qlen, pos);
+    if (score >= 0) return fuzzy_total(score, 1, len);
+    return fuzzy_total(fuzzy_match(path, 0, len, q, qlen, pos), 0, len);
+}
+
+/* First set bit at or after i in the nw-word mask m, or -1 */
+int fuzzy_next(const unsigned long long *m, int nw, int i) {
+    for (int w = i >> 6; w < nw; w++) {
+        unsigned long long bits = w == i >> 6 ? m[w] & ~0ULL << (i & 63) : m[w];
+        if (bits) return w * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+/* Last set bit before i in m, or -1 */
+int fuzzy_prev(const unsigned long long *m, int i) {
+    for (int w = (i - 1) >> 6; i > 0 && w >= 0; w--) {
+        unsigned long long bits = w == (i - 1) >> 6 ? m[w] & ~0ULL >> (63 - ((i - 1) & 63)) : m[w];
+        if (bits) return w * 64 + 63 - __builtin_clzll(bits);
+    }
+    return -1;
+}
+
+/* fuzzy_match on bitmasks: bit i of the FUZZY_WORDS words at masks + j * FUZZY_WORDS is set where s[i] matches q[j] */
+int fuzzy_match_masks(const char *s, const unsigned long long *masks, int nw, int from, int qlen, int *pos) {
+    int p = from - 1, score = 0, prev = -1;
+    
+    for (int j = 0; j < qlen; j++) {
+        p = fuzzy_next(masks + j * FUZZY_WORDS, nw, p + 1);
+        if (p < 0) return -1;
+    }
+    for (int j = qlen - 1, limit = p + 1; j >= 0; j--) limit = p = fuzzy_prev(masks + j * FUZZY_WORDS, limit);
+    
+    for (int j = 0, at = p; j < qlen; j++) {
+        p = fuzzy_next(masks + j * FUZZY_WORDS, nw, at);
+        score += fuzzy_points(s, p, prev);
+        if (pos) pos[j] = p;
+        prev = p;
+        at = p + 1;
+    }
+    return score;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* One compare per query byte and 32 path bytes finds all its positions; -2 for paths too long to vectorize */
+__attribute__((target("avx2")))
+int fuzzy_path_score_avx2(const char *path, const char *q, int qlen, int *pos) {
+    const __m256i zero = _mm256_setzero_si256(), slash = _mm256_set1_epi8('/');
+    const __m256i before_a = _mm256_set1_epi8('A' - 1), after_z = _mm256_set1_epi8('Z' + 1), bit = _mm256_set1_epi8(0x20);
+    __m256i chunks[FUZZY_WORDS * 2 + 1];
+    unsigned long long masks[32 * FUZZY_WORDS], valid[FUZZY_WORDS];
+    int len = -1, nc = 0, nw, base = 0;
+    
+    while (len < 0 && nc < FUZZY_WORDS * 2) {
+        chunks[nc] = _mm256_loadu_si256((const __m256i *)(path + nc * 32));
+        unsigned nul = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunks[nc], zero));
+        if (nul) len = nc * 32 + __builtin_ctz(nul);
+        nc++;
+    }
+    if (len < 0) return -2;
+#define FUZZY_WORD(lo, hi) ((unsigned)_mm256_movemask_epi8(lo) | (unsigned long long)(unsigned)_mm256_movemask_epi8(hi) << 32)
+    chunks[nc] = zero;
+    nw = (nc + 1) / 2;
+    for (int w = 0; w < nw; w++) {
+        unsigned long long slashes = FUZZY_WORD(_mm256_cmpeq_epi8(chunks[2 * w], slash), _mm256_cmpeq_epi8(chunks[2 * w + 1], slash));
+        valid[w] = len >= (w + 1) * 64 ? ~0ULL : (1ULL << (len - w * 64)) - 1;
+        if (slashes & valid[w]) base = w * 64 + 64 - __builtin_clzll(slashes & valid[w]);
+    }
+    /* Fold to lower case once, then each query byte costs a compare per 32 bytes */
+    for (int c = 0; c < nc; c++) {
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(chunks[c], before_a), _mm256_cmpgt_epi8(after_z, chunks[c]));
+        chunks[c] = _mm256_or_si256(chunks[c], _mm256_and_si256(upper, bit));
+    }
+    
+    for (int j = 0; j < qlen; j++) {
+        const __m256i c = _mm256_set1_epi8(q[j]);
+        unsigned long long any = 0;
+        for (int w = 0; w < nw; w++) {
+            unsigned long long m = FUZZY_WORD(_mm256_cmpeq_epi8(chunks[2 * w], c), _mm256_cmpeq_epi8(chunks[2 * w + 1], c));
+            masks[j * FUZZY_WORDS + w] = m & valid[w];
+            any |= m & valid[w];
+        }
+        if (!any) return -1;
+    }
+#undef FUZZY_WORD
+    int score = fuzzy_match_masks(path, masks, nw, base, qlen, pos);
+    if (score >= 0) return fuzzy_total(score, 1, len);
+    return fuzzy_total(fuzzy_match_masks(path, masks, nw, 0, qlen, pos), 0, len);
+}
+#endif
+
+/* Score of path against the folded query q, or -1; pos gets the matched offsets when given */
+int fuzzy_path_score(const char *path, const char *q, int qlen, int *pos) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (fuzzy_avx2 && qlen <= 32) {
+        int score = fuzzy_path_score_avx2(path, q, qlen, pos);
+        if (score != -2) return score;
+    }
+#endif
+    return fuzzy_path_score_scalar(path, q, qlen, pos);
+}
+
+/* Score a slice, writing the matches over the start of out's slice */
+void *fuzzy_rank_part(void *arg) {
+    FuzzyPart *part = arg;
+    PathIndex *ix = part->ix;
+    unsigned long long need = fuzzy_bag(part->q, part->qlen);
+    FindHit *hits = part->hits;
+    int max = part->max, kept = part->start, count = 0;
+    
+    for (int i = part->start; i < part->end; i++) {
+        int p = part->from[i];
+        if ((ix->bags[p] & need) != need) continue;
+        int score = fuzzy_path_score(ix->names + ix->offs[p], part->q, part->qlen, NULL);
+        if (score < 0) continue;
+        part->out[kept++] = p;
+        if (count == max && score <= hits[max - 1].score) continue;
+        
+        /* Insert into the sorted top list; ties keep index order */
+        int at = count < max ? count++ : max - 1;
+        while (at > 0 && hits[at - 1].score < score) {
+            hits[at] = hits[at - 1];
+            at--;
+        }
+        hits[at].path = p;
+        hits[at].score = score;
+    }
+    part->kept = kept - part->start;
+    part->count = count;
+    return NULL;
+}
+
+/*
+ * Rank paths against the folded query q. The n path indexes in from may
+ * match, or the whole index when from is NULL; the ones that do are
+ * written to out (which may be from) and counted in *matched, so a longer
+ * query can start from them. The best max go to hits, best first.
+ * Large lists are split across threads and their top lists merged.
+ */
+int fuzzy_rank(PathIndex *ix, const int *from, int n, int *out, int *matched, const char *q, int qlen, FindHit *hits, int max) {
+    FuzzyPart parts[FUZZY_MAX_THREADS];
+    int nparts = cpu_count(), kept = 0, count = 0;
+    
+    if (!from) {
+        n = fuzzy_filter(ix->bags, 0, ix->count, fuzzy_bag(q, qlen), out);
+        from = out;
+    }
+    if (nparts > n / FUZZY_PART_MIN) nparts = n / FUZZY_PART_MIN;
+    if (nparts > FUZZY_MAX_THREADS) nparts = FUZZY_MAX_THREADS;
+    if (nparts < 1) nparts = 1;
+    
+    for (int t = 0; t < nparts; t++) {
+        FuzzyPart *part = &parts[t];
+        part->ix = ix;
+        part->from = from;
+        part->out = out;
+        part->start = (int)((long long)n * t / nparts);
+        part->end = (int)((long long)n * (t + 1) / nparts);
+        part->q = q;
+        part->qlen = qlen;
+        part->hits = t ? malloc(sizeof(FindHit) * max) : hits;
+        part->max = max;
+        /* The caller's thread takes part 0, and any part a thread could not start */
+        if (t && !thread_start(&part->thread, fuzzy_rank_part, part)) part->max = -max;
+    }
+    fuzzy_rank_part(&parts[0]);
+    for (int t = 1; t < nparts; t++) {
+        if (parts[t].max < 0) {
+            parts[t].max = max;
+            fuzzy_rank_part(&parts[t]);
+        } else {
+            thread_join(parts[t].thread);
+        }
+    }
+    
+    /* Parts are in index order, so compacting keeps out sorted and ties resolve as on one thread */
+    for (int t = 0; t < nparts; t++) {
+        memmove(out + kept, out + parts[t].start, sizeof(int) * parts[t].kept);
+        kept += parts[t].kept;
+    }
+    if (nparts > 1) {
+        FindHit *merged = malloc(sizeof(FindHit) * max);
+        int next[FUZZY_MAX_THREADS] = {0};
+        while (count < max) {
+            int best = -1;
+            for (int t = 0; t < nparts; t++) {
+                if (next[t] < parts[t].count && (best < 0 || parts[t].hits[next[t]].score > parts[best].hits[next[best]].score)) best = t;
+            }
+            if (best < 0) break;
+            merged[count++] = parts[best].hits[next[best]++];
+        }
+        memcpy(hits, merged, sizeof(FindHit) * count);
+        free(merged);
+        for (int t = 1; t < nparts; t++) free(parts[t].hits);
+    } else {
+        count = parts[0].count;
+    }
+    *matched = kept;
+    return count;
+}
+
+/*
+ * Syntax highlighting
+ *
+ * Each language is a row in the syntaxes table: comment and string
+ * delimiters, keyword lists and a few flags, all walked by one lexer.
+ * All that carries from one line to the next is the lexer state at the
+ * line end (in a block comment, a string or a fenced code block), so the
+ * editor keeps the start and end state of every line in one byte. A line
+ * is lexed again only when its text changed or it now starts in another
+ * state, and only up to the last row on screen.
+ */
+#define SYN_NUMBERS   1
+#define SYN_PREPROC   2     /* # directives at the start of a line */
+#define SYN_KEYS      4     /* A string followed by ':' is a key */
+#define SYN_VARS      8     /* $name, ${name} */
+#define SYN_MULTILINE 16    /* Strings run on past the line end */
+#define SYN_MARKDOWN  32
+
+enum { HL_NORMAL, HL_COMMENT, HL_STRING, HL_NUMBER, HL_KEYWORD, HL_TYPE, HL_PREPROC, HL_HEADING, HL_CODE, HL_CLASSES };
+
+/* Lexer states at a line end; a string adds the index of its quote */
+enum { HL_ST_NORMAL, HL_ST_COMMENT, HL_ST_FENCE, HL_ST_STRING };
+#define HL_UNKNOWN 0xFF     /* Cached state of a line not lexed since it changed */
+
+typedef struct {
+    const char *name;
+    const char *extensions;     /* Space separated file name endings */
+    const char *line_comment;
+    const char *block_open, *block_close;
+    const char *quotes;         /* Up to three string delimiters */
+    const char *keywords, *types;
+    int flags;
+    struct SyntaxTables *tables;    /* Set up by syntax_for */
+} Syntax;
+
+typedef struct SyntaxTables {
+    const char *word[SYN_WORD_SLOTS];   /* Keyword hash */
+    unsigned char len[SYN_WORD_SLOTS], class[SYN_WORD_SLOTS];
+    unsigned char opens[256];           /* Bytes that may start a comment, string or variable */
+} SyntaxTables;
+
+Syntax syntaxes[] = {
+    { "C", ".c .h .cc .cpp .cxx .hpp .hh .hxx .inl", "//", "/*", "*/", "\"'",
+      "if else for while do switch case default break continue return goto sizeof typedef struct union enum "
+      "static extern const volatile inline register restrict auto class namespace template typename public "
+      "private protected virtual override final friend new delete this operator using try catch throw "
+      "noexcept constexpr nullptr true false static_cast dynamic_cast const_cast reinterpret_cast "
+      "decltype explicit mutable NULL",
+      "void char short int long float double signed unsigned bool size_t ssize_t ptrdiff_t wchar_t FILE "
+      "int8_t int16_t int32_t int64_t uint8_t uint16_t uint32_t uint64_t intptr_t uintptr_t",
+      SYN_NUMBERS | SYN_PREPROC, NULL },
+    { "JSON", ".json", NULL, NULL, NULL, "\"", "true false null", NULL, SYN_NUMBERS | SYN_KEYS, NULL },
+    { "Shell", ".sh .bash .zsh .bashrc .profile", "#", NULL, NULL, "\"'",
+      "if then else elif fi for while until do done case esac in function return local export readonly "
+      "declare unset shift exit break continue source alias set trap eval exec",
+      NULL, SYN_NUMBERS | SYN_VARS | SYN_MULTILINE, NULL },
+    { "Markdown", ".md .markdown", NULL, NULL, NULL, "", NULL, NULL, SYN_MARKDOWN, NULL },
+};
+SyntaxTables syntax_tables[sizeof(syntaxes) / sizeof(syntaxes[0])];
+
+unsigned syntax_hash(const char *w, int n) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < n; i++) h = (h ^ (unsigned char)w[i]) * 16777619u;
+    return h % SYN_WORD_SLOTS;
+}
+
+void syntax_init(Syntax *syn) {
+    const char *lists[2] = { syn->keywords, syn->types };
+    SyntaxTables *t = &syntax_tables[syn - syntaxes];
+    
+    for (int k = 0; k < 2; k++) {
+        for (const char *p = lists[k]; p && *p; ) {
+            int n = (int)strcspn(p, " ");
+            unsigned h = syntax_hash(p, n);
+            while (t->word[h]) h = (h + 1) % SYN_WORD_SLOTS;
+            t->word[h] = p;
+            t->len[h] = (unsigned char)n;
+            t->class[h] = k ? HL_TYPE : HL_KEYWORD;
+            p += n;
+            while (*p == ' ') p++;
+        }
+    }
+    for (const char *q = syn->quotes; *q; q++) t->opens[(unsigned char)*q] = 1;
+    if (syn->line_comment) t->opens[(unsigned char)syn->line_comment[0]] = 1;
+    if (syn->block_open) t->opens[(unsigned char)syn->block_open[0]] = 1;
+    if (syn->flags & SYN_VARS) t->opens['$'] = 1;
+    syn->tables = t;
+}
+
+/* HL_KEYWORD, HL_TYPE or HL_NORMAL for the identifier w */
+int syntax_word(const Syntax *syn, const char *w, int n) {
+    const SyntaxTables *t = syn->tables;
+    for (unsigned h = syntax_hash(w, n); t->word[h]; h = (h + 1) % SYN_WORD_SLOTS) {
+        if (t->len[h] == n && memcmp(t->word[h], w, n) == 0) return t->class[h];
+    }
+    return HL_NORMAL;
+}
+
+/* The table row whose extensions end the file name, or NULL for plain text */
+Syntax *syntax_for(const char *filename) {
+    int len = (int)strlen(filename);
+    
+    for (int i = 0; i < (int)(sizeof(syntaxes) / sizeof(syntaxes[0])); i++) {
+        Syntax *syn = &syntaxes[i];
+        for (const char *p = syn->extensions; *p; ) {
+            int n = (int)strcspn(p, " ");
+            if (n <= len && _strnicmp(filename + len - n, p, n) == 0) {
+                if (!syn->tables) syntax_init(syn);
+                return syn;
+            }
+            p += n;
+            while (*p == ' ') p++;
+        }
+    }
+    return NULL;
+}
+
+int syntax_ident(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/*
+ * One token outside comments and strings starting at i; returns where it
+ * ends and sets *class. A line comment returns len. Words come back as
+ * HL_NORMAL, left to syntax_word. The line starts with lead blanks.
+ */
+int syntax_token(const Syntax *syn, const char *s, int len, int lead, int i, int *class) {
+    const char *lc = syn->line_comment;
+    int lcn = lc ? (int)strlen(lc) : 0;
+    char c = s[i];
+    
+    *class = HL_NORMAL;
+    if (lcn && len - i >= lcn && memcmp(s + i, lc, lcn) == 0 && (c != '#' || i == 0 || isspace((unsigned char)s[i - 1]))) {
+        /* A # comment has to start a word, so $# and a#b stay code */
+        i = len;
+        *class = HL_COMMENT;
+    } else if (c == '#' && (syn->flags & SYN_PREPROC) && lead >= i) {
+        for (i++; i < len && (s[i] == ' ' || s[i] == '\t'); i++);
+        while (i < len && syntax_ident(s[i])) i++;
+        *class = HL_PREPROC;
+    } else if (c == '$' && (syn->flags & SYN_VARS) && i + 1 < len) {
+        i++;
+        if (s[i] == '{') {
+            while (i < len && s[i] != '}') i++;
+            if (i < len) i++;
+        } else if (syntax_ident(s[i])) {
+            while (i < len && syntax_ident(s[i])) i++;
+        } else {
+            i++;
+        }
+        *class = HL_TYPE;
+    } else if (isdigit((unsigned char)c) && (syn->flags & SYN_NUMBERS)) {
+        while (i < len && (syntax_ident(s[i]) || s[i] == '.')) i++;
+        *class = HL_NUMBER;
+    } else if (isalpha((unsigned char)c) || c == '_') {
+        while (i < len && syntax_ident(s[i])) i++;
+    } else {
+        i++;
+    }
+    return i;
+}
+
+/* Fenced code blocks carry over; headings, quotes, list markers, `code` and link targets are per line */
+int syntax_lex_markdown(const char *s, int len, int state, unsigned char *cls) {
+    int i = (int)strspn(s, " ");
+    int fence = i < 4 && len - i >= 3 && (memcmp(s + i, "```", 3) == 0 || memcmp(s + i, "~~~", 3) == 0);
+    
+    if (state == HL_ST_FENCE || fence) {
+        if (cls) memset(cls, HL_CODE, len);
+        return (state == HL_ST_FENCE) != fence ? HL_ST_FENCE : HL_ST_NORMAL;
+    }
+    if (!cls) return HL_ST_NORMAL;
+    
+    memset(cls, HL_NORMAL, len);
+    if (i < len && s[i] == '#') {
+        memset(cls, HL_HEADING, len);
+        return HL_ST_NORMAL;
+    }
+    if (i < len && s[i] == '>') {
+        memset(cls, HL_COMMENT, len);
+        return HL_ST_NORMAL;
+    }
+    if (len - i >= 2 && strchr("-*+", s[i]) && s[i + 1] == ' ') {
+        cls[i] = HL_KEYWORD;
+    } else {
+        int d = i;
+        while (d < len && isdigit((unsigned char)s[d])) d++;
+        if (d > i && d + 1 < len && s[d] == '.' && s[d + 1] == ' ') memset(cls + i, HL_KEYWORD, d + 1 - i);
+    }
+    for (; i < len; i++) {
+        const char *end = NULL;
+        if (s[i] == '`') end = memchr(s + i + 1, '`', len - i - 1);
+        if (s[i] == ']' && i + 1 < len && s[i + 1] == '(') end = memchr(s + i + 2, ')', len - i - 2);
+        if (!end) continue;
+        int to = (int)(end - s) + 1;
+        memset(cls + i + (s[i] == ']'), s[i] == '`' ? HL_CODE : HL_STRING, to - i - (s[i] == ']'));
+        i = to - 1;
+    }
+    return HL_ST_NORMAL;
+}
+
+/* Blanks a line starts with, counted no further than len */
+int syntax_lead(const char *s, int len) {
+    int i = 0;
+    while (i < len && (s[i] == ' ' || s[i] == '\t')) i++;
+    return i;
+}
+
+/*
+ * Lex bytes of a len byte line from *at, in state, until a token ends at
+ * or after stop; moves *at there and returns the state. Nothing before
+ * *at - 1 or from HL_TOKEN_MAX past stop on is read, so the rest of a long
+ * line need not be at hand. With cls, cls[k] gets the HL_ class of byte
+ * *at + k. Lexing from 0 to len gives the state before the end-of-line rule.
+ */
+int syntax_lex_run(const Syntax *syn, const char *s, int len, int lead, int *at, int stop, int state, unsigned char *cls) {
+    const char *bo = syn->block_open, *bc = syn->block_close;
+    const unsigned char *opens = syn->tables->opens;
+    int bon = bo ? (int)strlen(bo) : 0, bcn = bc ? (int)strlen(bc) : 0, i = *at, start = *at;
+    if (stop > len) stop = len;
+    int end = len - stop > HL_TOKEN_MAX ? stop + HL_TOKEN_MAX : len;
+    
+    while (i < stop) {
+        int from = i, class = HL_STRING;
+        
+        /* An opener switches state and is painted along with what it opens */
+        if (state == HL_ST_NORMAL) {
+            const char *q = s[i] ? strchr(syn->quotes, s[i]) : NULL;
+            if (bon && len - i >= bon && memcmp(s + i, bo, bon) == 0) {
+                state = HL_ST_COMMENT;
+                i += bon;
+            } else if (q) {
+                state = HL_ST_STRING + (int)(q - syn->quotes);
+                i++;
+            } else if (!cls && !opens[(unsigned char)s[i]]) {
+                /* Only the state is wanted: no other token can hide an opener, so skip to the next one */
+                for (i++; i < stop && !opens[(unsigned char)s[i]]; i++);
+                continue;
+            } else {
+                i = syntax_token(syn, s, end, lead, i, &class);
+                if (class == HL_COMMENT) {
+                    i = len;
+                } else if (cls && class == HL_NORMAL && (isalpha((unsigned char)s[from]) || s[from] == '_')) {
+                    class = syntax_word(syn, s + from, i - from);
+                }
+                if (cls) memset(cls + from - start, class, (i < end ? i : end) - from);
+                continue;
+            }
+        }
+        
+        if (state == HL_ST_COMMENT) {
+            class = HL_COMMENT;
+            while (i < stop) {
+                const char *p = memchr(s + i, bc[0], stop - i);
+                if (!p) {
+                    i = stop;
+                } else if (end - (p - s) >= bcn && memcmp(p, bc, bcn) == 0) {
+                    i = (int)(p - s) + bcn;
+                    state = HL_ST_NORMAL;
+                    break;
+                } else {
+                    i = (int)(p - s) + 1;
+                }
+            }
+        } else {
+            char quote = syn->quotes[state - HL_ST_STRING];
+            while (i < stop && s[i] != quote) i += s[i] == '\\' && i + 1 < end ? 2 : 1;
+            if (i < stop) {
+                i++;
+                state = HL_ST_NORMAL;
+                if (syn->flags & SYN_KEYS) {
+                    int j = i + syntax_lead(s + i, end - i);
+                    if (j < end && s[j] == ':') class = HL_TYPE;
+                }
+            }
+        }
+        if (cls) memset(cls + from - start, class, i - from);
+    }
+    *at = i;
+    return state;
+}
+
+/* A string ends with its line unless the syntax allows otherwise or the line ends in a backslash */
+int syntax_line_end(const Syntax *syn, const char *s, int len, int state) {
+    if (state >= HL_ST_STRING && !(syn->flags & SYN_MULTILINE) && (len == 0 || s[len - 1] != '\\')) return HL_ST_NORMAL;
+    return state;
+}
+
+/*
+ * Lex one line that starts in state; returns the state at its end. With
+ * cls, the HL_ class of each byte is written there.
+ */
+int syntax_lex(const Syntax *syn, const char *s, int len, int state, unsigned char *cls) {
+    if (syn->flags & SYN_MARKDOWN) return syntax_lex_markdown(s, len, state, cls);
+    
+    int at = 0;
+    state = syntax_lex_run(syn, s, len, syntax_lead(s, len), &at, len, state, cls);
+    return syntax_line_end(syn, s, len, state);
+}
+
+/*
+ * Per-line byte caches (regex results, lexer states) follow edits: one
+ * that replaced lines [y, y + removed] with [y, y + added] shifts the
+ * lines after it and marks the edited ones with fill.
+ */
+void line_cache_edit(unsigned char **cache, int *len, int *cap, int y, int removed, int added, int fill) {
+    if (y >= *len) return;
+    
+    int from = y + 1 + removed, tail = *len - from;
+    if (tail < 0) tail = 0;
+    int n = y + 1 + added + tail;
+    if (n > *cap) {
+        *cap = n * 2;
+        *cache = realloc(*cache, *cap);
+    }
+    memmove(*cache + y + 1 + added, *cache + from, tail);
+    memset(*cache + y, fill, added + 1);
+    *len = n;
+}
+
+/* Extend a cache to count lines, the new ones marked with fill */
+void line_cache_grow(unsigned char **cache, int *len, int *cap, int count, int fill) {
+    if (*len >= count) return;
+    if (count > *cap) {
+        *cap = count + count / 2;
+        *cache = realloc(*cache, *cap);
+    }
+    memset(*cache + *len, fill, count - *len);
+    *len = count;
+}
+
+/*
+ * Screen rows each line takes when wrapped at width columns, a line of len
+ * bytes taking len / width + 1 so the cursor past its end has a cell. The
+ * counts are summed over blocks of about WRAP_BLOCK lines, so the row a
+ * line starts on, or the line a row falls in, is a binary search over the
+ * blocks and a scan of one. An edit only drops the counts of the blocks it
+ * touched; the running sums past them are redone when next asked for, and
+ * only as far as asked, as are all of them after a change of width.
+ */
+typedef struct {
+    int lines;                  /* Lines in the block */
+    int rows;                   /* Rows they take, -1 until counted */
+    int line, row;              /* First line and row, right for blocks below valid */
+} WrapBlock;
+
+typedef struct {
+    WrapBlock *blocks;
+    int count, cap;
+    int valid;                  /* Blocks [0, valid) have the right first line and row */
+    int lines;                  /* Lines the blocks cover */
+    int width;                  /* Columns the rows are counted for */
+} WrapIndex;
+
+void wrap_free(WrapIndex *w) {
+    free(w->blocks);
+    memset(w, 0, sizeof(*w));
+}
+
+/* Make room for n uncounted blocks at k */
+void wrap_open(WrapIndex *w, int k, int n) {
+    if (w->count + n > w->cap) {
+        w->cap = (w->count + n) * 2;
+        w->blocks = realloc(w->blocks, sizeof(WrapBlock) * w->cap);
+    }
+    memmove(&w->blocks[k + n], &w->blocks[k], sizeof(WrapBlock) * (w->count - k));
+    for (int i = k; i < k + n; i++) w->blocks[i].rows = -1;
+    w->count += n;
+}
+
+/* Drop blocks [k, k + n) */
+void wrap_close(WrapIndex *w, int k, int n) {
+    memmove(&w->blocks[k], &w->blocks[k + n], sizeof(WrapBlock) * (w->count - k - n));
+    w->count -= n;
+}
+
+/* Split block k if it grew past twice WRAP_BLOCK lines */
+void wrap_split(WrapIndex *w, int k) {
+    int n = w->blocks[k].lines, parts = n / WRAP_BLOCK;
+    if (n < 2 * WRAP_BLOCK) return;
+    wrap_open(w, k + 1, parts - 1);
+    for (int i = 0; i < parts; i++) w->blocks[k + i].lines = WRAP_BLOCK;
+    w->blocks[k + parts - 1].lines = n - (parts - 1) * WRAP_BLOCK;
+    w->blocks[k].rows = -1;
+}
+
+/*
+ * Bring the index in line with the document, whose lines past the ones it
+ * covers were appended (by loading) since, and with width. Nothing is read:
+ * new lines and a new width only leave counts to be made.
+ */
+void wrap_sync(WrapIndex *w, Rope *r, int width) {
+    int count = rope_count(r);
+    if (count < w->lines) wrap_free(w);
+    if (width != w->width) {
+        for (int i = 0; i < w->count; i++) w->blocks[i].rows = -1;
+        w->valid = 0;
+        w->width = width;
+    }
+    while (w->lines < count) {
+        if (!w->count || w->blocks[w->count - 1].lines >= WRAP_BLOCK) {
+            wrap_open(w, w->count, 1);
+            w->blocks[w->count - 1].lines = 0;
+        }
+        WrapBlock *b = &w->blocks[w->count - 1];
+        int n = count - w->lines < WRAP_BLOCK - b->lines ? count - w->lines : WRAP_BLOCK - b->lines;
+        b->lines += n;
+        b->rows = -1;
+        w->lines += n;
+    }
+}
+
+/* Rows of block k, which must be below valid */
+int wrap_block_rows(WrapIndex *w, Rope *r, int k) {
+    WrapBlock *b = &w->blocks[k];
+    if (b->rows < 0) {
+        b->rows = 0;
+        for (int i = b->line; i < b->line + b->lines; i++) b->rows += rope_len(r, i) / w->width + 1;
+    }
+    return b->rows;
+}
+
+/* Make the first line and row of one more block right */
+void wrap_extend(WrapIndex *w, Rope *r) {
+    WrapBlock *b = &w->blocks[w->valid];
+    if (w->valid == 0) {
+        b->line = b->row = 0;
+    } else {
+        WrapBlock *p = b - 1;
+        b->line = p->line + p->lines;
+        b->row = p->row + wrap_block_rows(w, r, w->valid - 1);
+    }
+    w->valid++;
+}
+
+/* The last block below valid starting at or before line y, or row when y < 0 */
+int wrap_search(WrapIndex *w, int y, int row) {
+    int lo = 0, hi = w->valid - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (y >= 0 ? w->blocks[mid].line <= y : w->blocks[mid].row <= row) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* The screen row line y starts on, counting from the top of the file */
+int wrap_row(WrapIndex *w, Rope *r, int y) {
+    while (w->valid < w->count && (!w->valid || w->blocks[w->valid - 1].line + w->blocks[w->valid - 1].lines <= y)) wrap_extend(w, r);
+    if (!w->valid) return 0;
+    
+    int k = wrap_search(w, y, 0), row = w->blocks[k].row;
+    for (int i = w->blocks[k].line; i < y; i++) row += rope_len(r, i) / w->width + 1;
+    return row;
+}
+
+/* Rows the whole document takes */
+int wrap_total(WrapIndex *w, Rope *r) {
+    if (!w->count) return 0;
+    while (w->valid < w->count) wrap_extend(w, r);
+    return w->blocks[w->count - 1].row + wrap_block_rows(w, r, w->count - 1);
+}
+
+/* The line screen row row falls in, and how many rows of it come before; -1 past the last row */
+int wrap_find(WrapIndex *w, Rope *r, int row, int *sub) {
+    while (w->valid < w->count && (!w->valid || w->blocks[w->valid - 1].row + wrap_block_rows(w, r, w->valid - 1) <= row)) wrap_extend(w, r);
+    if (!w->valid) return -1;
+    
+    int k = wrap_search(w, -1, row), at = w->blocks[k].row;
+    for (int i = w->blocks[k].line; i < w->blocks[k].line + w->blocks[k].lines; i++) {
+        int rows = rope_len(r, i) / w->width + 1;
+        if (row < at + rows) {
+            *sub = row - at;
+            return i;
+        }
+        at += rows;
+    }
+    return -1;
+}
+
+/*
+ * Follow an edit that replaced lines [y, y + removed] with [y, y + added]:
+ * the blocks holding them are resized and left to be counted, and a block
+ * left small is merged into the next.
+ */
+void wrap_edit(WrapIndex *w, int y, int removed, int added) {
+    if (y >= w->lines) return;
+    if (removed > w->lines - 1 - y) removed = w->lines - 1 - y;
+    
+    int k = w->valid ? wrap_search(w, y, 0) : 0, line = w->valid ? w->blocks[k].line : 0;
+    while (line + w->blocks[k].lines <= y) line += w->blocks[k++].lines;
+    WrapBlock *b = &w->blocks[k];
+    int take = line + b->lines - 1 - y, next = k + 1;
+    if (take > removed) take = removed;
+    b->lines += added - take;
+    b->rows = -1;
+    for (int gone = removed - take; gone > 0; next++) {
+        take = gone < w->blocks[next].lines ? gone : w->blocks[next].lines;
+        w->blocks[next].lines -= take;
+        w->blocks[next].rows = -1;
+        gone -= take;
+    }
+    if (next > k + 1 && w->blocks[next - 1].lines) next--;
+    wrap_close(w, k + 1, next - (k + 1));
+    if (w->blocks[k].lines < WRAP_BLOCK / 4 && k + 1 < w->count) {
+        w->blocks[k].lines += w->blocks[k + 1].lines;
+        wrap_close(w, k + 1, 1);
+    }
+    wrap_split(w, k);
+    w->lines += added - removed;
+    if (w->valid > k + 1) w->valid = k + 1;
+}
+
+/*
+ * Lexer states saved every HL_MARK_STEP bytes or so along a long line, at
+ * token boundaries, so a few columns of it can be coloured, and an edit in
+ * it relexed, without lexing from the start. An edit shifts the marks past
+ * it, which are then only trusted again once relexing from the last good
+ * mark reaches one of them in the same state: the text from there on is
+ * what it was, so the rest of the marks and the end state still hold.
+ */
+typedef struct {
+    int row;
+    int start;                  /* State the line starts in */
+    int lead;                   /* Blanks the line starts with, as far as HL_TOKEN_MAX */
+    int end;                    /* State at the end of the line, -1 until lexed that far */
+    int count, cap;
+    int valid;                  /* Marks [0, valid) are right; later ones were shifted by an edit */
+    int *pos;                   /* Ascending, pos[0] being 0 */
+    unsigned char *state;
+    unsigned used;
+} LineMarks;
+
+typedef struct {
+    LineMarks lines[HL_MARK_LINES];     /* A free slot has no marks */
+    unsigned clock;
+} SyntaxMarks;
+
+/* Forget every line's marks */
+void syntax_marks_clear(SyntaxMarks *t) {
+    for (int i = 0; i < HL_MARK_LINES; i++) t->lines[i].count = 0;
+}
+
+void syntax_marks_free(SyntaxMarks *t) {
+    for (int i = 0; i < HL_MARK_LINES; i++) {
+        free(t->lines[i].pos);
+        free(t->lines[i].state);
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+/* Put a mark at index k */
+void syntax_mark_insert(LineMarks *m, int k, int pos, int state) {
+    if (m->count == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 16;
+        m->pos = realloc(m->pos, sizeof(int) * m->cap);
+        m->state = realloc(m->state, m->cap);
+    }
+    memmove(&m->pos[k + 1], &m->pos[k], sizeof(int) * (m->count - k));
+    memmove(&m->state[k + 1], &m->state[k], m->count - k);
+    m->pos[k] = pos;
+    m->state[k] = (unsigned char)state;
+    m->count++;
+}
+
+/*
+ * Marks of line row, brought up to date as far as upto (INT_MAX for the
+ * end state) for a line starting in state. A line with no slot takes the
+ * least recently used one.
+ */
+LineMarks *syntax_marks_update(SyntaxMarks *t, const Syntax *syn, Rope *r, int row, int state, int upto) {
+    LineMarks *m = NULL, *old = &t->lines[0];
+    for (int i = 0; i < HL_MARK_LINES && !m; i++) {
+        if (t->lines[i].count && t->lines[i].row == row) m = &t->lines[i];
+        else if (!t->lines[i].count || (old->count && t->lines[i].used < old->used)) old = &t->lines[i];
+    }
+    if (!m) {
+        m = old;
+        m->count = 0;
+    }
+    m->used = ++t->clock;
+    if (!m->count || m->start != state) {
+        m->row = row;
+        m->start = state;
+        m->end = -1;
+        m->count = m->valid = 0;
+        syntax_mark_insert(m, 0, 0, state);
+        m->valid = 1;
+    }
+    
+    int len;
+    const char *s = rope_peek(r, row, 0, HL_TOKEN_MAX, &len);
+    m->lead = syntax_lead(s, len < HL_TOKEN_MAX ? len : HL_TOKEN_MAX);
+    while (1) {
+        int at = m->pos[m->valid - 1], st = m->state[m->valid - 1];
+        if (m->valid == m->count && (m->end >= 0 || at >= upto)) break;
+        int stop = len - at > HL_MARK_STEP ? at + HL_MARK_STEP : len;
+        if (m->valid < m->count && m->pos[m->valid] < stop) stop = m->pos[m->valid];
+        s = rope_peek(r, row, at ? at - 1 : 0, stop + HL_TOKEN_MAX, &len);
+        st = syntax_lex_run(syn, s, len, m->lead, &at, stop, st, NULL);
+        if (at >= len) {
+            m->count = m->valid;
+            m->end = syntax_line_end(syn, s, len, st);
+            break;
+        }
+        
+        /* Shifted marks passed over are dropped; meeting one in the same state means the rest hold */
+        int k = m->valid, same = 0;
+        while (k < m->count && m->pos[k] < at) k++;
+        if (k < m->count && m->pos[k] == at) same = m->state[k++] == st;
+        memmove(&m->pos[m->valid], &m->pos[k], sizeof(int) * (m->count - k));
+        memmove(&m->state[m->valid], &m->state[k], m->count - k);
+        m->count -= k - m->valid;
+        syntax_mark_insert(m, m->valid, at, st);
+        m->valid = same ? m->count : m->valid + 1;
+    }
+    return m;
+}
+
+/* The last good mark of m at or before x */
+int syntax_mark_before(LineMarks *m, int x) {
+    int lo = 0, hi = m->valid - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (m->pos[mid] <= x) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/*
+ * Follow an edit of line row that replaced removed bytes at x with added.
+ * Marks a little before x, and right after it, are dropped too: lexing
+ * looks a few bytes ahead and one back. The marks past the edit are
+ * shifted and await checking.
+ */
+void syntax_marks_edit(SyntaxMarks *t, int row, int x, int removed, int added) {
+    for (int i = 0; i < HL_MARK_LINES; i++) {
+        LineMarks *m = &t->lines[i];
+        if (!m->count || m->row != row) continue;
+        
+        int n = 1, valid = 1;
+        for (int k = 1; k < m->count; k++) {
+            int pos = m->pos[k];
+            if (pos + 16 <= x && k < m->valid) {
+                valid = n + 1;
+            } else if (pos <= x + removed) {
+                continue;
+            } else {
+                pos += added - removed;
+            }
+            m->pos[n] = pos;
+            m->state[n++] = m->state[k];
+        }
+        if (m->pos[n - 1] < x + added) m->end = -1;
+        m->count = n;
+        m->valid = valid;
+    }
+}
+
+/* Follow an edit that replaced lines [y, y + removed] with [y, y + added] */
+void syntax_marks_lines(SyntaxMarks *t, int y, int removed, int added) {
+    for (int i = 0; i < HL_MARK_LINES; i++) {
+        LineMarks *m = &t->lines[i];
+        if (!m->count || m->row < y) continue;
+        if (m->row <= y + removed) m->count = 0;
+        else m->row += added - removed;
+    }
+}
+
+/*
+ * Bring cached states up to date for lines [from, last]; the end state
+ * cached for line from - 1 must be right. A line keeps its entry, without
+ * being read, while its text is unchanged and it starts in the same state
+ * as when it was lexed. Lines of 2 * HL_MARK_STEP bytes or more are lexed
+ * from their marks in t, if given. Returns the number of lines lexed.
+ */
+int syntax_update(const Syntax *syn, Rope *r, unsigned char *cache, int from, int last, SyntaxMarks *t) {
+    int state = from > 0 ? cache[from - 1] & 15 : HL_ST_NORMAL, lexed = 0, len;
+    
+    for (int y = from; y <= last; y++) {
+        if (cache[y] != HL_UNKNOWN && cache[y] >> 4 == state) {
+            state = cache[y] & 15;
+            continue;
+        }
+        int end;
+        if (t && !(syn->flags & SYN_MARKDOWN) && rope_len(r, y) >= 2 * HL_MARK_STEP) {
+            end = syntax_marks_update(t, syn, r, y, state, INT_MAX)->end;
+        } else {
+            const char *line = rope_get(r, y, &len);
+            end = syntax_lex(syn, line, len, state, NULL);
+        }
+        cache[y] = (unsigned char)(state << 4 | end);
+        state = end;
+        lexed++;
+    }
+    return lexed;
+}
+
+/* Verify subtree counts and heap order; returns the subtree line count or -1 */
+int rope_check(Piece *t) {
+    if (!t) return 0;
+    if (t->count < 1 || (!t->starts && t->count > PIECE_LINES)) return -1;
+    if ((t->left && t->left->prio > t->prio) || (t->right && t->right->prio > t->prio)) return -1;
+    int l = rope_check(t->left), r = rope_check(t->right);
+    if (l < 0 || r < 0 || t->total != l + t->count + r) return -1;
+    return t->total;
+}
+
+/* Owned lines in a tree, to match against its arena's count */
+long long rope_owned(Piece *t) {
+    if (!t) return 0;
+    return rope_owned(t->left) + (t->starts ? 0 : t->count) + rope_owned(t->right);
+}
+
+/* Randomized comparison of a mapped rope against a flat line array */
+int rope_selftest(void) {
+    const char *path = "az-selftest.tmp";
+    Rope r = {0};
+    char **model = NULL;
+    int n = 3000, cap = 1 << 16, ops = 200000;
+    char tmp[32];
+    Span *held = NULL;
+    char **held_lines = NULL;
+    int held_n = 0;
+    
+    /* Mixed line endings, lines longer than a chunk and no newline at EOF */
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("rope selftest: cannot create %s\n", path);
+        return 1;
+    }
+    model = malloc(sizeof(char*) * cap);
+    for (int i = 0; i < n; i++) {
+        snprintf(tmp, sizeof(tmp), "file line %d", i);
+        model[i] = _strdup(i % 7 == 3 && i != n - 1 ? "" : tmp);
+        if (i % 500 == 499) {
+            model[i] = realloc(model[i], 400);
+            memset(model[i], 'x', 399);
+            model[i][399] = '\0';
+        }
+        fprintf(fp, "%s%s", model[i], i == n - 1 ? "" : (i % 5 == 0 ? "\r\n" : "\n"));
+    }
+    fclose(fp);
+    
+    /* Small odd-sized chunks so boundaries split lines and CRLF pairs */
+    FileMap *map = filemap_open_chunked(path, 97, 4);
+    if (!map) {
+        printf("rope selftest: cannot map %s\n", path);
+        return 1;
+    }
+    rope_load(&r, map);
+    rope_finish(&r);
+    if (rope_count(&r) != n || map->newlines != n - 1 || map->crlf_newlines != (n + 4) / 5 || filemap_crlf(map)) {
+        printf("rope selftest: FAIL index (%d lines, %lld newlines, %lld CRLF)\n",
+               rope_count(&r), map->newlines, map->crlf_newlines);
+        return 1;
+    }
+    
+    for (int i = 0; i < ops; i++) {
+        int op = rope_rand() % 12, len;
+        if (op < 4 || n == 0) {
+            int at = rope_rand() % (n + 1);
+            if (op == 0) at = 0;
+            if (op == 1) at = n;
+            snprintf(tmp, sizeof(tmp), "line %d", i);
+            if (n == cap) {
+                cap *= 2;
+                model = realloc(model, sizeof(char*) * cap);
+            }
+            memmove(&model[at + 1], &model[at], sizeof(char*) * (n - at));
+            model[at] = _strdup(tmp);
+            rope_insert(&r, at, tmp, strlen(tmp));
+            n++;
+        } else if (op < 6) {
+            int at = rope_rand() % n;
+            rope_delete(&r, at);
+            free(model[at]);
+            memmove(&model[at], &model[at + 1], sizeof(char*) * (n - at - 1));
+            n--;
+        } else if (op < 8) {
+            int at = rope_rand() % n;
+            /* Now and then a long run, so lines outgrow the largest arena class */
+            int add = i % 499 == 0 ? 5000 : 1;
+            char **slot = rope_slot(&r, at);
+            len = line_length(*slot);
+            *slot = line_resize(&r.arena, *slot, len + add);
+            memset(*slot + len, '+', add);
+            model[at] = realloc(model[at], len + add + 1);
+            memset(model[at] + len, '+', add);
+            model[at][len + add] = '\0';
+        } else if (op < 10) {
+            int at = rope_rand() % n;
+            const char *s = rope_get(&r, at, &len);
+            if (len != (int)strlen(model[at]) || memcmp(s, model[at], len) != 0) {
+                printf("rope selftest: FAIL get %d after %d ops\n", at, i);
+                return 1;
+            }
+        } else if (op == 10) {
+            /* Yank a range into a span, and cut it out half the time */
+            int at = rope_rand() % n, max = n - at < 200 ? n - at : 200;
+            int count = 1 + rope_rand() % max;
+            span_release(held);
+            for (int j = 0; j < held_n; j++) free(held_lines[j]);
+            held = span_from_rope(&r, at, count);
+            held_lines = realloc(held_lines, sizeof(char*) * count);
+            held_n = count;
+            for (int j = 0; j < count; j++) held_lines[j] = _strdup(model[at + j]);
+            if ((rope_rand() % 2 || n > 20000) && count < n) {
+                rope_delete_range(&r, at, count);
+                for (int j = at; j < at + count; j++) free(model[j]);
+                memmove(&model[at], &model[at + count], sizeof(char*) * (n - at - count));
+                n -= count;
+            }
+        } else if (held && n < 20000) {
+            /* Put the span back somewhere, sharing its lines with the earlier copies */
+            int at = rope_rand() % (n + 1);
+            while (n + held_n > cap) {
+                cap *= 2;
+                model = realloc(model, sizeof(char*) * cap);
+            }
+            rope_insert_span(&r, at, held);
+            memmove(&model[at + held_n], &model[at], sizeof(char*) * (n - at));
+            for (int j = 0; j < held_n; j++) model[at + j] = _strdup(held_lines[j]);
+            n += held_n;
+        }
+        
+        if (i % 10000 == 0 || i == ops - 1) {
+            if (rope_check(r.root) != n || rope_count(&r) != n || rope_owned(r.root) != r.arena.lines) {
+                printf("rope selftest: FAIL invariants after %d ops\n", i);
+                return 1;
+            }
+            for (int j = 0; j < n; j++) {
+                const char *s = rope_get(&r, j, &len);
+                if (len != (int)strlen(model[j]) || memcmp(s, model[j], len) != 0) {
+                    printf("rope selftest: FAIL line %d after %d ops\n", j, i);
+                    return 1;
+                }
+            }
+        }
+    }
+    
+    /* Save over the mapped file and read it back */
+    long long bytes = rope_save(&r, path, 0);
+    Rope saved = {0};
+    int len;
+    FileMap *back = filemap_open_chunked(path, 97, 4);
+    if (bytes < 0 || !back || back->size != (size_t)bytes) {
+        printf("rope selftest: FAIL save\n");
+        return 1;
+    }
+    rope_load(&saved, back);
+    rope_finish(&saved);
+    for (int j = 0; j < n; j++) {
+        const char *s = rope_get(&saved, j, &len);
+        if (rope_count(&saved) != n || len != (int)strlen(model[j]) || memcmp(s, model[j], len) != 0) {
+            printf("rope selftest: FAIL saved line %d\n", j);
+            return 1;
+        }
+    }
+    rope_free(&saved);
+    
+    for (int i = 0; i < n; i++) free(model[i]);
+    for (int i = 0; i < held_n; i++) free(held_lines[i]);
+    free(model);
+    free(held_lines);
+    span_release(held);
+    rope_free(&r);
+    remove(path);
+    printf("rope selftest: OK (%d ops)\n", ops);
+    return 0;
+}
+
+int search_naive_at(const char *line, int pos, const char *pat, int m, int icase) {
+    for (int i = 0; i < m; i++) {
+        int a = (unsigned char)line[pos + i], b = (unsigned char)pat[i];
+        if (icase ? tolower(a) != tolower(b) : a != b) return 0;
+    }
+    return 1;
+}
+
+/* Forward and backward rope searches against a brute-force scan of a line array */
+int search_selftest(void) {
+    const char *path = "az-search.tmp", *alphabet = "abAB-";
+    int n = 400, trials = 20000;
+    char **model = malloc(sizeof(char*) * n), pat[32];
+    Rope r = {0};
+    
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("search selftest: cannot create %s\n", path);
+        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        int len = rope_rand() % 120;
+        model[i] = malloc(len + 3);
+        for (int j = 0; j < len; j++) model[i][j] = alphabet[rope_rand() % 5];
+        model[i][len] = '\0';
+        fprintf(fp, "%s%s", model[i], i % 3 ? "\n" : "\r\n");
+    }
+    fclose(fp);
+    rope_load(&r, filemap_open_chunked(path, 97, 2));
+    rope_finish(&r);
+    
+    /* Owned lines between the mapped runs */
+    for (int i = 0; i < n; i += 5) {
+        char **slot = rope_slot(&r, i);
+        *slot = line_resize(&r.arena, *slot, line_length(*slot) + 2);
+        memcpy(*slot + line_length(*slot) - 2, "ab", 2);
+        strcat(model[i], "ab");
+    }
+    
+    for (int t = 0; t < trials; t++) {
+        Searcher s;
+        int m = 1 + rope_rand() % (t % 2 ? 4 : 20), icase = rope_rand() % 2;
+        int y = rope_rand() % n, x = rope_rand() % 130, my, mx;
+        int want_y = -1, want_x = -1, got;
+        for (int i = 0; i < m; i++) pat[i] = alphabet[rope_rand() % 4];
+        search_compile(&s, pat, m, icase);
+        
+        for (int yy = y; yy < n && want_y < 0; yy++) {
+            int len = strlen(model[yy]);
+            for (int pos = yy == y ? (x < len ? x : len) : 0; pos + m <= len; pos++) {
+                if (search_naive_at(model[yy], pos, pat, m, icase)) {
+                    want_y = yy;
+                    want_x = pos;
+                    break;
+                }
+            }
+        }
+        got = rope_search(&r, &s, y, x, n, &my, &mx);
+        if (got != (want_y >= 0) || (got && (my != want_y || mx != want_x))) {
+            printf("search selftest: FAIL forward trial %d\n", t);
+            return 1;
+        }
+        
+        want_y = -1;
+        for (int yy = y; yy >= 0 && want_y < 0; yy--) {
+            int len = strlen(model[yy]);
+            int limit = yy == y ? (x < len ? x : len) : len;
+            for (int pos = limit - 1 < len - m ? limit - 1 : len - m; pos >= 0; pos--) {
+                if (search_naive_at(model[yy], pos, pat, m, icase)) {
+                    want_y = yy;
+                    want_x = pos;
+                    break;
+                }
+            }
+        }
+        got = rope_search_back(&r, &s, y, x, 0, &my, &mx);
+        if (got != (want_y >= 0) || (got && (my != want_y || mx != want_x))) {
+            printf("search selftest: FAIL backward trial %d\n", t);
+            return 1;
+        }
+    }
+    
+    for (int i = 0; i < n; i++) free(model[i]);
+    free(model);
+    rope_free(&r);
+    remove(path);
+    printf("search selftest: OK (%d searches)\n", trials * 2);
+    return 0;
+}
+
+/* Reference matcher for the self-test: the set of match ends from pos as a bitmask (lines under 64 bytes) */
+unsigned long long regex_ref_ends(Regex *re, int n, const char *line, int len, int pos) {
+    RxNode *node = &re->nodes[n];
+    unsigned long long out = 0, cur, next;
+    
+    switch (node->type) {
+    case RX_SET:
+        if (pos < len && rx_has(re->sets[node->a], line[pos])) out = 1ull << (pos + 1);
+        break;
+    case RX_CAT:
+        for (cur = regex_ref_ends(re, node->a, line, len, pos); cur; cur &= cur - 1) {
+            out |= regex_ref_ends(re, node->b, line, len, __builtin_ctzll(cur));
+        }
+        break;
+    case RX_ALT:
+        out = regex_ref_ends(re, node->a, line, len, pos) | regex_ref_ends(re, node->b, line, len, pos);
+        break;
+    case RX_REPEAT:
+        cur = 1ull << pos;
+        for (int i = 0; cur && (node->max < 0 || i < node->max); i++) {
+            if (i >= node->min) {
+                if ((out | cur) == out && node->max < 0) break;
+                out |= cur;
+            }
+            for (next = 0; cur; cur &= cur - 1) next |= regex_ref_ends(re, node->a, line, len, __builtin_ctzll(cur));
+            cur = next;
+        }
+        out |= cur;
+        break;
+    case RX_BOL:
+        if (pos == 0) out = 1;
+        break;
+    case RX_EOL:
+        if (pos == len) out = 1ull << pos;
+        break;
+    default:
+        out = 1ull << pos;
+    }
+    return out;
+}
+
+/* Random pattern over a small alphabet so that matches are common */
+void regex_random(char *out, int *len, int depth) {
+    static const char *atoms[] = { "a", "b", "c", ".", "[ab]", "[^a]", "\\d", "1", "[a-c1]", "\\W" };
+    static const char *reps[] = { "*", "+", "?", "{2}", "{1,2}", "{0,3}", "{2,}" };
+    int pick = rope_rand() % (depth > 2 ? 4 : 7);
+    
+    if (pick < 4) {
+        const char *a = atoms[rope_rand() % 10];
+        memcpy(out + *len, a, strlen(a));
+        *len += strlen(a);
+    } else if (pick == 4) {
+        out[(*len)++] = '(';
+        regex_random(out, len, depth + 1);
+        out[(*len)++] = '|';
+        regex_random(out, len, depth + 1);
+        out[(*len)++] = ')';
+    } else if (pick == 5) {
+        regex_random(out, len, depth + 1);
+        regex_random(out, len, depth + 1);
+    } else {
+        out[(*len)++] = '(';
+        regex_random(out, len, depth + 1);
+        out[(*len)++] = ')';
+        const char *r = reps[rope_rand() % 7];
+        memcpy(out + *len, r, strlen(r));
+        *len += strlen(r);
+    }
+}
+
+/* Fixed cases, then random patterns checked against regex_ref_ends */
+int regex_selftest(void) {
+    static const struct { const char *pat, *line; int icase, x, at, len; } cases[] = {
+        { "a{2,3}", "caaaab", 0, 0, 1, 3 },
+        { "^ab|c$", "abc", 0, 1, 2, 1 },
+        { "[^a-c]+", "abxyzc", 0, 0, 2, 3 },
+        { "\\d+\\.\\d*", "v 12.5", 0, 0, 2, 4 },
+        { "(foo|bar)baz", "foobarbaz", 0, 0, 3, 6 },
+        { "x*", "abc", 0, 1, 1, 0 },
+        { "HeLLo", "say hello", 1, 0, 4, 5 },
+        { "[^a]b", "AbXb", 1, 0, 2, 2 },
+        { "^$", "", 0, 0, 0, 0 },
+        { "a{2}$", "aaa aa", 0, 0, 4, 2 },
+        { "x{", "ax{", 0, 0, 1, 2 },
+    };
+    static const char *bad[] = { "(ab", "a{3,1}", "*a", "[ab", "ab)", "a{2000}", "x\\" };
+    char err[64], pat[512], line[64];
+    int trials = 20000, mlen = 0;
+    
+    for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+        Regex *re = regex_compile(cases[i].pat, strlen(cases[i].pat), cases[i].icase, err, sizeof(err));
+        int at = re ? regex_find(re, cases[i].line, strlen(cases[i].line), cases[i].x, &mlen) : -2;
+        if (at != cases[i].at || (at >= 0 && mlen != cases[i].len)) {
+            printf("regex selftest: FAIL /%s/ on '%s': %d+%d\n", cases[i].pat, cases[i].line, at, at >= 0 ? mlen : 0);
+            return 1;
+        }
+        regex_free(re);
+    }
+    for (int i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+        Regex *re = regex_compile(bad[i], strlen(bad[i]), 0, err, sizeof(err));
+        if (re) {
+            printf("regex selftest: FAIL /%s/ compiled\n", bad[i]);
+            return 1;
+        }
+    }
+    
+    /* Needs thousands of DFA states, so the cache is flushed and rebuilt mid-line */
+    Regex *wide = regex_compile("a[ab]{11}b", 10, 0, err, sizeof(err));
+    for (int t = 0; t < 300; t++) {
+        int want = -1, want_len = 0;
+        for (int i = 0; i < 63; i++) line[i] = "ab"[rope_rand() % 2];
+        for (int s = 0; s <= 63 && want < 0; s++) {
+            unsigned long long ends = regex_ref_ends(wide, wide->root, line, 63, s);
+            if (ends) {
+                want = s;
+                want_len = 63 - __builtin_clzll(ends) - s;
+            }
+        }
+        if (regex_find(wide, line, 63, 0, &mlen) != want || (want >= 0 && mlen != want_len)) {
+            printf("regex selftest: FAIL after a DFA flush on '%.63s'\n", line);
+            return 1;
+        }
+    }
+    regex_free(wide);
+    
+    for (int t = 0; t < trials; t++) {
+        int plen = 0, len = rope_rand() % 40, icase = rope_rand() % 2;
+        if (rope_rand() % 8 == 0) pat[plen++] = '^';
+        regex_random(pat, &plen, 0);
+        if (rope_rand() % 8 == 0) pat[plen++] = '$';
+        for (int i = 0; i < len; i++) line[i] = "abcAB1 -"[rope_rand() % 8];
+        
+        Regex *re = regex_compile(pat, plen, icase, err, sizeof(err));
+        if (!re) {
+            printf("regex selftest: FAIL /%.*s/: %s\n", plen, pat, err);
+            return 1;
+        }
+        int x = rope_rand() % (len + 1), want = -1, want_len = 0, got;
+        for (int s = x; s <= len && want < 0; s++) {
+            unsigned long long ends = regex_ref_ends(re, re->root, line, len, s);
+            if (ends) {
+                want = s;
+                want_len = 63 - __builtin_clzll(ends) - s;
+            }
+        }
+        got = regex_find(re, line, len, x, &mlen);
+        if (got != want || (got >= 0 && mlen != want_len)) {
+            printf("regex selftest: FAIL /%.*s/ on '%.*s' from %d: %d+%d, want %d+%d\n",
+                   plen, pat, len, line, x, got, mlen, want, want_len);
+            return 1;
+        }
+        
+        x = rope_rand() % (len + 2);
+        want = -1;
+        for (int s = x - 1 < len ? x - 1 : len; s >= 0 && want < 0; s--) {
+            unsigned long long ends = regex_ref_ends(re, re->root, line, len, s);
+            if (ends) {
+                want = s;
+                want_len = 63 - __builtin_clzll(ends) - s;
+            }
+        }
+        got = regex_find_last(re, line, len, x, &mlen);
+        if (got != want || (got >= 0 && mlen != want_len)) {
+            printf("regex selftest: FAIL /%.*s/ on '%.*s' back from %d: %d+%d, want %d+%d\n",
+                   plen, pat, len, line, x, got, mlen, want, want_len);
+            return 1;
+        }
+        regex_free(re);
+    }
+    printf("regex selftest: OK (%d patterns)\n", trials);
+    return 0;
+}
+
+/* Search a generated tree and check every reported line against the files */
+int grep_selftest(void) {
+    const char *root = "az-grep-selftest.tmp";
+    const char *dirs[] = { "", "src", "src/deep", "docs", ".git" };
+    char path[256], err[64];
+    int ndirs = sizeof(dirs) / sizeof(dirs[0]), files = 300, want = 0, fail = 0;
+    
+    for (int d = 0; d < ndirs; d++) {
+        snprintf(path, sizeof(path), "%s/%s", root, dirs[d]);
+#ifdef _WIN32
+        _mkdir(path);
+#else
+        mkdir(path, 0755);
+#endif
+    }
+    /* A few matching lines per file, one with a CRLF ending, plus a binary file and a hidden one that must be skipped */
+    for (int i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/%s/f%d.txt", root, dirs[i % ndirs], i);
+        FILE *fp = fopen(path, "wb");
+        if (!fp) {
+            printf("grep selftest: cannot create %s\n", path);
+            return 1;
+        }
+        if (i % ndirs == 4 || i == 7) fputc('\0', fp);
+        for (int y = 0; y < 40; y++) {
+            int hit = (y * 7 + i) % 13 == 0;
+            fprintf(fp, hit ? "line %d has a Needle in it%s" : "line %d is plain%s", y, y == 3 ? "\r\n" : "\n");
+            if (hit && i % ndirs != 4 && i != 7) want++;
+        }
+        fclose(fp);
+    }
+    
+    for (int pass = 0; pass < 2 && !fail; pass++) {
+        Grep *g = grep_start(root, pass ? "ne+dle" : "Needle", pass, pass, 4, err, sizeof(err));
+        grep_join(g, 0);
+        if (g->count != want) {
+            printf("grep selftest: FAIL pass %d found %d lines, want %d\n", pass, g->count, want);
+            fail = 1;
+        }
+        for (int i = 0; i < g->count && !fail; i++) {
+            GrepHit *h = &g->hits[i];
+            if (sscanf(h->text, "line %d", &want) != 1 || want != h->line || h->col != (h->line < 10 ? 13 : 14) ||
+                h->len != 6 || strchr(h->text, '\r')) {
+                printf("grep selftest: FAIL pass %d at %s:%d: '%s'\n", pass, g->files[h->file], h->line + 1, h->text);
+                fail = 1;
+            }
+        }
+        want = g->count;
+        grep_free(g);
+    }
+    
+    for (int i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/%s/f%d.txt", root, dirs[i % ndirs], i);
+        remove(path);
+    }
+    for (int d = ndirs - 1; d >= 0; d--) {
+        snprintf(path, sizeof(path), "%s/%s", root, dirs[d]);
+#ifdef _WIN32
+        _rmdir(path);
+#else
+        rmdir(path);
+#endif
+    }
+    if (!fail) printf("grep selftest: OK (%d files, %d matching lines)\n", files, want);
+    return fail;
+}
+
+/* Vector scorer against the scalar one on random paths, then a small ranking */
+int find_selftest(void) {
+    const char *alphabet = "abcAB/_.-xZ0";
+    const char *names[] = { "src/f37.c", "docs/f3/readme", "src/f3.c", "foo/bar/f_3.c", "README" };
+    char path[320 + 32], q[9];
+    int trials = 20000, pos[8], want_pos[8];
+    
+    fuzzy_init();
+    for (int t = 0; t < trials; t++) {
+        int len = 1 + rand() % (t % 10 ? 60 : 300), qlen = 1 + rand() % 8;
+        for (int i = 0; i < len; i++) path[i] = alphabet[rand() % 12];
+        path[len] = '\0';
+        for (int i = 0; i < qlen; i++) q[i] = fuzzy_fold[(unsigned char)alphabet[rand() % 12]];
+        int score = fuzzy_path_score(path, q, qlen, pos);
+        int want = fuzzy_path_score_scalar(path, q, qlen, want_pos);
+        if (score != want || (want >= 0 && memcmp(pos, want_pos, sizeof(int) * qlen) != 0)) {
+            printf("find selftest: FAIL '%.*s' in '%s': %d, want %d\n", qlen, q, path, score, want);
+            return 1;
+        }
+    }
+    
+    PathIndex *ix = path_index_new("");
+    FindHit hits[4];
+    int cand[8], n;
+    for (int i = 0; i < 5; i++) path_index_add(ix, names[i]);
+    int count = fuzzy_rank(ix, NULL, 0, cand, &n, "f3", 2, hits, 4);
+    int fail = count != 4 || n != 4 || strcmp(ix->names + ix->offs[hits[0].path], "src/f3.c") != 0;
+    if (fail) printf("find selftest: FAIL ranking 'f3': %d of %d, best %s\n", count, n, count ? ix->names + ix->offs[hits[0].path] : "-");
+    else printf("find selftest: OK (%d scores)\n", trials);
+    path_index_free(ix);
+    return fail;
+}
+
+/* Lexer classes for a few lines, then cached states against a full re-lex after random edits */
+int syntax_selftest(void) {
+    static const struct { const char *file, *line; int state; const char *want; int end; } cases[] = {
+        { "a.c", "int x = 0x1F; /* a", HL_ST_NORMAL, "ttt.....nnnn..cccc", HL_ST_COMMENT },
+        { "a.c", "still */ return \"a\\\"b\";", HL_ST_COMMENT, "cccccccc.kkkkkk.ssssss.", HL_ST_NORMAL },
+        { "a.c", "  #include <stdio.h>", HL_ST_NORMAL, "..pppppppp..........", HL_ST_NORMAL },
+        { "a.c", "char *s = \"abc\\", HL_ST_NORMAL, "tttt......sssss", HL_ST_STRING },
+        { "a.c", "char c = 'x", HL_ST_NORMAL, "tttt.....ss", HL_ST_NORMAL },
+        { "a.json", "{\"key\": [1, true, \"v\"]}", HL_ST_NORMAL, ".ttttt...n..kkkk..sss..", HL_ST_NORMAL },
+        { "a.sh", "echo $HOME # note $#", HL_ST_NORMAL, ".....ttttt.ccccccccc", HL_ST_NORMAL },
+        { "a.sh", "x='a", HL_ST_NORMAL, "..ss", HL_ST_STRING + 1 },
+        { "a.sh", "b' $y", HL_ST_STRING + 1, "ss.tt", HL_ST_NORMAL },
+        { "a.md", "```c", HL_ST_NORMAL, "xxxx", HL_ST_FENCE },
+        { "a.md", "int x;", HL_ST_FENCE, "xxxxxx", HL_ST_FENCE },
+        { "a.md", "## Title", HL_ST_NORMAL, "hhhhhhhh", HL_ST_NORMAL },
+        { "a.md", "- use `az` [doc](http://x)", HL_ST_NORMAL, "k.....xxxx......ssssssssss", HL_ST_NORMAL },
+    };
+    const char *letters = ".csnktphx";
+    const char *pieces[] = { "int a;", "/*", "*/", "x \"s", "\"", "// c /*", "b */ c", "'q'", "", "s \\", "#if \"/*\" 1.5e3" };
+    unsigned char cls[64], *cache = NULL;
+    char got[64];
+    int ncases = sizeof(cases) / sizeof(cases[0]), len = 0, cap = 0, valid = 0, ops = 20000;
+    Rope r = {0};
+    
+    for (int i = 0; i < ncases; i++) {
+        int n = (int)strlen(cases[i].line);
+        int end = syntax_lex(syntax_for(cases[i].file), cases[i].line, n, cases[i].state, cls);
+        for (int j = 0; j < n; j++) got[j] = letters[cls[j]];
+        got[n] = '\0';
+        int states_only = syntax_lex(syntax_for(cases[i].file), cases[i].line, n, cases[i].state, NULL);
+        if (strcmp(got, cases[i].want) != 0 || end != cases[i].end || states_only != end) {
+            printf("syntax selftest: FAIL '%s': %s end %d, want %s end %d\n", cases[i].line, got, end, cases[i].want, cases[i].end);
+            return 1;
+        }
+    }
+    
+    Syntax *syn = syntax_for("a.c");
+    for (int i = 0; i < 300; i++) {
+        const char *piece = pieces[rand() % 11];
+        rope_insert(&r, i, piece, strlen(piece));
+    }
+    for (int op = 0; op < ops; op++) {
+        int count = rope_count(&r), y = rand() % count, kind = rand() % 3;
+        if (kind == 0 && count > 1) {
+            /* Joining into the line above, as deleting a line break does */
+            rope_delete(&r, y);
+            int at = y > 0 ? y - 1 : 0;
+            line_cache_edit(&cache, &len, &cap, at, 1, 0, HL_UNKNOWN);
+            if (valid > at) valid = at;
+        } else if (kind == 1) {
+            const char *piece = pieces[rand() % 11];
+            rope_insert(&r, y + 1, piece, strlen(piece));
+            line_cache_edit(&cache, &len, &cap, y, 0, 1, HL_UNKNOWN);
+            if (valid > y) valid = y;
+        } else {
+            const char *piece = pieces[rand() % 11];
+            char **slot = rope_slot(&r, y);
+            *slot = line_resize(&r.arena, *slot, strlen(piece));
+            memcpy(*slot, piece, strlen(piece));
+            line_cache_edit(&cache, &len, &cap, y, 0, 0, HL_UNKNOWN);
+            if (valid > y) valid = y;
+        }
+        
+        count = rope_count(&r);
+        int last = rand() % count, state = HL_ST_NORMAL, n;
+        line_cache_grow(&cache, &len, &cap, count, HL_UNKNOWN);
+        if (last >= valid) {
+            syntax_update(syn, &r, cache, valid, last, NULL);
+            valid = last + 1;
+        }
+        /* The cache is built without classes, which skips ahead; check against a full lex */
+        for (int i = 0; i < valid; i++) {
+            const char *line = rope_get(&r, i, &n);
+            int end = syntax_lex(syn, line, n, state, cls);
+            if (cache[i] != (state << 4 | end)) {
+                printf("syntax selftest: FAIL line %d after %d edits: cached %02x, want %02x\n", i, op, cache[i], state << 4 | end);
+                return 1;
+            }
+            state = end;
+        }
+    }
+    printf("syntax selftest: OK (%d lines, %d edits)\n", ncases, ops);
+    free(cache);
+    rope_free(&r);
+    return 0;
+}
+
+/* Edits in the middle of one long line, its gap and lexer marks checked against a plain copy */
+int longline_selftest(void) {
+    const char *pieces[] = { "int a; ", "/*", "*/;", "x \"s", "\"", "'q'", " b ", "s \\", "#if 1.5e3 ", "return" };
+    Syntax *syn = syntax_for("a.c");
+    SyntaxMarks marks = {0};
+    Rope r = {0};
+    int len = 0, cap = 1 << 20, ops = 4000, n, checks = 0;
+    char *model = malloc(cap), *big = malloc(5000);
+    unsigned char *cls = malloc(cap);
+    
+    memset(big, 'w', 5000);
+    while (len < 200000) {
+        const char *piece = pieces[rand() % 10];
+        memcpy(model + len, piece, strlen(piece));
+        len += (int)strlen(piece);
+    }
+    rope_insert(&r, 0, model, len);
+    
+    for (int op = 0; op < ops; op++) {
+        int x = rand() % (len + 1);
+        char **slot = rope_slot(&r, 0);
+        if (rand() % 3 == 0 && len > 1000) {
+            int del = 1 + rand() % 20;
+            if (del > len - x) del = len - x;
+            *slot = line_erase(&r.arena, *slot, x, del);
+            syntax_marks_edit(&marks, 0, x, del, 0);
+            memmove(model + x, model + x + del, len - x - del);
+            len -= del;
+        } else {
+            const char *piece = op % 500 == 0 ? big : pieces[rand() % 10];
+            int add = op % 500 == 0 ? 5000 : (int)strlen(piece);
+            *slot = line_insert(&r.arena, *slot, x, piece, add);
+            syntax_marks_edit(&marks, 0, x, 0, add);
+            memmove(model + x + add, model + x, len - x);
+            memcpy(model + x, piece, add);
+            len += add;
+        }
+        
+        /* A window around the edit reads through the gap */
+        int from = x > 50 ? x - 50 : 0, to = x + 50;
+        const char *s = rope_peek(&r, 0, from, to, &n);
+        if (to > len) to = len;
+        if (n != len || memcmp(s + from, model + from, to - from) != 0) {
+            printf("longline selftest: FAIL window at %d after %d edits\n", x, op);
+            return 1;
+        }
+        if (op % 40) continue;
+        
+        /* Marks give the end state and the classes of any stretch a full lex does */
+        checks++;
+        int end = syntax_lex(syn, model, len, HL_ST_NORMAL, cls);
+        LineMarks *m = syntax_marks_update(&marks, syn, &r, 0, HL_ST_NORMAL, INT_MAX);
+        int at = rand() % len, k = syntax_mark_before(m, at), start = m->pos[k];
+        s = rope_peek(&r, 0, start ? start - 1 : 0, at + 100 + HL_TOKEN_MAX, &n);
+        unsigned char *run = malloc(n - start + 1);
+        syntax_lex_run(syn, s, n, m->lead, &start, at + 100, m->state[k], run);
+        int stop = at + 100 < len ? at + 100 : len, bad = memcmp(run + at - m->pos[k], cls + at, stop - at) != 0;
+        free(run);
+        if (m->end != end || bad) {
+            printf("longline selftest: FAIL after %d edits: end %d, want %d%s\n", op, m->end, end, bad ? ", classes differ" : "");
+            return 1;
+        }
+    }
+    
+    const char *line = rope_get(&r, 0, &n);
+    if (n != len || memcmp(line, model, len) != 0 || rope_len(&r, 0) != len) {
+        printf("longline selftest: FAIL joined line differs\n");
+        return 1;
+    }
+    printf("longline selftest: OK (%d edits, %d checks, %d bytes)\n", ops, checks, len);
+    syntax_marks_free(&marks);
+    rope_free(&r);
+    free(model);
+    free(big);
+    free(cls);
+    return 0;
+}
+
+/* Lines inserted, deleted, resized and appended under a wrap index, checked against counting from the top */
+int wrap_selftest(void) {
+    WrapIndex w = {0};
+    Rope r = {0};
+    int cap = 1 << 16, count = 0, ops = 3000, *len = malloc(sizeof(int) * cap), sub;
+    char *text = malloc(1000);
+    
+    memset(text, 'w', 1000);
+    for (int op = 0; op < ops; op++) {
+        int kind = rand() % 10, y = count ? rand() % count : 0;
+        if (count == 0 || kind == 0) {
+            /* Lines loaded past the end, seen by the next sync */
+            int n = 1 + rand() % 300;
+            for (int i = 0; i < n; i++) {
+                len[count] = rand() % 300;
+                rope_insert(&r, count, text, len[count]);
+                count++;
+            }
+        } else if (kind < 4) {
+            int n = 1 + rand() % (rand() % 8 ? 5 : 600);
+            if (count + n >= cap) continue;
+            memmove(&len[y + 1 + n], &len[y + 1], sizeof(int) * (count - y - 1));
+            for (int i = 1; i <= n; i++) {
+                len[y + i] = rand() % 3 ? rand() % 100 : rand() % 1000;
+                rope_insert(&r, y + i, text, len[y + i]);
+            }
+            count += n;
+            wrap_edit(&w, y, 0, n);
+        } else if (kind < 6) {
+            int n = rand() % (rand() % 8 ? 5 : 600);
+            if (n > count - 1 - y) n = count - 1 - y;
+            for (int i = 0; i < n; i++) rope_delete(&r, y + 1);
+            memmove(&len[y + 1], &len[y + 1 + n], sizeof(int) * (count - y - 1 - n));
+            count -= n;
+            wrap_edit(&w, y, n, 0);
+        } else {
+            rope_delete(&r, y);
+            len[y] = rand() % 1000;
+            rope_insert(&r, y, text, len[y]);
+            wrap_edit(&w, y, 0, 0);
+        }
+        wrap_sync(&w, &r, rand() % 50 ? (w.width ? w.width : 80) : 1 + rand() % 120);
+        
+        /* A few lines and rows, and sometimes the total */
+        int width = w.width, row = 0, want = rand() % count, probe = -1;
+        for (int i = 0; i < count; i++) {
+            int rows = len[i] / width + 1;
+            if (i == want && wrap_row(&w, &r, i) != row) {
+                printf("wrap selftest: FAIL row of line %d after %d edits: %d, want %d\n", i, op, wrap_row(&w, &r, i), row);
+                return 1;
+            }
+            if (probe < 0 && rand() % 64 == 0) {
+                probe = row + rand() % rows;
+                if (wrap_find(&w, &r, probe, &sub) != i || sub != probe - row) {
+                    printf("wrap selftest: FAIL line of row %d after %d edits\n", probe, op);
+                    return 1;
+                }
+            }
+            row += rows;
+        }
+        if (op % 50 == 0 && (wrap_total(&w, &r) != row || wrap_find(&w, &r, row, &sub) != -1)) {
+            printf("wrap selftest: FAIL total after %d edits: %d, want %d\n", op, wrap_total(&w, &r), row);
+            return 1;
+        }
+    }
+    printf("wrap selftest: OK (%d edits, %d lines in %d blocks)\n", ops, count, w.count);
+    wrap_free(&w);
+    rope_free(&r);
+    free(len);
+    free(text);
+    return 0;
+}
+
+/* Count every match in a file: per-line memchr scan versus the search engine */
+int search_bench(const char *path, const char *pattern) {
+    Rope r = {0};
+    Searcher s;
+    int m = strlen(pattern), len, y, x, count[3] = {0, 0, 0};
+    FileMap *map = filemap_open(path);
+    if (!map || m == 0) {
+        printf("search bench: cannot open %s\n", path);
+        return 1;
+    }
+    rope_load(&r, map);
+    rope_finish(&r);
+    int lines = rope_count(&r);
+    
+    /* Regex patterns: a cold pass fills the line cache, a second pass runs on it */
+    if (!regex_is_literal(pattern, m)) {
+        char err[64];
+        Regex *re = regex_compile(pattern, m, 0, err, sizeof(err));
+        unsigned char *cache = calloc(lines, 1);
+        if (!re) {
+            printf("search bench: bad pattern: %s\n", err);
+            return 1;
+        }
+        printf("search bench: %s, %.1f MB, %d lines, /%s/\n", path, map->size / 1048576.0, lines, pattern);
+        for (int pass = 0; pass < 2; pass++) {
+            double start = now_ms();
+            for (y = 0, x = 0; rope_regex_search(&r, re, cache, lines, y, x, lines, &y, &x); x++) count[pass]++;
+            double ms = now_ms() - start;
+            printf("  regex, %s  %8.2f ms (%5.2f GB/s) %d matches\n", pass ? "line cache:" : "cold:      ", ms, map->size / (ms * 1e6), count[pass]);
+        }
+        regex_free(re);
+        free(cache);
+        rope_free(&r);
+        return count[0] != count[1];
+    }
+    
+    double t0 = now_ms();
+    for (int i = 0; i < lines; i++) {
+        const char *line = rope_get(&r, i, &len);
+        for (const char *p = line, *end = line + len - m + 1; p < end && (p = memchr(p, pattern[0], end - p)) != NULL; p++) {
+            if (memcmp(p, pattern, m) == 0) count[0]++;
+        }
+    }
+    double t1 = now_ms();
+    double t[2];
+    for (int icase = 0; icase < 2; icase++) {
+        double start = now_ms();
+        search_compile(&s, pattern, m, icase);
+        for (y = 0, x = 0; rope_search(&r, &s, y, x, lines, &y, &x); x++) count[1 + icase]++;
+        t[icase] = now_ms() - start;
+    }
+    
+    printf("search bench: %s, %.1f MB, %d lines, '%s'\n", path, map->size / 1048576.0, lines, pattern);
+    printf("  per-line memchr:  %8.2f ms (%5.2f GB/s) %d matches\n", t1 - t0, map->size / ((t1 - t0) * 1e6), count[0]);
+    printf("  engine:           %8.2f ms (%5.2f GB/s) %d matches\n", t[0], map->size / (t[0] * 1e6), count[1]);
+    printf("  engine, icase:    %8.2f ms (%5.2f GB/s) %d matches\n", t[1], map->size / (t[1] * 1e6), count[2]);
+    
+    rope_free(&r);
+    return count[0] != count[1];
+}
+
+/* Search a directory tree on one thread and on all of them */
+int grep_bench(const char *root, const char *pattern) {
+    int threads[2] = { 1, cpu_count() }, count[2] = {0, 0};
+    char err[64];
+    
+    printf("grep bench: %s, '%s'\n", root, pattern);
+    for (int i = 0; i < 2; i++) {
+        Grep *g = grep_start(root, pattern, 0, 1, threads[i], err, sizeof(err));
+        if (!g) {
+            printf("grep bench: bad pattern: %s\n", err);
+            return 1;
+        }
+        grep_join(g, 0);
+        count[i] = g->count;
+        printf("  %2d thread%s  %8.2f ms (%6.0f files/s) %d files, %d matches in %d files\n", g->threads,
+               g->threads == 1 ? ": " : "s:", g->elapsed, g->scanned * 1000.0 / g->elapsed, g->scanned, g->count, g->file_count);
+        grep_free(g);
+    }
+    return count[0] != count[1];
+}
+
+/* List a directory the way the sidebar does: time to the first batch and to the end, then check the order */
+int dir_bench(const char *path) {
+    double t0 = now_ms(), first = 0;
+    DirList *d = dir_list_start(path);
+    int bad = 0;
+    
+    while (dir_list_loading(d)) {
+        mutex_lock(&d->lock);
+        if (!first && d->count > 1) first = now_ms() - t0;
+        mutex_unlock(&d->lock);
+        thread_yield();
+    }
+    double total = now_ms() - t0;
+    for (int i = 1; i < d->count; i++) {
+        DirEntry *a = &d->entries[i - 1], *b = &d->entries[i];
+        if (dir_cmp(d->names + a->name, a->is_dir, d->names + b->name, b->is_dir) >= 0) bad++;
+    }
+    printf("dir bench: %s, %d entries, %.1f KB of names\n", path, d->count - 1, d->names_len / 1024.0);
+    printf("  first batch:      %8.2f ms\n", first ? first : total);
+    printf("  whole listing:    %8.2f ms%s\n", total, bad ? " (OUT OF ORDER)" : "");
+    dir_list_free(d);
+    return bad != 0;
+}
+
+/* Build, save and load the path index of a tree, then time ranking it for each prefix of query */
+int find_bench(const char *root, const char *query) {
+    char cache[600], q[256];
+    FindHit *hits = malloc(sizeof(FindHit) * FIND_MAX_HITS);
+    int qlen = (int)strlen(query) < 255 ? (int)strlen(query) : 255;
+    
+    double t0 = now_ms();
+    PathIndex *built = path_build_finish(path_build_start(root), 0);
+    double t1 = now_ms();
+    path_index_cache(root, cache, sizeof(cache));
+    PathIndex *ix = path_index_load(root, cache);
+    double t2 = now_ms();
+    if (!ix || ix->count != built->count) {
+        printf("find bench: the cached index of %s does not match\n", root);
+        return 1;
+    }
+    printf("find bench: %s, %d paths\n", root, ix->count);
+    printf("  build and save:   %8.2f ms\n", t1 - t0);
+    printf("  load from cache:  %8.2f ms\n", t2 - t1);
+    
+    /* Copies of the tree under numbered prefixes, to rank at least 500k paths */
+    for (int copy = 1, n = built->count; n > 0 && ix->count < 500000; copy++) {
+        char path[1100];
+        for (int i = 0; i < n; i++) {
+            snprintf(path, sizeof(path), "copy%d/%s", copy, built->names + built->offs[i]);
+            path_index_add(ix, path);
+        }
+    }
+    int *cand = malloc(sizeof(int) * (ix->count + 1)), n = 0, count = 0;
+    for (int i = 0; i < qlen; i++) q[i] = fuzzy_fold[(unsigned char)query[i]];
+    /* Each keystroke is timed as the best of a few rounds */
+    for (int pass = 0; pass < 2; pass++) {
+        double best[256], worst = 0, total = 0;
+        for (int round = 0; round < 5; round++) {
+            for (int m = 1; m <= qlen; m++) {
+                double start = now_ms();
+                count = fuzzy_rank(ix, pass && m > 1 ? cand : NULL, n, cand, &n, q, m, hits, FIND_MAX_HITS);
+                double ms = now_ms() - start;
+                if (round == 0 || ms < best[m - 1]) best[m - 1] = ms;
+            }
+        }
+        for (int m = 0; m < qlen; m++) {
+            total += best[m];
+            if (best[m] > worst) worst = best[m];
+        }
+        printf("  %d paths, typed, %s %6.2f ms worst keystroke, %.2f ms for all %d, %d matches\n", ix->count,
+               pass ? "narrowed:    " : "from scratch:", worst, total, qlen, n);
+    }
+    if (count > 0) printf("  best: %s\n", ix->names + ix->offs[hits[0].path]);
+    
+    free(cand);
+    free(hits);
+    path_index_free(built);
+    path_index_free(ix);
+    return 0;
+}
+
+/* Edit-near-the-top workload: rope versus the old flat pointer array */
+void rope_bench(int lines) {
+    int ops = 20000, len;
+    Rope r = {0};
+    char **flat = malloc(sizeof(char*) * lines);
+    int flat_n = lines;
+    
+    for (int i = 0; i < lines; i++) {
+        rope_insert(&r, i, "int x = 0;", 10);
+        flat[i] = _strdup("int x = 0;");
+    }
+    
+    double t0 = now_ms();
+    for (int i = 0; i < ops; i++) rope_insert(&r, 1, "", 0);
+    for (int i = 0; i < ops; i++) rope_delete(&r, 1);
+    double t1 = now_ms();
+    for (int i = 0; i < ops; i++) {
+        flat = realloc(flat, sizeof(char*) * (flat_n + 1));
+        memmove(&flat[2], &flat[1], sizeof(char*) * (flat_n - 1));
+        flat[1] = _strdup("");
+        flat_n++;
+    }
+    for (int i = 0; i < ops; i++) {
+        free(flat[1]);
+        memmove(&flat[1], &flat[2], sizeof(char*) * (flat_n - 2));
+        flat_n--;
+    }
+    double t2 = now_ms();
+    
+    volatile size_t sink = 0;
+    for (int i = 0; i < ops * 10; i++) {
+        rope_get(&r, rope_rand() % lines, &len);
+        sink += len;
+    }
+    double t3 = now_ms();
+    for (int i = 0; i < lines; i++) {
+        rope_get(&r, i, &len);
+        sink += len;
+    }
+    double t4 = now_ms();
+    
+    printf("rope bench: %d lines, %d newline+delete pairs at line 2\n", lines, ops);
+    printf("  rope edit:        %8.2f ms (%6.0f ns/op)\n", t1 - t0, (t1 - t0) * 1e6 / (ops * 2));
+    printf("  flat array edit:  %8.2f ms (%6.0f ns/op)\n", t2 - t1, (t2 - t1) * 1e6 / (ops * 2));
+    printf("  random lookup:    %8.2f ms (%6.0f ns/op)\n", t3 - t2, (t3 - t2) * 1e6 / (ops * 10));
+    printf("  sequential scan:  %8.2f ms (%6.0f ns/line)\n", t4 - t3, (t4 - t3) * 1e6 / lines);
+    
+    for (int i = 0; i < flat_n; i++) free(flat[i]);
+    free(flat);
+    rope_free(&r);
+    
+    /* Typing into one line: arena line with a cached length vs realloc and strlen per key */
+    Rope typed = {0};
+    rope_insert(&typed, 0, "", 0);
+    t0 = now_ms();
+    for (int i = 0; i < ops; i++) {
+        char **slot = rope_slot(&typed, 0);
+        len = line_length(*slot);
+        *slot = line_resize(&typed.arena, *slot, len + 1);
+        (*slot)[len] = 'x';
+    }
+    t1 = now_ms();
+    char *plain = _strdup("");
+    for (int i = 0; i < ops; i++) {
+        len = strlen(plain);
+        plain = realloc(plain, len + 2);
+        plain[len] = 'x';
+        plain[len + 1] = '\0';
+    }
+    t2 = now_ms();
+    printf("  typing, arena:    %8.2f ms (%d keys, %lld moves)\n", t1 - t0, ops, typed.arena.moves);
+    printf("  typing, malloc:   %8.2f ms (%d reallocs)\n", t2 - t1, ops);
+    free(plain);
+    rope_free(&typed);
+    
+    /* Allocating a buffer's worth of lines and dropping them all, as opening and closing a file does */
+    Arena arena = {0};
+    flat = malloc(sizeof(char*) * lines);
+    t0 = now_ms();
+    for (int i = 0; i < lines; i++) flat[i] = line_new(&arena, "int x = 0;", 10);
+    t1 = now_ms();
+    int slabs = arena.slab_count;
+    arena_free(&arena);
+    t2 = now_ms();
+    for (int i = 0; i < lines; i++) flat[i] = _strdup("int x = 0;");
+    t3 = now_ms();
+    for (int i = 0; i < lines; i++) free(flat[i]);
+    t4 = now_ms();
+    free(flat);
+    printf("  fill, arena:      %8.2f ms (%d slabs)\n", t1 - t0, slabs);
+    printf("  close, arena:     %8.2f ms\n", t2 - t1);
+    printf("  fill, malloc:     %8.2f ms (%d blocks)\n", t3 - t2, lines);
+    printf("  close, malloc:    %8.2f ms\n", t4 - t3);
+}
+
+/* Time mapping and indexing a file, then touching its first and last line */
+int open_bench(const char *path) {
+    Rope r = {0};
+    int len;
+    double t0 = now_ms();
+    FileMap *map = filemap_open(path);
+    if (!map) {
+        printf("open bench: cannot open %s\n", path);
+        return 1;
+    }
+    rope_load(&r, map);
+    double t1 = now_ms();
+    rope_finish(&r);
+    double t2 = now_ms();
+    if (rope_count(&r) > 0) {
+        rope_get(&r, 0, &len);
+        rope_get(&r, rope_count(&r) - 1, &len);
+    }
+    double t3 = now_ms();
+    
+    printf("open bench: %s, %.1f MB, %d lines\n", path, map->size / 1048576.0, rope_count(&r));
+    printf("  first screen:     %8.2f ms\n", t1 - t0);
+    printf("  full index:       %8.2f ms (%.2f GB/s)\n", t2 - t0, map->size / ((t2 - t0) * 1e6));
+    printf("  first/last line:  %8.3f ms\n", t3 - t2);
+    rope_free(&r);
+    return 0;
+}
+
+/* Time one newline scanner over the whole mapping on the calling thread */
+double index_bench_scan(FileMap *m, void (*scan)(IndexChunk *, const char *, size_t, size_t), int *lines) {
+    IndexChunk c = {0};
+    c.cap = (int)(m->size / 40) + 64;
+    c.starts = malloc(sizeof(size_t) * c.cap);
+    c.count = 1;
+    double t0 = now_ms();
+    scan(&c, m->data, 0, m->size);
+    double t1 = now_ms();
+    *lines = c.count;
+    free(c.starts);
+    return t1 - t0;
+}
+
+/* Index a generated file with the scalar scanner, the vector scanner and the thread pool */
+int index_bench(int mb) {
+    const char *path = "az-bench-index.tmp";
+    const char *kernel = "scalar";
+    size_t size = (size_t)mb * 1024 * 1024, written = 0;
+    char *block = malloc(1 << 20);
+    Rope r = {0};
+    int lines[2];
+    
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("index bench: cannot create %s\n", path);
+        return 1;
+    }
+    while (written < size) {
+        size_t n = 0;
+        while (n < (1 << 20) - 200) {
+            int len = rope_rand() % 120;
+            for (int i = 0; i < len; i++, n++) block[n] = 'a' + n % 26;
+            if (rope_rand() % 8 == 0) block[n++] = '\r';
+            block[n++] = '\n';
+        }
+        if (n > size - written) n = size - written;
+        fwrite(block, 1, n, fp);
+        written += n;
+    }
+    fclose(fp);
+    free(block);
+    
+#if defined(__x86_64__) || defined(__i386__)
+    kernel = index_kernel() == index_scan_avx2 ? "avx2" : "sse2";
+#endif
+    FileMap *map = filemap_open_chunked(path, size + 1, 0);
+    if (!map) {
+        printf("index bench: cannot map %s\n", path);
+        return 1;
+    }
+    index_bench_scan(map, index_kernel(), &lines[0]);
+    double scalar = index_bench_scan(map, index_scan_scalar, &lines[0]);
+    double vector = index_bench_scan(map, index_kernel(), &lines[1]);
+    filemap_close(map);
+    
+    double t1 = now_ms();
+    map = filemap_open(path);
+    rope_load(&r, map);
+    double t2 = now_ms();
+    rope_finish(&r);
+    double t3 = now_ms();
+    
+    printf("index bench: %d MB, %d lines, %d threads, %s\n", mb, rope_count(&r), cpu_count(), kernel);
+    printf("  memchr, 1 thread: %8.2f ms (%5.2f GB/s)\n", scalar, size / (scalar * 1e6));
+    printf("  %-6s, 1 thread: %8.2f ms (%5.2f GB/s)\n", kernel, vector, size / (vector * 1e6));
+    printf("  %-6s, parallel: %8.2f ms (%5.2f GB/s)\n", kernel, t3 - t1, size / ((t3 - t1) * 1e6));
+    printf("  first screen:     %8.2f ms\n", t2 - t1);
+    printf("  line endings:     %s\n", filemap_crlf(map) ? "CRLF" : "LF");
+    
+    int ok = lines[0] == lines[1] && map->newlines == lines[0] - 1;
+    rope_free(&r);
+    remove(path);
+    if (!ok) {
+        printf("index bench: FAIL line counts differ\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Save a lightly edited copy of a file: per-line stdio versus gathered atomic writes */
+int save_bench(const char *path) {
+    char out[600];
+    Rope r = {0};
+    int len;
+    FileMap *map = filemap_open(path);
+    if (!map) {
+        printf("save bench: cannot open %s\n", path);
+        return 1;
+    }
+    rope_load(&r, map);
+    rope_finish(&r);
+    int count = rope_count(&r);
+    for (int i = 0; i < count; i += 1000) {
+        char **slot = rope_slot(&r, i);
+        *slot = line_resize(&r.arena, *slot, line_length(*slot) + 1);
+        (*slot)[line_length(*slot) - 1] = '+';
+    }
+    snprintf(out, sizeof(out), "%s.az-bench", path);
+    
+    double t0 = now_ms();
+    FILE *fp = fopen(out, "wb");
+    if (!fp) {
+        printf("save bench: cannot create %s\n", out);
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        const char *line = rope_get(&r, i, &len);
+        fwrite(line, 1, len, fp);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+    double t1 = now_ms();
+    long long bytes = rope_save(&r, out, filemap_crlf(map));
+    double t2 = now_ms();
+    
+    printf("save bench: %s, %d lines, %d edited\n", path, count, (count + 999) / 1000);
+    printf("  per-line stdio:   %8.2f ms\n", t1 - t0);
+    printf("  gathered + fsync: %8.2f ms (%lld bytes, %.2f GB/s)\n", t2 - t1, bytes, bytes / ((t2 - t1) * 1e6));
+    rope_free(&r);
+    remove(out);
+    return bytes < 0;
+}
+
+int draw_bench(int cols, int rows);
+int syntax_bench(int lines);
+int isearch_bench(const char *path, const char *pattern);
+int replay_run(const char *script, const char *path, int bench);
+int undo_file_selftest(void);
+int swap_selftest(void);
+int autosave_selftest(void);
+int autosave_bench(const char *path);
+int buffer_selftest(void);
+int longline_bench(int mb);
+int wrap_bench(int lines);
+int paste_bench(int chars);
+int yank_bench(int lines);
+
+/* Handle --selftest / --bench / --replay; returns -1 when argv asks for the editor */
+int run_headless(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--selftest") == 0) {
+        return rope_selftest() | search_selftest() | regex_selftest() | grep_selftest() | find_selftest() | syntax_selftest() |
+               longline_selftest() | wrap_selftest() | undo_file_selftest() | swap_selftest() | autosave_selftest() | buffer_selftest();
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        rope_bench(argc > 2 ? atoi(argv[2]) : 40000);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "--bench-open") == 0) {
+        return open_bench(argv[2]);
+    }
+    if (argc > 3 && strcmp(argv[1], "--bench-search") == 0) {
+        return search_bench(argv[2], argv[3]) | isearch_bench(argv[2], argv[3]);
+    }
+    if (argc > 3 && strcmp(argv[1], "--bench-find") == 0) {
+        return find_bench(argv[2], argv[3]);
+    }
+    if (argc > 2 && strcmp(argv[1], "--bench-dir") == 0) {
+        return dir_bench(argv[2]);
+    }
+    if (argc > 3 && strcmp(argv[1], "--bench-grep") == 0) {
+        return grep_bench(argv[2], argv[3]);
+    }
+    if (argc > 2 && strcmp(argv[1], "--bench-save") == 0) {
+        return save_bench(argv[2]);
+    }
+    if (argc > 2 && strcmp(argv[1], "--bench-autosave") == 0) {
+        return autosave_bench(argv[2]);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-syntax") == 0) {
+        return syntax_bench(argc > 2 ? atoi(argv[2]) : 100000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-longline") == 0) {
+        return longline_bench(argc > 2 ? atoi(argv[2]) : 50);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-wrap") == 0) {
+        return wrap_bench(argc > 2 ? atoi(argv[2]) : 1000000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-draw") == 0) {
+        return draw_bench(argc > 3 ? atoi(argv[2]) : 300, argc > 3 ? atoi(argv[3]) : 100);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-index") == 0) {
+        return index_bench(argc > 2 ? atoi(argv[2]) : 256);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-paste") == 0) {
+        return paste_bench(argc > 2 ? atoi(argv[2]) : 10000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-yank") == 0) {
+        return yank_bench(argc > 2 ? atoi(argv[2]) : 100000);
+    }
+    if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+        const char *path = NULL;
+        int bench = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--bench") == 0) bench = 1;
+            else path = argv[i];
+        }
+        return replay_run(argv[2], path, bench);
+    }
+    return -1;
+}
+
+/*
+ * Terminal backends
+ *
+ * The editor draws into a frame of Cells and reads neutral Events; the
+ * backend owns the console. Each backend provides:
+ *
+ *   term_init(&cols, &rows)   take over the terminal and report its size
+ *   term_free()               restore the terminal
+ *   term_read(&ev, timeout)   next event, waiting at most timeout ms (-1: forever);
+ *                             returns 0 on timeout
+ *   term_span(x, y, cells, n) send n changed cells starting at (x, y)
+ *   term_present(x, y)        place the cursor and finish the frame; returns
+ *                             the bytes sent for the frame
+ *
+ * Attributes use the Win32 console bit layout on both platforms. While H
+ * is active neither backend touches the console.
+ */
+typedef unsigned short Attr;
+
+typedef struct {
+    char ch;
+    Attr attr;
+} Cell;
+
+typedef enum {
+    EV_KEY = 1,
+    EV_MOUSE,
+    EV_RESIZE
+} EventType;
+
+/* Mouse buttons and flags */
+#define EV_BUTTON_LEFT  1
+#define EV_BUTTON_RIGHT 2
+#define EV_MOVED        1
+#define EV_DOUBLE       2
+
+typedef struct {
+    EventType type;
+    int vk;                 /* VK_ code; the letter for Ctrl+letter */
+    int ch;                 /* Character, 0 for keys without one */
+    int ctrl, shift;
+    int x, y;               /* Mouse cell, or the new size for EV_RESIZE */
+    int buttons;            /* EV_BUTTON_ bits held */
+    int flags;              /* EV_MOVED / EV_DOUBLE */
+    int wheel;              /* Notches, > 0 up, < 0 down */
+} Event;
+
+/*
+ * Key scripts: --replay runs the editor headless, reading events from a
+ * script instead of the console and building frames without writing them;
+ * --record writes each key read from the console to a script.
+ */
+struct {
+    int active;
+    Event *events;
+    int count, pos;
+    int cols, rows;
+    int quit;                   /* The script asked the editor to quit */
+    FILE *record;
+} H;
+
+int script_next(Event *ev);
+void script_record(const Event *ev);
+
+#ifdef _WIN32
+
+/* Win32 console: cells go out through WriteConsoleOutput one row span at a time */
+struct {
+    HANDLE out, in;
+    DWORD orig_in_mode, orig_out_mode;
+    CHAR_INFO *span;
+    int span_cap;
+    int cols, rows;
+    int bytes;
+} T;
+
+void term_size(int *cols, int *rows) {
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    GetConsoleScreenBufferInfo(T.out, &csbi);
+    *cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+    *rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+}
+
+void term_init(int *cols, int *rows) {
+    if (H.active) {
+        *cols = T.cols = H.cols;
+        *rows = T.rows = H.rows;
+        return;
+    }
+    T.out = GetStdHandle(STD_OUTPUT_HANDLE);
+    T.in = GetStdHandle(STD_INPUT_HANDLE);
+    
+    GetConsoleMode(T.in, &T.orig_in_mode);
+    GetConsoleMode(T.out, &T.orig_out_mode);
+    
+    SetConsoleMode(T.in, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT);
+    SetConsoleMode(T.out, T.orig_out_mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+    
+    /* Hide cursor blink during refresh */
+    CONSOLE_CURSOR_INFO cci = { 25, TRUE };
+    SetConsoleCursorInfo(T.out, &cci);
+    
+    term_size(&T.cols, &T.rows);
+    *cols = T.cols;
+    *rows = T.rows;
+}
+
+void term_free(void) {
+    if (H.active) {
+        free(T.span);
+        return;
+    }
+    SetConsoleMode(T.in, T.orig_in_mode);
+    SetConsoleMode(T.out, T.orig_out_mode);
+    
+    /* Clear screen on exit */
+    COORD pos = {0, 0};
+    DWORD written;
+    FillConsoleOutputCharacter(T.out, ' ', T.cols * T.rows, pos, &written);
+    FillConsoleOutputAttribute(T.out, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE, T.cols * T.rows, pos, &written);
+    SetConsoleCursorPosition(T.out, pos);
+    free(T.span);
+}
+
+int term_read(Event *ev, int timeout) {
+    INPUT_RECORD ir;
+    DWORD count;
+    
+    if (H.active) return script_next(ev);
+    for (;;) {
+        memset(ev, 0, sizeof(Event));
+        if (timeout >= 0 && WaitForSingleObject(T.in, timeout) == WAIT_TIMEOUT) return 0;
+        if (!ReadConsoleInput(T.in, &ir, 1, &count)) return 0;
+        
+        if (ir.EventType == WINDOW_BUFFER_SIZE_EVENT) {
+            ev->type = EV_RESIZE;
+            ev->x = T.cols = ir.Event.WindowBufferSizeEvent.dwSize.X;
+            ev->y = T.rows = ir.Event.WindowBufferSizeEvent.dwSize.Y;
+            return 1;
+        }
+        if (ir.EventType == MOUSE_EVENT) {
+            MOUSE_EVENT_RECORD *m = &ir.Event.MouseEvent;
+            ev->type = EV_MOUSE;
+            ev->x = m->dwMousePosition.X;
+            ev->y = m->dwMousePosition.Y;
+            if (m->dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED) ev->buttons |= EV_BUTTON_LEFT;
+            if (m->dwButtonState & RIGHTMOST_BUTTON_PRESSED) ev->buttons |= EV_BUTTON_RIGHT;
+            if (m->dwEventFlags & MOUSE_MOVED) ev->flags |= EV_MOVED;
+            if (m->dwEventFlags & DOUBLE_CLICK) ev->flags |= EV_DOUBLE;
+            if (m->dwEventFlags & MOUSE_WHEELED) {
+                ev->wheel = (short)HIWORD(m->dwButtonState) > 0 ? 1 : -1;
+                ev->buttons = 0;
+            }
+            return 1;
+        }
+        if (ir.EventType == KEY_EVENT && ir.Event.KeyEvent.bKeyDown) {
+            KEY_EVENT_RECORD *key = &ir.Event.KeyEvent;
+            ev->type = EV_KEY;
+            ev->vk = key->wVirtualKeyCode;
+            ev->ch = key->uChar.AsciiChar;
+            ev->ctrl = (key->dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) != 0;
+            ev->shift = (key->dwControlKeyState & SHIFT_PRESSED) != 0;
+            if (H.record) script_record(ev);
+            return 1;
+        }
+    }
+}
+
+/* Ctrl+C waiting in the input queue; it and everything before it are dropped */
+int term_interrupted(void) {
+    INPUT_RECORD ir[64];
+    DWORD count;
+    
+    if (H.active) return 0;
+    if (!PeekConsoleInput(T.in, ir, 64, &count)) return 0;
+    for (DWORD i = 0; i < count; i++) {
+        KEY_EVENT_RECORD *key = &ir[i].Event.KeyEvent;
+        if (ir[i].EventType == KEY_EVENT && key->bKeyDown && key->uChar.AsciiChar == 3) {
+            ReadConsoleInput(T.in, ir, i + 1, &count);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void term_span(int x, int y, const Cell *cells, int n) {
+    if (n > T.span_cap) {
+        T.span_cap = n;
+        T.span = realloc(T.span, sizeof(CHAR_INFO) * n);
+    }
+    for (int i = 0; i < n; i++) {
+        T.span[i].Char.AsciiChar = cells[i].ch;
+        T.span[i].Attributes = cells[i].attr;
+    }
+    COORD size = { (SHORT)n, 1 };
+    COORD origin = { 0, 0 };
+    SMALL_RECT region = { (SHORT)x, (SHORT)y, (SHORT)(x + n - 1), (SHORT)y };
+    if (!H.active) WriteConsoleOutput(T.out, T.span, size, origin, &region);
+    T.bytes += n * (int)sizeof(CHAR_INFO);
+}
+
+int term_present(int x, int y) {
+    COORD pos = { (SHORT)x, (SHORT)y };
+    int bytes = T.bytes;
+    if (!H.active) SetConsoleCursorPosition(T.out, pos);
+    T.bytes = 0;
+    return bytes;
+}
+
+#else
+
+/* Win32 key codes and console colour bits, so the editor code stays the same */
+#define VK_BACK     0x08
+#define VK_TAB      0x09
+#define VK_RETURN   0x0D
+#define VK_ESCAPE   0x1B
+#define VK_PRIOR    0x21
+#define VK_NEXT     0x22
+#define VK_END      0x23
+#define VK_HOME     0x24
+#define VK_LEFT     0x25
+#define VK_UP       0x26
+#define VK_RIGHT    0x27
+#define VK_DOWN     0x28
+#define VK_DELETE   0x2E
+
+#define FOREGROUND_BLUE      0x01
+#define FOREGROUND_GREEN     0x02
+#define FOREGROUND_RED       0x04
+#define FOREGROUND_INTENSITY 0x08
+#define BACKGROUND_BLUE      0x10
+#define BACKGROUND_GREEN     0x20
+#define BACKGROUND_RED       0x40
+#define BACKGROUND_INTENSITY 0x80
+
+/*
+ * termios + ANSI: a frame is built in one output buffer and sent with a
+ * single write(). Colours are only re-sent when the attribute changes, and
+ * the cursor is moved with the shortest sequence that gets it there.
+ */
+struct {
+    struct termios orig;
+    char *out;
+    int out_len, out_cap;
+    int cur_x, cur_y;           /* Terminal cursor after the bytes so far, -1 if unknown */
+    int attr;                   /* Attribute in effect, -1 if unknown */
+    int cols;
+    unsigned char in[256];
+    int in_len, in_pos;
+} T;
+
+volatile sig_atomic_t term_resized;
+
+void term_on_winch(int sig) {
+    (void)sig;
+    term_resized = 1;
+}
+
+void term_size(int *cols, int *rows) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+    } else {
+        *cols = 80;
+        *rows = 24;
+    }
+}
+
+void term_put(const char *s, int n) {
+    if (T.out_len + n > T.out_cap) {
+        T.out_cap = (T.out_len + n) * 2;
+        T.out = realloc(T.out, T.out_cap);
+    }
+    memcpy(T.out + T.out_len, s, n);
+    T.out_len += n;
+}
+
+void term_putf(const char *fmt, ...) {
+    char tmp[64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    term_put(tmp, n);
+}
+
+void term_write_all(const char *s, int n) {
+    while (n > 0) {
+        ssize_t done = write(STDOUT_FILENO, s, n);
+        if (done < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        s += done;
+        n -= done;
+    }
+}
+
+void term_init(int *cols, int *rows) {
+    struct termios raw;
+    struct sigaction sa;
+    
+    T.cur_x = T.cur_y = T.attr = -1;
+    if (H.active) {
+        *cols = T.cols = H.cols;
+        *rows = H.rows;
+        return;
+    }
+    tcgetattr(STDIN_FILENO, &T.orig);
+    raw = T.orig;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~OPOST;
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = term_on_winch;
+    sigaction(SIGWINCH, &sa, NULL);
+    
+    /* Alternate screen, button-event mouse tracking with SGR coordinates */
+    const char *enter = "\x1b[?1049h\x1b[?1000h\x1b[?1002h\x1b[?1006h";
+    term_write_all(enter, strlen(enter));
+    term_size(cols, rows);
+    T.cols = *cols;
+}
+
+void term_free(void) {
+    const char *leave = "\x1b[?1006l\x1b[?1002l\x1b[?1000l\x1b[0m\x1b[?1049l";
+    if (!H.active) {
+        term_write_all(leave, strlen(leave));
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &T.orig);
+    }
+    free(T.out);
+    T.out = NULL;
+    T.out_len = T.out_cap = 0;
+}
+
+/* Next input byte, waiting at most timeout ms; -1 on timeout, -2 if interrupted */
+int term_byte(int timeout) {
+    if (T.in_pos == T.in_len) {
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0) return errno == EINTR ? -2 : -1;
+        if (ready == 0) return -1;
+        ssize_t n = read(STDIN_FILENO, T.in, sizeof(T.in));
+        if (n <= 0) return -1;
+        T.in_len = (int)n;
+        T.in_pos = 0;
+    }
+    return T.in[T.in_pos++];
+}
+
+/* Decode the rest of an escape sequence after ESC */
+void term_escape(Event *ev) {
+    int c = term_byte(25), params[3] = {0, 0, 0}, np = 0, sgr_mouse = 0;
+    
+    ev->vk = VK_ESCAPE;
+    ev->ch = 27;
+    if (c != '[' && c != 'O') {
+        if (c >= 0) T.in_pos--;
+        return;
+    }
+    ev->ch = 0;
+    
+    int final = term_byte(25);
+    if (final == '<') {
+        sgr_mouse = 1;
+        final = term_byte(25);
+    }
+    while (final >= 0 && ((final >= '0' && final <= '9') || final == ';')) {
+        if (final == ';') {
+            if (np < 2) np++;
+        } else {
+            params[np] = params[np] * 10 + (final - '0');
+        }
+        final = term_byte(25);
+    }
+    
+    if (sgr_mouse) {
+        /* ESC [ < button ; x ; y (M press/drag, m release) */
+        int b = params[0];
+        ev->type = EV_MOUSE;
+        ev->vk = 0;
+        ev->x = params[1] - 1;
+        ev->y = params[2] - 1;
+        if (b & 64) {
+            ev->wheel = (b & 1) ? -1 : 1;
+        } else if (final == 'M') {
+            if ((b & 3) == 0) ev->buttons = EV_BUTTON_LEFT;
+            if ((b & 3) == 2) ev->buttons = EV_BUTTON_RIGHT;
+            if (b & 32) ev->flags |= EV_MOVED;
+        }
+        return;
+    }
+    
+    int mod = np > 0 ? params[np] - 1 : 0;
+    ev->shift = (mod & 1) != 0;
+    ev->ctrl = (mod & 4) != 0;
+    switch (final) {
+        case 'A': ev->vk = VK_UP; break;
+        case 'B': ev->vk = VK_DOWN; break;
+        case 'C': ev->vk = VK_RIGHT; break;
+        case 'D': ev->vk = VK_LEFT; break;
+        case 'H': ev->vk = VK_HOME; break;
+        case 'F': ev->vk = VK_END; break;
+        case '~':
+            switch (params[0]) {
+                case 1: case 7: ev->vk = VK_HOME; break;
+                case 4: case 8: ev->vk = VK_END; break;
+                case 3: ev->vk = VK_DELETE; break;
+                case 5: ev->vk = VK_PRIOR; break;
+                case 6: ev->vk = VK_NEXT; break;
+                default: ev->vk = 0; break;
+            }
+            break;
+        default: ev->vk = 0; break;
+    }
+}
+
+int term_read(Event *ev, int timeout) {
+    if (H.active) return script_next(ev);
+    for (;;) {
+        memset(ev, 0, sizeof(Event));
+        if (term_resized) {
+            term_resized = 0;
+            ev->type = EV_RESIZE;
+            term_size(&ev->x, &ev->y);
+            T.cols = ev->x;
+            T.cur_x = T.cur_y = T.attr = -1;
+            return 1;
+        }
+        
+        int c = term_byte(timeout);
+        if (c == -2) continue;
+        if (c < 0) return 0;
+        
+        ev->type = EV_KEY;
+        ev->ch = c;
+        if (c == 27) {
+            term_escape(ev);
+            if (ev->type == EV_KEY && ev->vk == 0) continue;
+        } else if (c == '\r' || c == '\n') {
+            ev->vk = VK_RETURN;
+            ev->ch = '\r';
+        } else if (c == 127 || c == 8) {
+            ev->vk = VK_BACK;
+            ev->ch = 8;
+        } else if (c == '\t') {
+            ev->vk = VK_TAB;
+        } else if (c < 32) {
+            ev->vk = 'A' + c - 1;
+            ev->ctrl = 1;
+        } else if (c < 128 && isalnum(c)) {
+            /* Win32 gives punctuation VK_OEM codes; toupper('$') would read as VK_HOME */
+            ev->vk = toupper(c);
+        }
+        if (H.record) script_record(ev);
+        return 1;
+    }
+}
+
+/* Ctrl+C waiting in the input queue; it and everything before it are dropped */
+int term_interrupted(void) {
+    if (H.active) return 0;
+    if (T.in_pos == T.in_len) {
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) <= 0) return 0;
+        ssize_t n = read(STDIN_FILENO, T.in, sizeof(T.in));
+        if (n <= 0) return 0;
+        T.in_len = (int)n;
+        T.in_pos = 0;
+    }
+    unsigned char *hit = memchr(T.in + T.in_pos, 3, T.in_len - T.in_pos);
+    if (!hit) return 0;
+    T.in_pos = (int)(hit - T.in) + 1;
+    return 1;
+}
+
+/* Move the terminal cursor with the shortest sequence we know */
+void term_move(int x, int y) {
+    if (y == T.cur_y && x == T.cur_x) return;
+    if (y == T.cur_y && T.cur_x >= 0 && x > T.cur_x) {
+        term_putf("\x1b[%dC", x - T.cur_x);
+    } else if (y == T.cur_y + 1 && T.cur_y >= 0 && x == 0) {
+        term_put("\r\n", 2);
+    } else if (y == T.cur_y && x == 0) {
+        term_put("\r", 1);
+    } else {
+        term_putf("\x1b[%d;%dH", y + 1, x + 1);
+    }
+    T.cur_x = x;
+    T.cur_y = y;
+}
+
+void term_span(int x, int y, const Cell *cells, int n) {
+    /* Console colour bits are blue, green, red from the bottom; ANSI counts red first */
+    static const int ansi[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+    
+    term_move(x, y);
+    for (int i = 0; i < n; i++) {
+        int attr = cells[i].attr;
+        if (attr != T.attr) {
+            int fg = ansi[attr & 7] + ((attr & FOREGROUND_INTENSITY) ? 90 : 30);
+            int bg = ansi[(attr >> 4) & 7] + ((attr & BACKGROUND_INTENSITY) ? 100 : 40);
+            term_putf("\x1b[%d;%dm", fg, bg);
+            T.attr = attr;
+        }
+        unsigned char c = (unsigned char)cells[i].ch;
+        char out = c < 32 ? ' ' : (c > 126 ? '?' : (char)c);
+        term_put(&out, 1);
+    }
+    /* Past the last column the terminal holds the cursor in a pending wrap */
+    T.cur_x = x + n < T.cols ? x + n : -1;
+}
+
+int term_present(int x, int y) {
+    term_move(x, y);
+    int bytes = T.out_len;
+    if (!H.active) term_write_all(T.out, T.out_len);
+    T.out_len = 0;
+    return bytes;
+}
+
+#endif
+
+/*
+ * Key scripts use vim's notation: characters stand for themselves, and
+ * <Esc>, <CR>, <BS>, <Tab>, <Del>, <Up>, <Down>, <Left>, <Right>, <Home>,
+ * <End>, <PageUp>, <PageDown> and <lt> name the other keys, with C- and S-
+ * prefixes for Ctrl and Shift (<C-r>, <S-Down>). Line breaks are ignored.
+ */
+struct {
+    const char *name;
+    int vk, ch;
+} script_keys[] = {
+    {"Esc", VK_ESCAPE, 27}, {"CR", VK_RETURN, '\r'}, {"BS", VK_BACK, 8}, {"Tab", VK_TAB, '\t'},
+    {"Del", VK_DELETE, 0}, {"Up", VK_UP, 0}, {"Down", VK_DOWN, 0}, {"Left", VK_LEFT, 0},
+    {"Right", VK_RIGHT, 0}, {"Home", VK_HOME, 0}, {"End", VK_END, 0}, {"PageUp", VK_PRIOR, 0},
+    {"PageDown", VK_NEXT, 0}, {"lt", '<', '<'},
+};
+
+/* The <...> key at s, as the console would report it; returns the bytes used or 0 if it is not one */
+int script_key(const char *s, int len, Event *ev) {
+    const char *end = memchr(s, '>', len < 16 ? len : 16);
+    int ctrl = 0, shift = 0;
+    
+    if (!end) return 0;
+    const char *name = s + 1;
+    while (end - name > 2 && name[1] == '-') {
+        if (*name == 'C' || *name == 'c') ctrl = 1;
+        else if (*name == 'S' || *name == 's') shift = 1;
+        else return 0;
+        name += 2;
+    }
+    int n = (int)(end - name);
+    memset(ev, 0, sizeof(Event));
+    ev->type = EV_KEY;
+    ev->ctrl = ctrl;
+    ev->shift = shift;
+    if (ctrl && n == 1 && isalpha((unsigned char)*name)) {
+        ev->vk = toupper((unsigned char)*name);
+        ev->ch = ev->vk - 'A' + 1;
+        return (int)(end - s) + 1;
+    }
+    for (int i = 0; i < (int)(sizeof(script_keys) / sizeof(script_keys[0])); i++) {
+        if ((int)strlen(script_keys[i].name) == n && _strnicmp(name, script_keys[i].name, n) == 0) {
+            ev->vk = script_keys[i].vk;
+            ev->ch = script_keys[i].ch;
+            return (int)(end - s) + 1;
+        }
+    }
+    return 0;
+}
+
+/* Parse a script into H.events */
+int script_load(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    char *text;
+    long size;
+    
+    if (!fp) return 0;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    text = malloc(size + 1);
+    size = (long)fread(text, 1, size, fp);
+    fclose(fp);
+    
+    H.events = malloc(sizeof(Event) * (size + 1));
+    H.count = H.pos = 0;
+    for (long i = 0; i < size; ) {
+        Event *ev = &H.events[H.count];
+        unsigned char c = (unsigned char)text[i];
+        int used = c == '<' ? script_key(text + i, (int)(size - i), ev) : 0;
+        if (used) {
+            i += used;
+            H.count++;
+            continue;
+        }
+        i++;
+        if (c == '\n' || c == '\r') continue;
+        memset(ev, 0, sizeof(Event));
+        ev->type = EV_KEY;
+        ev->ch = c;
+        ev->vk = c < 128 && isalnum(c) ? toupper(c) : 0;
+        H.count++;
+    }
+    free(text);
+    return 1;
+}
+
+int script_next(Event *ev) {
+    if (H.pos >= H.count) {
+        memset(ev, 0, sizeof(Event));
+        return 0;
+    }
+    *ev = H.events[H.pos++];
+    return 1;
+}
+
+void script_record(const Event *ev) {
+    const char *mods = ev->ctrl ? (ev->shift ? "C-S-" : "C-") : (ev->shift ? "S-" : "");
+    
+    if (ev->ctrl && ev->vk >= 'A' && ev->vk <= 'Z') {
+        fprintf(H.record, "<%s%c>", mods, tolower(ev->vk));
+    } else if (ev->ch == '<') {
+        fputs("<lt>", H.record);
+    } else if (ev->ch >= 32 && ev->ch < 127) {
+        fputc(ev->ch, H.record);
+    } else {
+        for (int i = 0; i < (int)(sizeof(script_keys) / sizeof(script_keys[0])); i++) {
+            if (ev->vk == script_keys[i].vk) {
+                fprintf(H.record, "<%s%s>%s", mods, script_keys[i].name, ev->vk == VK_RETURN ? "\n" : "");
+                break;
+            }
+        }
+    }
+}
+
+/* Editor modes */
+typedef enum {
+    MODE_NORMAL,
+    MODE_INSERT,
+    MODE_COMMAND,
+    MODE_SEARCH,
+    MODE_SIDEBAR,
+    MODE_GREP,
+    MODE_FIND
+} EditorMode;
+
+/* Undo journal entry: one inserted or deleted span of text */
+typedef enum {
+    UNDO_INSERT,
+    UNDO_DELETE
+} UndoType;
+
+typedef struct {
+    UndoType type;
+    int y, x;               /* Start of the span */
+    char *text;             /* Span contents, '\n' joins lines */
+    int len;
+    Span *span;             /* Instead of text: whole lines inserted or deleted before line y */
+    int lines;              /* Whole lines, as span or, restored from the undo file, as packed text */
+    long long file_off;     /* Text in the mapped undo file, when text and span are NULL */
+    int joined;             /* Undone and redone together with the op before it */
+    int cx, cy;             /* Cursor before the edit */
+} UndoOp;
+
+/* Journal record kinds: the file it applies to, then one per edit */
+enum { SWAP_REC_BASE = 1, SWAP_REC_INSERT, SWAP_REC_DELETE, SWAP_REC_PUT, SWAP_REC_CUT };
+
+/* Journal of the edits since the last save, written out by a background thread */
+typedef struct {
+    char path[600];
+    char abs[1024];             /* The file's absolute name, kept in the header */
+    long long size, mtime;      /* The file the edits apply to, size -1 if it did not exist */
+    Thread thread;
+    int running;                /* Writer started, so the journal holds edits */
+    int stop;
+    int failed;                 /* Set by the writer when the journal cannot be written */
+    long long written, syncs;   /* Set by the writer, for :stats */
+    long long queued;           /* Bytes queued since the journal began, its size once written */
+    long long first;            /* Offset of its first edit */
+    
+    Mutex lock;                 /* Guards everything below */
+    char *buf;                  /* Records the writer has not taken yet */
+    size_t used, cap;
+} Swap;
+
+/* A background save: a frozen copy of the document and the thread writing it */
+typedef struct {
+    Span *span;                 /* Every line as the snapshot was taken */
+    Rope rope;                  /* Pieces over the span's runs, for the writer */
+    char path[512], tmp[600];
+    int crlf;
+    long long gen;              /* E.edit_gen when the snapshot was taken */
+    long long swap_start;       /* Journal offset of the edits made after it, 0 for all of them */
+    Thread thread;
+    int done;                   /* Set by the writer when it is finished */
+    long long bytes;            /* Written, -1 on failure */
+    int replaced;               /* The file now holds the snapshot */
+    double started, elapsed;
+} Autosave;
+
+/* Selection */
+typedef struct {
+    int active;
+    int start_x, start_y;
+    int end_x, end_y;
+} Selection;
+
+/* A buffer not on screen: the per-file fields of E, parked until it is switched to */
+typedef struct {
+    int loaded;                 /* 0 once dropped back to its file */
+    long long file_size, file_mtime;    /* The file when it was dropped; the history kept only fits that */
+    int packed;                 /* Edited lines packed since it was last on screen */
+    double used;                /* When it was last on screen */
+    Rope doc;
+    int cx, cy;
+    int row_offset, col_offset;
+    int wrap_sub;
+    WrapIndex wrap_index;
+    char filename[512];
+    int modified, crlf;
+    Syntax *syntax;
+    unsigned char *hl_state;
+    int hl_len, hl_cap, hl_valid;
+    Selection sel;
+    UndoOp *undo_ops;
+    int undo_count, undo_cap, undo_pos, undo_saved, undo_open;
+    size_t undo_bytes;
+    long long undo_base;
+    FileMap *undo_map;
+    int undo_logged;
+    long long undo_log_end;
+    Swap *swap;
+    int swap_found;
+    long long edit_gen;
+    double autosave_time;
+    int autosave_pos;
+} Buffer;
+
+/* Where search-as-you-type landed for one prefix of the pattern */
+typedef struct {
+    int found;              /* 1, 0 for no match, -1 if not known */
+    int y, x;
+    int wrapped;            /* Match is past the end of the file, back from the top */
+} SearchHit;
+
+/* Editor state */
+typedef struct {
+    Rope doc;
+    int cx, cy;
+    int row_offset;
+    int col_offset;
+    int wrap;                   /* :set wrap */
+    int wrap_sub;               /* Rows of line row_offset above the screen, when wrapping */
+    WrapIndex wrap_index;       /* Rows each line takes at the text width, once wrapping has been on */
+    int screen_rows;
+    int screen_cols;
+    char filename[512];
+    int modified;
+    int crlf;                   /* File uses CRLF line endings */
+    EditorMode mode;
+    EditorMode prev_mode;
+    char status_msg[256];
+    char command_buf[256];
+    int command_len;
+    char search_buf[256];
+    int search_len;
+    int search_icase;           /* :set ic */
+    int search_highlight;       /* Matches of the compiled pattern are highlighted; :noh clears */
+    int isearch_y, isearch_x;   /* Cursor when / was pressed */
+    SearchHit isearch[257];     /* First match for each prefix of E.search_buf, by length */
+    int search_regex;           /* :set regex */
+    Searcher searcher;          /* Compiled by the last literal search */
+    Regex *regex;               /* Compiled by the last regex search, NULL for literals */
+    char regex_pat[256];
+    int regex_icase;
+    unsigned char *line_match;  /* RX_LINE_ result per line for E.regex */
+    int line_match_len, line_match_cap;
+    Syntax *syntax;             /* Highlighter for the file type, NULL for plain text */
+    unsigned char *hl_state;    /* Start state << 4 | end state per line, or HL_UNKNOWN */
+    int hl_len, hl_cap;
+    int hl_valid;               /* Lines [0, hl_valid) have up-to-date states */
+    SyntaxMarks hl_marks;       /* Lexer states along long lines */
+    unsigned char *hl_class;    /* HL_ class per byte of the row being drawn */
+    int hl_class_cap;
+    int count_active;           /* Match count still running in editor_poll */
+    int count_y, count_x;       /* Where the count resumes */
+    int count_total, count_before;
+    int count_at_y, count_at_x; /* Match the cursor landed on */
+    Grep *grep;                 /* Results of the last :grep */
+    int grep_active;            /* Its workers have not been joined yet */
+    int grep_cursor, grep_scroll;
+    PathIndex *paths;           /* Files below paths->root for the fuzzy finder */
+    PathBuild *path_build;      /* Fresh index being built in the background */
+    double paths_time;          /* When paths was built, 0 if it came from the cache */
+    char find_buf[256];
+    int find_len;
+    int *find_cand[256];        /* Paths matching the first k bytes of the query, or NULL */
+    int find_cand_n[256];
+    FindHit find_hits[FIND_MAX_HITS];
+    int find_count;
+    int find_cursor, find_scroll;
+    
+    int sidebar_visible;
+    DirList *dir;               /* Listing of current_dir, possibly still loading */
+    int dir_version;            /* dir->version the sidebar last showed */
+    DirEntry sidebar_pick;      /* Entry under the cursor, found again after each merge */
+    int sidebar_scroll;
+    int sidebar_cursor;
+    char current_dir[512];
+    
+    Span *registers[REGISTERS];
+    int register_next;          /* Register named with " for the next command */
+    Selection sel;
+    
+    UndoOp *undo_ops;
+    int undo_count;
+    int undo_cap;
+    int undo_pos;           /* Ops before this index are applied */
+    int undo_saved;         /* undo_pos at the last save, -1 if unreachable */
+    int undo_open;          /* Top op may still absorb adjacent typing */
+    size_t undo_bytes;
+    long long undo_base;    /* Ops dropped from the front, so undo_ops[i] is op undo_base + i of the file's history */
+    int undofile;           /* :set undofile */
+    FileMap *undo_map;      /* Undo file the restored ops read their text from */
+    int undo_logged;        /* Ops [0, undo_logged) are in the undo file as they are now */
+    long long undo_log_end; /* Bytes of the undo file up to its last save mark, 0 if it is not in use */
+    Swap *swap;             /* Journal for the current file, NULL without a file name or with :set noswapfile */
+    int swap_found;         /* Edits in a journal left by a session that ended early, until :recover or :recover! */
+    int noswapfile;         /* :set noswapfile */
+    long long edit_gen;     /* Bumped by every edit, so a background save can tell whether it saved the latest text */
+    int autosave;           /* :set autosave */
+    Autosave *autosave_job; /* Background save in progress */
+    double autosave_time;   /* When the last background save started, or the first change since a save was made */
+    int autosave_pos;       /* undo_pos of the snapshot being saved, -1 once the history has left it */
+    Buffer *buffers;        /* Every open buffer; the fields of buffers[buffer_cur] are the ones in E */
+    int buffer_count, buffer_cur;
+    long long buffer_budget; /* :set buffermem, in bytes */
+    
+    /* Double buffer: the frame being built and the frame on screen */
+    Cell *buffer;
+    Cell *front;
+    int front_valid;
+    int buf_size;
+    int cursor_x, cursor_y;
+    int frame_cells;        /* Cells sent to the terminal by the last flush */
+    int frame_bytes;
+    int show_stats;
+    
+    /* Events read for the current frame; the ones not yet handled start at input_pos */
+    Event input[INPUT_BATCH];
+    int input_len, input_pos;
+    
+    int dirty;
+} Editor;
+
+Editor E;
+
+/* Colors - Dark theme */
+#define CLR_DEFAULT     (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE)
+#define CLR_YELLOW      (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_INTENSITY)
+#define CLR_CYAN        (FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY)
+#define CLR_GREEN       (FOREGROUND_GREEN | FOREGROUND_INTENSITY)
+#define CLR_MAGENTA     (FOREGROUND_RED | FOREGROUND_BLUE | FOREGROUND_INTENSITY)
+#define CLR_WHITE       (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY)
+#define CLR_GRAY        (FOREGROUND_INTENSITY)
+#define CLR_RED         (FOREGROUND_RED | FOREGROUND_INTENSITY)
+
+#define BG_BLACK        0
+#define BG_BLUE         (BACKGROUND_BLUE)
+#define BG_CYAN         (BACKGROUND_GREEN | BACKGROUND_BLUE)
+#define BG_GRAY         (BACKGROUND_INTENSITY)
+#define BG_SELECT       (BACKGROUND_BLUE | BACKGROUND_INTENSITY)
+#define BG_MATCH        (BACKGROUND_RED | BACKGROUND_GREEN)
+#define BG_MATCH_CURSOR (BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_INTENSITY)
+#define BG_MASK         (BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_BLUE | BACKGROUND_INTENSITY)
+
+/* Foreground for each HL_ class; a row keeps its background */
+Attr syntax_colors[HL_CLASSES] = {
+    CLR_DEFAULT, CLR_GRAY, CLR_GREEN, CLR_MAGENTA, CLR_YELLOW, CLR_CYAN, CLR_MAGENTA, CLR_CYAN, CLR_GREEN
+};
+
+/* Function prototypes */
+void editor_init(void);
+void editor_free(void);
+void editor_open(const char *filename);
+void editor_save(void);
+void editor_draw(void);
+void editor_process_key(Event *ev);
+void editor_set_status(const char *fmt, ...);
+void editor_count_step(void);
+void editor_isearch(void);
+void editor_lines_changed(int y, int removed, int added);
+void editor_syntax_select(void);
+void editor_grep_status(void);
+void editor_find_update(void);
+void editor_find_drop(int len);
+void sidebar_load_dir(const char *path);
+void sidebar_refresh(void);
+void pop_undo(void);
+void editor_redo(void);
+void swap_log(int kind, int y, int x, int n, const char *text, int len);
+
+/* Buffer drawing functions */
+void buf_set(int x, int y, char c, Attr attr) {
+    if (x < 0 || x >= E.screen_cols || y < 0 || y >= E.screen_rows + STATUS_HEIGHT) return;
+    int idx = y * E.screen_cols + x;
+    E.buffer[idx].ch = c;
+    E.buffer[idx].attr = attr;
+}
+
+/* First cell of a run of n cells at (x, y) after clipping to the screen, or NULL */
+Cell *buf_span(int *x, int y, int *n) {
+    if (y < 0 || y >= E.screen_rows + STATUS_HEIGHT) return NULL;
+    if (*x < 0) {
+        *n += *x;
+        *x = 0;
+    }
+    if (*n > E.screen_cols - *x) *n = E.screen_cols - *x;
+    return *n > 0 ? E.buffer + y * E.screen_cols + *x : NULL;
+}
+
+void buf_fill(int x, int y, int n, char c, Attr attr) {
+    Cell *cell = buf_span(&x, y, &n);
+    for (int i = 0; cell && i < n; i++) {
+        cell[i].ch = c;
+        cell[i].attr = attr;
+    }
+}
+
+void buf_copy(int x, int y, const char *s, int n, Attr attr) {
+    int from = x;
+    Cell *cell = buf_span(&x, y, &n);
+    s += x - from;
+    for (int i = 0; cell && i < n; i++) {
+        cell[i].ch = s[i];
+        cell[i].attr = attr;
+    }
+}
+
+/* Recolour n cells without touching their characters */
+void buf_attr(int x, int y, int n, Attr attr) {
+    Cell *cell = buf_span(&x, y, &n);
+    for (int i = 0; cell && i < n; i++) cell[i].attr = attr;
+}
+
+void buf_write(int x, int y, const char *str, Attr attr) {
+    buf_copy(x, y, str, strlen(str), attr);
+}
+
+void buf_fill_line(int y, char c, Attr attr) {
+    buf_fill(0, y, E.screen_cols, c, attr);
+}
+
+int cell_equal(const Cell *a, const Cell *b) {
+    return a->ch == b->ch && a->attr == b->attr;
+}
+
+/* Allocate both frames for the current screen size; the next flush repaints everything */
+void buf_resize(void) {
+    E.buf_size = E.screen_cols * (E.screen_rows + STATUS_HEIGHT);
+    E.buffer = realloc(E.buffer, sizeof(Cell) * E.buf_size);
+    E.front = realloc(E.front, sizeof(Cell) * E.buf_size);
+    E.front_valid = 0;
+}
+
+/* Send each row's changed span, compared against the frame already on screen */
+void buf_flush(void) {
+    int rows = E.screen_rows + STATUS_HEIGHT, cols = E.screen_cols;
+    
+    E.frame_cells = 0;
+    for (int y = 0; y < rows; y++) {
+        Cell *back = E.buffer + y * cols, *front = E.front + y * cols;
+        int x0 = 0, x1 = cols - 1;
+        if (E.front_valid) {
+            while (x0 < cols && cell_equal(&back[x0], &front[x0])) x0++;
+            if (x0 == cols) continue;
+            while (cell_equal(&back[x1], &front[x1])) x1--;
+        }
+        term_span(x0, y, back + x0, x1 - x0 + 1);
+        memcpy(front + x0, back + x0, sizeof(Cell) * (x1 - x0 + 1));
+        E.frame_cells += x1 - x0 + 1;
+    }
+    E.front_valid = 1;
+    E.frame_bytes = term_present(E.cursor_x, E.cursor_y);
+}
+
+void set_cursor(int x, int y) {
+    E.cursor_x = x;
+    E.cursor_y = y;
+}
+
+/* Selection helpers */
+void selection_bounds(int *sy, int *sx, int *ey, int *ex) {
+    *sy = E.sel.start_y; *sx = E.sel.start_x;
+    *ey = E.sel.end_y; *ex = E.sel.end_x;
+    
+    /* Normalize selection */
+    if (*sy > *ey || (*sy == *ey && *sx > *ex)) {
+        *sy = E.sel.end_y; *sx = E.sel.end_x;
+        *ey = E.sel.start_y; *ex = E.sel.start_x;
+    }
+}
+
+/* Selected columns [*from, *to) of row y; the end is inclusive, middle rows run to the edge */
+int selection_columns(int y, int *from, int *to) {
+    int sy, sx, ey, ex;
+    if (!E.sel.active) return 0;
+    selection_bounds(&sy, &sx, &ey, &ex);
+    if (y < sy || y > ey) return 0;
+    *from = (y == sy) ? sx : 0;
+    *to = (y == ey) ? ex + 1 : INT_MAX;
+    return *to > *from;
+}
+
+void clear_selection(void) {
+    E.sel.active = 0;
+}
+
+/* Text primitives: every edit is an insert or delete of a span at (y, x) */
+
+/* Position just past text inserted at (y, x) */
+void text_end(int y, int x, const char *s, int len, int *ey, int *ex) {
+    *ey = y;
+    *ex = x;
+    for (int i = 0; i < len; i++) {
+        if (s[i] == '\n') {
+            (*ey)++;
+            *ex = 0;
+        } else {
+            (*ex)++;
+        }
+    }
+}
+
+/* Every edit ends here: the buffer differs from the file, and the autosave delay starts with the first change */
+void doc_changed(void) {
+    if (!E.modified) E.autosave_time = now_ms();
+    E.modified = 1;
+    E.edit_gen++;
+    E.dirty = 1;
+}
+
+/* Insert len bytes at (y, x), splitting lines at '\n'; cursor ends after the text */
+void doc_insert_text(int y, int x, const char *s, int len) {
+    int first = y;
+    Arena *a = &E.doc.arena;
+    char **slot = rope_slot(&E.doc, y);
+    int line_len = line_length(*slot);
+    const char *nl = memchr(s, '\n', len);
+    
+    swap_log(SWAP_REC_INSERT, y, x, 0, s, len);
+    if (!nl) {
+        *slot = line_insert(a, *slot, x, s, len);
+        syntax_marks_edit(&E.hl_marks, y, x, 0, len);
+        E.cy = y;
+        E.cx = x + len;
+    } else {
+        /* Build the last line first: the slot is not valid once lines go in after it */
+        const char *end = s + len, *p = end;
+        while (p[-1] != '\n') p--;
+        int seg = end - p, tail_len = line_len - x;
+        line_join(*slot);
+        char *last = line_new(a, NULL, seg + tail_len);
+        memcpy(last, p, seg);
+        memcpy(last + seg, *slot + x, tail_len);
+        
+        *slot = line_resize(a, *slot, x + (nl - s));
+        memcpy(*slot + x, s, nl - s);
+        
+        for (const char *q = nl + 1; q < p; q = nl + 1) {
+            nl = memchr(q, '\n', p - q);
+            rope_insert(&E.doc, ++y, q, nl - q);
+        }
+        rope_insert_line(&E.doc, ++y, last);
+        E.cy = y;
+        E.cx = seg;
+    }
+    doc_changed();
+    editor_lines_changed(first, 0, E.cy - first);
+}
+
+/* Delete len bytes from (y, x), a line break counting as one; returns the removed text */
+char *doc_delete_text(int y, int x, int len, int *out_len) {
+    char *out = malloc(len + 1);
+    int got = 0, ey = y, ex = x, count = rope_count(&E.doc), line_len;
+    const char *line = rope_peek(&E.doc, y, x, x + len, &line_len);
+    
+    while (1) {
+        int take = line_len - ex;
+        if (take > len - got) take = len - got;
+        memcpy(out + got, line + ex, take);
+        got += take;
+        ex += take;
+        if (got == len || ey + 1 >= count) break;
+        out[got++] = '\n';
+        ey++;
+        ex = 0;
+        line = rope_get(&E.doc, ey, &line_len);
+    }
+    out[got] = '\0';
+    
+    char **slot = rope_slot(&E.doc, y);
+    if (ey == y) {
+        *slot = line_erase(&E.doc.arena, *slot, x, ex - x);
+        syntax_marks_edit(&E.hl_marks, y, x, ex - x, 0);
+    } else {
+        /* Line ey keeps its bytes until it is deleted below */
+        int tail_len = line_len - ex;
+        *slot = line_resize(&E.doc.arena, *slot, x + tail_len);
+        memcpy(*slot + x, line + ex, tail_len);
+        for (int i = y + 1; i <= ey; i++) rope_delete(&E.doc, y + 1);
+    }
+    
+    E.cy = y;
+    E.cx = x;
+    doc_changed();
+    editor_lines_changed(y, ey - y, 0);
+    swap_log(SWAP_REC_DELETE, y, x, got, NULL, 0);
+    *out_len = got;
+    return out;
+}
+
+/* Insert a span's lines before line y */
+void doc_insert_lines(int y, Span *s) {
+    if (E.swap && !E.swap_found) {
+        int len;
+        char *packed = span_text(s, &len);
+        swap_log(SWAP_REC_PUT, y, 0, s->lines, packed, len);
+        free(packed);
+    }
+    rope_insert_span(&E.doc, y, s);
+    E.cy = y;
+    E.cx = 0;
+    doc_changed();
+    editor_lines_changed(y, 0, s->lines);
+}
+
+/* Remove lines [y, y + n); at least one line must remain */
+void doc_delete_lines(int y, int n) {
+    swap_log(SWAP_REC_CUT, y, 0, n, NULL, 0);
+    rope_delete_range(&E.doc, y, n);
+    E.cy = y < rope_count(&E.doc) ? y : rope_count(&E.doc) - 1;
+    E.cx = 0;
+    doc_changed();
+    editor_lines_changed(y, n, 0);
+}
+
+/* Bytes an op counts against UNDO_MAX_BYTES; a span's lines are shared with the document, so only the op counts */
+size_t undo_op_bytes(UndoOp *op) {
+    return sizeof(UndoOp) + (op->lines ? 0 : op->len);
+}
+
+/* Undo journal */
+void undo_free_ops(int from, int to) {
+    for (int i = from; i < to; i++) {
+        E.undo_bytes -= undo_op_bytes(&E.undo_ops[i]);
+        free(E.undo_ops[i].text);
+        span_release(E.undo_ops[i].span);
+    }
+}
+
+void undo_clear(void) {
+    undo_free_ops(0, E.undo_count);
+    free(E.undo_ops);
+    filemap_close(E.undo_map);
+    E.undo_ops = NULL;
+    E.undo_map = NULL;
+    E.undo_count = E.undo_cap = E.undo_pos = E.undo_saved = 0;
+    E.undo_open = 0;
+    E.undo_base = E.undo_log_end = 0;
+    E.undo_logged = 0;
+}
+
+/* Drop the oldest steps once the history outgrows its byte budget, never half a joined step nor one still to be redone */
+void undo_trim(void) {
+    int drop = 0;
+    while (drop < E.undo_count - 1 && drop < E.undo_pos && (E.undo_bytes > UNDO_MAX_BYTES || E.undo_ops[drop].joined)) {
+        undo_free_ops(drop, drop + 1);
+        drop++;
+    }
+    if (drop > 0) {
+        memmove(E.undo_ops, E.undo_ops + drop, sizeof(UndoOp) * (E.undo_count - drop));
+        E.undo_count -= drop;
+        E.undo_pos -= drop;
+        E.undo_saved = (E.undo_saved >= drop) ? E.undo_saved - drop : -1;
+        E.autosave_pos = (E.autosave_pos >= drop) ? E.autosave_pos - drop : -1;
+        E.undo_base += drop;
+        E.undo_logged = E.undo_logged > drop ? E.undo_logged - drop : 0;
+    }
+}
+
+/* Room for one more op */
+UndoOp *undo_push(void) {
+    if (E.undo_count == E.undo_cap) {
+        E.undo_cap = E.undo_cap ? E.undo_cap * 2 : 64;
+        E.undo_ops = realloc(E.undo_ops, sizeof(UndoOp) * E.undo_cap);
+    }
+    UndoOp *op = &E.undo_ops[E.undo_count++];
+    memset(op, 0, sizeof(UndoOp));
+    return op;
+}
+
+/* Close the current group so the next edit starts a new undo step */
+void undo_seal(void) {
+    E.undo_open = 0;
+}
+
+/* Append an op (taking ownership of text), merging runs of typing into one step */
+void undo_record(UndoType type, int y, int x, char *text, int len, int cx, int cy) {
+    /* A new edit discards the redo branch */
+    if (E.undo_pos < E.undo_count) {
+        undo_free_ops(E.undo_pos, E.undo_count);
+        E.undo_count = E.undo_pos;
+        if (E.undo_saved > E.undo_pos) E.undo_saved = -1;
+        if (E.autosave_pos > E.undo_pos) E.autosave_pos = -1;
+        if (E.undo_logged > E.undo_pos) E.undo_logged = E.undo_pos;
+        E.undo_open = 0;
+    }
+    
+    /* Steps already in the undo file are not extended */
+    if (E.undo_open && E.mode == MODE_INSERT && E.undo_count > E.undo_logged && text && E.undo_ops[E.undo_count - 1].text) {
+        UndoOp *top = &E.undo_ops[E.undo_count - 1];
+        int ey, ex;
+        if (type == UNDO_INSERT && top->type == UNDO_INSERT) {
+            text_end(top->y, top->x, top->text, top->len, &ey, &ex);
+            if (ey == y && ex == x) {
+                top->text = realloc(top->text, top->len + len + 1);
+                memcpy(top->text + top->len, text, len + 1);
+                top->len += len;
+                E.undo_bytes += len;
+                free(text);
+                return;
+            }
+        } else if (type == UNDO_DELETE && top->type == UNDO_DELETE) {
+            text_end(y, x, text, len, &ey, &ex);
+            if (ey == top->y && ex == top->x) {
+                /* Backspace run: the new text goes in front */
+                text = realloc(text, len + top->len + 1);
+                memcpy(text + len, top->text, top->len + 1);
+                free(top->text);
+                top->text = text;
+                top->len += len;
+                top->y = y;
+                top->x = x;
+                E.undo_bytes += len;
+                return;
+            } else if (y == top->y && x == top->x) {
+                /* Forward delete run: the new text goes behind */
+                top->text = realloc(top->text, top->len + len + 1);
+                memcpy(top->text + top->len, text, len + 1);
+                top->len += len;
+                E.undo_bytes += len;
+                free(text);
+                return;
+            }
+        }
+    }
+    
+    UndoOp *op = undo_push();
+    op->type = type;
+    op->y = y;
+    op->x = x;
+    op->text = text;
+    op->len = len;
+    op->cx = cx;
+    op->cy = cy;
+    E.undo_bytes += sizeof(UndoOp) + len;
+    E.undo_pos = E.undo_count;
+    E.undo_open = 1;
+    undo_trim();
+}
+
+/* Record whole lines inserted or deleted before line y; the op keeps a reference on the span */
+void undo_record_lines(UndoType type, int y, Span *s, int cx, int cy) {
+    undo_record(type, y, 0, NULL, 0, cx, cy);
+    E.undo_ops[E.undo_count - 1].span = s;
+    E.undo_ops[E.undo_count - 1].lines = 1;
+    s->refs++;
+}
+
+void editor_insert_text(int y, int x, const char *s, int len) {
+    int cx = E.cx, cy = E.cy;
+    char *copy = malloc(len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    doc_insert_text(y, x, s, len);
+    undo_record(UNDO_INSERT, y, x, copy, len, cx, cy);
+}
+
+void editor_delete_text(int y, int x, int len) {
+    int cx = E.cx, cy = E.cy, got;
+    char *text = doc_delete_text(y, x, len, &got);
+    if (got == 0) {
+        free(text);
+        return;
+    }
+    undo_record(UNDO_DELETE, y, x, text, got, cx, cy);
+}
+
+/* Text of an op, wherever it is kept */
+const char *undo_text(UndoOp *op) {
+    return op->text ? op->text : E.undo_map->data + op->file_off;
+}
+
+/* Mark the buffer clean when history is back at the last save */
+void undo_update_modified(void) {
+    E.modified = (E.undo_pos != E.undo_saved);
+}
+
+/* Redo an op, or with revert set undo it */
+void undo_apply(UndoOp *op, int revert) {
+    int insert = (op->type == UNDO_INSERT) != revert;
+    if (op->lines && !op->span) op->span = span_from_text(undo_text(op), op->len);
+    if (op->span && insert) {
+        doc_insert_lines(op->y, op->span);
+    } else if (op->span) {
+        doc_delete_lines(op->y, op->span->lines);
+    } else if (insert) {
+        doc_insert_text(op->y, op->x, undo_text(op), op->len);
+    } else {
+        int len;
+        free(doc_delete_text(op->y, op->x, op->len, &len));
+    }
+}
+
+void pop_undo(void) {
+    if (E.undo_pos <= 0) {
+        editor_set_status("Nothing to undo");
+        return;
+    }
+    
+    undo_seal();
+    UndoOp *op;
+    do {
+        op = &E.undo_ops[--E.undo_pos];
+        undo_apply(op, 1);
+    } while (op->joined && E.undo_pos > 0);
+    E.cx = op->cx;
+    E.cy = op->cy;
+    
+    if (E.cy >= rope_count(&E.doc)) E.cy = rope_count(&E.doc) - 1;
+    if (E.cx > rope_len(&E.doc, E.cy)) E.cx = rope_len(&E.doc, E.cy);
+    
+    undo_update_modified();
+    E.dirty = 1;
+    editor_set_status("Undo");
+}
+
+void editor_redo(void) {
+    if (E.undo_pos >= E.undo_count) {
+        editor_set_status("Nothing to redo");
+        return;
+    }
+    
+    undo_seal();
+    do {
+        undo_apply(&E.undo_ops[E.undo_pos++], 0);
+    } while (E.undo_pos < E.undo_count && E.undo_ops[E.undo_pos].joined);
+    
+    undo_update_modified();
+    E.dirty = 1;
+    editor_set_status("Redo");
+}
+
+/*
+ * Undo file
+ *
+ * With :set undofile, each save appends the undo steps not yet written to a
+ * per-file log in the cache directory, then a save mark. Each record is a
+ * length and an FNV-1a checksum, then a body. A step record carries its
+ * position in the history, so steps written after an undo replace the
+ * branch they cut off. A torn append fails its checksum and is ignored.
+ * Opening a file maps its log and replays it up to the last intact save
+ * mark, if that mark matches the file's size and modification time.
+ * Restored steps keep their text in the mapping and are only read when
+ * undone. The log is rewritten in full only once it has grown well past
+ * the history it holds.
+ */
+#define UNDO_FILE_MAGIC "AZUNDO1 "
+
+enum { UNDO_REC_STEP = 1, UNDO_REC_SAVE = 2 };
+
+typedef struct {
+    unsigned char kind, type, lines, joined;
+    int y, x, cx, cy, len;
+    long long seq;              /* Position in the history, counted from the first op ever kept */
+} UndoStepRec;
+
+typedef struct {
+    unsigned char kind, pad[7];
+    long long count, pos;       /* History length and position at the save, counted like seq */
+    long long size, mtime;      /* Of the file as saved */
+} UndoSaveRec;
+
+unsigned undo_file_sum(unsigned h, const void *data, size_t n) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+/* Size and modification time of a file, to tell whether it changed since a save */
+int file_stamp(const char *path, long long *size, long long *mtime) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &fa)) return 0;
+    *size = ((long long)fa.nFileSizeHigh << 32) | fa.nFileSizeLow;
+    *mtime = ((long long)fa.ftLastWriteTime.dwHighDateTime << 32) | fa.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+    *size = st.st_size;
+    *mtime = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return 1;
+}
+
+/* A cache file kept for the current file, and the absolute name it is kept under */
+void editor_cache_file(const char *kind, char *out, int size, char *abs, int abs_size) {
+    path_absolute(E.filename, abs, abs_size);
+    cache_file(kind, abs, out, size);
+}
+
+/* The undo file of the current file */
+void undo_file_path(char *out, int size, char *abs, int abs_size) {
+    editor_cache_file("undo", out, size, abs, abs_size);
+}
+
+/* Copy the text restored ops still read from the undo file, and close it */
+void undo_file_unmap(void) {
+    if (!E.undo_map) return;
+    for (int i = 0; i < E.undo_count; i++) {
+        UndoOp *op = &E.undo_ops[i];
+        if (op->text || op->span) continue;
+        op->text = malloc(op->len + 1);
+        memcpy(op->text, E.undo_map->data + op->file_off, op->len);
+        op->text[op->len] = '\0';
+    }
+    filemap_close(E.undo_map);
+    E.undo_map = NULL;
+}
+
+int undo_file_record(FILE *fp, const void *body, int size, const char *text, int len) {
+    unsigned head[2] = {(unsigned)(size + len), undo_file_sum(undo_file_sum(2166136261u, body, size), text, len)};
+    if (fwrite(head, sizeof(head), 1, fp) != 1 || fwrite(body, size, 1, fp) != 1) return -1;
+    if (len > 0 && fwrite(text, len, 1, fp) != 1) return -1;
+    return (int)sizeof(head) + size + len;
+}
+
+/* Write op i of the history as a step record; returns the bytes written or -1 */
+int undo_file_step(FILE *fp, int i) {
+    UndoOp *op = &E.undo_ops[i];
+    UndoStepRec rec;
+    char *packed = NULL;
+    int len = op->len;
+    
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = UNDO_REC_STEP;
+    rec.type = op->type;
+    rec.lines = op->lines;
+    rec.joined = op->joined;
+    rec.y = op->y;
+    rec.x = op->x;
+    rec.cx = op->cx;
+    rec.cy = op->cy;
+    rec.seq = E.undo_base + i;
+    if (op->span) packed = span_text(op->span, &len);
+    rec.len = len;
+    int n = undo_file_record(fp, &rec, sizeof(rec), packed ? packed : undo_text(op), len);
+    free(packed);
+    return n;
+}
+
+/* After a save: bring the undo file up to date, appending to it when it can; returns 0 on failure */
+int undo_file_save(void) {
+    char path[600], tmp[620], abs[1024];
+    long long size, mtime, disk, disk_mtime;
+    UndoSaveRec mark;
+    
+    if (!E.undofile && !E.undo_log_end) return 1;
+    undo_file_path(path, sizeof(path), abs, sizeof(abs));
+    if (!file_stamp(E.filename, &size, &mtime)) return 0;
+    
+    /* Append unless the file is not ours any more or has grown well past the history it holds */
+    int append = E.undo_log_end > 0 && file_stamp(path, &disk, &disk_mtime) && disk == E.undo_log_end &&
+                 E.undo_log_end < 2 * (long long)E.undo_bytes + (1 << 20);
+#ifdef _WIN32
+    /* An open mapping keeps the file from being written or replaced */
+    undo_file_unmap();
+#endif
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(append ? path : tmp, append ? "ab" : "wb");
+    if (!fp) {
+        E.undo_log_end = 0;
+        return 0;
+    }
+    long long written = append ? E.undo_log_end : fprintf(fp, "%s%s\n", UNDO_FILE_MAGIC, abs);
+    int ok = written > 0;
+    for (int i = append ? E.undo_logged : 0; ok && i < E.undo_count; i++) {
+        int n = undo_file_step(fp, i);
+        ok = n >= 0;
+        written += n;
+    }
+    memset(&mark, 0, sizeof(mark));
+    mark.kind = UNDO_REC_SAVE;
+    mark.count = E.undo_base + E.undo_count;
+    mark.pos = E.undo_base + E.undo_pos;
+    mark.size = size;
+    mark.mtime = mtime;
+    int n = ok ? undo_file_record(fp, &mark, sizeof(mark), NULL, 0) : -1;
+    ok = n >= 0 && !ferror(fp);
+    written += n;
+    ok = fclose(fp) == 0 && ok;
+    if (!append) {
+#ifdef _WIN32
+        ok = ok && MoveFileEx(tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+        ok = ok && rename(tmp, path) == 0;
+#endif
+        if (!ok) remove(tmp);
+    }
+    E.undo_logged = ok ? E.undo_count : 0;
+    E.undo_log_end = ok ? written : 0;
+    return ok;
+}
+
+/* Restore the history kept for the file just opened, if its undo file matches the file */
+void undo_file_load(void) {
+    char path[600], abs[1024];
+    long long size, mtime;
+    unsigned head[2];
+    UndoSaveRec mark;
+    UndoStepRec rec;
+    
+    undo_file_path(path, sizeof(path), abs, sizeof(abs));
+    E.undo_map = calloc(1, sizeof(FileMap));
+    if (!filemap_map(E.undo_map, path) || !file_stamp(E.filename, &size, &mtime)) {
+        undo_clear();
+        return;
+    }
+    const char *data = E.undo_map->data, *end = data + E.undo_map->size;
+    const char *nl = E.undo_map->size ? memchr(data, '\n', E.undo_map->size) : NULL;
+    size_t magic = strlen(UNDO_FILE_MAGIC);
+    if (!nl || (size_t)(nl - data) != magic + strlen(abs) || memcmp(data, UNDO_FILE_MAGIC, magic) != 0 ||
+        memcmp(data + magic, abs, strlen(abs)) != 0) {
+        undo_clear();
+        return;
+    }
+    
+    /* First the last intact save mark, then the steps before it */
+    const char *p, *last = NULL;
+    for (p = nl + 1; end - p >= (ptrdiff_t)sizeof(head); p += sizeof(head) + head[0]) {
+        memcpy(head, p, sizeof(head));
+        if (head[0] == 0 || head[0] > (size_t)(end - p) - sizeof(head) ||
+            undo_file_sum(2166136261u, p + sizeof(head), head[0]) != head[1]) break;
+        if (p[sizeof(head)] == UNDO_REC_SAVE && head[0] == sizeof(mark)) {
+            memcpy(&mark, p + sizeof(head), sizeof(mark));
+            last = p + sizeof(head) + head[0];
+        }
+    }
+    int ok = last && mark.size == size && mark.mtime == mtime;
+    for (p = nl + 1; ok && p < last; p += sizeof(head) + head[0]) {
+        memcpy(head, p, sizeof(head));
+        if (p[sizeof(head)] != UNDO_REC_STEP) continue;
+        memcpy(&rec, p + sizeof(head), sizeof(rec));
+        if (E.undo_count == 0) E.undo_base = rec.seq;
+        long long i = rec.seq - E.undo_base;
+        if (head[0] < sizeof(rec) || rec.len != (int)(head[0] - sizeof(rec)) || i < 0 || i > E.undo_count) {
+            ok = 0;
+            break;
+        }
+        undo_free_ops((int)i, E.undo_count);
+        E.undo_count = (int)i;
+        UndoOp *op = undo_push();
+        op->type = rec.type;
+        op->lines = rec.lines;
+        op->joined = rec.joined;
+        op->y = rec.y;
+        op->x = rec.x;
+        op->cx = rec.cx;
+        op->cy = rec.cy;
+        op->len = rec.len;
+        op->file_off = p + sizeof(head) + sizeof(rec) - data;
+        E.undo_bytes += undo_op_bytes(op);
+    }
+    if (!ok || mark.count != E.undo_base + E.undo_count || mark.pos < E.undo_base || mark.pos > mark.count) {
+        undo_clear();
+        return;
+    }
+    E.undo_pos = E.undo_saved = (int)(mark.pos - E.undo_base);
+    E.undo_logged = E.undo_count;
+    E.undo_log_end = last - data;
+    undo_trim();
+}
+
+/* :set noundofile: stop keeping history for this file and delete what was kept */
+void undo_file_drop(void) {
+    char path[600], abs[1024];
+    if (E.filename[0]) {
+        undo_file_path(path, sizeof(path), abs, sizeof(abs));
+        undo_file_unmap();
+        remove(path);
+    }
+    E.undo_logged = 0;
+    E.undo_log_end = 0;
+}
+
+/*
+ * Swap journal
+ *
+ * Every edit since the last save goes into a journal in the cache
+ * directory, so a crash or a closed terminal costs at most the last
+ * SWAP_DELAY ms of work. The edit functions only copy a small record into
+ * a memory buffer. A writer thread wakes every SWAP_DELAY ms, takes all
+ * that has collected, then writes and syncs it in one go, so typing never
+ * waits on the disk. The journal starts with the size and modification
+ * time the file had when it was opened or saved, and its records are
+ * framed like the undo file's, so a torn write at the end is ignored.
+ * Saving or quitting deletes it. Opening a file whose journal still
+ * matches it offers :recover, which replays the edits as one undo step.
+ */
+#define SWAP_FILE_MAGIC "AZSWAP1 "
+
+typedef struct {
+    unsigned char kind, pad[3];
+    int y, x;
+    int n;                      /* Bytes deleted or lines put or cut; inserted text follows the record */
+} SwapRec;
+
+typedef struct {
+    unsigned char kind, pad[7];
+    long long size, mtime;      /* Of the file the edits apply to, size -1 if it did not exist */
+    long long start;            /* Journal offset of the first of those edits */
+} SwapBaseRec;
+
+void *swap_writer(void *arg) {
+    Swap *w = arg;
+    char *out = NULL;
+    size_t cap = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFile(w->path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    int failed = file == INVALID_HANDLE_VALUE;
+#else
+    int fd = open(w->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int failed = fd < 0;
+#endif
+    
+    for (int stop = 0; !stop;) {
+        for (int t = 0; t < SWAP_DELAY && !(stop = __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)); t += SWAP_TICK) {
+            thread_sleep(SWAP_TICK);
+        }
+        
+        /* Take all that was queued, leaving the emptied buffer for the next batch */
+        mutex_lock(&w->lock);
+        char *full = w->buf;
+        size_t n = w->used, full_cap = w->cap;
+        w->buf = out;
+        w->cap = cap;
+        w->used = 0;
+        mutex_unlock(&w->lock);
+        out = full;
+        cap = full_cap;
+        if (n == 0 || failed) continue;
+        
+#ifdef _WIN32
+        DWORD done;
+        failed = !WriteFile(file, out, (DWORD)n, &done, NULL) || done != n || !FlushFileBuffers(file);
+#else
+        for (size_t done = 0; done < n && !failed;) {
+            ssize_t k = write(fd, out + done, n - done);
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) failed = 1;
+            else done += k;
+        }
+        failed = failed || fsync(fd) != 0;
+#endif
+        __atomic_add_fetch(&w->written, (long long)n, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->syncs, 1, __ATOMIC_RELAXED);
+        if (failed) __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+    }
+#ifdef _WIN32
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (fd >= 0) close(fd);
+#endif
+    if (failed) __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+    free(out);
+    return NULL;
+}
+
+/* Queue a record for the writer, framed as in the undo file */
+void swap_queue(Swap *w, const void *body, int size, const char *text, int len) {
+    unsigned head[2] = {(unsigned)(size + len), undo_file_sum(undo_file_sum(2166136261u, body, size), text, len)};
+    
+    mutex_lock(&w->lock);
+    size_t need = w->used + sizeof(head) + size + len;
+    if (need > w->cap) {
+        w->cap = need * 2 > 4096 ? need * 2 : 4096;
+        w->buf = realloc(w->buf, w->cap);
+    }
+    memcpy(w->buf + w->used, head, sizeof(head));
+    memcpy(w->buf + w->used + sizeof(head), body, size);
+    if (len > 0) memcpy(w->buf + w->used + sizeof(head) + size, text, len);
+    w->used = need;
+    mutex_unlock(&w->lock);
+    w->queued += sizeof(head) + size + len;
+}
+
+/* Note that edits from journal offset start on apply to the file as it is on disk now */
+void swap_rebase(Swap *w, long long start) {
+    SwapBaseRec base;
+    memset(&base, 0, sizeof(base));
+    base.kind = SWAP_REC_BASE;
+    if (!file_stamp(E.filename, &base.size, &base.mtime)) base.size = base.mtime = -1;
+    base.start = start;
+    swap_queue(w, &base, sizeof(base), NULL, 0);
+}
+
+/* Journal the current file's edits against the file as it is on disk now */
+void swap_open(void) {
+    if (E.swap || E.noswapfile || !E.filename[0]) return;
+    Swap *w = calloc(1, sizeof(Swap));
+    editor_cache_file("swap", w->path, sizeof(w->path), w->abs, sizeof(w->abs));
+    if (!file_stamp(E.filename, &w->size, &w->mtime)) w->size = w->mtime = -1;
+    mutex_init(&w->lock);
+    E.swap = w;
+}
+
+/* Stop journaling, deleting the journal with discard set or keeping it for :recover */
+void swap_close(int discard) {
+    Swap *w = E.swap;
+    if (!w) return;
+    if (w->running) {
+        __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+        thread_join(w->thread);
+        if (discard) remove(w->path);
+    }
+    mutex_free(&w->lock);
+    free(w->buf);
+    free(w);
+    E.swap = NULL;
+}
+
+/* Queue an edit; the first since the file was opened or saved starts a new journal */
+void swap_log(int kind, int y, int x, int n, const char *text, int len) {
+    Swap *w = E.swap;
+    SwapRec rec;
+    
+    if (!w || E.swap_found || (w->failed && !w->running)) return;
+    if (!w->running) {
+        SwapBaseRec base;
+        memset(&base, 0, sizeof(base));
+        base.kind = SWAP_REC_BASE;
+        base.size = w->size;
+        base.mtime = w->mtime;
+        w->cap = 4096;
+        w->buf = malloc(w->cap);
+        w->used = w->queued = snprintf(w->buf, w->cap, "%s%s\n", SWAP_FILE_MAGIC, w->abs);
+        base.start = w->first = w->queued + 2 * sizeof(unsigned) + sizeof(base);
+        swap_queue(w, &base, sizeof(base), NULL, 0);
+        if (!thread_start(&w->thread, swap_writer, w)) {
+            w->failed = 1;
+            return;
+        }
+        w->running = 1;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = kind;
+    rec.y = y;
+    rec.x = x;
+    rec.n = n;
+    swap_queue(w, &rec, sizeof(rec), text, len);
+}
+
+/* Read the journal left for the current file; returns it, with the edits to replay in [start, size), or NULL */
+char *swap_load(size_t *start, size_t *size, int *edits, int *stale) {
+    char path[600], abs[1024];
+    long long file_size, file_mtime, from = -1;
+    unsigned head[2];
+    SwapBaseRec base;
+    int bases = 0;
+    
+    *edits = *stale = 0;
+    editor_cache_file("swap", path, sizeof(path), abs, sizeof(abs));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long n = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *data = n > 0 ? malloc(n) : NULL;
+    int ok = data && fread(data, 1, n, fp) == (size_t)n;
+    fclose(fp);
+    
+    /* Header, then records up to the first torn or damaged one; the last base matching the file says where its edits start */
+    if (!file_stamp(E.filename, &file_size, &file_mtime)) file_size = file_mtime = -1;
+    size_t magic = strlen(SWAP_FILE_MAGIC), head_len = magic + strlen(abs) + 1;
+    ok = ok && (size_t)n >= head_len + sizeof(head) + sizeof(base) && memcmp(data, SWAP_FILE_MAGIC, magic) == 0 &&
+         memcmp(data + magic, abs, strlen(abs)) == 0 && data[head_len - 1] == '\n';
+    const char *p = data + head_len, *end = data + n;
+    for (; ok && end - p >= (ptrdiff_t)sizeof(head); p += sizeof(head) + head[0]) {
+        memcpy(head, p, sizeof(head));
+        if (head[0] > (size_t)(end - p) - sizeof(head) || undo_file_sum(2166136261u, p + sizeof(head), head[0]) != head[1]) break;
+        if (p[sizeof(head)] == SWAP_REC_BASE && head[0] == sizeof(base)) {
+            memcpy(&base, p + sizeof(head), sizeof(base));
+            bases++;
+            if (base.size == file_size && base.mtime == file_mtime) from = base.start;
+        } else if (head[0] < sizeof(SwapRec) || bases == 0) {
+            break;
+        }
+    }
+    *size = p - data;
+    
+    /* Count the edits from there on; the start must fall on a record */
+    int aligned = from == (long long)*size;
+    for (const char *q = data + head_len; ok && from >= 0 && q < p; q += sizeof(head) + head[0]) {
+        memcpy(head, q, sizeof(head));
+        if (q - data == from) aligned = 1;
+        if (q - data >= from && q[sizeof(head)] != SWAP_REC_BASE) (*edits)++;
+    }
+    *stale = !aligned;
+    if (!ok || bases == 0 || (!*stale && *edits == 0)) {
+        free(data);
+        *edits = *stale = 0;
+        return NULL;
+    }
+    *start = from;
+    return data;
+}
+
+/* After opening a file: look for edits a session that ended early left behind */
+void swap_check(void) {
+    size_t start, size;
+    int stale;
+    
+    E.swap_found = 0;
+    if (E.noswapfile || !E.filename[0]) return;
+    free(swap_load(&start, &size, &E.swap_found, &stale));
+    if (stale) {
+        /* Made to an older version of the file: the next edit's journal replaces it */
+        E.swap_found = 0;
+    }
+    if (E.swap_found) {
+        editor_set_status("Found %d unsaved edit%s from a session that ended early: :recover replays, :recover! deletes",
+                          E.swap_found, E.swap_found == 1 ? "" : "s");
+    }
+}
+
+/* :recover: replay the journal on the file as opened, as one undo step */
+void swap_recover(void) {
+    size_t start, size;
+    int edits, stale, done = 0, bad = 0;
+    unsigned head[2];
+    SwapRec rec;
+    
+    if (E.modified) {
+        editor_set_status("Save or undo your changes first");
+        return;
+    }
+    char *data = swap_load(&start, &size, &edits, &stale);
+    if (!data || stale) {
+        editor_set_status(data ? "The unsaved edits were made to another version of %s" : "No unsaved edits for %s", E.filename);
+        free(data);
+        return;
+    }
+    
+    /* The replayed edits go into a fresh journal; its base is the file as it is now */
+    swap_close(0);
+    E.swap_found = 0;
+    swap_open();
+    undo_seal();
+    long long first = E.undo_base + E.undo_pos;
+    for (const char *p = data + start; p < data + size && !bad; p += sizeof(head) + head[0]) {
+        memcpy(head, p, sizeof(head));
+        if (p[sizeof(head)] == SWAP_REC_BASE) continue;
+        memcpy(&rec, p + sizeof(head), sizeof(rec));
+        const char *text = p + sizeof(head) + sizeof(rec);
+        int len = (int)(head[0] - sizeof(rec)), count = rope_count(&E.doc), cx = E.cx, cy = E.cy;
+        bad = rec.y < 0 || rec.y > count || (rec.y == count && rec.kind != SWAP_REC_PUT) ||
+              (rec.kind <= SWAP_REC_DELETE && (rec.x < 0 || rec.x > rope_len(&E.doc, rec.y))) ||
+              (rec.kind == SWAP_REC_CUT && (rec.n < 1 || rec.n > count - rec.y || rec.n >= count));
+        if (bad) break;
+        if (rec.kind == SWAP_REC_INSERT) {
+            editor_insert_text(rec.y, rec.x, text, len);
+        } else if (rec.kind == SWAP_REC_DELETE) {
+            editor_delete_text(rec.y, rec.x, rec.n);
+        } else if (rec.kind == SWAP_REC_PUT) {
+            Span *s = span_from_text(text, len);
+            doc_insert_lines(rec.y, s);
+            undo_record_lines(UNDO_INSERT, rec.y, s, cx, cy);
+            span_release(s);
+        } else if (rec.kind == SWAP_REC_CUT) {
+            Span *s = span_from_rope(&E.doc, rec.y, rec.n);
+            doc_delete_lines(rec.y, rec.n);
+            undo_record_lines(UNDO_DELETE, rec.y, s, cx, cy);
+            span_release(s);
+        }
+        done++;
+    }
+    free(data);
+    
+    for (long long i = first - E.undo_base + 1; i < E.undo_count; i++) {
+        if (i > 0) E.undo_ops[i].joined = 1;
+    }
+    undo_seal();
+    E.dirty = 1;
+    if (bad) editor_set_status("Recovered %d of %d edits; the rest do not fit the file", done, edits);
+    else editor_set_status("Recovered %d edit%s; u undoes them", done, done == 1 ? "" : "s");
+}
+
+/* :recover!: delete the journal without replaying it */
+void swap_discard(void) {
+    char path[600], abs[1024];
+    if (!E.swap_found) {
+        editor_set_status("No unsaved edits from an earlier session");
+        return;
+    }
+    editor_cache_file("swap", path, sizeof(path), abs, sizeof(abs));
+    remove(path);
+    E.swap_found = 0;
+    editor_set_status("Deleted the unsaved edits from the earlier session");
+}
+
+/*
+ * Autosave
+ *
+ * With :set autosave, a buffer with unsaved changes is saved every
+ * AUTOSAVE_DELAY ms without holding up the editor. The snapshot is a span
+ * over every line: lines still in the file are shared with its mapping and
+ * only edited lines are copied, so taking one costs about as much as the
+ * edits made, not the size of the file. A worker writes the snapshot to a
+ * temporary file and moves it into place while editing goes on. When it
+ * is done the buffer is marked clean only if nothing was edited since the
+ * snapshot; otherwise the journal is told where the later edits start.
+ * Windows cannot replace a file the editor maps, so there the editor
+ * itself moves the new file into place, and only if it is still current.
+ */
+void *autosave_worker(void *arg) {
+    Autosave *a = arg;
+    a->bytes = rope_write(&a->rope, a->tmp, a->path, a->crlf);
+#ifndef _WIN32
+    a->replaced = a->bytes >= 0 && rope_replace(&a->rope, a->tmp, a->path);
+#endif
+    a->elapsed = now_ms() - a->started;
+    __atomic_store_n(&a->done, 1, __ATOMIC_RELEASE);
+    return NULL;
 }
 
-void buf_set(int x, int y, char c, WORD attr) {
-    if (x < 0 || x >= E.screen_cols || y < 0 || y >= E.screen_rows + STATUS_HEIGHT) return;
-    int idx = y * E.screen_cols + x;
-    E.buffer[idx].Char.AsciiChar = c;
-    E.buffer[idx].Attributes = attr;
+void autosave_free(Autosave *a) {
+    piece_free(a->rope.root, NULL);
+    span_release(a->span);
+    free(a);
 }
 
-void buf_write(int x, int y, const char *str, WORD attr) {
-    int len = strlen(str);
-    for (int i = 0; i < len && x + i < E.screen_cols; i++) {
-        buf_set(x + i, y, str[i], attr);
+/* Take a snapshot of the document and start writing it out */
+void autosave_start(void) {
+    if (E.autosave_job || !E.filename[0] || filemap_loading(E.doc.map)) return;
+    Autosave *a = calloc(1, sizeof(Autosave));
+    a->span = span_from_rope(&E.doc, 0, rope_count(&E.doc));
+    rope_insert_span(&a->rope, 0, a->span);
+    /* Lines still in the file keep their own line endings, as in a save from the editor */
+    a->rope.map = E.doc.map;
+    snprintf(a->path, sizeof(a->path), "%s", E.filename);
+    save_temp_name(a->tmp, sizeof(a->tmp), a->path);
+    a->crlf = E.crlf;
+    a->gen = E.edit_gen;
+    a->swap_start = E.swap && E.swap->running ? E.swap->queued : 0;
+    a->started = E.autosave_time = now_ms();
+    E.autosave_pos = E.undo_pos;
+    if (!thread_start(&a->thread, autosave_worker, a)) {
+        autosave_free(a);
+        editor_set_status("Autosave failed: cannot start a thread");
+        return;
     }
+    E.autosave_job = a;
+    E.dirty = 1;
 }
 
-void buf_fill_line(int y, char c, WORD attr) {
-    for (int x = 0; x < E.screen_cols; x++) {
-        buf_set(x, y, c, attr);
+/* Pick up a background save; the buffer is clean only if nothing was edited since its snapshot */
+void autosave_finish(void) {
+    Autosave *a = E.autosave_job;
+    thread_join(a->thread);
+    E.autosave_job = NULL;
+    E.dirty = 1;
+    
+    int current = a->gen == E.edit_gen;
+#ifdef _WIN32
+    if (a->bytes >= 0 && current) a->replaced = rope_replace(&E.doc, a->tmp, a->path);
+    else if (a->bytes >= 0) DeleteFile(a->tmp);
+#endif
+    if (!a->replaced) {
+        /* On Windows a snapshot overtaken by edits is dropped, and the next one tries again */
+        if (a->bytes < 0 || current) editor_set_status("Autosave failed: cannot write %s", a->path);
+    } else if (current) {
+        E.modified = 0;
+        E.undo_saved = E.undo_pos;
+        swap_close(1);
+        swap_open();
+        undo_file_save();
+    } else {
+        E.undo_saved = E.autosave_pos;
+        if (E.swap && E.swap->running) swap_rebase(E.swap, a->swap_start ? a->swap_start : E.swap->first);
     }
+    autosave_free(a);
 }
 
-void buf_flush(void) {
-    COORD bufSize = { (SHORT)E.screen_cols, (SHORT)(E.screen_rows + STATUS_HEIGHT) };
-    COORD bufCoord = { 0, 0 };
-    SMALL_RECT region = { 0, 0, (SHORT)(E.screen_cols - 1), (SHORT)(E.screen_rows + STATUS_HEIGHT - 1) };
-    WriteConsoleOutput(E.hStdout, E.buffer, bufSize, bufCoord, &region);
+/* How long the input loop may wait before the next background save is due, -1 for no limit */
+int autosave_wait(void) {
+    if (!E.autosave || !E.modified || E.autosave_job) return -1;
+    double due = E.autosave_time + AUTOSAVE_DELAY - now_ms();
+    return due > 0 ? (int)due + 1 : 0;
 }
 
-void set_cursor(int x, int y) {
-    COORD pos = { (SHORT)x, (SHORT)y };
-    SetConsoleCursorPosition(E.hStdout, pos);
+/* From editor_poll: start a background save when one is due, and pick up one that finished */
+void autosave_poll(void) {
+    if (E.autosave_job && __atomic_load_n(&E.autosave_job->done, __ATOMIC_ACQUIRE)) autosave_finish();
+    if (autosave_wait() == 0) autosave_start();
 }
 
-/* Selection helpers */
-int is_selected(int x, int y) {
-    if (!E.sel.active) return 0;
-    
-    int sy = E.sel.start_y, sx = E.sel.start_x;
-    int ey = E.sel.end_y, ex = E.sel.end_x;
-    
-    /* Normalize selection */
-    if (sy > ey || (sy == ey && sx > ex)) {
-        int ty = sy, tx = sx;
-        sy = ey; sx = ex;
-        ey = ty; ex = tx;
+/*
+ * Buffers
+ *
+ * Every file opened gets a buffer of its own, with its cursor, scroll
+ * position, undo history and journal. The buffer on screen lives in E,
+ * where the editing code finds it; the others are parked in Buffer records
+ * holding the same per-file fields, and switching exchanges the two.
+ * Buffers are kept within E.buffer_budget bytes of heap: once they outgrow
+ * it, the inactive ones used least recently give memory back. An
+ * unmodified buffer is dropped back to its file, keeping only its name and
+ * position, and is opened again when it is switched to. A modified one has
+ * its edited lines packed into one block, which also lets the slabs of its
+ * arena go. Mapped file bytes are not counted: the system can always read
+ * them back from the file.
+ */
+void buffer_swap_bytes(void *a, void *b, size_t size) {
+    unsigned char *p = a, *q = b;
+    for (size_t i = 0; i < size; i++) {
+        unsigned char t = p[i];
+        p[i] = q[i];
+        q[i] = t;
     }
-    
-    if (y < sy || y > ey) return 0;
-    if (y == sy && y == ey) return x >= sx && x <= ex;
-    if (y == sy) return x >= sx;
-    if (y == ey) return x <= ex;
-    return 1;
 }
 
-void clear_selection(void) {
-    E.sel.active = 0;
+#define BUFFER_SWAP(field) buffer_swap_bytes(&E.field, &b->field, sizeof(E.field))
+
+/* Exchange the undo history of E with that of a parked buffer */
+void buffer_exchange_undo(Buffer *b) {
+    BUFFER_SWAP(undo_ops);
+    BUFFER_SWAP(undo_count);
+    BUFFER_SWAP(undo_cap);
+    BUFFER_SWAP(undo_pos);
+    BUFFER_SWAP(undo_saved);
+    BUFFER_SWAP(undo_open);
+    BUFFER_SWAP(undo_bytes);
+    BUFFER_SWAP(undo_base);
+    BUFFER_SWAP(undo_map);
+    BUFFER_SWAP(undo_logged);
+    BUFFER_SWAP(undo_log_end);
 }
 
-/* Undo system */
-void push_undo(void) {
-    /* Free oldest if full */
-    if (E.undo_count >= MAX_UNDO) {
-        UndoState *old = &E.undo_stack[0];
-        if (old->lines) {
-            for (int i = 0; i < old->num_lines; i++) free(old->lines[i]);
-            free(old->lines);
-        }
-        memmove(&E.undo_stack[0], &E.undo_stack[1], sizeof(UndoState) * (MAX_UNDO - 1));
-        E.undo_count--;
+/* Exchange the per-file fields of E with those of a parked buffer */
+void buffer_exchange(Buffer *b) {
+    BUFFER_SWAP(doc);
+    BUFFER_SWAP(cx);
+    BUFFER_SWAP(cy);
+    BUFFER_SWAP(row_offset);
+    BUFFER_SWAP(col_offset);
+    BUFFER_SWAP(wrap_sub);
+    BUFFER_SWAP(wrap_index);
+    BUFFER_SWAP(filename);
+    BUFFER_SWAP(modified);
+    BUFFER_SWAP(crlf);
+    BUFFER_SWAP(syntax);
+    BUFFER_SWAP(hl_state);
+    BUFFER_SWAP(hl_len);
+    BUFFER_SWAP(hl_cap);
+    BUFFER_SWAP(hl_valid);
+    BUFFER_SWAP(sel);
+    buffer_exchange_undo(b);
+    BUFFER_SWAP(swap);
+    BUFFER_SWAP(swap_found);
+    BUFFER_SWAP(edit_gen);
+    BUFFER_SWAP(autosave_time);
+    BUFFER_SWAP(autosave_pos);
+}
+
+/* Let go of the document in E but not its history: its lines, journal and highlight states */
+void buffer_release_lines(void) {
+    swap_close(1);
+    rope_free(&E.doc);
+    free(E.hl_state);
+    E.hl_state = NULL;
+    E.hl_len = E.hl_cap = E.hl_valid = 0;
+    syntax_marks_clear(&E.hl_marks);
+    wrap_free(&E.wrap_index);
+}
+
+/* Let go of the document in E: its lines, history, journal and highlight states */
+void buffer_release(void) {
+    undo_clear();
+    buffer_release_lines();
+}
+
+/* Roughly the heap bytes buffer i holds */
+long long buffer_footprint(int i) {
+    if (i == E.buffer_cur) return rope_footprint(&E.doc) + E.undo_bytes + E.hl_cap;
+    Buffer *b = &E.buffers[i];
+    return rope_footprint(&b->doc) + b->undo_bytes + b->hl_cap;
+}
+
+/*
+ * Give back an inactive buffer's memory: drop it back to its file, or pack
+ * its edited lines if it has unsaved changes. A dropped buffer keeps its
+ * history, whose ops hold their own references to the text they need.
+ */
+void buffer_shrink(Buffer *b) {
+    if (b->modified) {
+        rope_compact(&b->doc);
+        free(b->hl_state);
+        b->hl_state = NULL;
+        b->hl_len = b->hl_cap = b->hl_valid = 0;
+        wrap_free(&b->wrap_index);
+        b->packed = 1;
+        return;
     }
-    
-    /* Clear any redo states */
-    for (int i = E.undo_pos; i < E.undo_count; i++) {
-        UndoState *s = &E.undo_stack[i];
-        if (s->lines) {
-            for (int j = 0; j < s->num_lines; j++) free(s->lines[j]);
-            free(s->lines);
-            s->lines = NULL;
+    long long size = -1, mtime = -1;
+    buffer_exchange(b);
+    buffer_release_lines();
+    file_stamp(E.filename, &size, &mtime);
+    buffer_exchange(b);
+    b->loaded = 0;
+    b->file_size = size;
+    b->file_mtime = mtime;
+}
+
+/* Shrink inactive buffers, least recently used first, until all of them fit in the budget */
+void buffer_trim(void) {
+    long long total = 0;
+    for (int i = 0; i < E.buffer_count; i++) total += buffer_footprint(i);
+    while (total > E.buffer_budget) {
+        int pick = -1;
+        for (int i = 0; i < E.buffer_count; i++) {
+            Buffer *b = &E.buffers[i];
+            if (i == E.buffer_cur || !b->loaded || (b->modified && b->packed)) continue;
+            if (pick < 0 || b->used < E.buffers[pick].used) pick = i;
         }
+        if (pick < 0) break;
+        long long before = buffer_footprint(pick);
+        buffer_shrink(&E.buffers[pick]);
+        total -= before - buffer_footprint(pick);
+    }
+}
+
+/* Bring buffer n into E, whose own document must already be parked or let go; a dropped one is opened again */
+void buffer_enter(int n) {
+    Buffer *b = &E.buffers[n];
+    buffer_exchange(b);
+    E.buffer_cur = n;
+    b->packed = 0;
+    E.line_match_len = 0;
+    syntax_marks_clear(&E.hl_marks);
+    E.count_active = 0;
+    E.mode = MODE_NORMAL;
+    E.dirty = 1;
+    if (b->loaded) {
+        editor_set_status("Buffer %d of %d: %s%s", n + 1, E.buffer_count, E.filename[0] ? E.filename : "[No Name]", E.modified ? " [+]" : "");
+        return;
     }
-    E.undo_count = E.undo_pos;
     
-    /* Save current state */
-    UndoState *state = &E.undo_stack[E.undo_count];
-    state->lines = malloc(sizeof(char*) * E.num_lines);
-    state->num_lines = E.num_lines;
-    state->cx = E.cx;
-    state->cy = E.cy;
-    for (int i = 0; i < E.num_lines; i++) {
-        state->lines[i] = _strdup(E.lines[i]);
+    char path[512];
+    int cx = E.cx, cy = E.cy, row = E.row_offset, col = E.col_offset, sub = E.wrap_sub;
+    long long size, mtime;
+    Buffer kept = {0};
+    snprintf(path, sizeof(path), "%s", E.filename);
+    buffer_exchange_undo(&kept);
+    rope_insert(&E.doc, 0, "", 0);
+    editor_open(path);
+    b->loaded = 1;
+    
+    /* The history kept through the drop wins over the undo file's, unless the file changed meanwhile */
+    int same = kept.undo_count && file_stamp(path, &size, &mtime) && size == b->file_size && mtime == b->file_mtime;
+    if (same) undo_clear();
+    buffer_exchange_undo(&kept);
+    if (!same) {
+        undo_clear();
+        buffer_exchange_undo(&kept);
+    }
+    if (cy >= rope_count(&E.doc)) rope_finish(&E.doc);
+    if (cy < rope_count(&E.doc)) {
+        int len = rope_len(&E.doc, cy);
+        E.cy = cy;
+        E.cx = cx < len ? cx : len;
+        E.row_offset = row;
+        E.col_offset = col;
+        E.wrap_sub = sub;
     }
-    E.undo_count++;
-    E.undo_pos = E.undo_count;
 }
 
-void pop_undo(void) {
-    if (E.undo_pos <= 0) {
-        editor_set_status("Nothing to undo");
+/* Put buffer n on screen */
+void buffer_switch(int n) {
+    if (n == E.buffer_cur) {
+        editor_set_status("Buffer %d of %d: %s%s", n + 1, E.buffer_count, E.filename[0] ? E.filename : "[No Name]", E.modified ? " [+]" : "");
         return;
     }
+    if (E.autosave_job) autosave_finish();
+    undo_seal();
+    buffer_exchange(&E.buffers[E.buffer_cur]);
+    E.buffers[E.buffer_cur].used = now_ms();
+    buffer_enter(n);
+    buffer_trim();
+}
+
+/* The buffer holding a file, -1 if there is none */
+int buffer_find(const char *path) {
+    char abs[1024], other[1024];
     
-    E.undo_pos--;
-    UndoState *state = &E.undo_stack[E.undo_pos];
-    
-    /* Free current */
-    for (int i = 0; i < E.num_lines; i++) free(E.lines[i]);
-    free(E.lines);
+    path_absolute(path, abs, sizeof(abs));
+    for (int i = 0; i < E.buffer_count; i++) {
+        const char *name = i == E.buffer_cur ? E.filename : E.buffers[i].filename;
+        if (!name[0]) continue;
+        path_absolute(name, other, sizeof(other));
+        if (strcmp(abs, other) == 0) return i;
+    }
+    return -1;
+}
+
+/* The buffer for a file, added to the list unopened if there is none */
+int buffer_add(const char *path) {
+    int i = buffer_find(path);
+    if (i >= 0) return i;
+    E.buffers = realloc(E.buffers, sizeof(Buffer) * (E.buffer_count + 1));
+    memset(&E.buffers[E.buffer_count], 0, sizeof(Buffer));
+    snprintf(E.buffers[E.buffer_count].filename, sizeof(E.buffers[0].filename), "%s", path);
+    return E.buffer_count++;
+}
+
+/* Show a file: switch to its buffer, or open it in a new one; an untouched empty buffer is reused */
+void buffer_open(const char *path) {
+    int i = buffer_find(path);
+    if (i < 0 && !E.filename[0] && !E.modified && E.undo_count == 0 && rope_count(&E.doc) == 1 && rope_len(&E.doc, 0) == 0) {
+        editor_open(path);
+        buffer_trim();
+        return;
+    }
+    buffer_switch(i >= 0 ? i : buffer_add(path));
+}
+
+/* :bd - close the current buffer and show the one used last, or an empty one */
+void buffer_close(int force) {
+    char name[512];
+    Buffer blank;
     
-    /* Restore */
-    E.lines = malloc(sizeof(char*) * state->num_lines);
-    E.num_lines = state->num_lines;
-    for (int i = 0; i < E.num_lines; i++) {
-        E.lines[i] = _strdup(state->lines[i]);
+    if (E.modified && !force) {
+        editor_set_status("Unsaved changes! Use :bd! to discard them or :w to save");
+        return;
     }
-    E.cx = state->cx;
-    E.cy = state->cy;
+    if (E.autosave_job) autosave_finish();
+    snprintf(name, sizeof(name), "%s", E.filename[0] ? E.filename : "[No Name]");
+    buffer_release();
+    memset(&blank, 0, sizeof(blank));
+    buffer_exchange(&blank);
     
-    if (E.cy >= E.num_lines) E.cy = E.num_lines - 1;
-    if (E.cx > (int)strlen(E.lines[E.cy])) E.cx = strlen(E.lines[E.cy]);
+    if (E.buffer_count == 1) {
+        rope_insert(&E.doc, 0, "", 0);
+        E.mode = MODE_NORMAL;
+        E.dirty = 1;
+    } else {
+        int next = -1;
+        memmove(&E.buffers[E.buffer_cur], &E.buffers[E.buffer_cur + 1], sizeof(Buffer) * (E.buffer_count - E.buffer_cur - 1));
+        E.buffer_count--;
+        for (int i = 0; i < E.buffer_count; i++) {
+            if (next < 0 || E.buffers[i].used > E.buffers[next].used) next = i;
+        }
+        buffer_enter(next);
+        if (!E.buffers[next].loaded) return;
+    }
+    editor_set_status("Closed %s", name);
+}
+
+/* The first buffer with unsaved changes, the current one before the others; -1 if there is none */
+int buffer_unsaved(void) {
+    if (E.modified) return E.buffer_cur;
+    for (int i = 0; i < E.buffer_count; i++) {
+        if (i != E.buffer_cur && E.buffers[i].modified) return i;
+    }
+    return -1;
+}
+
+/* :ls - every buffer with its state, and the heap they hold against the budget */
+void buffer_list(void) {
+    char line[512];
+    int used = 0;
+    long long total = 0;
     
-    E.dirty = 1;
-    editor_set_status("Undo");
+    for (int i = 0; i < E.buffer_count; i++) {
+        Buffer *b = &E.buffers[i];
+        int cur = i == E.buffer_cur;
+        const char *name = cur ? E.filename : b->filename;
+        total += buffer_footprint(i);
+        if (used >= (int)sizeof(line) - 64) continue;
+        used += snprintf(line + used, sizeof(line) - used, "%s%d%s %s%s%s", used ? "  " : "", i + 1, cur ? "%" : "",
+                         name[0] ? name : "[No Name]", (cur ? E.modified : b->modified) ? " [+]" : "",
+                         cur ? "" : !b->loaded ? " (on disk)" : b->packed ? " (packed)" : "");
+    }
+    editor_set_status("%s | %.1f of %lld MB", line, total / 1048576.0, E.buffer_budget >> 20);
 }
 
 void editor_init(void) {
     memset(&E, 0, sizeof(E));
     
     E.mode = MODE_NORMAL;
+    E.search_regex = 1;
     _getcwd(E.current_dir, sizeof(E.current_dir));
     
-    /* Console setup */
-    E.hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
-    E.hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    
-    GetConsoleMode(E.hStdin, &E.orig_in_mode);
-    GetConsoleMode(E.hStdout, &E.orig_out_mode);
-    
-    SetConsoleMode(E.hStdin, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT);
-    SetConsoleMode(E.hStdout, E.orig_out_mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
-    
-    /* Get screen size */
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(E.hStdout, &csbi);
-    E.screen_cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-    E.screen_rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1 - STATUS_HEIGHT;
+    /* Terminal setup */
+    term_init(&E.screen_cols, &E.screen_rows);
+    E.screen_rows -= STATUS_HEIGHT;
     
     /* Allocate double buffer */
-    E.buf_size = E.screen_cols * (E.screen_rows + STATUS_HEIGHT);
-    E.buffer = malloc(sizeof(CHAR_INFO) * E.buf_size);
-    
-    /* Hide cursor blink during refresh */
-    CONSOLE_CURSOR_INFO cci = { 25, TRUE };
-    SetConsoleCursorInfo(E.hStdout, &cci);
+    buf_resize();
     
     /* Create empty buffer */
-    E.lines = malloc(sizeof(char*));
-    E.lines[0] = _strdup("");
-    E.num_lines = 1;
+    rope_insert(&E.doc, 0, "", 0);
+    E.buffers = calloc(1, sizeof(Buffer));
+    E.buffers[0].loaded = 1;
+    E.buffer_count = 1;
+    E.buffer_budget = (long long)BUFFER_BUDGET << 20;
     E.dirty = 1;
 }
 
 void editor_free(void) {
-    for (int i = 0; i < E.num_lines; i++) free(E.lines[i]);
-    free(E.lines);
-    if (E.clipboard) free(E.clipboard);
+    if (E.autosave_job) autosave_finish();
+    for (int i = 0; i < E.buffer_count; i++) {
+        if (i == E.buffer_cur) continue;
+        buffer_exchange(&E.buffers[i]);
+        buffer_release();
+        buffer_exchange(&E.buffers[i]);
+    }
+    buffer_release();
+    free(E.buffers);
+    for (int i = 0; i < REGISTERS; i++) span_release(E.registers[i]);
     if (E.buffer) free(E.buffer);
+    if (E.front) free(E.front);
+    regex_free(E.regex);
+    free(E.line_match);
+    syntax_marks_free(&E.hl_marks);
+    free(E.hl_class);
+    grep_free(E.grep);
+    dir_list_free(E.dir);
+    if (E.path_build) path_build_finish(E.path_build, 1);
+    path_index_free(E.paths);
+    editor_find_drop(0);
     
-    for (int i = 0; i < E.undo_count; i++) {
-        if (E.undo_stack[i].lines) {
-            for (int j = 0; j < E.undo_stack[i].num_lines; j++)
-                free(E.undo_stack[i].lines[j]);
-            free(E.undo_stack[i].lines);
-        }
+    term_free();
+}
+
+/* Leave the editor, or end the script when replaying one */
+void editor_quit(void) {
+    if (H.active) {
+        H.quit = 1;
+        return;
+    }
+    editor_free();
+    exit(0);
+}
+
+/* :q - leave unless a buffer has unsaved changes */
+void editor_try_quit(void) {
+    int n = buffer_unsaved();
+    if (n == E.buffer_cur) {
+        editor_set_status("Unsaved changes! Use :q! to force quit or :w to save");
+    } else if (n >= 0) {
+        editor_set_status("Unsaved changes in buffer %d! Use :b %d and :w to save or :q! to force quit", n + 1, n + 1);
+    } else {
+        editor_quit();
     }
-    
-    SetConsoleMode(E.hStdin, E.orig_in_mode);
-    SetConsoleMode(E.hStdout, E.orig_out_mode);
-    
-    /* Clear screen on exit */
-    COORD pos = {0, 0};
-    DWORD written;
-    FillConsoleOutputCharacter(E.hStdout, ' ', E.screen_cols * (E.screen_rows + STATUS_HEIGHT), pos, &written);
-    FillConsoleOutputAttribute(E.hStdout, CLR_DEFAULT, E.screen_cols * (E.screen_rows + STATUS_HEIGHT), pos, &written);
-    SetConsoleCursorPosition(E.hStdout, pos);
 }
 
 void editor_open(const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
+    if (E.autosave_job) autosave_finish();
+    FileMap *map = filemap_open(filename);
+    
+    /* Unsaved edits to the file being left stay in its journal for :recover */
+    swap_close(!E.modified);
+    if (!map) {
         strncpy(E.filename, filename, sizeof(E.filename) - 1);
+        editor_syntax_select();
         editor_set_status("New file: %s", filename);
+        swap_check();
+        if (rope_count(&E.doc) == 1 && rope_len(&E.doc, 0) == 0) swap_open();
         return;
     }
     
     strncpy(E.filename, filename, sizeof(E.filename) - 1);
+    editor_syntax_select();
     
-    for (int i = 0; i < E.num_lines; i++) free(E.lines[i]);
-    free(E.lines);
-    E.lines = NULL;
-    E.num_lines = 0;
-    
-    char line[MAX_LINE_LEN];
-    while (fgets(line, sizeof(line), fp)) {
-        int len = strlen(line);
-        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
-            line[--len] = '\0';
-        
-        E.lines = realloc(E.lines, sizeof(char*) * (E.num_lines + 1));
-        E.lines[E.num_lines++] = _strdup(line);
-    }
-    fclose(fp);
-    
-    if (E.num_lines == 0) {
-        E.lines = malloc(sizeof(char*));
-        E.lines[0] = _strdup("");
-        E.num_lines = 1;
+    /* Clear undo history for new file, before the old file's lines are let go */
+    undo_clear();
+    rope_load(&E.doc, map);
+    if (rope_count(&E.doc) == 0) rope_finish(&E.doc);
+    E.count_active = 0;
+    E.line_match_len = 0;
+    E.hl_len = E.hl_valid = 0;
+    syntax_marks_clear(&E.hl_marks);
+    wrap_free(&E.wrap_index);
+    if (rope_count(&E.doc) == 0) {
+        rope_insert(&E.doc, 0, "", 0);
     }
+    E.crlf = filemap_crlf(map);
     
     E.cy = E.cx = 0;
     E.modified = 0;
     E.dirty = 1;
     clear_selection();
+    undo_file_load();
     
-    /* Clear undo stack for new file */
-    for (int i = 0; i < E.undo_count; i++) {
-        if (E.undo_stack[i].lines) {
-            for (int j = 0; j < E.undo_stack[i].num_lines; j++)
-                free(E.undo_stack[i].lines[j]);
-            free(E.undo_stack[i].lines);
-            E.undo_stack[i].lines = NULL;
+    if (filemap_loading(map)) {
+        editor_set_status("Opening: %s ...", filename);
+    } else {
+        editor_set_status("Opened: %s (%d lines)", filename, rope_count(&E.doc));
+    }
+    swap_check();
+    swap_open();
+}
+
+/* A file is still being indexed or searched, or a directory listed or indexed */
+int editor_busy(void) {
+    return filemap_loading(E.doc.map) || E.grep_active || dir_list_loading(E.dir) || E.path_build != NULL || E.autosave_job;
+}
+
+/* Pick up lines indexed, files searched, directory entries listed and paths indexed in the background */
+void editor_poll(void) {
+    if (E.dir) sidebar_refresh();
+    autosave_poll();
+    if (E.path_build && path_build_done(E.path_build)) {
+        path_index_free(E.paths);
+        E.paths = path_build_finish(E.path_build, 0);
+        E.path_build = NULL;
+        E.paths_time = now_ms();
+        editor_find_drop(0);
+        if (E.mode == MODE_FIND) editor_find_update();
+    } else if (E.path_build && E.mode == MODE_FIND && !E.paths) {
+        editor_set_status("Indexing %s: %d files so far...", E.path_build->root, __atomic_load_n(&E.path_build->progress, __ATOMIC_RELAXED));
+        E.dirty = 1;
+    }
+    if (E.grep_active) {
+        if (!grep_running(E.grep)) {
+            grep_join(E.grep, 0);
+            E.grep_active = 0;
         }
+        editor_grep_status();
+    }
+    if (!filemap_loading(E.doc.map)) {
+        if (E.count_active) editor_count_step();
+        return;
+    }
+    rope_poll(&E.doc);
+    E.dirty = 1;
+    if (!filemap_loading(E.doc.map)) {
+        E.crlf = filemap_crlf(E.doc.map);
+        editor_set_status("Opened: %s (%d lines)", E.filename, rope_count(&E.doc));
+        if (E.swap_found) swap_check();
+        buffer_trim();
     }
-    E.undo_count = E.undo_pos = 0;
-    
-    editor_set_status("Opened: %s (%d lines)", filename, E.num_lines);
 }
 
 void editor_save(void) {
@@ -377,22 +8048,23 @@ void editor_save(void) {
         return;
     }
     
-    FILE *fp = fopen(E.filename, "w");
-    if (!fp) {
+    if (E.autosave_job) autosave_finish();
+    double t0 = now_ms();
+    long long bytes = rope_save(&E.doc, E.filename, E.crlf);
+    double t1 = now_ms();
+    if (bytes < 0) {
         editor_set_status("Error: Cannot save file!");
         return;
     }
     
-    int bytes = 0;
-    for (int i = 0; i < E.num_lines; i++) {
-        fprintf(fp, "%s\n", E.lines[i]);
-        bytes += strlen(E.lines[i]) + 1;
-    }
-    fclose(fp);
-    
     E.modified = 0;
+    E.undo_saved = E.undo_pos;
+    undo_seal();
     E.dirty = 1;
-    editor_set_status("Saved: %s (%d bytes)", E.filename, bytes);
+    swap_close(1);
+    swap_open();
+    int logged = undo_file_save();
+    editor_set_status("Saved: %s (%lld bytes in %.1f ms)%s", E.filename, bytes, t1 - t0, logged ? "" : ", undo file not written");
 }
 
 void editor_set_status(const char *fmt, ...) {
@@ -404,110 +8076,192 @@ void editor_set_status(const char *fmt, ...) {
 }
 
 void editor_insert_char(int c) {
-    push_undo();
-    char *line = E.lines[E.cy];
-    int len = strlen(line);
-    E.lines[E.cy] = realloc(line, len + 2);
-    line = E.lines[E.cy];
-    memmove(&line[E.cx + 1], &line[E.cx], len - E.cx + 1);
-    line[E.cx++] = c;
-    E.modified = 1;
-    E.dirty = 1;
+    char ch = c;
+    editor_insert_text(E.cy, E.cx, &ch, 1);
 }
 
 void editor_delete_char(void) {
-    if (E.cy == E.num_lines) return;
+    if (E.cy == rope_count(&E.doc)) return;
     if (E.cx == 0 && E.cy == 0) return;
     
-    push_undo();
-    char *line = E.lines[E.cy];
-    int len = strlen(line);
-    
     if (E.cx > 0) {
-        memmove(&line[E.cx - 1], &line[E.cx], len - E.cx + 1);
-        E.cx--;
+        editor_delete_text(E.cy, E.cx - 1, 1);
     } else {
-        char *prev = E.lines[E.cy - 1];
-        int prev_len = strlen(prev);
-        E.lines[E.cy - 1] = realloc(prev, prev_len + len + 1);
-        strcat(E.lines[E.cy - 1], line);
-        free(E.lines[E.cy]);
-        memmove(&E.lines[E.cy], &E.lines[E.cy + 1], sizeof(char*) * (E.num_lines - E.cy - 1));
-        E.num_lines--;
-        E.cy--;
-        E.cx = prev_len;
+        editor_delete_text(E.cy - 1, rope_len(&E.doc, E.cy - 1), 1);
     }
-    E.modified = 1;
-    E.dirty = 1;
 }
 
 void editor_insert_newline(void) {
-    push_undo();
-    char *line = E.lines[E.cy];
-    char *new_line = _strdup(&line[E.cx]);
-    line[E.cx] = '\0';
-    
-    E.lines = realloc(E.lines, sizeof(char*) * (E.num_lines + 1));
-    memmove(&E.lines[E.cy + 2], &E.lines[E.cy + 1], sizeof(char*) * (E.num_lines - E.cy - 1));
-    E.lines[E.cy + 1] = new_line;
-    E.num_lines++;
-    E.cy++;
-    E.cx = 0;
-    E.modified = 1;
-    E.dirty = 1;
+    editor_insert_text(E.cy, E.cx, "\n", 1);
 }
 
-void editor_delete_line(void) {
-    if (E.num_lines <= 1) {
-        push_undo();
-        free(E.lines[0]);
-        E.lines[0] = _strdup("");
-        E.cx = 0;
-        E.modified = 1;
-        E.dirty = 1;
-        return;
+/* Register for a name: 0 is the unnamed register ", then a to z, with REGISTER_APPEND for A to Z; -1 for anything else */
+int register_index(int name) {
+    if (name == '"') return 0;
+    if (name >= 'a' && name <= 'z') return name - 'a' + 1;
+    if (name >= 'A' && name <= 'Z') return (name - 'A' + 1) | REGISTER_APPEND;
+    return -1;
+}
+
+/* Store lines in a register, or after its lines for A to Z; a named one fills the unnamed register too */
+void register_set(int reg, Span *s) {
+    if ((reg & REGISTER_APPEND) && E.registers[reg & ~REGISTER_APPEND]) {
+        Span *joined = span_join(E.registers[reg & ~REGISTER_APPEND], s);
+        span_release(s);
+        s = joined;
     }
-    
-    push_undo();
-    if (E.clipboard) free(E.clipboard);
-    E.clipboard = _strdup(E.lines[E.cy]);
-    
-    free(E.lines[E.cy]);
-    memmove(&E.lines[E.cy], &E.lines[E.cy + 1], sizeof(char*) * (E.num_lines - E.cy - 1));
-    E.num_lines--;
-    
-    if (E.cy >= E.num_lines) E.cy = E.num_lines - 1;
-    if (E.cx > (int)strlen(E.lines[E.cy])) E.cx = strlen(E.lines[E.cy]);
-    E.modified = 1;
-    E.dirty = 1;
+    reg &= ~REGISTER_APPEND;
+    if (reg) {
+        s->refs++;
+        span_release(E.registers[0]);
+        E.registers[0] = s;
+    }
+    span_release(E.registers[reg]);
+    E.registers[reg] = s;
+}
+
+void editor_yank_lines(int y, int n, int reg) {
+    if (n > rope_count(&E.doc) - y) n = rope_count(&E.doc) - y;
+    register_set(reg, span_from_rope(&E.doc, y, n));
+    if (n == 1) editor_set_status("Line yanked");
+    else editor_set_status("%d lines yanked", n);
 }
 
-void editor_copy_line(void) {
-    if (E.clipboard) free(E.clipboard);
-    E.clipboard = _strdup(E.lines[E.cy]);
-    editor_set_status("Line yanked");
+/* Delete lines [y, y + n) into a register, leaving one empty line if that was all of them */
+void editor_delete_lines(int y, int n, int reg) {
+    int cx = E.cx, cy = E.cy, count = rope_count(&E.doc);
+    
+    if (n > count - y) n = count - y;
+    Span *s = span_from_rope(&E.doc, y, n);
+    if (n == count) {
+        if (n > 1) {
+            Span *rest = span_from_rope(&E.doc, 1, n - 1);
+            doc_delete_lines(1, n - 1);
+            undo_record_lines(UNDO_DELETE, 1, rest, cx, cy);
+            span_release(rest);
+        }
+        int ops = E.undo_count;
+        editor_delete_text(0, 0, rope_len(&E.doc, 0));
+        if (n > 1 && E.undo_count > ops) E.undo_ops[E.undo_count - 1].joined = 1;
+    } else {
+        doc_delete_lines(y, n);
+        undo_record_lines(UNDO_DELETE, y, s, cx, cy);
+    }
+    register_set(reg, s);
+    
+    E.cy = y < rope_count(&E.doc) ? y : rope_count(&E.doc) - 1;
+    E.cx = cx < rope_len(&E.doc, E.cy) ? cx : rope_len(&E.doc, E.cy);
+    if (n > 1) editor_set_status("%d fewer lines", n);
 }
 
-void editor_paste(void) {
-    if (!E.clipboard) {
+/* Put a register's lines before line y */
+void editor_put(int y, int reg) {
+    Span *s = E.registers[reg & ~REGISTER_APPEND];
+    int cx = E.cx, cy = E.cy;
+    
+    if (!s) {
         editor_set_status("Nothing to paste");
         return;
     }
-    push_undo();
-    E.lines = realloc(E.lines, sizeof(char*) * (E.num_lines + 1));
-    memmove(&E.lines[E.cy + 2], &E.lines[E.cy + 1], sizeof(char*) * (E.num_lines - E.cy - 1));
-    E.lines[E.cy + 1] = _strdup(E.clipboard);
-    E.num_lines++;
-    E.cy++;
+    doc_insert_lines(y, s);
+    undo_record_lines(UNDO_INSERT, y, s, cx, cy);
+    E.cy = y;
     E.cx = 0;
-    E.modified = 1;
-    E.dirty = 1;
-    editor_set_status("Pasted");
+    if (s->lines == 1) editor_set_status("Pasted");
+    else editor_set_status("%d more lines", s->lines);
+}
+
+/* :registers on the message line */
+void editor_show_registers(void) {
+    char line[512];
+    int used = 0;
+    
+    for (int i = 0; i < REGISTERS && used < (int)sizeof(line) - 64; i++) {
+        Span *s = E.registers[i];
+        if (!s) continue;
+        double kb = s->bytes / 1024.0;
+        used += snprintf(line + used, sizeof(line) - used, "%s\"%c %d line%s, ", used ? "  " : "",
+                         i ? 'a' + i - 1 : '"', s->lines, s->lines == 1 ? "" : "s");
+        if (s->bytes < 1024) used += snprintf(line + used, sizeof(line) - used, "%lld B", s->bytes);
+        else if (kb < 1024) used += snprintf(line + used, sizeof(line) - used, "%.1f KB", kb);
+        else used += snprintf(line + used, sizeof(line) - used, "%.1f MB", kb / 1024);
+    }
+    editor_set_status("%s", used ? line : "Registers are empty");
+}
+
+/* The wrap index, brought in line with the document and the width of the text area */
+WrapIndex *editor_wrap(void) {
+    int width = E.screen_cols - (E.sidebar_visible ? SIDEBAR_WIDTH : 0) - 6;
+    wrap_sync(&E.wrap_index, &E.doc, width > 0 ? width : 1);
+    return &E.wrap_index;
+}
+
+/* The screen row, from the top of the file, of the top of the screen when wrapping */
+int editor_wrap_top(WrapIndex *w) {
+    if (E.row_offset >= rope_count(&E.doc)) E.row_offset = rope_count(&E.doc) - 1;
+    int rows = rope_len(&E.doc, E.row_offset) / w->width + 1;
+    if (E.wrap_sub >= rows) E.wrap_sub = rows - 1;
+    return wrap_row(w, &E.doc, E.row_offset) + E.wrap_sub;
+}
+
+/* Put screen row top, from the top of the file, at the top of the screen when wrapping; the last row stays at the bottom */
+void editor_wrap_set_top(WrapIndex *w, int top) {
+    int sub;
+    if (top < 0) top = 0;
+    if (wrap_find(w, &E.doc, top + E.screen_rows - 1, &sub) < 0) {
+        top = wrap_total(w, &E.doc) - E.screen_rows;
+        if (top < 0) top = 0;
+    }
+    E.row_offset = wrap_find(w, &E.doc, top, &E.wrap_sub);
+}
+
+/* Move the cursor n screen rows when wrapping, keeping its column within the row */
+void editor_wrap_move(int n) {
+    WrapIndex *w = editor_wrap();
+    int col = E.cx % w->width, sub, row = wrap_row(w, &E.doc, E.cy) + E.cx / w->width + n;
+    if (row < 0) row = 0;
+    int y = wrap_find(w, &E.doc, row, &sub);
+    if (y < 0) {
+        y = rope_count(&E.doc) - 1;
+        sub = rope_len(&E.doc, y) / w->width;
+    }
+    int len = rope_len(&E.doc, y);
+    E.cy = y;
+    E.cx = sub * w->width + col < len ? sub * w->width + col : len;
+}
+
+/* The file position shown at row y, column x of the text area; returns 0 below the last line */
+int editor_text_pos(int y, int x, int *fy, int *fx) {
+    if (!E.wrap) {
+        *fy = y + E.row_offset;
+        *fx = x + E.col_offset;
+        return *fy < rope_count(&E.doc);
+    }
+    
+    WrapIndex *w = editor_wrap();
+    int sub;
+    *fy = wrap_find(w, &E.doc, editor_wrap_top(w) + y, &sub);
+    *fx = sub * w->width + x;
+    return *fy >= 0;
 }
 
 void editor_scroll(void) {
     int editor_width = E.screen_cols - (E.sidebar_visible ? SIDEBAR_WIDTH : 0) - 6;
     
+    /* Wrapped, the screen scrolls by rows of the index instead of by lines */
+    if (E.wrap) {
+        WrapIndex *w = editor_wrap();
+        E.col_offset = 0;
+        if (E.cy < E.row_offset || (E.cy == E.row_offset && E.cx / w->width < E.wrap_sub)) {
+            E.row_offset = E.cy;
+            E.wrap_sub = E.cx / w->width;
+            return;
+        }
+        int top = editor_wrap_top(w), cur = wrap_row(w, &E.doc, E.cy) + E.cx / w->width;
+        if (cur >= top + E.screen_rows) editor_wrap_set_top(w, cur - E.screen_rows + 1);
+        return;
+    }
+    
     if (E.cy < E.row_offset) E.row_offset = E.cy;
     if (E.cy >= E.row_offset + E.screen_rows) E.row_offset = E.cy - E.screen_rows + 1;
     if (E.cx < E.col_offset) E.col_offset = E.cx;
@@ -515,132 +8269,312 @@ void editor_scroll(void) {
 }
 
 void sidebar_load_dir(const char *path) {
-    E.num_entries = 0;
+    if (path != E.current_dir) strncpy(E.current_dir, path, sizeof(E.current_dir) - 1);
+    dir_list_free(E.dir);
+    E.dir = dir_list_start(E.current_dir);
+    E.dir_version = -1;
     E.sidebar_cursor = 0;
     E.sidebar_scroll = 0;
-    strncpy(E.current_dir, path, sizeof(E.current_dir) - 1);
-    
-    strcpy(E.dir_entries[E.num_entries].name, "..");
-    E.dir_entries[E.num_entries++].is_dir = 1;
-    
-    char search_path[520];
-    snprintf(search_path, sizeof(search_path), "%s\\*", path);
-    
-    WIN32_FIND_DATA ffd;
-    HANDLE hFind = FindFirstFile(search_path, &ffd);
+    mutex_lock(&E.dir->lock);
+    E.sidebar_pick = E.dir->entries[0];
+    mutex_unlock(&E.dir->lock);
+    E.dirty = 1;
+}
+
+/* Move the cursor to entry idx and remember which entry that is */
+void sidebar_select(int idx) {
+    mutex_lock(&E.dir->lock);
+    if (idx > E.dir->count - 1) idx = E.dir->count - 1;
+    if (idx < 0) idx = 0;
+    E.sidebar_cursor = idx;
+    E.sidebar_pick = E.dir->entries[idx];
+    mutex_unlock(&E.dir->lock);
     
-    if (hFind != INVALID_HANDLE_VALUE) {
-        do {
-            if (strcmp(ffd.cFileName, ".") == 0 || strcmp(ffd.cFileName, "..") == 0) continue;
-            if (E.num_entries >= MAX_DIR_ENTRIES) break;
-            
-            strncpy(E.dir_entries[E.num_entries].name, ffd.cFileName, 259);
-            E.dir_entries[E.num_entries].is_dir = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
-            E.num_entries++;
-        } while (FindNextFile(hFind, &ffd));
-        FindClose(hFind);
-    }
+    if (E.sidebar_cursor < E.sidebar_scroll) E.sidebar_scroll = E.sidebar_cursor;
+    if (E.sidebar_cursor >= E.sidebar_scroll + E.screen_rows) E.sidebar_scroll = E.sidebar_cursor - E.screen_rows + 1;
     E.dirty = 1;
 }
 
+/* After entries were merged in, keep the cursor on the same entry and at the same screen row */
+void sidebar_refresh(void) {
+    mutex_lock(&E.dir->lock);
+    if (E.dir->version != E.dir_version) {
+        int idx = dir_list_find(E.dir, E.sidebar_pick);
+        E.sidebar_scroll += idx - E.sidebar_cursor;
+        if (E.sidebar_scroll < 0) E.sidebar_scroll = 0;
+        E.sidebar_cursor = idx;
+        E.dir_version = E.dir->version;
+        E.dirty = 1;
+    }
+    mutex_unlock(&E.dir->lock);
+}
+
 void sidebar_open_selected(void) {
-    if (E.sidebar_cursor >= E.num_entries) return;
+    char path[1024], name[512];
+    int is_dir;
     
-    char path[1024];
-    if (strcmp(E.dir_entries[E.sidebar_cursor].name, "..") == 0) {
+    mutex_lock(&E.dir->lock);
+    DirEntry *e = &E.dir->entries[E.sidebar_cursor];
+    snprintf(name, sizeof(name), "%s", E.dir->names + e->name);
+    is_dir = e->is_dir;
+    mutex_unlock(&E.dir->lock);
+    
+    if (strcmp(name, "..") == 0) {
         char *last_sep = strrchr(E.current_dir, '\\');
         if (!last_sep) last_sep = strrchr(E.current_dir, '/');
-        if (last_sep && last_sep != E.current_dir) {
+        if (last_sep && last_sep[1] != '\0') {
+            /* Keep the separator when the parent is the root */
             char parent[512];
-            strncpy(parent, E.current_dir, last_sep - E.current_dir);
-            parent[last_sep - E.current_dir] = '\0';
+            int n = last_sep == E.current_dir ? 1 : (int)(last_sep - E.current_dir);
+            strncpy(parent, E.current_dir, n);
+            parent[n] = '\0';
             sidebar_load_dir(parent);
         }
     } else {
-        snprintf(path, sizeof(path), "%s\\%s", E.current_dir, E.dir_entries[E.sidebar_cursor].name);
-        if (E.dir_entries[E.sidebar_cursor].is_dir) {
+        snprintf(path, sizeof(path), "%s%c%s", E.current_dir, PATH_SEP, name);
+        if (is_dir) {
             sidebar_load_dir(path);
         } else {
-            editor_open(path);
+            buffer_open(path);
             E.mode = MODE_NORMAL;
         }
     }
 }
 
-void sidebar_draw(void) {
-    if (!E.sidebar_visible) return;
+/* Only the rows in view are read from the listing */
+void sidebar_draw(void) {
+    if (!E.sidebar_visible) return;
+    
+    mutex_lock(&E.dir->lock);
+    for (int y = 0; y < E.screen_rows; y++) {
+        int idx = y + E.sidebar_scroll;
+        Attr attr = CLR_CYAN | BG_BLACK;
+        
+        if (idx < E.dir->count) {
+            if (idx == E.sidebar_cursor) {
+                attr = (E.mode == MODE_SIDEBAR) ? (CLR_WHITE | BG_CYAN) : (CLR_CYAN | BG_GRAY);
+            }
+            
+            char display[SIDEBAR_WIDTH];
+            memset(display, ' ', SIDEBAR_WIDTH - 1);
+            display[SIDEBAR_WIDTH - 1] = '\0';
+            
+            char temp[SIDEBAR_WIDTH];
+            const char *name = E.dir->names + E.dir->entries[idx].name;
+            if (E.dir->entries[idx].is_dir) {
+                snprintf(temp, SIDEBAR_WIDTH - 3, " [%s]", name);
+            } else {
+                snprintf(temp, SIDEBAR_WIDTH - 3, "  %s", name);
+            }
+            int len = strlen(temp);
+            if (len > SIDEBAR_WIDTH - 2) len = SIDEBAR_WIDTH - 2;
+            memcpy(display, temp, len);
+            
+            buf_write(0, y, display, attr);
+        } else {
+            for (int x = 0; x < SIDEBAR_WIDTH - 1; x++)
+                buf_set(x, y, ' ', CLR_CYAN | BG_BLACK);
+        }
+        buf_set(SIDEBAR_WIDTH - 1, y, '|', CLR_YELLOW | BG_BLACK);
+    }
+    mutex_unlock(&E.dir->lock);
+}
+
+/* Results of the last :grep over the text area: path:line: text, with the match marked */
+void grep_draw(int start_col) {
+    Grep *g = E.grep;
+    int width = E.screen_cols - start_col, skip = (int)strlen(g->root);
+    
+    mutex_lock(&g->lock);
+    for (int y = 0; y < E.screen_rows; y++) {
+        int idx = y + E.grep_scroll;
+        int selected = idx == E.grep_cursor;
+        Attr bg = selected ? BG_BLUE : BG_BLACK;
+        
+        buf_fill(start_col, y, width, ' ', CLR_DEFAULT | bg);
+        if (idx >= g->count) continue;
+        
+        GrepHit *h = &g->hits[idx];
+        const char *path = g->files[h->file];
+        if (strncmp(path, g->root, skip) == 0 && (path[skip] == '/' || path[skip] == '\\')) path += skip + 1;
+        char where[32];
+        int x = start_col, at = h->col - h->text_col, n = (int)strlen(h->text);
+        snprintf(where, sizeof(where), ":%d: ", h->line + 1);
+        
+        buf_write(x, y, path, CLR_MAGENTA | bg);
+        x += (int)strlen(path);
+        buf_write(x, y, where, CLR_GREEN | bg);
+        x += (int)strlen(where);
+        buf_copy(x, y, h->text, n, (selected ? CLR_WHITE : CLR_DEFAULT) | bg);
+        buf_attr(x + at, y, h->len < n - at ? h->len : n - at, selected ? BG_MATCH_CURSOR : BG_MATCH);
+    }
+    mutex_unlock(&g->lock);
+}
+
+/* Ranked paths of the fuzzy finder over the text area, with the matched characters marked */
+void find_draw(int start_col) {
+    int width = E.screen_cols - start_col, pos[256];
+    char q[256];
+    for (int i = 0; i < E.find_len; i++) q[i] = fuzzy_fold[(unsigned char)E.find_buf[i]];
+    
+    for (int y = 0; y < E.screen_rows; y++) {
+        int idx = y + E.find_scroll;
+        int selected = idx == E.find_cursor;
+        Attr bg = selected ? BG_BLUE : BG_BLACK;
+        
+        buf_fill(start_col, y, width, ' ', CLR_DEFAULT | bg);
+        if (idx >= E.find_count) continue;
+        
+        const char *path = E.paths->names + E.paths->offs[E.find_hits[idx].path];
+        buf_write(start_col + 1, y, path, (selected ? CLR_WHITE : CLR_DEFAULT) | bg);
+        if (fuzzy_path_score(path, q, E.find_len, pos) < 0) continue;
+        for (int i = 0; i < E.find_len; i++) buf_attr(start_col + 1 + pos[i], y, 1, CLR_YELLOW | bg);
+    }
+}
+
+/* Next match of the compiled pattern in one line at or after x, or -1 */
+int editor_line_match(const char *line, int len, int x, int *mlen) {
+    if (E.regex) return regex_find(E.regex, line, len, x, mlen);
+    const char *hit = search_next(&E.searcher, line + x, line + len);
+    *mlen = E.searcher.len;
+    return hit ? (int)(hit - line) : -1;
+}
+
+/*
+ * Mark the matches that fall in columns [col, col + width) of a row; the
+ * one under the cursor is brighter. Only a pattern's length either side of
+ * them is searched, so a regex match longer than that is not shown.
+ */
+void editor_highlight_row(int file_row, int col, int text_x, int y, int width) {
+    int x = col > (int)sizeof(E.search_buf) ? col - (int)sizeof(E.search_buf) : 0, at, mlen, len;
+    int end = col + width + (int)sizeof(E.search_buf);
+    if (E.regex && file_row < E.line_match_len && E.line_match[file_row] == RX_LINE_MISS) return;
+    
+    const char *line = rope_peek(&E.doc, file_row, x ? x - 1 : 0, end, &len);
+    if (end < len) len = end;
+    while (x <= len && (at = editor_line_match(line, len, x, &mlen)) >= 0 && at < col + width) {
+        int from = at > col ? at - col : 0;
+        int to = at + mlen - col < width ? at + mlen - col : width;
+        if (to > from) buf_attr(text_x + from, y, to - from, file_row == E.cy && at == E.cx ? BG_MATCH_CURSOR : BG_MATCH);
+        x = at + (mlen ? mlen : 1);
+    }
+}
+
+/* Pick the highlighter for E.filename; another one starts from an empty state cache */
+void editor_syntax_select(void) {
+    Syntax *syn = syntax_for(E.filename);
+    if (syn != E.syntax) {
+        E.hl_len = E.hl_valid = 0;
+        syntax_marks_clear(&E.hl_marks);
+    }
+    E.syntax = syn;
+}
+
+/*
+ * Colour the visible columns of a row, from col on, by syntax class; lexing
+ * stops a little past the right edge, and on a long line starts from the
+ * last mark before the left one.
+ */
+void editor_syntax_row(int file_row, int len, int col, int text_x, int y, int visible, Attr base_attr) {
+    int end = col + visible, start = 0, state = E.hl_state[file_row] >> 4, lead = 0;
+    const char *line;
+    
+    if (E.syntax->flags & SYN_MARKDOWN) {
+        line = rope_get(&E.doc, file_row, &len);
+        len = len < end + 256 ? len : end + 256;
+    } else if (len >= 2 * HL_MARK_STEP) {
+        LineMarks *m = syntax_marks_update(&E.hl_marks, E.syntax, &E.doc, file_row, state, col);
+        int k = syntax_mark_before(m, col);
+        start = m->pos[k];
+        state = m->state[k];
+        lead = m->lead;
+        line = rope_peek(&E.doc, file_row, start ? start - 1 : 0, end + HL_TOKEN_MAX, &len);
+    } else {
+        line = rope_get(&E.doc, file_row, &len);
+        lead = syntax_lead(line, len);
+    }
+    
+    int n = (len - end > HL_TOKEN_MAX ? end + HL_TOKEN_MAX : len) - start, at = start;
+    if (n > E.hl_class_cap) {
+        E.hl_class_cap = n * 2;
+        E.hl_class = realloc(E.hl_class, E.hl_class_cap);
+    }
+    if (E.syntax->flags & SYN_MARKDOWN) syntax_lex(E.syntax, line, len, state, E.hl_class);
+    else syntax_lex_run(E.syntax, line, len, lead, &at, end, state, E.hl_class);
+    
+    for (int x = col, run; x < end; x = run) {
+        int class = E.hl_class[x - start];
+        for (run = x + 1; run < end && E.hl_class[run - start] == class; run++);
+        if (class != HL_NORMAL) buf_attr(text_x + x - col, y, run - x, syntax_colors[class] | (base_attr & BG_MASK));
+    }
+}
+
+/* Draw columns [col, col + width) of a line at screen row y; a row continuing a wrapped line has no number */
+void editor_draw_row(int file_row, int col, int y, int start_col, int width) {
+    char linenum[16];
+    int len, from, to;
+    int is_current = (file_row == E.cy);
     
-    for (int y = 0; y < E.screen_rows; y++) {
-        int idx = y + E.sidebar_scroll;
-        WORD attr = CLR_CYAN | BG_BLACK;
-        
-        if (idx < E.num_entries) {
-            if (idx == E.sidebar_cursor) {
-                attr = (E.mode == MODE_SIDEBAR) ? (CLR_WHITE | BG_CYAN) : (CLR_CYAN | BG_GRAY);
-            }
-            
-            char display[SIDEBAR_WIDTH];
-            memset(display, ' ', SIDEBAR_WIDTH - 1);
-            display[SIDEBAR_WIDTH - 1] = '\0';
-            
-            char temp[SIDEBAR_WIDTH];
-            if (E.dir_entries[idx].is_dir) {
-                snprintf(temp, SIDEBAR_WIDTH - 3, " [%s]", E.dir_entries[idx].name);
-            } else {
-                snprintf(temp, SIDEBAR_WIDTH - 3, "  %s", E.dir_entries[idx].name);
-            }
-            int len = strlen(temp);
-            if (len > SIDEBAR_WIDTH - 2) len = SIDEBAR_WIDTH - 2;
-            memcpy(display, temp, len);
-            
-            buf_write(0, y, display, attr);
-        } else {
-            for (int x = 0; x < SIDEBAR_WIDTH - 1; x++)
-                buf_set(x, y, ' ', CLR_CYAN | BG_BLACK);
-        }
-        buf_set(SIDEBAR_WIDTH - 1, y, '|', CLR_YELLOW | BG_BLACK);
+    /* Line numbers */
+    snprintf(linenum, sizeof(linenum), "%5d ", file_row + 1);
+    Attr ln_attr = is_current ? (CLR_YELLOW | BG_BLUE) : (CLR_YELLOW | BG_BLACK);
+    buf_write(start_col, y, E.wrap && col ? "      " : linenum, ln_attr);
+    
+    /* Line content: the visible slice, padding, then the selected columns */
+    const char *line = rope_peek(&E.doc, file_row, col, col + width, &len);
+    Attr base_attr = is_current ? (CLR_WHITE | BG_BLUE) : (CLR_DEFAULT | BG_BLACK);
+    int text_x = start_col + 6;
+    int visible = len - col;
+    if (visible < 0) visible = 0;
+    if (visible > width) visible = width;
+    
+    buf_copy(text_x, y, line + (visible ? col : 0), visible, base_attr);
+    buf_fill(text_x + visible, y, width - visible, ' ', base_attr);
+    if (E.syntax && visible > 0) editor_syntax_row(file_row, len, col, text_x, y, visible, base_attr);
+    if (E.search_highlight) editor_highlight_row(file_row, col, text_x, y, width);
+    if (selection_columns(file_row, &from, &to)) {
+        from = from > col ? from - col : 0;
+        to = to - col < width ? to - col : width;
+        if (to > from) buf_attr(text_x + from, y, to - from, CLR_WHITE | BG_SELECT);
     }
 }
 
-void editor_draw(void) {
-    buf_clear();
-    
+/* Build the whole frame in E.buffer; every cell is written, so no clear is needed */
+void editor_render(void) {
+
     int start_col = E.sidebar_visible ? SIDEBAR_WIDTH : 0;
     int editor_width = E.screen_cols - start_col - 6;
+    int last_row = E.row_offset + E.screen_rows < rope_count(&E.doc) ? E.row_offset + E.screen_rows : rope_count(&E.doc);
+    
+    /* Lexer states through the last row on screen; lines above that kept theirs are not read */
+    if (E.syntax) {
+        line_cache_grow(&E.hl_state, &E.hl_len, &E.hl_cap, rope_count(&E.doc), HL_UNKNOWN);
+        if (last_row > E.hl_valid) {
+            syntax_update(E.syntax, &E.doc, E.hl_state, E.hl_valid, last_row - 1, &E.hl_marks);
+            E.hl_valid = last_row;
+        }
+    }
     
-    /* Draw text area */
+    /* Draw text area; wrapped, a line goes on to the next row until its end is shown */
+    int file_row = E.row_offset, col = E.wrap ? E.wrap_sub * editor_width : E.col_offset;
     for (int y = 0; y < E.screen_rows; y++) {
-        int file_row = y + E.row_offset;
-        
-        if (file_row < E.num_lines) {
-            /* Line numbers */
-            char linenum[8];
-            snprintf(linenum, sizeof(linenum), "%5d ", file_row + 1);
-            WORD ln_attr = (file_row == E.cy) ? (CLR_YELLOW | BG_BLUE) : (CLR_YELLOW | BG_BLACK);
-            buf_write(start_col, y, linenum, ln_attr);
-            
-            /* Line content */
-            char *line = E.lines[file_row];
-            int len = strlen(line);
-            int is_current = (file_row == E.cy);
-            WORD base_attr = is_current ? (CLR_WHITE | BG_BLUE) : (CLR_DEFAULT | BG_BLACK);
-            
-            for (int i = 0; i < editor_width; i++) {
-                int file_col = i + E.col_offset;
-                char c = (file_col < len) ? line[file_col] : ' ';
-                WORD attr = base_attr;
-                
-                if (is_selected(file_col, file_row)) {
-                    attr = CLR_WHITE | BG_SELECT;
-                }
-                
-                buf_set(start_col + 6 + i, y, c, attr);
+        if (file_row < rope_count(&E.doc)) {
+            editor_draw_row(file_row, col, y, start_col, editor_width);
+            if (E.wrap && col + editor_width <= rope_len(&E.doc, file_row)) {
+                col += editor_width;
+            } else {
+                file_row++;
+                col = E.wrap ? 0 : E.col_offset;
             }
         } else {
             buf_write(start_col, y, "    ~ ", CLR_GRAY | BG_BLACK);
+            buf_fill(start_col + 6, y, editor_width, ' ', CLR_DEFAULT | BG_BLACK);
         }
     }
     
+    if (E.mode == MODE_GREP) grep_draw(start_col);
+    if (E.mode == MODE_FIND) find_draw(start_col);
+    
     /* Sidebar */
     sidebar_draw();
     
@@ -648,22 +8582,42 @@ void editor_draw(void) {
     buf_fill_line(E.screen_rows, ' ', CLR_WHITE | BG_GRAY);
     
     const char *mode_str = "NORMAL";
-    WORD mode_color = CLR_GREEN;
+    Attr mode_color = CLR_GREEN;
     switch (E.mode) {
         case MODE_INSERT: mode_str = "INSERT"; mode_color = CLR_YELLOW; break;
         case MODE_COMMAND: mode_str = "COMMAND"; mode_color = CLR_CYAN; break;
         case MODE_SEARCH: mode_str = "SEARCH"; mode_color = CLR_MAGENTA; break;
         case MODE_SIDEBAR: mode_str = "BROWSE"; mode_color = CLR_CYAN; break;
+        case MODE_GREP: mode_str = "GREP"; mode_color = CLR_MAGENTA; break;
+        case MODE_FIND: mode_str = "FIND"; mode_color = CLR_MAGENTA; break;
         default: break;
     }
     
-    char status[256];
-    snprintf(status, sizeof(status), " [%s] %s%s | Ln %d, Col %d | %d lines",
+    char status[sizeof(E.filename) + 256], extra[128] = "";
+    if (filemap_loading(E.doc.map)) {
+        snprintf(extra, sizeof(extra), " | indexing %d%%", E.doc.map->published * 100 / E.doc.map->num_chunks);
+    } else if (E.crlf) {
+        strcpy(extra, " | CRLF");
+    }
+    if (E.autosave_job) strcat(extra, " | autosaving");
+    if (E.show_stats) {
+        snprintf(extra + strlen(extra), sizeof(extra) - strlen(extra), " | %d cells, %d bytes | %lld owned lines, %d slabs",
+                 E.frame_cells, E.frame_bytes, E.doc.arena.lines, E.doc.arena.slab_count);
+        if (E.swap && E.swap->running) {
+            snprintf(extra + strlen(extra), sizeof(extra) - strlen(extra), " | journal %lld KB, %lld syncs%s",
+                     __atomic_load_n(&E.swap->written, __ATOMIC_RELAXED) / 1024, __atomic_load_n(&E.swap->syncs, __ATOMIC_RELAXED),
+                     __atomic_load_n(&E.swap->failed, __ATOMIC_RELAXED) ? ", failing" : "");
+        }
+    }
+    snprintf(status, sizeof(status), " [%s] %s%s | Ln %d, Col %d | %d lines%s",
              mode_str,
              E.filename[0] ? E.filename : "[No Name]",
              E.modified ? " [+]" : "",
-             E.cy + 1, E.cx + 1, E.num_lines);
+             E.cy + 1, E.cx + 1, rope_count(&E.doc), extra);
     buf_write(0, E.screen_rows, status, CLR_WHITE | BG_GRAY);
+    char label[16];
+    snprintf(label, sizeof(label), "[%s]", mode_str);
+    buf_write(1, E.screen_rows, label, mode_color | BG_GRAY);
     
     /* Message line */
     buf_fill_line(E.screen_rows + 1, ' ', CLR_DEFAULT | BG_BLACK);
@@ -676,15 +8630,24 @@ void editor_draw(void) {
         char srch[260];
         snprintf(srch, sizeof(srch), "/%s", E.search_buf);
         buf_write(0, E.screen_rows + 1, srch, CLR_CYAN | BG_BLACK);
+    } else if (E.mode == MODE_FIND && E.paths) {
+        char find[300];
+        snprintf(find, sizeof(find), "> %s", E.find_buf);
+        buf_write(0, E.screen_rows + 1, find, CLR_CYAN | BG_BLACK);
+        snprintf(find, sizeof(find), "  %d/%d%s", E.find_cand_n[E.find_len], E.paths->count, E.path_build ? " (reindexing)" : "");
+        buf_write(E.find_len + 2, E.screen_rows + 1, find, CLR_GRAY | BG_BLACK);
     } else {
         buf_write(1, E.screen_rows + 1, E.status_msg, CLR_DEFAULT | BG_BLACK);
     }
     
-    buf_flush();
-    
     /* Position cursor */
     int cursor_y = E.cy - E.row_offset;
     int cursor_x = E.cx - E.col_offset + start_col + 6;
+    if (E.wrap) {
+        WrapIndex *w = editor_wrap();
+        cursor_y = wrap_row(w, &E.doc, E.cy) + E.cx / w->width - editor_wrap_top(w);
+        cursor_x = E.cx % w->width + start_col + 6;
+    }
     
     if (E.mode == MODE_COMMAND) {
         set_cursor(E.command_len + 1, E.screen_rows + 1);
@@ -692,14 +8655,297 @@ void editor_draw(void) {
         set_cursor(E.search_len + 1, E.screen_rows + 1);
     } else if (E.mode == MODE_SIDEBAR) {
         set_cursor(1, E.sidebar_cursor - E.sidebar_scroll);
+    } else if (E.mode == MODE_GREP) {
+        set_cursor(start_col, E.grep_cursor - E.grep_scroll);
+    } else if (E.mode == MODE_FIND && E.paths) {
+        set_cursor(E.find_len + 2, E.screen_rows + 1);
     } else {
         set_cursor(cursor_x, cursor_y);
     }
 }
 
+void editor_draw(void) {
+    editor_render();
+    buf_flush();
+}
+
+/* Frames per second rendering a screen of long lines, without and with a full-screen selection */
+int draw_bench(int cols, int rows) {
+    char line[256];
+    int frames = 2000;
+    
+    E.screen_cols = cols;
+    E.screen_rows = rows - STATUS_HEIGHT;
+    buf_resize();
+    for (int i = 0; i < (int)sizeof(line) - 1; i++) line[i] = 'a' + i % 26;
+    line[sizeof(line) - 1] = '\0';
+    for (int i = 0; i < rows * 4; i++) rope_insert(&E.doc, i, line, strlen(line));
+    
+    printf("draw bench: %dx%d, %d frames\n", cols, rows, frames);
+    for (int pass = 0; pass < 2; pass++) {
+        E.sel.active = pass;
+        E.sel.start_x = 3;
+        E.sel.start_y = 0;
+        E.sel.end_x = 10;
+        E.sel.end_y = rows;
+        double t0 = now_ms();
+        for (int i = 0; i < frames; i++) {
+            E.cy = i % E.screen_rows;
+            editor_render();
+        }
+        double t1 = now_ms();
+        printf("  %-16s  %8.0f fps (%5.1f ns/cell)\n", pass ? "full selection:" : "no selection:",
+               frames * 1000.0 / (t1 - t0), (t1 - t0) * 1e6 / ((double)frames * E.buf_size));
+    }
+    rope_free(&E.doc);
+    return 0;
+}
+
+/*
+ * Frame cost of highlighting a large C file while an unterminated comment
+ * opener is typed and removed on line 1, then the one-off cost of jumping
+ * to the end with every line's state changed
+ */
+int syntax_bench(int lines) {
+    const char *sample[] = {
+        "static int count_%d(const char *s) {",
+        "    /* Walk the string */",
+        "    for (int i = 0; s[i]; i++) if (s[i] == 'x') return i + 0x10;",
+        "    return \"done\\n\"[0];  // fallback",
+        "}",
+        "",
+    };
+    char line[128];
+    int frames = 2000, len;
+    
+    E.screen_cols = 120;
+    E.screen_rows = 50 - STATUS_HEIGHT;
+    buf_resize();
+    for (int i = 0; i < lines; i++) {
+        snprintf(line, sizeof(line), sample[i % 6], i);
+        rope_insert(&E.doc, i, line, strlen(line));
+    }
+    strcpy(E.filename, "bench.c");
+    
+    printf("syntax bench: %d lines, %d frames typing at line 1\n", lines, frames);
+    for (int pass = 0; pass < 2; pass++) {
+        E.syntax = pass ? syntax_for(E.filename) : NULL;
+        E.hl_len = E.hl_valid = 0;
+        E.row_offset = 0;
+        double t0 = now_ms(), worst = 0;
+        for (int i = 0; i < frames; i++) {
+            if (i % 2 == 0) {
+                doc_insert_text(0, 0, "/*", 2);
+            } else {
+                free(doc_delete_text(0, 0, 2, &len));
+            }
+            double f0 = now_ms();
+            editor_render();
+            double ms = now_ms() - f0;
+            if (ms > worst) worst = ms;
+        }
+        double t1 = now_ms();
+        printf("  %-12s %8.4f ms per edit and frame, %.4f ms worst frame\n", pass ? "highlighted:" : "plain:", (t1 - t0) / frames, worst);
+    }
+    
+    /* Leave the comment open, then draw the bottom of the file twice */
+    doc_insert_text(0, 0, "/*", 2);
+    editor_render();
+    E.row_offset = lines - E.screen_rows;
+    for (int i = 0; i < 2; i++) {
+        double t0 = now_ms();
+        editor_render();
+        printf("  %-12s %8.2f ms\n", i ? "end again:" : "jump to end:", now_ms() - t0);
+    }
+    E.syntax = NULL;
+    rope_free(&E.doc);
+    return 0;
+}
+
+/* Typing in the middle of one line of mb megabytes, and jumping along it, with highlighting on */
+int longline_bench(int mb) {
+    const char *sample = "x = f(a, \"s\"); /* c */ y += 0x1f; ";
+    int size = mb * 1024 * 1024, n = (int)strlen(sample), edits = 2000, len;
+    char *text = malloc(size);
+    for (int i = 0; i < size; i++) text[i] = sample[i % n];
+    
+    E.screen_cols = 120;
+    E.screen_rows = 50 - STATUS_HEIGHT;
+    buf_resize();
+    rope_insert(&E.doc, 0, text, size);
+    free(text);
+    strcpy(E.filename, "bench.c");
+    E.syntax = syntax_for(E.filename);
+    E.hl_len = E.hl_valid = 0;
+    
+    printf("long line bench: one line of %d MB\n", mb);
+    double t0 = now_ms();
+    editor_render();
+    printf("  %-14s %8.2f ms\n", "first frame:", now_ms() - t0);
+    
+    E.cx = size / 2;
+    E.col_offset = E.cx - 40;
+    for (int pass = 0; pass < 2; pass++) {
+        double worst = 0;
+        t0 = now_ms();
+        for (int i = 0; i < edits; i++) {
+            if (pass == 0) doc_insert_text(0, E.cx, "a", 1);
+            else free(doc_delete_text(0, E.cx - 1, 1, &len));
+            double f0 = now_ms();
+            editor_render();
+            if (now_ms() - f0 > worst) worst = now_ms() - f0;
+        }
+        printf("  %-14s %8.4f ms per edit and frame, %.4f ms worst frame\n", pass ? "deleting:" : "typing:", (now_ms() - t0) / edits, worst);
+    }
+    
+    /* A quote turns the rest of the line inside out, so that much is lexed again */
+    t0 = now_ms();
+    doc_insert_text(0, E.cx, "\"", 1);
+    editor_render();
+    printf("  %-14s %8.2f ms\n", "typing \":", now_ms() - t0);
+    
+    /* $ then 0, each followed by a frame at that end of the line */
+    t0 = now_ms();
+    E.cx = rope_len(&E.doc, 0);
+    E.col_offset = E.cx - 80;
+    editor_render();
+    E.cx = E.col_offset = 0;
+    editor_render();
+    printf("  %-14s %8.4f ms\n", "$ and 0:", now_ms() - t0);
+    
+    t0 = now_ms();
+    for (int i = 0; i < edits; i++) {
+        E.col_offset = (int)((long long)rand() * rand() % size);
+        editor_render();
+    }
+    printf("  %-14s %8.4f ms per frame\n", "random scroll:", (now_ms() - t0) / edits);
+    
+    /* For scale: what reading the whole line once costs */
+    doc_insert_text(0, size / 3, "a", 1);
+    t0 = now_ms();
+    rope_get(&E.doc, 0, &len);
+    printf("  %-14s %8.2f ms\n", "join once:", now_ms() - t0);
+    E.syntax = NULL;
+    rope_free(&E.doc);
+    syntax_marks_clear(&E.hl_marks);
+    return 0;
+}
+
+/* Paging, typing and resizing with soft wrap on, against counting rows from the top of the file */
+int wrap_bench(int lines) {
+    char text[400];
+    int pages = 1000, edits = 1000;
+    
+    memset(text, 'x', sizeof(text));
+    E.screen_cols = 120;
+    E.screen_rows = 50 - STATUS_HEIGHT;
+    buf_resize();
+    for (int i = 0; i < lines; i++) rope_insert(&E.doc, i, text, i % 7 ? i % 90 : (i * 31) % 400);
+    E.wrap = 1;
+    
+    printf("wrap bench: %d lines, %d columns of text\n", lines, E.screen_cols - 6);
+    double t0 = now_ms();
+    editor_scroll();
+    editor_render();
+    printf("  %-16s %8.2f ms\n", "first frame:", now_ms() - t0);
+    
+    t0 = now_ms();
+    E.cy = lines - 1;
+    editor_scroll();
+    editor_render();
+    printf("  %-16s %8.2f ms\n", "G, counting all:", now_ms() - t0);
+    
+    t0 = now_ms();
+    for (int i = 0; i < pages; i++) {
+        editor_wrap_move(i < pages / 2 ? -E.screen_rows : E.screen_rows);
+        editor_scroll();
+        editor_render();
+    }
+    printf("  %-16s %8.4f ms per page and frame\n", "PgUp and PgDn:", (now_ms() - t0) / pages);
+    
+    t0 = now_ms();
+    for (int i = 0; i < edits; i++) {
+        doc_insert_text(E.cy, E.cx, "a", 1);
+        editor_scroll();
+        editor_render();
+    }
+    printf("  %-16s %8.4f ms per edit and frame\n", "typing:", (now_ms() - t0) / edits);
+    
+    /* A line added near the top moves every row below it, the cursor staying near the end */
+    t0 = now_ms();
+    for (int i = 0; i < edits; i++) {
+        int cy = E.cy, cx = E.cx;
+        doc_insert_text(10, 0, "\n", 1);
+        E.cy = cy + 1;
+        E.cx = cx;
+        editor_scroll();
+        editor_render();
+    }
+    printf("  %-16s %8.4f ms per edit and frame\n", "Enter far above:", (now_ms() - t0) / edits);
+    
+    t0 = now_ms();
+    E.screen_cols = 100;
+    buf_resize();
+    editor_scroll();
+    editor_render();
+    printf("  %-16s %8.2f ms\n", "resize at end:", now_ms() - t0);
+    
+    t0 = now_ms();
+    E.screen_cols = 120;
+    buf_resize();
+    E.cy = E.cx = 0;
+    editor_scroll();
+    editor_render();
+    printf("  %-16s %8.2f ms\n", "resize at top:", now_ms() - t0);
+    
+    /* For scale: finding the row of the last line without the index */
+    t0 = now_ms();
+    int rows = 0;
+    for (int i = 0; i < rope_count(&E.doc); i++) rows += rope_len(&E.doc, i) / (E.screen_cols - 6) + 1;
+    printf("  %-16s %8.2f ms (%d rows)\n", "walk from top:", now_ms() - t0, rows);
+    E.wrap = 0;
+    wrap_free(&E.wrap_index);
+    rope_free(&E.doc);
+    return 0;
+}
+
+/* Search as you type from the top: each prefix narrowed from the last one, then each from scratch */
+int isearch_bench(const char *path, const char *pattern) {
+    int m = strlen(pattern);
+    FileMap *map = filemap_open(path);
+    if (!map || m == 0) return 1;
+    rope_load(&E.doc, map);
+    rope_finish(&E.doc);
+    E.search_regex = 1;
+    
+    for (int pass = 0; pass < 2; pass++) {
+        double worst = 0, total = 0;
+        E.cy = E.cx = 0;
+        E.isearch_y = E.isearch_x = 0;
+        E.isearch[0].found = 1;
+        E.isearch[0].y = E.isearch[0].wrapped = 0;
+        E.isearch[0].x = 1;
+        for (E.search_len = 1; E.search_len <= m; E.search_len++) {
+            memcpy(E.search_buf, pattern, E.search_len);
+            E.search_buf[E.search_len] = '\0';
+            if (pass) E.isearch[E.search_len - 1].found = -1;
+            double t0 = now_ms();
+            editor_isearch();
+            double ms = now_ms() - t0;
+            total += ms;
+            if (ms > worst) worst = ms;
+        }
+        printf("  typed, %s %8.2f ms worst keystroke, %.2f ms for all %d\n", pass ? "from scratch:" : "narrowed:    ", worst, total, m);
+    }
+    regex_free(E.regex);
+    free(E.line_match);
+    rope_free(&E.doc);
+    return 0;
+}
+
 void editor_move_cursor(int key, int is_vk) {
-    char *line = (E.cy < E.num_lines) ? E.lines[E.cy] : NULL;
-    int len = line ? strlen(line) : 0;
+    undo_seal();
+    int len = (E.cy < rope_count(&E.doc)) ? rope_len(&E.doc, E.cy) : 0;
     
     if (is_vk) {
         /* Virtual key codes */
@@ -714,7 +8960,7 @@ void editor_move_cursor(int key, int is_vk) {
                 if (E.cy > 0) E.cy--;
                 break;
             case VK_DOWN:
-                if (E.cy < E.num_lines - 1) E.cy++;
+                if (E.cy < rope_count(&E.doc) - 1) E.cy++;
                 break;
             case VK_HOME:
                 E.cx = 0;
@@ -723,12 +8969,20 @@ void editor_move_cursor(int key, int is_vk) {
                 E.cx = len;
                 break;
             case VK_PRIOR:
+                if (E.wrap) {
+                    editor_wrap_move(-E.screen_rows);
+                    break;
+                }
                 E.cy -= E.screen_rows;
                 if (E.cy < 0) E.cy = 0;
                 break;
             case VK_NEXT:
+                if (E.wrap) {
+                    editor_wrap_move(E.screen_rows);
+                    break;
+                }
                 E.cy += E.screen_rows;
-                if (E.cy >= E.num_lines) E.cy = E.num_lines - 1;
+                if (E.cy >= rope_count(&E.doc)) E.cy = rope_count(&E.doc) - 1;
                 break;
         }
     } else {
@@ -744,7 +8998,7 @@ void editor_move_cursor(int key, int is_vk) {
                 if (E.cy > 0) E.cy--;
                 break;
             case 'j':
-                if (E.cy < E.num_lines - 1) E.cy++;
+                if (E.cy < rope_count(&E.doc) - 1) E.cy++;
                 break;
             case '0':
                 E.cx = 0;
@@ -756,35 +9010,35 @@ void editor_move_cursor(int key, int is_vk) {
     }
     
     /* Snap to line end */
-    line = (E.cy < E.num_lines) ? E.lines[E.cy] : NULL;
-    len = line ? strlen(line) : 0;
+    len = (E.cy < rope_count(&E.doc)) ? rope_len(&E.doc, E.cy) : 0;
     if (E.cx > len) E.cx = len;
     E.dirty = 1;
 }
 
 void editor_word_forward(void) {
-    char *line = E.lines[E.cy];
-    int len = strlen(line);
+    int len;
+    const char *line = rope_peek(&E.doc, E.cy, E.cx, INT_MAX, &len);
     
     while (E.cx < len && !isspace(line[E.cx])) E.cx++;
     while (E.cx < len && isspace(line[E.cx])) E.cx++;
     
-    if (E.cx >= len && E.cy < E.num_lines - 1) {
+    if (E.cx >= len && E.cy < rope_count(&E.doc) - 1) {
         E.cy++;
         E.cx = 0;
-        line = E.lines[E.cy];
-        while (E.cx < (int)strlen(line) && isspace(line[E.cx])) E.cx++;
+        line = rope_peek(&E.doc, E.cy, 0, INT_MAX, &len);
+        while (E.cx < len && isspace(line[E.cx])) E.cx++;
     }
     E.dirty = 1;
 }
 
 void editor_word_backward(void) {
-    char *line = E.lines[E.cy];
+    int len;
+    const char *line = rope_peek(&E.doc, E.cy, 0, E.cx + 1, &len);
     
     if (E.cx == 0 && E.cy > 0) {
         E.cy--;
-        E.cx = strlen(E.lines[E.cy]);
-        line = E.lines[E.cy];
+        line = rope_peek(&E.doc, E.cy, 0, INT_MAX, &len);
+        E.cx = len;
     }
     
     if (E.cx > 0) E.cx--;
@@ -793,33 +9047,440 @@ void editor_word_backward(void) {
     E.dirty = 1;
 }
 
-void editor_search(void) {
-    if (E.search_len == 0) return;
+/*
+ * Keep the per-line regex and lexer caches in step with an edit that
+ * replaced lines [y, y + removed] with [y, y + added]: only those lines
+ * are forgotten, and lexer states from y on are checked again when drawn.
+ * An edit within one line has already moved that line's lexer marks. The
+ * wrap index only recounts the blocks of lines the edit touched.
+ */
+void editor_lines_changed(int y, int removed, int added) {
+    E.count_active = 0;
+    line_cache_edit(&E.line_match, &E.line_match_len, &E.line_match_cap, y, removed, added, RX_LINE_UNKNOWN);
+    line_cache_edit(&E.hl_state, &E.hl_len, &E.hl_cap, y, removed, added, HL_UNKNOWN);
+    if (removed || added) syntax_marks_lines(&E.hl_marks, y, removed, added);
+    if (E.hl_valid > y) E.hl_valid = y;
+    wrap_edit(&E.wrap_index, y, removed, added);
+}
+
+/* Matches for the current pattern: regex when E.regex is set, literal otherwise */
+int editor_find(int y, int x, int to_y, int backward, int *my, int *mx) {
+    if (!E.regex) {
+        if (backward) return rope_search_back(&E.doc, &E.searcher, y, x, to_y, my, mx);
+        return rope_search(&E.doc, &E.searcher, y, x, to_y, my, mx);
+    }
     
+    line_cache_grow(&E.line_match, &E.line_match_len, &E.line_match_cap, rope_count(&E.doc), RX_LINE_UNKNOWN);
+    if (backward) return rope_regex_search_back(&E.doc, E.regex, E.line_match, E.line_match_len, y, x, to_y, my, mx);
+    return rope_regex_search(&E.doc, E.regex, E.line_match, E.line_match_len, y, x, to_y, my, mx);
+}
+
+/*
+ * Scan lines from y towards to_y (inclusive when going backward, exclusive
+ * going forward) SEARCH_SLICE lines at a time, checking for Ctrl+C between
+ * slices. Returns 1 on a match, 0 on a miss, -1 if cancelled.
+ */
+int editor_search_lines(int y, int x, int to_y, int backward, int *my, int *mx) {
+    if (!backward) {
+        for (; y < to_y; y += SEARCH_SLICE, x = 0) {
+            int end = to_y - y > SEARCH_SLICE ? y + SEARCH_SLICE : to_y;
+            if (editor_find(y, x, end, 0, my, mx)) return 1;
+            if (end < to_y && term_interrupted()) return -1;
+        }
+    } else {
+        for (; y >= to_y; y -= SEARCH_SLICE, x = INT_MAX) {
+            int stop = y - to_y >= SEARCH_SLICE ? y - SEARCH_SLICE + 1 : to_y;
+            if (editor_find(y, x, stop, 1, my, mx)) return 1;
+            if (stop > to_y && term_interrupted()) return -1;
+        }
+    }
+    return 0;
+}
+
+/* Compile E.search_buf, reusing the last regex (and its line cache) if the pattern is unchanged */
+int editor_search_compile(char *err, int err_size) {
+    if (E.search_regex && !regex_is_literal(E.search_buf, E.search_len)) {
+        if (!E.regex || strcmp(E.regex_pat, E.search_buf) != 0 || E.regex_icase != E.search_icase) {
+            regex_free(E.regex);
+            E.regex = regex_compile(E.search_buf, E.search_len, E.search_icase, err, err_size);
+            if (!E.regex) return 0;
+            strcpy(E.regex_pat, E.search_buf);
+            E.regex_icase = E.search_icase;
+            E.line_match_len = 0;
+        }
+    } else {
+        regex_free(E.regex);
+        E.regex = NULL;
+        search_compile(&E.searcher, E.search_buf, E.search_len, E.search_icase);
+    }
+    return 1;
+}
+
+/*
+ * Forward from (y, x) to the end of the file, then on from the top through
+ * line end_y; if wrapped is set the scan is already past the end. A match
+ * on the last line that the first pass skipped is picked up by the wrap.
+ */
+int editor_search_forward(int y, int x, int wrapped, int end_y, int *my, int *mx, int *did_wrap) {
     int found = 0;
-    int start_y = E.cy, start_x = E.cx + 1;
+    *did_wrap = wrapped;
+    if (!wrapped) {
+        found = editor_search_lines(y, x, rope_count(&E.doc), 0, my, mx);
+        y = x = 0;
+        *did_wrap = 1;
+    }
+    if (found == 0) found = editor_search_lines(y, x, end_y + 1, 0, my, mx);
+    else *did_wrap = wrapped;
+    return found;
+}
+
+/* Land on a match: status, and start counting matches while idle */
+void editor_search_found(int my, int mx, int wrapped) {
+    E.cy = my;
+    E.cx = mx;
+    E.search_highlight = 1;
+    editor_set_status(wrapped ? "Found: '%s' (wrapped)" : "Found: '%s'", E.search_buf);
     
-    for (int y = start_y; y < E.num_lines && !found; y++) {
-        char *match = strstr(E.lines[y] + (y == start_y ? start_x : 0), E.search_buf);
-        if (match) {
-            E.cy = y;
-            E.cx = match - E.lines[y];
-            found = 1;
+    /* Matches are counted in editor_poll while the editor is idle */
+    E.count_active = 1;
+    E.count_y = E.count_x = 0;
+    E.count_total = E.count_before = 0;
+    E.count_at_y = my;
+    E.count_at_x = mx;
+}
+
+/* Jump to the next (or previous) match, wrapping around the file once */
+void editor_search(int backward) {
+    if (E.search_len == 0) return;
+    
+    int count = rope_count(&E.doc), my, mx, wrapped = 0, found;
+    char err[64];
+    E.count_active = 0;
+    if (!editor_search_compile(err, sizeof(err))) {
+        editor_set_status("Bad pattern: %s", err);
+        return;
+    }
+    
+    if (!backward) {
+        found = editor_search_forward(E.cy, E.cx + 1, 0, E.cy, &my, &mx, &wrapped);
+    } else {
+        found = editor_search_lines(E.cy, E.cx, 0, 1, &my, &mx);
+        if (found == 0) {
+            found = editor_search_lines(count - 1, INT_MAX, E.cy, 1, &my, &mx);
+            wrapped = 1;
         }
     }
     
-    if (!found) {
-        for (int y = 0; y <= start_y && !found; y++) {
-            char *match = strstr(E.lines[y], E.search_buf);
-            if (match && (y < start_y || (match - E.lines[y]) < start_x)) {
-                E.cy = y;
-                E.cx = match - E.lines[y];
-                found = 1;
-            }
+    if (found < 0) {
+        editor_set_status("Search cancelled");
+    } else if (found == 0) {
+        editor_set_status("Not found: '%s'", E.search_buf);
+    } else {
+        editor_search_found(my, mx, wrapped);
+    }
+}
+
+/*
+ * Search as you type: runs after every change to E.search_buf. A literal
+ * pattern one byte longer can only match where its prefix matched, so its
+ * first match is at or after the prefix's: the scan resumes from there, and
+ * a prefix with no match at all ends it at once. E.isearch keeps the result
+ * for every prefix length, so Backspace just steps back to the shorter one.
+ */
+void editor_isearch(void) {
+    int len = E.search_len, my, mx, wrapped, found;
+    SearchHit *hit = &E.isearch[len], *from = &E.isearch[0];
+    char err[64];
+    
+    E.count_active = 0;
+    E.search_highlight = 0;
+    E.cy = E.isearch_y;
+    E.cx = E.isearch_x;
+    E.dirty = 1;
+    if (len == 0 || !editor_search_compile(err, sizeof(err))) {
+        hit->found = -1;
+        return;
+    }
+    E.search_highlight = 1;
+    
+    int literal = !E.search_regex || (regex_is_literal(E.search_buf, len));
+    if (literal && len > 1 && E.isearch[len - 1].found >= 0) from = &E.isearch[len - 1];
+    if (from->found == 0) {
+        hit->found = 0;
+        return;
+    }
+    
+    found = editor_search_forward(from->y, from->x, from->wrapped, E.isearch_y, &my, &mx, &wrapped);
+    hit->found = found;
+    if (found > 0) {
+        hit->y = E.cy = my;
+        hit->x = E.cx = mx;
+        hit->wrapped = wrapped;
+    }
+}
+
+/* Back to a shorter prefix: its first match is already known */
+void editor_isearch_back(void) {
+    SearchHit *hit = &E.isearch[E.search_len];
+    char err[64];
+    
+    if (hit->found < 0 || E.search_len == 0) {
+        editor_isearch();
+        return;
+    }
+    editor_search_compile(err, sizeof(err));
+    E.search_highlight = 1;
+    E.count_active = 0;
+    E.cy = hit->found ? hit->y : E.isearch_y;
+    E.cx = hit->found ? hit->x : E.isearch_x;
+    E.dirty = 1;
+}
+
+/* Count matches of the last search for a few milliseconds; edits cancel the count */
+void editor_count_step(void) {
+    int count = rope_count(&E.doc), my, mx, steps = 0;
+    double deadline = now_ms() + 8;
+    
+    while (E.count_y < count) {
+        int end = count - E.count_y > 4096 ? E.count_y + 4096 : count;
+        while (editor_find(E.count_y, E.count_x, end, 0, &my, &mx)) {
+            E.count_total++;
+            if (my < E.count_at_y || (my == E.count_at_y && mx <= E.count_at_x)) E.count_before++;
+            E.count_y = my;
+            E.count_x = mx + 1;
+            if (++steps % 4096 == 0 && now_ms() > deadline) return;
+        }
+        E.count_y = end;
+        E.count_x = 0;
+        if (now_ms() > deadline) return;
+    }
+    E.count_active = 0;
+    editor_set_status("'%s' match %d of %d", E.search_buf, E.count_before, E.count_total);
+}
+
+/* Progress or outcome of the last :grep on the message line */
+void editor_grep_status(void) {
+    Grep *g = E.grep;
+    mutex_lock(&g->lock);
+    int count = g->count, files = g->file_count;
+    mutex_unlock(&g->lock);
+    int scanned = __atomic_load_n(&g->scanned, __ATOMIC_RELAXED);
+    
+    if (E.grep_active) {
+        editor_set_status("grep '%s': %d matches in %d files, %d files searched...", g->pattern, count, files, scanned);
+    } else {
+        editor_set_status("grep '%s': %d matches in %d files, %d files searched in %.0f ms%s", g->pattern, count, files,
+                          scanned, g->elapsed, count >= GREP_MAX_HITS ? " (stopped at the limit)" : g->cancel ? " (cancelled)" : "");
+    }
+    E.dirty = 1;
+}
+
+/* Search every file under the sidebar directory and list the matching lines */
+void editor_grep(const char *pat) {
+    char err[64];
+    Grep *g = grep_start(E.current_dir, pat, E.search_icase, E.search_regex, cpu_count(), err, sizeof(err));
+    if (!g) {
+        editor_set_status("Bad pattern: %s", err);
+        return;
+    }
+    grep_free(E.grep);
+    E.grep = g;
+    E.grep_active = 1;
+    E.grep_cursor = E.grep_scroll = 0;
+    E.mode = MODE_GREP;
+    editor_grep_status();
+}
+
+void editor_grep_move(int delta) {
+    mutex_lock(&E.grep->lock);
+    int count = E.grep->count;
+    mutex_unlock(&E.grep->lock);
+    
+    E.grep_cursor += delta;
+    if (E.grep_cursor > count - 1) E.grep_cursor = count - 1;
+    if (E.grep_cursor < 0) E.grep_cursor = 0;
+    if (E.grep_cursor < E.grep_scroll) E.grep_scroll = E.grep_cursor;
+    if (E.grep_cursor >= E.grep_scroll + E.screen_rows) E.grep_scroll = E.grep_cursor - E.screen_rows + 1;
+    E.dirty = 1;
+}
+
+/* Open the file of the selected result at the match */
+void editor_grep_open(void) {
+    char path[1024];
+    int line, col;
+    Grep *g = E.grep;
+    
+    mutex_lock(&g->lock);
+    if (E.grep_cursor >= g->count) {
+        mutex_unlock(&g->lock);
+        return;
+    }
+    GrepHit *h = &g->hits[E.grep_cursor];
+    snprintf(path, sizeof(path), "%s", g->files[h->file]);
+    line = h->line;
+    col = h->col;
+    mutex_unlock(&g->lock);
+    
+    buffer_open(path);
+    if (line >= rope_count(&E.doc)) rope_finish(&E.doc);
+    if (line < rope_count(&E.doc)) {
+        E.cy = line;
+        E.cx = col;
+    }
+    E.mode = MODE_NORMAL;
+    E.dirty = 1;
+}
+
+/* Open the fuzzy finder over the files below the sidebar directory */
+void editor_find_open(const char *query) {
+    if (E.path_build && strcmp(E.path_build->root, E.current_dir) != 0) {
+        path_build_finish(E.path_build, 1);
+        E.path_build = NULL;
+    }
+    if (E.paths && strcmp(E.paths->root, E.current_dir) != 0) {
+        path_index_free(E.paths);
+        E.paths = NULL;
+    }
+    if (!E.paths) {
+        char cache[600];
+        path_index_cache(E.current_dir, cache, sizeof(cache));
+        E.paths = path_index_load(E.current_dir, cache);
+        E.paths_time = 0;
+    }
+    /* A cached or old index is used right away and replaced when the new one is ready */
+    if (!E.path_build && (!E.paths || E.paths_time == 0 || now_ms() - E.paths_time > FIND_REFRESH_MS)) {
+        E.path_build = path_build_start(E.current_dir);
+    }
+    
+    snprintf(E.find_buf, sizeof(E.find_buf), "%s", query);
+    E.find_len = (int)strlen(E.find_buf);
+    editor_find_drop(0);
+    E.mode = MODE_FIND;
+    editor_find_update();
+}
+
+/* Forget the candidates for query prefixes of at least len bytes */
+void editor_find_drop(int len) {
+    for (int k = len; k < 256; k++) {
+        free(E.find_cand[k]);
+        E.find_cand[k] = NULL;
+    }
+}
+
+/*
+ * Re-rank after the query grew or shrank at its end. Each prefix keeps
+ * its candidates, so typing narrows the last list and Backspace goes
+ * back to a stored one instead of rescanning the index.
+ */
+void editor_find_update(void) {
+    char q[256];
+    int len = E.find_len, k = len;
+    
+    E.find_count = 0;
+    E.find_cursor = E.find_scroll = 0;
+    E.dirty = 1;
+    if (!E.paths) return;
+    
+    editor_find_drop(len + 1);
+    while (k >= 0 && !E.find_cand[k]) k--;
+    if (k < len) E.find_cand[len] = malloc(sizeof(int) * ((k < 0 ? E.paths->count : E.find_cand_n[k]) + 1));
+    for (int i = 0; i < len; i++) q[i] = fuzzy_fold[(unsigned char)E.find_buf[i]];
+    E.find_count = fuzzy_rank(E.paths, k < 0 ? NULL : E.find_cand[k], k < 0 ? 0 : E.find_cand_n[k],
+                              E.find_cand[len], &E.find_cand_n[len], q, len, E.find_hits, FIND_MAX_HITS);
+}
+
+void editor_find_move(int delta) {
+    E.find_cursor += delta;
+    if (E.find_cursor > E.find_count - 1) E.find_cursor = E.find_count - 1;
+    if (E.find_cursor < 0) E.find_cursor = 0;
+    if (E.find_cursor < E.find_scroll) E.find_scroll = E.find_cursor;
+    if (E.find_cursor >= E.find_scroll + E.screen_rows) E.find_scroll = E.find_cursor - E.screen_rows + 1;
+    E.dirty = 1;
+}
+
+void editor_find_accept(void) {
+    char path[1024];
+    if (E.find_cursor >= E.find_count) return;
+    snprintf(path, sizeof(path), "%s%c%s", E.paths->root, PATH_SEP, E.paths->names + E.paths->offs[E.find_hits[E.find_cursor].path]);
+    buffer_open(path);
+    E.mode = MODE_NORMAL;
+    E.dirty = 1;
+}
+
+/* One line address of an ex range: N, . or $, as a line index (-1 for line 0); returns 0 if there is none */
+int command_address(char **s, int *line) {
+    char *p = *s;
+    
+    if (*p == '.') {
+        *line = E.cy;
+        p++;
+    } else if (*p == '$') {
+        *line = rope_count(&E.doc) - 1;
+        p++;
+    } else if (*p >= '0' && *p <= '9') {
+        *line = (int)strtol(p, &p, 10) - 1;
+    } else {
+        return 0;
+    }
+    *s = p;
+    return 1;
+}
+
+/* :[range]y [x], :[range]d [x], :[line]pu [x] and :registers; 0 if cmd is none of them */
+int editor_line_command(char *cmd) {
+    int from = E.cy, to = E.cy, count = rope_count(&E.doc);
+    char *p = cmd;
+    
+    if (*p == '%') {
+        from = 0;
+        to = count - 1;
+        p++;
+    } else if (command_address(&p, &from)) {
+        to = from;
+        if (*p == ',') {
+            p++;
+            if (!command_address(&p, &to)) return 0;
         }
     }
     
-    editor_set_status(found ? "Found: '%s'" : "Not found: '%s'", E.search_buf);
+    char *name = p;
+    while (*name && *name != ' ') name++;
+    int len = (int)(name - p);
+    while (*name == ' ') name++;
+    int reg = *name ? register_index(*name) : 0;
+    
+    int op;
+    if (len == 1 && *p == 'y') op = 'y';
+    else if (len == 1 && *p == 'd') op = 'd';
+    else if (len == 2 && strncmp(p, "pu", 2) == 0) op = 'p';
+    else if (p == cmd && (strcmp(p, "reg") == 0 || strcmp(p, "registers") == 0)) op = 'r';
+    else return 0;
+    
+    if (op == 'r') {
+        editor_show_registers();
+        return 1;
+    }
+    if (reg < 0 || (*name && name[1])) {
+        editor_set_status("No register %s", name);
+        return 1;
+    }
+    if (from > to) {
+        int t = from;
+        from = to;
+        to = t;
+    }
+    
+    /* Line 0 is above the first line: :0pu puts there, and elsewhere it stands for line 1 as in vim */
+    if (op != 'p' && from < 0) from = 0;
+    if (op != 'p' && to < 0) to = 0;
+    if (to >= count) {
+        editor_set_status("Invalid range");
+        return 1;
+    }
+    if (op == 'y') editor_yank_lines(from, to - from + 1, reg);
+    else if (op == 'd') editor_delete_lines(from, to - from + 1, reg);
+    else editor_put(to + 1, reg);
+    return 1;
 }
 
 void editor_process_command(void) {
@@ -829,36 +9490,112 @@ void editor_process_command(void) {
     while (*cmd == ' ') cmd++;
     
     if (strcmp(cmd, "q") == 0) {
-        if (E.modified) {
-            editor_set_status("Unsaved changes! Use :q! to force quit or :w to save");
-        } else {
-            editor_free();
-            exit(0);
-        }
+        editor_try_quit();
     } else if (strcmp(cmd, "q!") == 0) {
-        editor_free();
-        exit(0);
+        editor_quit();
     } else if (strcmp(cmd, "w") == 0) {
         editor_save();
     } else if (strncmp(cmd, "w ", 2) == 0) {
         char *fname = cmd + 2;
         while (*fname == ' ') fname++;
         strncpy(E.filename, fname, sizeof(E.filename) - 1);
+        editor_syntax_select();
         editor_save();
     } else if (strcmp(cmd, "wq") == 0 || strcmp(cmd, "x") == 0) {
         editor_save();
-        editor_free();
-        exit(0);
+        editor_try_quit();
     } else if (strncmp(cmd, "e ", 2) == 0) {
         char *fname = cmd + 2;
         while (*fname == ' ') fname++;
-        editor_open(fname);
+        buffer_open(fname);
+    } else if (strcmp(cmd, "ls") == 0 || strcmp(cmd, "buffers") == 0) {
+        buffer_list();
+    } else if (strcmp(cmd, "bn") == 0 || strcmp(cmd, "bnext") == 0) {
+        buffer_switch((E.buffer_cur + 1) % E.buffer_count);
+    } else if (strcmp(cmd, "bp") == 0 || strcmp(cmd, "bprevious") == 0) {
+        buffer_switch((E.buffer_cur + E.buffer_count - 1) % E.buffer_count);
+    } else if (strcmp(cmd, "bd") == 0 || strcmp(cmd, "bd!") == 0) {
+        buffer_close(cmd[2] == '!');
+    } else if (cmd[0] == 'b' && (cmd[1] == ' ' || isdigit((unsigned char)cmd[1]))) {
+        int n = atoi(cmd + 1);
+        if (n >= 1 && n <= E.buffer_count) buffer_switch(n - 1);
+        else editor_set_status("No buffer %s", cmd + 1 + (cmd[1] == ' '));
+    } else if (strncmp(cmd, "set buffermem=", 14) == 0) {
+        int mb = atoi(cmd + 14);
+        if (mb > 0) {
+            E.buffer_budget = (long long)mb << 20;
+            buffer_trim();
+            editor_set_status("Inactive buffers give memory back once all buffers hold more than %d MB", mb);
+        } else {
+            editor_set_status("Invalid size: %s", cmd + 14);
+        }
+    } else if (strcmp(cmd, "set ic") == 0 || strcmp(cmd, "set noic") == 0) {
+        E.search_icase = cmd[4] == 'i';
+        editor_set_status(E.search_icase ? "Search ignores case" : "Search matches case");
+    } else if (strcmp(cmd, "set wrap") == 0 || strcmp(cmd, "set nowrap") == 0) {
+        E.wrap = cmd[4] == 'w';
+        E.wrap_sub = 0;
+        if (!E.wrap) wrap_free(&E.wrap_index);
+        editor_set_status(E.wrap ? "Long lines wrap onto the next rows" : "Long lines scroll sideways");
+    } else if (strcmp(cmd, "set regex") == 0 || strcmp(cmd, "set noregex") == 0) {
+        E.search_regex = cmd[4] == 'r';
+        editor_set_status(E.search_regex ? "Search patterns are regular expressions" : "Search patterns are literal text");
+    } else if (strcmp(cmd, "set undofile") == 0) {
+        E.undofile = 1;
+        if (E.filename[0] && !E.modified && !undo_file_save()) {
+            editor_set_status("Cannot write the undo file");
+        } else {
+            editor_set_status(E.modified || !E.filename[0] ? "Undo history is kept with the file from the next save" : "Undo history is kept with the file");
+        }
+    } else if (strcmp(cmd, "set noundofile") == 0) {
+        E.undofile = 0;
+        undo_file_drop();
+        editor_set_status("Undo history is no longer kept with the file");
+    } else if (strcmp(cmd, "set swapfile") == 0) {
+        E.noswapfile = 0;
+        if (!E.modified) swap_open();
+        editor_set_status(E.swap ? "Edits are journaled until saved" : "Edits are journaled from the next save");
+    } else if (strcmp(cmd, "set noswapfile") == 0) {
+        E.noswapfile = 1;
+        swap_close(1);
+        editor_set_status("Edits are no longer journaled");
+    } else if (strcmp(cmd, "set autosave") == 0 || strcmp(cmd, "set noautosave") == 0) {
+        E.autosave = cmd[4] == 'a';
+        E.autosave_time = now_ms();
+        editor_set_status(E.autosave ? "Changes are saved in the background every %d s" : "Changes are saved only with :w", AUTOSAVE_DELAY / 1000);
+    } else if (strcmp(cmd, "recover") == 0) {
+        swap_recover();
+    } else if (strcmp(cmd, "recover!") == 0) {
+        swap_discard();
+    } else if (strcmp(cmd, "noh") == 0 || strcmp(cmd, "nohlsearch") == 0) {
+        E.search_highlight = 0;
+        E.dirty = 1;
+    } else if (strncmp(cmd, "grep ", 5) == 0) {
+        char *pat = cmd + 5;
+        while (*pat == ' ') pat++;
+        if (*pat) editor_grep(pat);
+    } else if (strcmp(cmd, "find") == 0 || strncmp(cmd, "find ", 5) == 0) {
+        char *query = cmd + 4;
+        while (*query == ' ') query++;
+        editor_find_open(query);
+    } else if (strcmp(cmd, "grep") == 0) {
+        if (E.grep) {
+            E.mode = MODE_GREP;
+            editor_grep_status();
+        } else {
+            editor_set_status("No grep results yet. Use :grep <pattern>");
+        }
+    } else if (strcmp(cmd, "stats") == 0) {
+        E.show_stats = !E.show_stats;
+        E.dirty = 1;
     } else if (strcmp(cmd, "help") == 0) {
         editor_set_status("h/j/k/l:move i:insert :w:save :q:quit Tab:sidebar Enter:open");
+    } else if (editor_line_command(cmd)) {
+        /* Handled: yank, delete or put lines, or list registers */
     } else if (cmd[0] >= '0' && cmd[0] <= '9') {
         /* Go to line number */
         int line = atoi(cmd) - 1;
-        if (line >= 0 && line < E.num_lines) {
+        if (line >= 0 && line < rope_count(&E.doc)) {
             E.cy = line;
             E.cx = 0;
             editor_set_status("Line %d", line + 1);
@@ -868,29 +9605,30 @@ void editor_process_command(void) {
     }
 }
 
-void editor_process_mouse(MOUSE_EVENT_RECORD *event) {
-    int x = event->dwMousePosition.X;
-    int y = event->dwMousePosition.Y;
+void editor_process_mouse(Event *event) {
+    int x = event->x;
+    int y = event->y;
     int start_col = E.sidebar_visible ? SIDEBAR_WIDTH : 0;
     
     /* Left click */
-    if (event->dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED) {
+    if ((event->buttons & EV_BUTTON_LEFT) && !(event->flags & EV_MOVED)) {
         if (E.sidebar_visible && x < SIDEBAR_WIDTH && y < E.screen_rows) {
             /* Click in sidebar */
-            int idx = y + E.sidebar_scroll;
-            if (idx < E.num_entries) {
-                E.sidebar_cursor = idx;
+            mutex_lock(&E.dir->lock);
+            int idx = y + E.sidebar_scroll, count = E.dir->count;
+            mutex_unlock(&E.dir->lock);
+            if (idx < count) {
+                sidebar_select(idx);
                 E.mode = MODE_SIDEBAR;
-                E.dirty = 1;
             }
         } else if (y < E.screen_rows && x >= start_col + 6) {
             /* Click in editor */
-            int click_y = y + E.row_offset;
-            int click_x = x - start_col - 6 + E.col_offset;
+            int click_y, click_x;
             
-            if (click_y < E.num_lines) {
+            if (editor_text_pos(y, x - start_col - 6, &click_y, &click_x)) {
+                undo_seal();
                 E.cy = click_y;
-                int len = strlen(E.lines[E.cy]);
+                int len = rope_len(&E.doc, E.cy);
                 E.cx = (click_x < len) ? click_x : len;
                 if (E.cx < 0) E.cx = 0;
                 
@@ -906,14 +9644,13 @@ void editor_process_mouse(MOUSE_EVENT_RECORD *event) {
     }
     
     /* Mouse drag for selection */
-    if ((event->dwEventFlags & MOUSE_MOVED) && (event->dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED)) {
+    if ((event->flags & EV_MOVED) && (event->buttons & EV_BUTTON_LEFT)) {
         if (E.sel.active && y < E.screen_rows && x >= start_col + 6) {
-            int drag_y = y + E.row_offset;
-            int drag_x = x - start_col - 6 + E.col_offset;
+            int drag_y, drag_x;
             
-            if (drag_y < E.num_lines && drag_y >= 0) {
+            if (editor_text_pos(y, x - start_col - 6, &drag_y, &drag_x) && drag_y >= 0) {
                 E.sel.end_y = drag_y;
-                int len = strlen(E.lines[drag_y]);
+                int len = rope_len(&E.doc, drag_y);
                 E.sel.end_x = (drag_x < len) ? drag_x : len;
                 if (E.sel.end_x < 0) E.sel.end_x = 0;
                 E.cy = E.sel.end_y;
@@ -924,33 +9661,35 @@ void editor_process_mouse(MOUSE_EVENT_RECORD *event) {
     }
     
     /* Release - finalize selection */
-    if (event->dwButtonState == 0 && E.sel.active) {
+    if (event->buttons == 0 && E.sel.active) {
         if (E.sel.start_x == E.sel.end_x && E.sel.start_y == E.sel.end_y) {
             E.sel.active = 0;  /* No actual selection */
         }
     }
     
     /* Double click in sidebar - open */
-    if ((event->dwEventFlags & DOUBLE_CLICK) && E.sidebar_visible && x < SIDEBAR_WIDTH) {
+    if ((event->flags & EV_DOUBLE) && E.sidebar_visible && x < SIDEBAR_WIDTH) {
         sidebar_open_selected();
     }
     
     /* Right click in sidebar - open */
-    if (event->dwButtonState & RIGHTMOST_BUTTON_PRESSED) {
+    if (event->buttons & EV_BUTTON_RIGHT) {
         if (E.sidebar_visible && x < SIDEBAR_WIDTH) {
             sidebar_open_selected();
         }
     }
     
     /* Mouse wheel */
-    if (event->dwEventFlags & MOUSE_WHEELED) {
-        int delta = (short)HIWORD(event->dwButtonState);
-        if (delta > 0) {
-            E.row_offset -= 3;
+    if (event->wheel) {
+        if (E.wrap) {
+            WrapIndex *w = editor_wrap();
+            editor_wrap_set_top(w, editor_wrap_top(w) - 3 * event->wheel);
+        } else if (event->wheel > 0) {
+            E.row_offset -= 3 * event->wheel;
             if (E.row_offset < 0) E.row_offset = 0;
         } else {
-            E.row_offset += 3;
-            int max = E.num_lines - E.screen_rows;
+            E.row_offset -= 3 * event->wheel;
+            int max = rope_count(&E.doc) - E.screen_rows;
             if (max < 0) max = 0;
             if (E.row_offset > max) E.row_offset = max;
         }
@@ -958,38 +9697,44 @@ void editor_process_mouse(MOUSE_EVENT_RECORD *event) {
     }
 }
 
-void editor_process_key(void) {
-    INPUT_RECORD ir;
-    DWORD count;
-    
-    if (!ReadConsoleInput(E.hStdin, &ir, 1, &count)) return;
-    
-    if (ir.EventType == WINDOW_BUFFER_SIZE_EVENT) {
-        E.screen_cols = ir.Event.WindowBufferSizeEvent.dwSize.X;
-        E.screen_rows = ir.Event.WindowBufferSizeEvent.dwSize.Y - STATUS_HEIGHT;
+/* Next event of this frame's batch, or from the terminal once it is used up */
+int editor_read(Event *ev) {
+    if (E.input_pos < E.input_len) {
+        *ev = E.input[E.input_pos++];
+        return 1;
+    }
+    return term_read(ev, -1);
+}
+
+/* Wait for the second key of a two-key command such as gg or dd */
+int editor_next_char(void) {
+    Event ev;
+    if (editor_read(&ev) && ev.type == EV_KEY) return ev.ch;
+    return 0;
+}
+
+void editor_process_key(Event *ev) {
+    if (ev->type == EV_RESIZE) {
+        E.screen_cols = ev->x;
+        E.screen_rows = ev->y - STATUS_HEIGHT;
         
-        free(E.buffer);
-        E.buf_size = E.screen_cols * (E.screen_rows + STATUS_HEIGHT);
-        E.buffer = malloc(sizeof(CHAR_INFO) * E.buf_size);
+        buf_resize();
         E.dirty = 1;
         return;
     }
     
-    if (ir.EventType == MOUSE_EVENT) {
-        editor_process_mouse(&ir.Event.MouseEvent);
+    if (ev->type == EV_MOUSE) {
+        editor_process_mouse(ev);
         return;
     }
     
-    if (ir.EventType != KEY_EVENT || !ir.Event.KeyEvent.bKeyDown) return;
-    
-    KEY_EVENT_RECORD *key = &ir.Event.KeyEvent;
-    int c = key->uChar.AsciiChar;
-    int vk = key->wVirtualKeyCode;
-    DWORD ctrl = key->dwControlKeyState;
-    int is_ctrl = (ctrl & LEFT_CTRL_PRESSED) || (ctrl & RIGHT_CTRL_PRESSED);
+    int c = ev->ch;
+    int vk = ev->vk;
+    int is_ctrl = ev->ctrl;
+    int reg = 0;
     
     /* Clear selection on movement unless shift held */
-    if (!(ctrl & SHIFT_PRESSED) && E.sel.active) {
+    if (!ev->shift && E.sel.active) {
         if (vk == VK_LEFT || vk == VK_RIGHT || vk == VK_UP || vk == VK_DOWN ||
             c == 'h' || c == 'j' || c == 'k' || c == 'l') {
             clear_selection();
@@ -1002,24 +9747,18 @@ void editor_process_key(void) {
                 E.mode = MODE_NORMAL;
                 E.dirty = 1;
             } else if (vk == VK_UP || c == 'k') {
-                if (E.sidebar_cursor > 0) {
-                    E.sidebar_cursor--;
-                    if (E.sidebar_cursor < E.sidebar_scroll)
-                        E.sidebar_scroll = E.sidebar_cursor;
-                    E.dirty = 1;
-                }
+                sidebar_select(E.sidebar_cursor - 1);
             } else if (vk == VK_DOWN || c == 'j') {
-                if (E.sidebar_cursor < E.num_entries - 1) {
-                    E.sidebar_cursor++;
-                    if (E.sidebar_cursor >= E.sidebar_scroll + E.screen_rows)
-                        E.sidebar_scroll = E.sidebar_cursor - E.screen_rows + 1;
-                    E.dirty = 1;
-                }
+                sidebar_select(E.sidebar_cursor + 1);
+            } else if (vk == VK_PRIOR) {
+                sidebar_select(E.sidebar_cursor - E.screen_rows);
+            } else if (vk == VK_NEXT) {
+                sidebar_select(E.sidebar_cursor + E.screen_rows);
             } else if (vk == VK_RETURN || c == 'l') {
                 sidebar_open_selected();
             } else if (c == 'h') {
                 /* Go to parent */
-                E.sidebar_cursor = 0;
+                sidebar_select(0);
                 sidebar_open_selected();
             } else if (c == 'q') {
                 E.sidebar_visible = 0;
@@ -1028,17 +9767,69 @@ void editor_process_key(void) {
             }
             break;
             
+        case MODE_FIND:
+            if (vk == VK_ESCAPE) {
+                E.mode = MODE_NORMAL;
+                E.dirty = 1;
+            } else if (vk == VK_RETURN) {
+                editor_find_accept();
+            } else if (vk == VK_UP || (is_ctrl && (vk == 'P' || c == 16))) {
+                editor_find_move(-1);
+            } else if (vk == VK_DOWN || (is_ctrl && (vk == 'N' || c == 14))) {
+                editor_find_move(1);
+            } else if (vk == VK_PRIOR) {
+                editor_find_move(-E.screen_rows);
+            } else if (vk == VK_NEXT) {
+                editor_find_move(E.screen_rows);
+            } else if (vk == VK_BACK) {
+                if (E.find_len > 0) {
+                    E.find_buf[--E.find_len] = '\0';
+                    editor_find_update();
+                }
+            } else if (c >= 32 && c < 127 && E.find_len < 255) {
+                E.find_buf[E.find_len++] = c;
+                E.find_buf[E.find_len] = '\0';
+                editor_find_update();
+            }
+            break;
+            
+        case MODE_GREP:
+            if (vk == VK_ESCAPE || c == 'q') {
+                E.mode = MODE_NORMAL;
+                E.dirty = 1;
+            } else if (is_ctrl && (vk == 'C' || c == 3)) {
+                grep_join(E.grep, 1);
+            } else if (vk == VK_UP || c == 'k') {
+                editor_grep_move(-1);
+            } else if (vk == VK_DOWN || c == 'j') {
+                editor_grep_move(1);
+            } else if (vk == VK_PRIOR) {
+                editor_grep_move(-E.screen_rows);
+            } else if (vk == VK_NEXT) {
+                editor_grep_move(E.screen_rows);
+            } else if (vk == VK_HOME || c == 'g') {
+                editor_grep_move(-E.grep_cursor);
+            } else if (vk == VK_END || c == 'G') {
+                editor_grep_move(INT_MAX / 2);
+            } else if (vk == VK_RETURN) {
+                editor_grep_open();
+            }
+            break;
+            
         case MODE_NORMAL:
+            undo_seal();
+            reg = E.register_next;
+            E.register_next = 0;
             if (c == 'i') {
                 E.mode = MODE_INSERT;
                 editor_set_status("-- INSERT --");
             } else if (c == 'a') {
-                int len = strlen(E.lines[E.cy]);
+                int len = rope_len(&E.doc, E.cy);
                 if (E.cx < len) E.cx++;
                 E.mode = MODE_INSERT;
                 editor_set_status("-- INSERT --");
             } else if (c == 'A') {
-                E.cx = strlen(E.lines[E.cy]);
+                E.cx = rope_len(&E.doc, E.cy);
                 E.mode = MODE_INSERT;
                 editor_set_status("-- INSERT --");
             } else if (c == 'I') {
@@ -1046,7 +9837,7 @@ void editor_process_key(void) {
                 E.mode = MODE_INSERT;
                 editor_set_status("-- INSERT --");
             } else if (c == 'o') {
-                E.cx = strlen(E.lines[E.cy]);
+                E.cx = rope_len(&E.doc, E.cy);
                 editor_insert_newline();
                 E.mode = MODE_INSERT;
                 editor_set_status("-- INSERT --");
@@ -1065,9 +9856,18 @@ void editor_process_key(void) {
                 E.mode = MODE_SEARCH;
                 E.search_buf[0] = '\0';
                 E.search_len = 0;
+                E.search_highlight = 0;
+                E.isearch_y = E.cy;
+                E.isearch_x = E.cx;
+                E.isearch[0].found = 1;
+                E.isearch[0].y = E.cy;
+                E.isearch[0].x = E.cx + 1;
+                E.isearch[0].wrapped = 0;
                 E.dirty = 1;
             } else if (c == 'n') {
-                editor_search();
+                editor_search(0);
+            } else if (c == 'N') {
+                editor_search(1);
             } else if (c == 'h' || vk == VK_LEFT) {
                 editor_move_cursor('h', 0);
             } else if (c == 'j' || vk == VK_DOWN) {
@@ -1089,50 +9889,44 @@ void editor_process_key(void) {
             } else if (c == 'b') {
                 editor_word_backward();
             } else if (c == 'g') {
-                INPUT_RECORD ir2;
-                if (ReadConsoleInput(E.hStdin, &ir2, 1, &count)) {
-                    if (ir2.EventType == KEY_EVENT && ir2.Event.KeyEvent.bKeyDown) {
-                        if (ir2.Event.KeyEvent.uChar.AsciiChar == 'g') {
-                            E.cy = 0; E.cx = 0;
-                            E.dirty = 1;
-                        }
-                    }
+                if (editor_next_char() == 'g') {
+                    E.cy = 0; E.cx = 0;
+                    E.dirty = 1;
                 }
             } else if (c == 'G') {
-                E.cy = E.num_lines - 1;
+                E.cy = rope_count(&E.doc) - 1;
                 E.cx = 0;
                 E.dirty = 1;
             } else if (c == 'x') {
-                int len = strlen(E.lines[E.cy]);
+                int len = rope_len(&E.doc, E.cy);
                 if (E.cx < len) {
-                    push_undo();
-                    char *line = E.lines[E.cy];
-                    memmove(&line[E.cx], &line[E.cx + 1], len - E.cx);
-                    E.modified = 1;
-                    E.dirty = 1;
+                    editor_delete_text(E.cy, E.cx, 1);
                 }
             } else if (c == 'd') {
-                INPUT_RECORD ir2;
-                if (ReadConsoleInput(E.hStdin, &ir2, 1, &count)) {
-                    if (ir2.EventType == KEY_EVENT && ir2.Event.KeyEvent.bKeyDown) {
-                        if (ir2.Event.KeyEvent.uChar.AsciiChar == 'd') {
-                            editor_delete_line();
-                        }
-                    }
+                if (editor_next_char() == 'd') {
+                    editor_delete_lines(E.cy, 1, reg);
                 }
             } else if (c == 'y') {
-                INPUT_RECORD ir2;
-                if (ReadConsoleInput(E.hStdin, &ir2, 1, &count)) {
-                    if (ir2.EventType == KEY_EVENT && ir2.Event.KeyEvent.bKeyDown) {
-                        if (ir2.Event.KeyEvent.uChar.AsciiChar == 'y') {
-                            editor_copy_line();
-                        }
-                    }
+                if (editor_next_char() == 'y') {
+                    editor_yank_lines(E.cy, 1, reg);
                 }
             } else if (c == 'p') {
-                editor_paste();
+                editor_put(E.cy + 1, reg);
+            } else if (c == 'P') {
+                editor_put(E.cy, reg);
+            } else if (c == '"') {
+                int name = editor_next_char();
+                E.register_next = register_index(name);
+                if (E.register_next < 0) {
+                    E.register_next = 0;
+                    editor_set_status("No register %c", name >= 32 && name < 127 ? name : '?');
+                }
             } else if (c == 'u') {
                 pop_undo();
+            } else if (is_ctrl && (vk == 'R' || c == 18)) {
+                editor_redo();
+            } else if (is_ctrl && (vk == 'P' || c == 16)) {
+                editor_find_open("");
             } else if (vk == VK_TAB) {
                 E.sidebar_visible = !E.sidebar_visible;
                 if (E.sidebar_visible) {
@@ -1143,9 +9937,8 @@ void editor_process_key(void) {
             } else if (is_ctrl && (vk == 'S' || c == 19)) {
                 editor_save();
             } else if (is_ctrl && (vk == 'Q' || c == 17)) {
-                if (!E.modified) {
-                    editor_free();
-                    exit(0);
+                if (buffer_unsaved() < 0) {
+                    editor_quit();
                 }
             }
             break;
@@ -1153,23 +9946,22 @@ void editor_process_key(void) {
         case MODE_INSERT:
             if (vk == VK_ESCAPE) {
                 E.mode = MODE_NORMAL;
+                undo_seal();
                 if (E.cx > 0) E.cx--;
                 editor_set_status("");
             } else if (vk == VK_BACK) {
                 editor_delete_char();
             } else if (vk == VK_DELETE) {
-                int len = strlen(E.lines[E.cy]);
+                int len = rope_len(&E.doc, E.cy);
                 if (E.cx < len) {
-                    push_undo();
-                    char *line = E.lines[E.cy];
-                    memmove(&line[E.cx], &line[E.cx + 1], len - E.cx);
-                    E.modified = 1;
-                    E.dirty = 1;
+                    editor_delete_text(E.cy, E.cx, 1);
                 }
             } else if (vk == VK_RETURN) {
                 editor_insert_newline();
             } else if (vk == VK_TAB) {
-                for (int i = 0; i < TAB_SIZE; i++) editor_insert_char(' ');
+                char spaces[TAB_SIZE];
+                memset(spaces, ' ', TAB_SIZE);
+                editor_insert_text(E.cy, E.cx, spaces, TAB_SIZE);
             } else if (vk == VK_LEFT) {
                 editor_move_cursor(VK_LEFT, 1);
             } else if (vk == VK_RIGHT) {
@@ -1216,14 +10008,29 @@ void editor_process_key(void) {
         case MODE_SEARCH:
             if (vk == VK_ESCAPE) {
                 E.mode = MODE_NORMAL;
+                E.search_highlight = 0;
+                E.cy = E.isearch_y;
+                E.cx = E.isearch_x;
                 editor_set_status("");
             } else if (vk == VK_RETURN) {
+                SearchHit *hit = &E.isearch[E.search_len];
+                char err[64];
                 E.mode = MODE_NORMAL;
-                editor_search();
+                if (E.search_len == 0) {
+                    editor_set_status("");
+                } else if (!editor_search_compile(err, sizeof(err))) {
+                    editor_set_status("Bad pattern: %s", err);
+                } else if (hit->found < 0) {
+                    editor_search(0);
+                } else if (hit->found == 0) {
+                    editor_set_status("Not found: '%s'", E.search_buf);
+                } else {
+                    editor_search_found(hit->y, hit->x, hit->wrapped);
+                }
             } else if (vk == VK_BACK) {
                 if (E.search_len > 0) {
                     E.search_buf[--E.search_len] = '\0';
-                    E.dirty = 1;
+                    editor_isearch_back();
                 } else {
                     E.mode = MODE_NORMAL;
                     editor_set_status("");
@@ -1231,20 +10038,877 @@ void editor_process_key(void) {
             } else if (c >= 32 && c < 127 && E.search_len < 255) {
                 E.search_buf[E.search_len++] = c;
                 E.search_buf[E.search_len] = '\0';
-                E.dirty = 1;
+                editor_isearch();
             }
             break;
     }
 }
 
+/* A key that insert mode turns into text */
+int editor_typed(const Event *ev) {
+    if (ev->type != EV_KEY || ev->ctrl) return 0;
+    if (ev->vk == VK_RETURN || ev->vk == VK_TAB) return 1;
+    switch (ev->vk) {
+        case VK_ESCAPE: case VK_BACK: case VK_DELETE: case VK_LEFT: case VK_RIGHT:
+        case VK_UP: case VK_DOWN: case VK_HOME: case VK_END: case VK_PRIOR: case VK_NEXT:
+            return 0;
+    }
+    return ev->ch >= 32 && ev->ch < 127;
+}
+
+/* A drag, or wheel notches in the same direction, that can stand in for the one before it */
+int editor_mouse_merges(const Event *prev, const Event *ev) {
+    if (prev->type != EV_MOUSE || ev->type != EV_MOUSE) return 0;
+    if (prev->wheel || ev->wheel) return (prev->wheel > 0 && ev->wheel > 0) || (prev->wheel < 0 && ev->wheel < 0);
+    return prev->flags == EV_MOVED && ev->flags == EV_MOVED && prev->buttons == EV_BUTTON_LEFT && ev->buttons == EV_BUTTON_LEFT;
+}
+
+/*
+ * Handle an event and everything already queued behind it, so a burst
+ * costs one frame. In insert mode a run of typed keys is one insert;
+ * consecutive drags keep the last position, wheel notches add up, and
+ * only the last of several resizes counts.
+ */
+void editor_process_input(Event *first) {
+    E.input[0] = *first;
+    E.input_len = 1;
+    E.input_pos = 0;
+    while (E.input_len < INPUT_BATCH && term_read(&E.input[E.input_len], 0)) E.input_len++;
+    
+    while (E.input_pos < E.input_len) {
+        Event ev = E.input[E.input_pos++];
+        if (E.mode == MODE_INSERT && !E.sel.active && editor_typed(&ev)) {
+            int end = E.input_pos;
+            while (end < E.input_len && editor_typed(&E.input[end])) end++;
+            char *text = malloc((end - E.input_pos + 1) * TAB_SIZE);
+            int len = 0;
+            for (int i = E.input_pos - 1; i < end; i++) {
+                if (E.input[i].vk == VK_RETURN) {
+                    text[len++] = '\n';
+                } else if (E.input[i].vk == VK_TAB) {
+                    memset(text + len, ' ', TAB_SIZE);
+                    len += TAB_SIZE;
+                } else {
+                    text[len++] = (char)E.input[i].ch;
+                }
+            }
+            editor_insert_text(E.cy, E.cx, text, len);
+            free(text);
+            E.input_pos = end;
+            continue;
+        }
+        while (E.input_pos < E.input_len &&
+               (editor_mouse_merges(&ev, &E.input[E.input_pos]) ||
+                (ev.type == EV_RESIZE && E.input[E.input_pos].type == EV_RESIZE))) {
+            Event *next = &E.input[E.input_pos++];
+            if (ev.wheel) next->wheel += ev.wheel;
+            ev = *next;
+        }
+        editor_process_key(&ev);
+    }
+    E.input_len = E.input_pos = 0;
+}
+
+/* The document as one string, lines joined by '\n' */
+char *doc_text(void) {
+    int lines = rope_count(&E.doc), size = 0, len;
+    for (int i = 0; i < lines; i++) size += rope_len(&E.doc, i) + 1;
+    char *text = malloc(size + 1), *p = text;
+    for (int i = 0; i < lines; i++) {
+        const char *line = rope_get(&E.doc, i, &len);
+        memcpy(p, line, len);
+        p += len;
+        *p++ = '\n';
+    }
+    *p = '\0';
+    return text;
+}
+
+/* Walk the whole history and check the text at every position against states */
+int undo_file_walk(char **states, int count) {
+    int bad = 0;
+    while (E.undo_pos > 0 && !bad) {
+        pop_undo();
+        char *text = doc_text();
+        bad = states[E.undo_pos] && strcmp(text, states[E.undo_pos]) != 0;
+        free(text);
+    }
+    while (E.undo_pos < count && !bad) {
+        editor_redo();
+        char *text = doc_text();
+        bad = states[E.undo_pos] && strcmp(text, states[E.undo_pos]) != 0;
+        free(text);
+    }
+    return bad;
+}
+
+/* Random edits and saves with an undo file, then reopening: the restored history must walk through the same texts */
+int undo_file_selftest(void) {
+    const char *path = "az-undo.tmp";
+    char undo_path[600], abs[1024];
+    int steps = 600, fail = 0;
+    
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("undo file selftest: cannot create %s\n", path);
+        return 1;
+    }
+    for (int i = 0; i < 300; i++) fprintf(fp, "line %d\n", i);
+    fclose(fp);
+    H.active = 1;
+    H.cols = 80;
+    H.rows = 24;
+    editor_init();
+    E.undofile = 1;
+    editor_open(path);
+    undo_file_path(undo_path, sizeof(undo_path), abs, sizeof(abs));
+    
+    for (int i = 0; i < steps; i++) {
+        int n = rope_count(&E.doc), y = rope_rand() % n, kind = rope_rand() % 10;
+        int len = rope_len(&E.doc, y), x = rope_rand() % (len + 1);
+        E.mode = MODE_NORMAL;
+        if (kind < 3) {
+            /* A run of typing, one step */
+            E.mode = MODE_INSERT;
+            E.cy = y;
+            E.cx = x;
+            for (int k = rope_rand() % 6; k >= 0; k--) editor_insert_char('a' + k);
+            undo_seal();
+        } else if (kind < 5) {
+            editor_delete_text(y, x, 1 + rope_rand() % 8);
+        } else if (kind == 5) {
+            editor_insert_text(y, x, "one\ntwo\n", 8);
+        } else if (kind == 6) {
+            editor_yank_lines(y, 1 + rope_rand() % 20, 0);
+            editor_put(rope_rand() % (n + 1), 0);
+        } else if (kind == 7 && n > 30) {
+            editor_delete_lines(y, 1 + rope_rand() % 10, 0);
+        } else if (kind == 8) {
+            for (int k = rope_rand() % 4; k > 0; k--) pop_undo();
+        } else {
+            editor_save();
+        }
+    }
+    
+    /* Keep the text at every position, then save where the edits left off */
+    int pos = E.undo_pos, count = E.undo_count;
+    char **states = calloc(count + 1, sizeof(char *));
+    while (E.undo_pos > 0) pop_undo();
+    states[0] = doc_text();
+    while (E.undo_pos < count) {
+        editor_redo();
+        states[E.undo_pos] = doc_text();
+    }
+    while (E.undo_pos > pos) pop_undo();
+    editor_save();
+    
+    /* Reopened: the same history, at the same place */
+    editor_open(path);
+    char *text = doc_text();
+    if (E.undo_count != count || E.undo_pos != pos || strcmp(text, states[pos]) != 0 || undo_file_walk(states, count)) {
+        printf("undo file selftest: FAIL restored %d of %d steps at %d (want %d)\n", E.undo_count, count, E.undo_pos, pos);
+        fail = 1;
+    }
+    free(text);
+    
+    /* A torn append is skipped, and the next save replaces the file */
+    fp = fopen(undo_path, "ab");
+    fwrite("\x10\0\0\0junk", 8, 1, fp);
+    fclose(fp);
+    editor_open(path);
+    if (!fail && E.undo_count != count) {
+        printf("undo file selftest: FAIL after a torn append, %d of %d steps\n", E.undo_count, count);
+        fail = 1;
+    }
+    E.cy = E.cx = 0;
+    editor_insert_text(0, 0, "x", 1);
+    editor_save();
+    editor_open(path);
+    if (!fail && (E.undo_count != E.undo_pos || E.undo_pos == 0 || E.undo_ops[E.undo_pos - 1].len != 1)) {
+        printf("undo file selftest: FAIL rewriting a damaged undo file\n");
+        fail = 1;
+    }
+    
+    /* A file changed behind the editor's back drops the history */
+    fp = fopen(path, "ab");
+    fputs("changed\n", fp);
+    fclose(fp);
+    editor_open(path);
+    if (!fail && E.undo_count != 0) {
+        printf("undo file selftest: FAIL kept history for a changed file\n");
+        fail = 1;
+    }
+    
+    for (int i = 0; i <= count; i++) free(states[i]);
+    free(states);
+    editor_free();
+    H.active = 0;
+    remove(undo_path);
+    remove(path);
+    if (!fail) printf("undo file selftest: OK (%d steps, %d saved)\n", steps, count);
+    return fail;
+}
+
+/* Random edits, then a session cut short: :recover must bring back the same text, and u the file */
+int swap_selftest(void) {
+    const char *path = "az-swap.tmp";
+    char swap_path[600], abs[1024];
+    int steps = 400, fail = 0;
+    
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("swap selftest: cannot create %s\n", path);
+        return 1;
+    }
+    for (int i = 0; i < 200; i++) fprintf(fp, "line %d\n", i);
+    fclose(fp);
+    H.active = 1;
+    H.cols = 80;
+    H.rows = 24;
+    editor_init();
+    editor_open(path);
+    editor_cache_file("swap", swap_path, sizeof(swap_path), abs, sizeof(abs));
+    char *original = doc_text();
+    
+    /* The edit functions must not wait for the writer */
+    double worst = 0;
+    for (int i = 0; i < steps; i++) {
+        int n = rope_count(&E.doc), y = rope_rand() % n, kind = rope_rand() % 8;
+        int len = rope_len(&E.doc, y), x = rope_rand() % (len + 1);
+        double t0 = now_ms();
+        E.mode = MODE_NORMAL;
+        if (kind < 3) {
+            E.mode = MODE_INSERT;
+            E.cy = y;
+            E.cx = x;
+            for (int k = rope_rand() % 6; k >= 0; k--) editor_insert_char('a' + k);
+            undo_seal();
+        } else if (kind < 5) {
+            editor_delete_text(y, x, 1 + rope_rand() % 8);
+        } else if (kind == 5) {
+            editor_yank_lines(y, 1 + rope_rand() % 20, 0);
+            editor_put(rope_rand() % (n + 1), 0);
+        } else if (kind == 6 && n > 30) {
+            editor_delete_lines(y, 1 + rope_rand() % 10, 0);
+        } else {
+            for (int k = rope_rand() % 3; k > 0; k--) pop_undo();
+        }
+        if (now_ms() - t0 > worst) worst = now_ms() - t0;
+        if (i == steps / 2) thread_sleep(SWAP_DELAY + 50);
+    }
+    char *edited = doc_text();
+    long long syncs = E.swap ? __atomic_load_n(&E.swap->syncs, __ATOMIC_RELAXED) : 0;
+    
+    /* Cut short: the journal stays, torn at the end */
+    swap_close(0);
+    E.modified = 0;
+    fp = fopen(swap_path, "ab");
+    fwrite("\x20\0\0\0junk", 8, 1, fp);
+    fclose(fp);
+    editor_open(path);
+    int found = E.swap_found;
+    swap_recover();
+    char *text = doc_text();
+    if (!found || strcmp(text, edited) != 0) {
+        printf("swap selftest: FAIL recovering %d edits\n", found);
+        fail = 1;
+    }
+    free(text);
+    pop_undo();
+    text = doc_text();
+    if (!fail && strcmp(text, original) != 0) {
+        printf("swap selftest: FAIL undoing the recovery\n");
+        fail = 1;
+    }
+    free(text);
+    
+    /* The replayed edits went into a new journal, which recovers the same way */
+    editor_redo();
+    swap_close(0);
+    E.modified = 0;
+    editor_open(path);
+    swap_recover();
+    text = doc_text();
+    if (!fail && (E.swap_found || strcmp(text, edited) != 0)) {
+        printf("swap selftest: FAIL recovering a replayed journal\n");
+        fail = 1;
+    }
+    free(text);
+    
+    /* Saving leaves nothing to recover */
+    editor_save();
+    editor_open(path);
+    if (!fail && E.swap_found) {
+        printf("swap selftest: FAIL found a journal after saving\n");
+        fail = 1;
+    }
+    
+    free(original);
+    free(edited);
+    editor_free();
+    H.active = 0;
+    remove(swap_path);
+    remove(path);
+    if (!fail) printf("swap selftest: OK (%d edits, %lld syncs, slowest %.3f ms)\n", found, syncs, worst);
+    return fail;
+}
+
+/* The whole file as text, each line ending in '\n' */
+char *file_text(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long n = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *text = malloc(n + 1);
+    text[fread(text, 1, n, fp)] = '\0';
+    fclose(fp);
+    return text;
+}
+
+/* Background saves overtaken by edits and not: the file, the [+] flag and the journal must agree */
+int autosave_selftest(void) {
+    const char *path = "az-autosave.tmp";
+    char swap_path[600], abs[1024];
+    int fail = 0, rounds = 20;
+    
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("autosave selftest: cannot create %s\n", path);
+        return 1;
+    }
+    for (int i = 0; i < 500; i++) fprintf(fp, "line %d\r\n", i);
+    fclose(fp);
+    H.active = 1;
+    H.cols = 80;
+    H.rows = 24;
+    editor_init();
+    editor_open(path);
+    editor_cache_file("swap", swap_path, sizeof(swap_path), abs, sizeof(abs));
+    
+    for (int r = 0; r < rounds && !fail; r++) {
+        for (int k = 0; k < 10; k++) {
+            int y = rope_rand() % rope_count(&E.doc);
+            if (k % 3 == 0) editor_delete_text(y, 0, 3);
+            else editor_insert_text(y, rope_rand() % (rope_len(&E.doc, y) + 1), "ab\ncd", 5);
+        }
+        char *snapshot = doc_text();
+        autosave_start();
+        /* Odd rounds edit while the snapshot is written */
+        if (r % 2) editor_insert_text(0, 0, "late ", 5);
+        autosave_finish();
+        
+        char *disk = file_text(path), *text = doc_text();
+        int crlf = 0;
+        for (char *q = disk; (q = strstr(q, "\r\n")) != NULL; q++) {
+            memmove(q, q + 1, strlen(q));
+            crlf++;
+        }
+        if (strcmp(disk, snapshot) != 0 || crlf != rope_count(&E.doc) || E.modified != (r % 2)) {
+            printf("autosave selftest: FAIL round %d: file %s the snapshot, modified %d\n", r, strcmp(disk, snapshot) ? "differs from" : "matches", E.modified);
+            fail = 1;
+        }
+        
+        /* A session cut short after an overtaken save recovers the later edits on top of the saved file */
+        if (!fail && r % 2 && r > rounds / 2) {
+            swap_close(0);
+            E.modified = 0;
+            editor_open(path);
+            swap_recover();
+            char *back = doc_text();
+            if (strcmp(back, text) != 0) {
+                printf("autosave selftest: FAIL recovering after round %d\n", r);
+                fail = 1;
+            }
+            free(back);
+        }
+        free(snapshot);
+        free(disk);
+        free(text);
+    }
+    
+    editor_free();
+    H.active = 0;
+    remove(swap_path);
+    remove(path);
+    if (!fail) printf("autosave selftest: OK (%d saves)\n", rounds);
+    return fail;
+}
+
+/* Switch between edited and untouched buffers under a budget that forces every inactive one to shrink */
+int buffer_selftest(void) {
+    const char *paths[3] = { "az-buffer-a.tmp", "az-buffer-b.tmp", "az-buffer-c.tmp" };
+    char *orig[3], *edited = NULL;
+    int fail = 0;
+    
+    for (int f = 0; f < 3; f++) {
+        FILE *fp = fopen(paths[f], "wb");
+        if (!fp) {
+            printf("buffer selftest: cannot create %s\n", paths[f]);
+            return 1;
+        }
+        for (int i = 0; i < 2000; i++) fprintf(fp, "file %c line %d\n", 'a' + f, i);
+        fclose(fp);
+        orig[f] = file_text(paths[f]);
+    }
+    H.active = 1;
+    H.cols = 80;
+    H.rows = 24;
+    editor_init();
+    buffer_open(paths[0]);
+    for (int i = 0; i < 2000; i += 7) editor_insert_text(i, 3, "<edit>", 6);
+    undo_seal();
+    E.cy = 1500;
+    E.cx = 4;
+    edited = doc_text();
+    
+    /* b is edited and saved, so it is dropped with a history to keep */
+    buffer_open(paths[1]);
+    editor_insert_text(0, 0, "<b>", 3);
+    undo_seal();
+    editor_save();
+    free(orig[1]);
+    orig[1] = file_text(paths[1]);
+    E.cy = 700;
+    buffer_open(paths[2]);
+    char *text = doc_text();
+    if (E.buffer_count != 3 || E.modified || strcmp(text, orig[2]) != 0) {
+        printf("buffer selftest: FAIL opening a third buffer\n");
+        fail = 1;
+    }
+    free(text);
+    
+    /* Everything inactive must give memory back: b is dropped to its file, a has its edits packed */
+    long long before = buffer_footprint(0);
+    E.buffer_budget = 1;
+    buffer_trim();
+    if (!fail && (E.buffers[1].loaded || !E.buffers[0].packed || buffer_footprint(0) >= before)) {
+        printf("buffer selftest: FAIL shrinking: b %s, a %lld -> %lld bytes\n", E.buffers[1].loaded ? "loaded" : "dropped", before, buffer_footprint(0));
+        fail = 1;
+    }
+    
+    for (int round = 0; round < 4 && !fail; round++) {
+        buffer_open(round % 2 ? "./az-buffer-b.tmp" : paths[0]);
+        text = doc_text();
+        if (round % 2 ? strcmp(text, orig[1]) != 0 || E.cy != 700 || E.modified : strcmp(text, edited) != 0 || E.cy != 1500 || E.cx != 4 || !E.modified) {
+            printf("buffer selftest: FAIL round %d back in buffer %d at line %d\n", round, E.buffer_cur + 1, E.cy + 1);
+            fail = 1;
+        }
+        free(text);
+    }
+    
+    /* Buffer a keeps its history through being packed */
+    if (!fail) {
+        buffer_switch(0);
+        while (E.undo_pos > 0) pop_undo();
+        text = doc_text();
+        if (E.buffer_count != 3 || strcmp(text, orig[0]) != 0 || E.modified) {
+            printf("buffer selftest: FAIL undoing in a packed buffer\n");
+            fail = 1;
+        }
+        free(text);
+        while (E.undo_pos < E.undo_count) editor_redo();
+    }
+    
+    /* And b, dropped clean, comes back with its own */
+    if (!fail) {
+        buffer_switch(1);
+        pop_undo();
+        text = doc_text();
+        if (E.undo_pos != 0 || strncmp(text, "file b line 0\n", 14) != 0 || !E.modified) {
+            printf("buffer selftest: FAIL undoing in a buffer dropped after saving\n");
+            fail = 1;
+        }
+        free(text);
+        editor_redo();
+        buffer_switch(0);
+    }
+    buffer_close(0);
+    if (!fail && E.buffer_count != 3) {
+        printf("buffer selftest: FAIL closing a buffer with unsaved changes\n");
+        fail = 1;
+    }
+    buffer_close(1);
+    if (!fail && (E.buffer_count != 2 || buffer_unsaved() >= 0)) {
+        printf("buffer selftest: FAIL forcing a buffer closed\n");
+        fail = 1;
+    }
+    
+    editor_free();
+    H.active = 0;
+    for (int f = 0; f < 3; f++) {
+        free(orig[f]);
+        remove(paths[f]);
+    }
+    free(edited);
+    if (!fail) printf("buffer selftest: OK (3 buffers)\n");
+    return fail;
+}
+
+/* Save a large file in the background while typing, against a save that blocks */
+int autosave_bench(const char *path) {
+    char copy[sizeof(E.filename)];
+    double worst = 0;
+    int keys = 0;
+    
+    H.active = 1;
+    H.cols = 120;
+    H.rows = 50;
+    editor_init();
+    E.noswapfile = 1;
+    editor_open(path);
+    rope_finish(&E.doc);
+    editor_poll();
+    int count = rope_count(&E.doc);
+    snprintf(copy, sizeof(copy), "%s.az-bench", path);
+    snprintf(E.filename, sizeof(E.filename), "%s", copy);
+    for (int y = 0; y < count; y += 1000) editor_insert_text(y, 0, "x", 1);
+    
+    double t0 = now_ms();
+    autosave_start();
+    double t1 = now_ms();
+    if (!E.autosave_job) {
+        printf("autosave bench: cannot start\n");
+        editor_free();
+        return 1;
+    }
+    E.mode = MODE_INSERT;
+    E.cy = E.cx = 0;
+    while (!__atomic_load_n(&E.autosave_job->done, __ATOMIC_ACQUIRE)) {
+        double k0 = now_ms();
+        editor_insert_char('a' + keys % 26);
+        if (now_ms() - k0 > worst) worst = now_ms() - k0;
+        keys++;
+        thread_sleep(1);
+    }
+    double write_ms = E.autosave_job->elapsed;
+    long long bytes = E.autosave_job->bytes;
+    autosave_finish();
+    
+    double t2 = now_ms();
+    editor_save();
+    double t3 = now_ms();
+    
+    printf("autosave bench: %s, %d lines, %d edited\n", path, count, (count + 999) / 1000);
+    printf("  snapshot:         %8.2f ms\n", t1 - t0);
+    printf("  background write: %8.2f ms (%lld bytes), %d keys typed meanwhile, slowest %.3f ms\n", write_ms, bytes, keys, worst);
+    printf("  blocking save:    %8.2f ms\n", t3 - t2);
+    editor_free();
+    H.active = 0;
+    remove(copy);
+    return bytes < 0;
+}
+
+/* Paste a block into insert mode one event per frame, as before batching, then batched */
+int paste_bench(int chars) {
+    const char *sample = "    for (int i = 0; i < count; i++) total += values[i];\t// sum\n";
+    Event *events = malloc(sizeof(Event) * chars);
+    char *first = NULL;
+    int ok = 1;
+    
+    for (int i = 0; i < chars; i++) {
+        char c = sample[i % strlen(sample)];
+        memset(&events[i], 0, sizeof(Event));
+        events[i].type = EV_KEY;
+        events[i].ch = c == '\n' ? '\r' : c;
+        events[i].vk = c == '\n' ? VK_RETURN : c == '\t' ? VK_TAB : isalnum((unsigned char)c) ? toupper((unsigned char)c) : 0;
+    }
+    H.active = 1;
+    H.cols = 120;
+    H.rows = 50;
+    editor_init();
+    
+    printf("paste bench: %d characters into insert mode\n", chars);
+    for (int pass = 0; pass < 2; pass++) {
+        Event ev;
+        int frames = 0;
+        rope_free(&E.doc);
+        rope_insert(&E.doc, 0, "", 0);
+        undo_clear();
+        E.cy = E.cx = E.row_offset = 0;
+        E.hl_len = E.hl_valid = 0;
+        E.mode = MODE_INSERT;
+        H.events = events;
+        H.count = chars;
+        H.pos = 0;
+        double t0 = now_ms();
+        while (term_read(&ev, 0)) {
+            if (pass) editor_process_input(&ev);
+            else editor_process_key(&ev);
+            editor_scroll();
+            if (E.dirty) {
+                editor_draw();
+                E.dirty = 0;
+                frames++;
+            }
+        }
+        double t1 = now_ms();
+        printf("  %-18s %8.2f ms, %d frames, %d undo steps\n", pass ? "batched:" : "event per frame:", t1 - t0, frames, E.undo_count);
+        
+        /* Both passes must leave the same text behind */
+        char *text = doc_text();
+        if (!first) {
+            first = text;
+        } else {
+            ok = strcmp(first, text) == 0;
+            free(text);
+        }
+    }
+    if (!ok) printf("paste bench: FAIL batched text differs\n");
+    free(first);
+    free(events);
+    H.events = NULL;
+    editor_free();
+    H.active = 0;
+    return !ok;
+}
+
+/* Yank and put whole ranges of a mapped file, against copying each line as a one-line clipboard would */
+int yank_bench(int lines) {
+    const char *path = "az-yank.tmp";
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("yank bench: cannot create %s\n", path);
+        return 1;
+    }
+    for (int i = 0; i < lines; i++) fprintf(fp, "line %d of the yank bench, with some text after it\n", i);
+    fclose(fp);
+    H.active = 1;
+    H.cols = 120;
+    H.rows = 50;
+    editor_init();
+    editor_open(path);
+    rope_finish(&E.doc);
+    
+    printf("yank bench: %d lines\n", lines);
+    double t0 = now_ms();
+    for (int i = 0; i < lines; i++) free(rope_dup(&E.doc, i));
+    double t1 = now_ms();
+    printf("  %-24s %8.2f ms\n", "copy each line:", t1 - t0);
+    
+    t0 = now_ms();
+    editor_yank_lines(0, lines, 0);
+    t1 = now_ms();
+    printf("  %-24s %8.3f ms\n", "yank all (mapped):", t1 - t0);
+    
+    t0 = now_ms();
+    editor_put(lines / 2, 0);
+    t1 = now_ms();
+    printf("  %-24s %8.3f ms\n", "put in the middle:", t1 - t0);
+    
+    /* Edit every 100th line so the next yank has owned rows to pack */
+    for (int i = 0; i < rope_count(&E.doc); i += 100) editor_insert_text(i, 0, "*", 1);
+    t0 = now_ms();
+    editor_yank_lines(0, rope_count(&E.doc), 0);
+    t1 = now_ms();
+    printf("  %-24s %8.3f ms (%d runs)\n", "yank all (1% edited):", t1 - t0, E.registers[0]->num_runs);
+    
+    t0 = now_ms();
+    editor_put(rope_count(&E.doc), 0);
+    t1 = now_ms();
+    printf("  %-24s %8.3f ms\n", "put at the end:", t1 - t0);
+    
+    /* The last put must read back as the two copies before it */
+    int half = rope_count(&E.doc) / 2, ok = half == 2 * lines, a, b;
+    for (int i = 0; ok && i < half; i++) {
+        const char *x = rope_get(&E.doc, i, &a);
+        const char *y = rope_get(&E.doc, half + i, &b);
+        ok = a == b && memcmp(x, y, a) == 0;
+    }
+    if (!ok) printf("yank bench: FAIL put lines differ\n");
+    editor_free();
+    H.active = 0;
+    remove(path);
+    return !ok;
+}
+
+/*
+ * Headless replay of a key script against a file. Each key is timed from
+ * its handler through the frame it leads to; background work it starts is
+ * left to finish before the next key, as if the user paused to look.
+ */
+typedef struct {
+    double ms;
+    int mode;
+    long long allocs, bytes, frees;
+} ReplayOp;
+
+const char *replay_modes[] = {"normal", "insert", "command", "search", "sidebar", "grep", "find"};
+
+int replay_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+void replay_settle(void) {
+    editor_poll();
+    while (editor_busy() || E.count_active) {
+        thread_yield();
+        editor_poll();
+    }
+    if (E.dirty) {
+        editor_scroll();
+        editor_draw();
+        E.dirty = 0;
+    }
+}
+
+void json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char)*s < 32) printf("\\u%04x", *s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+/* Latency percentiles and heap calls of the ops in one mode, or in all of them for mode -1 */
+void replay_stats(const ReplayOp *ops, int n, int mode, double *ms) {
+    long long allocs = 0, bytes = 0, frees = 0;
+    double sum = 0;
+    int count = 0;
+    
+    for (int i = 0; i < n; i++) {
+        if (mode >= 0 && ops[i].mode != mode) continue;
+        ms[count++] = ops[i].ms;
+        sum += ops[i].ms;
+        allocs += ops[i].allocs;
+        bytes += ops[i].bytes;
+        frees += ops[i].frees;
+    }
+    qsort(ms, count, sizeof(double), replay_cmp);
+    /* Nearest rank */
+    printf("{\"ops\": %d, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p90_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f, ",
+           count, count ? sum / count : 0, count ? ms[(50 * count + 99) / 100 - 1] : 0, count ? ms[(90 * count + 99) / 100 - 1] : 0,
+           count ? ms[(99 * count + 99) / 100 - 1] : 0, count ? ms[count - 1] : 0);
+#ifdef AZ_COUNT_ALLOCS
+    printf("\"allocs\": %lld, \"alloc_bytes\": %lld, \"frees\": %lld}", allocs, bytes, frees);
+#else
+    (void)allocs;
+    (void)bytes;
+    (void)frees;
+    printf("\"allocs\": null, \"alloc_bytes\": null, \"frees\": null}");
+#endif
+}
+
+long replay_peak_rss_kb(void) {
+#ifdef _WIN32
+    return -1;
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return -1;
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif
+#endif
+}
+
+/* Run a script headless; with bench set, print a JSON report */
+int replay_run(const char *script, const char *path, int bench) {
+    Event ev;
+    long long frame_bytes = 0;
+    double settle = 0;
+    int n = 0;
+    
+    if (!script_load(script)) {
+        fprintf(stderr, "replay: cannot read %s\n", script);
+        return 1;
+    }
+    H.active = 1;
+    H.cols = 120;
+    H.rows = 50;
+    editor_init();
+    double t0 = now_ms();
+    if (path) editor_open(path);
+    replay_settle();
+    double open_ms = now_ms() - t0;
+    
+    ReplayOp *ops = malloc(sizeof(ReplayOp) * (H.count + 1));
+    double start = now_ms();
+    while (!H.quit && term_read(&ev, -1)) {
+        ReplayOp *op = &ops[n++];
+        long long allocs = alloc_calls, bytes = alloc_bytes, frees = free_calls;
+        op->mode = E.mode;
+        double k0 = now_ms();
+        editor_process_key(&ev);
+        editor_poll();
+        editor_scroll();
+        if (E.dirty) {
+            editor_draw();
+            E.dirty = 0;
+            frame_bytes += E.frame_bytes;
+        }
+        op->ms = now_ms() - k0;
+        op->allocs = alloc_calls - allocs;
+        op->bytes = alloc_bytes - bytes;
+        op->frees = free_calls - frees;
+        double s0 = now_ms();
+        replay_settle();
+        settle += now_ms() - s0;
+    }
+    double total = now_ms() - start;
+    
+    if (bench) {
+        double *ms = malloc(sizeof(double) * (n + 1));
+        long rss = replay_peak_rss_kb();
+        printf("{\n  \"script\": ");
+        json_string(script);
+        printf(",\n  \"file\": ");
+        if (path) json_string(path);
+        else printf("null");
+        printf(",\n  \"keys\": %d, \"ops\": %d, \"quit\": %s, \"screen\": [%d, %d],\n", H.pos, n, H.quit ? "true" : "false", H.cols, H.rows);
+        printf("  \"open_ms\": %.3f, \"replay_ms\": %.3f, \"settle_ms\": %.3f, \"frame_bytes\": %lld,\n", open_ms, total - settle, settle, frame_bytes);
+        if (rss >= 0) printf("  \"peak_rss_kb\": %ld,\n", rss);
+        else printf("  \"peak_rss_kb\": null,\n");
+        printf("  \"all\": ");
+        replay_stats(ops, n, -1, ms);
+        printf(",\n  \"modes\": {");
+        for (int m = 0, first = 1; m < (int)(sizeof(replay_modes) / sizeof(replay_modes[0])); m++) {
+            int used = 0;
+            for (int i = 0; i < n && !used; i++) used = ops[i].mode == m;
+            if (!used) continue;
+            printf("%s\n    \"%s\": ", first ? "" : ",", replay_modes[m]);
+            replay_stats(ops, n, m, ms);
+            first = 0;
+        }
+        printf("\n  }\n}\n");
+        free(ms);
+    }
+    free(ops);
+    editor_free();
+    free(H.events);
+    H.active = 0;
+    return 0;
+}
+
 void show_help(void) {
     printf("\n");
     printf("  AZ Editor v%s - A minimal terminal text editor\n\n", AZ_VERSION);
-    printf("  Usage: az [filename]\n\n");
+    printf("  Usage: az [files...]\n\n");
     printf("  Navigation:  h/j/k/l or arrows, w/b words, 0/$ line, gg/G file\n");
-    printf("  Editing:     i insert, a append, o newline, x delete, dd cut, yy copy, p paste\n");
-    printf("  Commands:    :w save, :q quit, :wq save+quit, :e file, /<text> search\n");
-    printf("  Other:       Tab sidebar, u undo, Ctrl+S save, Ctrl+Q quit\n\n");
+    printf("  Editing:     i insert, a append, o newline, x delete, dd cut, yy copy, p/P paste after/before\n");
+    printf("  Registers:   \"a before dd/yy/p/P uses register a, :[range]y [a], :[range]d [a], :[line]pu [a],\n"
+           "               :registers lists them with their sizes\n");
+    printf("  Commands:    :w save, :q quit, :wq save+quit, :e file, :set ic/noic, :set regex/noregex, :set wrap/nowrap,\n"
+           "               :set undofile/noundofile keeps undo history across sessions, :set autosave saves every 5 s,\n"
+           "               :recover replays unsaved edits from a session that ended early, :recover! deletes them\n");
+    printf("  Buffers:     :e file opens a buffer, :ls lists them, :b N, :bn, :bp switch, :bd closes,\n"
+           "               :set buffermem=MB bounds the memory they hold\n");
+    printf("  Grep:        :grep <regex> searches every file under the sidebar directory,\n"
+           "               j/k pick a match, Enter opens it, :grep shows the last results\n");
+    printf("  Find:        Ctrl+P or :find [query] picks a file below the sidebar directory by fuzzy name\n");
+    printf("  Search:      /<regex> as you type, n next, N previous, :noh clears highlights,\n"
+           "               Ctrl+C cancels a long search\n");
+    printf("  Other:       Tab sidebar, u undo, Ctrl+R redo, Ctrl+S save, Ctrl+Q quit\n");
+    printf("  Tools:       az --selftest, az --bench [lines], az --bench-open <file>, az --bench-index [MB],\n"
+           "               az --bench-save <file>, az --bench-autosave <file>, az --bench-draw [cols rows],\n"
+           "               az --bench-search <file> <text>, az --bench-grep <dir> <text>, az --bench-dir <dir>,\n"
+           "               az --bench-find <dir> <query>, az --bench-syntax [lines], az --bench-longline [MB],\n"
+           "               az --bench-wrap [lines], az --bench-paste [chars], az --bench-yank [lines],\n"
+           "               az --replay <keys> [--bench] [file], az --record <keys> [file]\n\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -1258,23 +10922,44 @@ int main(int argc, char *argv[]) {
         return 0;
     }
     
+    int status = run_headless(argc, argv);
+    if (status >= 0) return status;
+    
+    /* --record keeps the keys of this session as a script for --replay */
+    if (argc > 2 && strcmp(argv[1], "--record") == 0) {
+        H.record = fopen(argv[2], "wb");
+        if (!H.record) {
+            fprintf(stderr, "Cannot create %s\n", argv[2]);
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    
     editor_init();
     
     if (argc > 1) {
-        editor_open(argv[1]);
+        /* Files after the first are listed as buffers and opened when switched to */
+        buffer_open(argv[1]);
+        for (int i = 2; i < argc; i++) buffer_add(argv[i]);
     } else {
         editor_set_status("AZ Editor v%s | :help | Tab: sidebar | i: insert", AZ_VERSION);
     }
     
     while (1) {
+        Event ev;
+        editor_poll();
         editor_scroll();
         if (E.dirty) {
             editor_draw();
             E.dirty = 0;
         }
-        editor_process_key();
+        /* While background work runs, wake up to show the progress */
+        if (!term_read(&ev, editor_busy() ? 50 : E.count_active ? 0 : autosave_wait())) continue;
+        editor_process_input(&ev);
     }
     
     editor_free();
     return 0;
 }
+